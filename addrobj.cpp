@@ -17,11 +17,69 @@
     
 */    
 
+#include <cstring>
+#include <arpa/inet.h>
+
 #include <addrobj.hpp>
 #include <dns.hpp>
 
-int CidrAddress::contains(CIDR* other) {
-    return cidr_contains(c_,other);
+bool AddressKey::load(const char* str) {
+    
+    proto = CIDR_NOPROTO;
+    memset(addr,0,16);
+
+    if(str == nullptr) {
+        return false;
+    }
+    
+    if(inet_pton(AF_INET,str,&addr[12]) == 1) {
+        proto = CIDR_IPV4;
+    } 
+    else if(inet_pton(AF_INET6,str,&addr[0]) == 1) {
+        proto = CIDR_IPV6;
+    }
+    else {
+        memset(addr,0,16);
+    }
+    
+    return valid();
+}
+
+std::string AddressKey::to_string() const {
+    char b[INET6_ADDRSTRLEN];
+    memset(b,0,INET6_ADDRSTRLEN);
+    
+    if(proto == CIDR_IPV4) {
+        inet_ntop(AF_INET,&addr[12],b,INET6_ADDRSTRLEN);
+    } else if(proto == CIDR_IPV6) {
+        inet_ntop(AF_INET6,&addr[0],b,INET6_ADDRSTRLEN);
+    } else {
+        return "?";
+    }
+    
+    return std::string(b);
+}
+
+
+int CidrAddress::contains(AddressKey const& k) {
+    
+    if(c_ == nullptr || c_->proto != k.proto) {
+        return -1;
+    }
+    
+    // IPv4: first 12 octets are irrelevant
+    int i = 0;
+    if(k.proto == CIDR_IPV4) {
+        i = 12;
+    }
+    
+    for( ; i < 16; i++) {
+        if(((c_->addr[i] ^ k.addr[i]) & c_->mask[i]) != 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
 }
 
 
@@ -31,14 +89,14 @@ std::string FqdnAddress::to_string(int verbosity) {
     bool cached_a = false;
     bool cached_4a= false;
     if(verbosity > INF) {
-        inspect_dns_cache.lock();
-        if(inspect_dns_cache.get("A:"+fqdn_) != nullptr) {
+        DnsCache::entry_ptr r = inspect_dns_cache.get(A,fqdn_);
+        if(r && ! r->negative) {
             cached_a = true;
         }
-        if(inspect_dns_cache.get("AAAA:"+fqdn_) != nullptr) {
+        r = inspect_dns_cache.get(AAAA,fqdn_);
+        if(r && ! r->negative) {
             cached_4a = true;
         }
-        inspect_dns_cache.unlock();
         
         if(cached_4a or cached_a) {
             ret += " (cached";
@@ -54,38 +112,12 @@ std::string FqdnAddress::to_string(int verbosity) {
 }
 
 
-bool FqdnAddress::match(CIDR* c) {
-    bool ret = false;
+bool FqdnAddress::match(AddressKey const& k) {
     
-    DNS_Response* r = nullptr;
+    // DNS cache keeps index of resolved addresses
+    bool ret = inspect_dns_cache.resolves_to(fqdn_,k);
     
-    if(c->proto == CIDR_IPV4) {
-        r = inspect_dns_cache.get("A:" + fqdn_);
-    }
-    else if(c->proto == CIDR_IPV6) {
-        r = inspect_dns_cache.get("AAAA:" + fqdn_);
-    }
-    if(r != nullptr) {
-        DEB_("FqdnAddress::match: found in cache: %s",fqdn_.c_str());
-        
-        std::vector<CidrAddress*> ips = r->get_a_anwsers();
-        
-        int i = 0;
-        for(CidrAddress* ip: ips) {
-            if(ip->match(c)) {
-                DEB_("FqdnAddress::match: cached %s matches answer[%d] with %s",fqdn_.c_str(),i,ip->to_string().c_str());
-                ret = true;
-            } else {
-                DEB_("FqdnAddress::match: cached %s DOESN'T match answer[%d] with %s",fqdn_.c_str(),i,ip->to_string().c_str());
-            }
-            ++i;
-            // delete it straigt away.
-            delete ip;
-        }
-        
-    } else {
-        DEB_("FqdnAddress::match: NOT found in cache: %s",fqdn_.c_str());
-    }
+    DEB_("FqdnAddress::match: %s %s %s",k.to_string().c_str(),ret ? "resolved from" : "NOT resolved from",fqdn_.c_str());
     
     return ret;
 }
@@ -20,14 +20,27 @@
 #ifndef ADDROBJ_HPP_
 #define ADDROBJ_HPP_
 
+#include <cstdint>
+
 #include <cidr.hpp>
 #include <display.hpp>
 #include <logger.hpp>
 #include <sobject.hpp>
 
+// Host address parsed into binary form, same layout as in CIDR (IPv4 address occupies last 4 bytes).
+// It's meant to live on stack: parse once per connection, match against any number of objects.
+struct AddressKey {
+    int proto = CIDR_NOPROTO;
+    uint8_t addr[16] = {0};
+    
+    bool load(const char* str);
+    bool valid() const { return proto != CIDR_NOPROTO; }
+    std::string to_string() const;
+};
+
 class AddressObject : public socle::sobject {
 public:
-    virtual bool match(CIDR* c) = 0;
+    virtual bool match(AddressKey const& k) = 0;
     virtual std::string to_string(int=iINF) = 0;
     virtual ~AddressObject() {};
 };
@@ -38,8 +51,9 @@ public:
     CidrAddress(CIDR* c) : c_(c) { }
     CIDR* cidr() { return c_; }
 
-    int contains(CIDR *other);
-    virtual bool match(CIDR* c) { return (contains(c) >= 0); };
+    // returns 0 if key is inside of this CIDR, -1 otherwise (same as cidr_contains)
+    int contains(AddressKey const& k);
+    virtual bool match(AddressKey const& k) { return (contains(k) >= 0); };
     virtual bool ask_destroy() { return false; };
     
     virtual std::string to_string(int verbosity=iINF) { char* temp = cidr_to_str(c_); std::string ret = string_format("CidrAddress: %s",temp); delete temp; return ret;  }
@@ -57,7 +71,7 @@ public:
     FqdnAddress(std::string s) : fqdn_(s) { }
     std::string fqdn() const { return fqdn_; }
     
-    virtual bool match(CIDR* c);
+    virtual bool match(AddressKey const& k);
     virtual bool ask_destroy() { return false; };
     virtual std::string to_string(int verbosity=iINF);
 protected:
@@ -0,0 +1,244 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ADDRTRIE_HPP
+ #define ADDRTRIE_HPP
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include <cidr.hpp>
+#include <addrobj.hpp>
+
+//
+// Path-compressed binary radix (Patricia) trie of IPv4 and IPv6 prefixes. Each family has its own root.
+// Nodes are kept in a vector and linked by index, so the structure is compact and cheap to copy.
+// Lookup walks at most prefix-length nodes, regardless how many prefixes are stored.
+//
+// Value of type T is attached to each inserted prefix. Lookup visits values of all prefixes
+// containing the key, from the shortest to the longest one.
+//
+template <class T>
+class AddressTrie {
+public:
+    AddressTrie() { clear(); }
+
+    void clear() {
+        nodes_.clear();
+        values_.clear();
+        root_[0] = -1;
+        root_[1] = -1;
+    }
+
+    unsigned int size() const { return values_.size(); }
+    unsigned int nodes() const { return nodes_.size(); }
+
+    // insert prefix in CIDR layout (IPv4 in last 4 bytes); returns reference to the value for the prefix.
+    // If the prefix is already present, its value is returned, otherwise value is default-constructed.
+    T& insert(int proto, const uint8_t* addr16, int pflen);
+    T& insert(CIDR* c) { return insert(c->proto,c->addr,cidr_pflen(c)); }
+
+    // call fn(T&) for each prefix containing the key, shortest first. Returns number of matched prefixes.
+    template <class F>
+    int lookup(AddressKey const& k, F fn);
+
+    // longest prefix containing the key, or nullptr
+    T* longest(AddressKey const& k) {
+        T* ret = nullptr;
+        lookup(k,[&ret](T& v) { ret = &v; });
+        return ret;
+    }
+
+    // prefix length from CIDR mask bytes (relative to the address family)
+    static int cidr_pflen(CIDR* c) {
+        int from = (c->proto == CIDR_IPV4) ? 12 : 0;
+        int pflen = 0;
+        for(int i = from; i < 16; i++) {
+            pflen += __builtin_popcount(c->mask[i]);
+        }
+        return pflen;
+    }
+
+private:
+    struct node {
+        uint8_t key[16];
+        int bits;
+        int child[2];
+        int value;
+    };
+
+    std::vector<node> nodes_;
+    std::vector<T> values_;
+    int root_[2];
+
+    static int family(int proto) { return (proto == CIDR_IPV4) ? 0 : 1; }
+    static int max_bits(int proto) { return (proto == CIDR_IPV4) ? 32 : 128; }
+
+    // key bytes as stored in trie: IPv4 starts at byte 0
+    static const uint8_t* key_bytes(int proto, const uint8_t* addr16) { return (proto == CIDR_IPV4) ? addr16 + 12 : addr16; }
+
+    static inline int bit_at(const uint8_t* k, int i) { return (k[i/8] >> (7 - i%8)) & 1; }
+
+    static int common_bits(const uint8_t* a, const uint8_t* b, int max) {
+        int i = 0;
+        for( ; i + 8 <= max; i += 8) {
+            uint8_t x = a[i/8] ^ b[i/8];
+            if(x) {
+                return i + __builtin_clz((unsigned int)x) - 24;
+            }
+        }
+        for( ; i < max; i++) {
+            if(bit_at(a,i) != bit_at(b,i)) break;
+        }
+        return i;
+    }
+
+    int new_node(const uint8_t* k, int bits, int value) {
+        node n;
+        memset(n.key,0,16);
+        // copy only prefix bits, rest is zeroed
+        for(int i = 0; i < (bits + 7)/8; i++) {
+            n.key[i] = k[i];
+        }
+        if(bits % 8) {
+            n.key[bits/8] &= (uint8_t)(0xff << (8 - bits%8));
+        }
+        n.bits = bits;
+        n.child[0] = -1;
+        n.child[1] = -1;
+        n.value = value;
+
+        nodes_.push_back(n);
+        return nodes_.size() - 1;
+    }
+
+    int new_value() {
+        values_.push_back(T());
+        return values_.size() - 1;
+    }
+};
+
+
+template <class T>
+T& AddressTrie<T>::insert(int proto, const uint8_t* addr16, int pflen) {
+
+    int fam = family(proto);
+    const uint8_t* k = key_bytes(proto,addr16);
+    if(pflen > max_bits(proto)) pflen = max_bits(proto);
+    if(pflen < 0) pflen = 0;
+
+    // nodes are linked by index: remember parent and direction, vector may reallocate while inserting
+    int parent = -1;
+    int dir = 0;
+    int idx = root_[fam];
+
+    while(idx >= 0) {
+        int node_bits = nodes_[idx].bits;
+        int cl = common_bits(k,nodes_[idx].key,std::min(pflen,node_bits));
+
+        if(cl < node_bits) {
+            // node has to be split: new node at 'cl' bits becomes parent of current one
+            int v = new_value();
+            int top = -1;
+
+            if(cl == pflen) {
+                // inserted prefix is parent of current node
+                top = new_node(k,pflen,v);
+                nodes_[top].child[bit_at(nodes_[idx].key,pflen)] = idx;
+            } else {
+                // branch node without value, two children
+                int leaf = new_node(k,pflen,v);
+                top = new_node(k,cl,-1);
+                nodes_[top].child[bit_at(nodes_[idx].key,cl)] = idx;
+                nodes_[top].child[bit_at(k,cl)] = leaf;
+            }
+
+            if(parent < 0) {
+                root_[fam] = top;
+            } else {
+                nodes_[parent].child[dir] = top;
+            }
+
+            return values_[v];
+        }
+
+        // node is prefix of inserted prefix
+        if(node_bits == pflen) {
+            if(nodes_[idx].value < 0) {
+                int v = new_value();
+                nodes_[idx].value = v;
+            }
+            return values_[nodes_[idx].value];
+        }
+
+        parent = idx;
+        dir = bit_at(k,node_bits);
+        idx = nodes_[idx].child[dir];
+    }
+
+    int v = new_value();
+    int n = new_node(k,pflen,v);
+    if(parent < 0) {
+        root_[fam] = n;
+    } else {
+        nodes_[parent].child[dir] = n;
+    }
+
+    return values_[v];
+}
+
+
+template <class T>
+template <class F>
+int AddressTrie<T>::lookup(AddressKey const& key, F fn) {
+
+    if(!key.valid()) {
+        return 0;
+    }
+
+    int matched = 0;
+    const uint8_t* k = key_bytes(key.proto,key.addr);
+    int max = max_bits(key.proto);
+
+    int idx = root_[family(key.proto)];
+    while(idx >= 0) {
+        node& n = nodes_[idx];
+
+        if(common_bits(k,n.key,n.bits) < n.bits) {
+            break;
+        }
+
+        if(n.value >= 0) {
+            fn(values_[n.value]);
+            ++matched;
+        }
+
+        if(n.bits >= max) {
+            break;
+        }
+
+        idx = n.child[bit_at(k,n.bits)];
+    }
+
+    return matched;
+}
+
+#endif
@@ -0,0 +1,132 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <deque>
+
+#include <ahocorasick.hpp>
+
+
+void AhoCorasick::clear() {
+    compiled_ = false;
+    delta_.clear();
+    depth_.clear();
+    fail_.clear();
+    dict_.clear();
+    out_.clear();
+    out_next_.clear();
+    hold_.clear();
+    lengths_.clear();
+
+    new_state(0);
+}
+
+int AhoCorasick::new_state(int depth) {
+    delta_.resize(delta_.size() + 256, -1);
+    depth_.push_back(depth);
+    fail_.push_back(0);
+    dict_.push_back(0);
+    out_.push_back(-1);
+    hold_.push_back(0);
+
+    return depth_.size() - 1;
+}
+
+int AhoCorasick::add(const char* data, unsigned int len) {
+
+    if(compiled_) {
+        // compiled transitions are not trie edges anymore: rebuild from scratch is the caller's job
+        return -1;
+    }
+
+    int s = root;
+    for(unsigned int i = 0; i < len; i++) {
+        unsigned char c = data[i];
+        int n = delta_[(s << 8) + c];
+        if(n < 0) {
+            n = new_state(depth_[s] + 1);
+            delta_[(s << 8) + c] = n;
+        }
+        s = n;
+    }
+
+    int id = lengths_.size();
+    lengths_.push_back(len);
+
+    // keep list ordered as added
+    out_next_.push_back(-1);
+    if(out_[s] < 0) {
+        out_[s] = id;
+    } else {
+        int last = out_[s];
+        while(out_next_[last] >= 0) last = out_next_[last];
+        out_next_[last] = id;
+    }
+
+    return id;
+}
+
+void AhoCorasick::compile() {
+
+    if(compiled_) return;
+
+    // states with trie children can be continued by more data
+    std::vector<bool> inner(depth_.size(),false);
+    for(unsigned int s = 0; s < depth_.size(); s++) {
+        for(int c = 0; c < 256; c++) {
+            if(delta_[(s << 8) + c] >= 0) {
+                inner[s] = true;
+                break;
+            }
+        }
+    }
+
+    // BFS over trie: states are processed after their fail states (which are shallower)
+    std::deque<int> q;
+    for(int c = 0; c < 256; c++) {
+        int n = delta_[c];
+        if(n < 0) {
+            delta_[c] = root;
+        } else {
+            fail_[n] = root;
+            q.push_back(n);
+        }
+    }
+    hold_[root] = 0;
+
+    while(! q.empty()) {
+        int s = q.front();
+        q.pop_front();
+
+        int f = fail_[s];
+        dict_[s] = (out_[f] >= 0) ? f : dict_[f];
+        hold_[s] = inner[s] ? depth_[s] : hold_[f];
+
+        for(int c = 0; c < 256; c++) {
+            int n = delta_[(s << 8) + c];
+            if(n < 0) {
+                delta_[(s << 8) + c] = delta_[(f << 8) + c];
+            } else {
+                fail_[n] = delta_[(f << 8) + c];
+                q.push_back(n);
+            }
+        }
+    }
+
+    compiled_ = true;
+}
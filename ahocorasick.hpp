@@ -0,0 +1,100 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef AHOCORASICK_HPP
+ #define AHOCORASICK_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+//
+// Aho-Corasick multi-pattern automaton over bytes. Patterns are added, then automaton is compiled
+// into full transition table (256 entries per state), so scanning is one table lookup per byte,
+// regardless of number of patterns. Compiled automaton is read-only and can be shared between threads;
+// scan state is plain int and belongs to the caller.
+//
+class AhoCorasick {
+public:
+    AhoCorasick() { clear(); }
+
+    void clear();
+
+    // add pattern, returns its id. Ids are assigned from 0 in order of adding. Invalidates compilation.
+    int add(const char* data, unsigned int len);
+    int add(std::string const& s) { return add(s.data(),s.size()); }
+
+    void compile();
+    bool compiled() const { return compiled_; }
+
+    unsigned int patterns() const { return lengths_.size(); }
+    unsigned int states() const { return depth_.size(); }
+    unsigned int pattern_length(int id) const { return lengths_[id]; }
+
+    // start state
+    static const int root = 0;
+
+    inline int next(int state, unsigned char c) const { return delta_[(state << 8) + c]; }
+
+    // true if some pattern ends in this state
+    inline bool has_output(int state) const { return out_[state] >= 0 || dict_[state] > 0; }
+
+    // call fn(id) for each pattern ending in this state, longest first
+    template <class F>
+    void outputs(int state, F fn) const {
+        for(int s = state; s > 0; s = dict_[s]) {
+            for(int id = out_[s]; id >= 0; id = out_next_[id]) {
+                fn(id);
+            }
+        }
+    }
+
+    // length of the longest suffix of scanned data which is still a proper prefix of some pattern.
+    // Those bytes could be beginning of a match continuing in next data.
+    inline unsigned int pending(int state) const { return hold_[state]; }
+
+    // scan data from state, call fn(id, end_offset) for each match (end_offset is one past the match). Returns last state.
+    template <class F>
+    int scan(int state, const unsigned char* data, unsigned int len, F fn) const {
+        for(unsigned int i = 0; i < len; i++) {
+            state = next(state,data[i]);
+            if(has_output(state)) {
+                outputs(state,[&fn,i](int id) { fn(id,i+1); });
+            }
+        }
+        return state;
+    }
+
+private:
+    bool compiled_;
+
+    // trie built by add(), -1 in delta_ means no edge until compiled
+    std::vector<int> delta_;
+    std::vector<int> depth_;
+    std::vector<int> fail_;
+    std::vector<int> dict_;      // nearest state on fail chain with output (0 if none)
+    std::vector<int> out_;       // first pattern ending in state, -1 if none
+    std::vector<int> out_next_;  // next pattern ending in the same state
+    std::vector<unsigned int> hold_;
+    std::vector<unsigned int> lengths_;
+
+    int new_state(int depth);
+};
+
+#endif
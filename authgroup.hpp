@@ -0,0 +1,68 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef AUTHGROUP_HPP
+ #define AUTHGROUP_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+//
+// Identity group names are interned into small integer IDs, both when auth profiles are loaded
+// and when identity is refreshed. Group membership test is then bitset intersection.
+// Intern table is append-only, so IDs stay valid over config reloads.
+//
+unsigned int cfgapi_auth_group_id(std::string const& name);
+std::string  cfgapi_auth_group_name(unsigned int id);
+
+// set of group IDs
+struct GroupSet {
+    std::vector<uint64_t> bits;
+
+    void add(unsigned int id) {
+        if(bits.size() <= id/64) {
+            bits.resize(id/64 + 1,0);
+        }
+        bits[id/64] |= ((uint64_t)1) << (id % 64);
+    }
+
+    bool contains(unsigned int id) const {
+        return id/64 < bits.size() && (bits[id/64] & (((uint64_t)1) << (id % 64)));
+    }
+
+    bool intersects(GroupSet const& other) const {
+        unsigned int n = std::min(bits.size(),other.bits.size());
+        for(unsigned int i = 0; i < n; i++) {
+            if(bits[i] & other.bits[i]) return true;
+        }
+        return false;
+    }
+
+    void clear() { bits.clear(); }
+    bool empty() const {
+        for(auto w: bits) {
+            if(w) return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -24,6 +24,7 @@
 #include <policy.hpp>
 #include <mitmproxy.hpp>
 #include <mitmhost.hpp>
+#include <contentmatch.hpp>
 
 #include <socle.hpp>
 #include <smithproxy.hpp>
@@ -34,15 +35,22 @@ Config cfgapi;
 time_t system_started;
 
 std::map<std::string,AddressObject*> cfgapi_obj_address;
+AddressTrie<std::vector<std::string>> cfgapi_obj_address_trie;
 std::map<std::string,range> cfgapi_obj_port;
 std::map<std::string,int> cfgapi_obj_proto;
 std::vector<PolicyRule*> cfgapi_obj_policy;
+PolicyIndex cfgapi_obj_policy_index;
 std::map<std::string,ProfileDetection*> cfgapi_obj_profile_detection;
 std::map<std::string,ProfileContent*> cfgapi_obj_profile_content;
 std::map<std::string,ProfileTls*> cfgapi_obj_profile_tls;
 std::map<std::string,ProfileAuth*> cfgapi_obj_profile_auth;
 std::map<std::string,ProfileAlgDns*> cfgapi_obj_profile_alg_dns;
 
+// published snapshot; cfgapi_obj_* tables above are used to build it
+static cfgapi_snapshot_ptr cfgapi_snapshot_current = std::make_shared<CfgSnapshot>();
+// true if objects in cfgapi_obj_* tables are owned by published snapshot
+static bool cfgapi_obj_published = false;
+
 std::vector<int> cfgapi_obj_udp_quick_ports;
 std::vector<std::string> cfgapi_obj_nameservers;
 
@@ -91,6 +99,14 @@ AddressObject* cfgapi_lookup_address(const char* name) {
     return nullptr;
 }
 
+int cfgapi_lookup_address(AddressKey const& key, std::vector<std::string>& names) {
+    std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
+    
+    return cfgapi_obj_address_trie.lookup(key,[&names](std::vector<std::string>& v) {
+        names.insert(names.end(),v.begin(),v.end());
+    });
+}
+
 range cfgapi_lookup_port(const char* name) {
     std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
     
@@ -195,6 +211,9 @@ int cfgapi_load_obj_address() {
                         if (cur_object.lookupValue("cidr",address)) {
                             CIDR* c = cidr_from_str(address.c_str());
                             cfgapi_obj_address[name] = new CidrAddress(c);
+                            if(c != nullptr) {
+                                cfgapi_obj_address_trie.insert(c).push_back(name);
+                            }
                             DIA_("cfgapi_load_addresses: cidr '%s': ok",name.c_str());
                         }
                     break;
@@ -589,11 +608,82 @@ int cfgapi_load_obj_policy() {
     return num;
 }
 
-int cfgapi_obj_policy_match(baseProxy* proxy) {
+static bool cfgapi_profile_tls_sni_bypass_dns(ProfileTls* ps);
+static Inspector* cfgapi_create_alg_dns_inspector(ProfileAlgDns* p_alg_dns, AppHostCX* cx);
+
+// resolve everything policy application needs, so it isn't done again for each accepted connection
+void cfgapi_compile_policy_bundle(PolicyRule* rule) {
+    
+    PolicyProfileBundle& b = rule->bundle;
+    b = PolicyProfileBundle();
+    
+    if(rule->profile_tls != nullptr) {
+        b.tls_sni_bypass_dns = cfgapi_profile_tls_sni_bypass_dns(rule->profile_tls);
+    }
+    
+    ProfileAlgDns* p_alg_dns = rule->profile_alg_dns;
+    if(p_alg_dns != nullptr) {
+        PolicyProfileBundle::inspector_entry e;
+        e.name = p_alg_dns->prof_name;
+        e.create = [p_alg_dns](AppHostCX* cx) { return cfgapi_create_alg_dns_inspector(p_alg_dns,cx); };
+        
+        b.inspectors.push_back(e);
+    }
+}
+
+int cfgapi_compile_obj_policy() {
     std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
     
+    for(auto rule: cfgapi_obj_policy) {
+        rule->compile();
+        cfgapi_compile_policy_bundle(rule);
+    }
+    
+    cfgapi_obj_policy_index.compile(cfgapi_obj_policy);
+    DIA_("cfgapi_compile_obj_policy: %s",cfgapi_obj_policy_index.to_string().c_str());
+    
+    return cfgapi_obj_policy.size();
+}
+
+int CfgSnapshot::policy_match(ConnectionKey const& key) {
+    
+    int idx = policy_index.match(policy,key);
+    if(idx != PolicyIndex::POLICYIDX_NOINDEX) {
+        if(idx < 0) {
+            DIAS_("cfgapi_obj_policy_match_key: implicit deny");
+        }
+        return idx;
+    }
+    
     int x = 0;
-    for( std::vector<PolicyRule*>::iterator i = cfgapi_obj_policy.begin(); i != cfgapi_obj_policy.end(); ++i) {
+    for( std::vector<PolicyRule*>::iterator i = policy.begin(); i != policy.end(); ++i) {
+        PolicyRule* rule = (*i);
+        bool r = rule->match(key);
+        
+        if(r) {
+            DIA_("cfgapi_obj_policy_match_key: matched #%d",x);
+            return x;
+        }
+        
+        x++;
+    }
+    
+    DIAS_("cfgapi_obj_policy_match_key: implicit deny");
+    return -1;
+}
+
+int CfgSnapshot::policy_match(baseProxy* proxy) {
+    
+    int idx = policy_index.match(policy,proxy);
+    if(idx != PolicyIndex::POLICYIDX_NOINDEX) {
+        if(idx < 0) {
+            DIAS_("cfgapi_obj_policy_match: implicit deny");
+        }
+        return idx;
+    }
+    
+    int x = 0;
+    for( std::vector<PolicyRule*>::iterator i = policy.begin(); i != policy.end(); ++i) {
         PolicyRule* rule = (*i);
         bool r = rule->match(proxy);
         
@@ -609,11 +699,18 @@ int cfgapi_obj_policy_match(baseProxy* proxy) {
     return -1;
 }
 
-int cfgapi_obj_policy_match(std::vector<baseHostCX*>& left, std::vector<baseHostCX*>& right) {
-    std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
+int CfgSnapshot::policy_match(std::vector<baseHostCX*>& left, std::vector<baseHostCX*>& right) {
+    
+    int idx = policy_index.match(policy,left,right);
+    if(idx != PolicyIndex::POLICYIDX_NOINDEX) {
+        if(idx < 0) {
+            DIAS_("cfgapi_obj_policy_match_lr: implicit deny");
+        }
+        return idx;
+    }
     
     int x = 0;
-    for( std::vector<PolicyRule*>::iterator i = cfgapi_obj_policy.begin(); i != cfgapi_obj_policy.end(); ++i) {
+    for( std::vector<PolicyRule*>::iterator i = policy.begin(); i != policy.end(); ++i) {
         PolicyRule* rule = (*i);
         bool r = rule->match(left,right);
         
@@ -629,96 +726,187 @@ int cfgapi_obj_policy_match(std::vector<baseHostCX*>& left, std::vector<baseHost
     return -1;
 }    
 
-int cfgapi_obj_policy_action(int index) {
-    std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
+PolicyRule* CfgSnapshot::policy_at(int index) {
+    
+    if(index < 0 || index >= (signed int)policy.size()) {
+        return nullptr;
+    }
+    
+    return policy.at(index);
+}
+
+int CfgSnapshot::policy_action(int index) {
     
     if(index < 0) {
         return -1;
     }
     
-    if(index < (signed int)cfgapi_obj_policy.size()) {
-        return cfgapi_obj_policy.at(index)->action;
+    PolicyRule* rule = policy_at(index);
+    if(rule != nullptr) {
+        return rule->action;
     } else {
         DIA_("cfg_obj_policy_action[#%d]: out of bounds, deny",index);
         return POLICY_ACTION_DENY;
     }
 }
 
-ProfileContent* cfgapi_obj_policy_profile_content(int index) {
-    std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
+ProfileContent* CfgSnapshot::policy_profile_content(int index) {
     
-    if(index < 0) {
+    PolicyRule* rule = policy_at(index);
+    if(rule == nullptr) {
+        if(index >= 0) DIA_("cfgapi_obj_policy_profile_content[#%d]: out of bounds, nullptr",index);
         return nullptr;
     }
     
-    if(index < (signed int)cfgapi_obj_policy.size()) {
-        return cfgapi_obj_policy.at(index)->profile_content;
-    } else {
-        DIA_("cfgapi_obj_policy_profile_content[#%d]: out of bounds, nullptr",index);
-        return nullptr;
-    }
+    return rule->profile_content;
 }
 
-ProfileDetection* cfgapi_obj_policy_profile_detection(int index) {
-    std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
+ProfileDetection* CfgSnapshot::policy_profile_detection(int index) {
     
-    if(index < 0) {
+    PolicyRule* rule = policy_at(index);
+    if(rule == nullptr) {
+        if(index >= 0) DIA_("cfgapi_obj_policy_profile_detection[#%d]: out of bounds, nullptr",index);
         return nullptr;
     }
     
-    if(index < (signed int)cfgapi_obj_policy.size()) {
-        return cfgapi_obj_policy.at(index)->profile_detection;
-    } else {
-        DIA_("cfgapi_obj_policy_profile_detection[#%d]: out of bounds, nullptr",index);
-        return nullptr;
-    }
+    return rule->profile_detection;
 }
 
-ProfileTls* cfgapi_obj_policy_profile_tls(int index) {
-    std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
+ProfileTls* CfgSnapshot::policy_profile_tls(int index) {
     
-    if(index < 0) {
+    PolicyRule* rule = policy_at(index);
+    if(rule == nullptr) {
+        if(index >= 0) DIA_("cfgapi_obj_policy_profile_tls[#%d]: out of bounds, nullptr",index);
         return nullptr;
     }
     
-    if(index < (signed int)cfgapi_obj_policy.size()) {
-        return cfgapi_obj_policy.at(index)->profile_tls;
-    } else {
-        DIA_("cfgapi_obj_policy_profile_tls[#%d]: out of bounds, nullptr",index);
+    return rule->profile_tls;
+}
+
+ProfileAlgDns* CfgSnapshot::policy_profile_alg_dns(int index) {
+    
+    PolicyRule* rule = policy_at(index);
+    if(rule == nullptr) {
+        if(index >= 0) DIA_("cfgapi_obj_policy_profile_alg_dns[#%d]: out of bounds, nullptr",index);
         return nullptr;
     }
+    
+    return rule->profile_alg_dns;
 }
 
-
-ProfileAlgDns* cfgapi_obj_policy_profile_alg_dns(int index) {
-    std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
+ProfileAuth* CfgSnapshot::policy_profile_auth(int index) {
     
-    if(index < 0) {
+    PolicyRule* rule = policy_at(index);
+    if(rule == nullptr) {
+        if(index >= 0) DIA_("cfgapi_obj_policy_profile_auth[#%d]: out of bounds, nullptr",index);
         return nullptr;
     }
     
-    if(index < (signed int)cfgapi_obj_policy.size()) {
-        return cfgapi_obj_policy.at(index)->profile_alg_dns;
-    } else {
-        DIA_("cfgapi_obj_policy_profile_alg_dns[#%d]: out of bounds, nullptr",index);
-        return nullptr;
+    return rule->profile_auth;
+}
+
+CfgSnapshot::~CfgSnapshot() {
+    
+    for(auto p: policy) {
+        delete p;
+    }
+    for(auto a: address) {
+        delete a.second;
+    }
+    for(auto p: profile_detection) {
+        delete p.second;
+    }
+    for(auto p: profile_content) {
+        delete p.second;
+    }
+    for(auto p: profile_tls) {
+        delete p.second;
     }
+    for(auto p: profile_auth) {
+        for(auto j: p.second->sub_policies) {
+            delete j;
+        }
+        delete p.second;
+    }
+    for(auto p: profile_alg_dns) {
+        delete p.second;
+    }
+    
+    DEB_("CfgSnapshot: %d policies freed",policy.size());
 }
 
 
-ProfileAuth* cfgapi_obj_policy_profile_auth(int index) {
+cfgapi_snapshot_ptr cfgapi_snapshot() {
+    return std::atomic_load(&cfgapi_snapshot_current);
+}
+
+void cfgapi_snapshot_publish() {
     std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
     
-    if(index < 0) {
-        return nullptr;
+    cfgapi_snapshot_ptr snap = std::make_shared<CfgSnapshot>();
+    
+    snap->address = cfgapi_obj_address;
+    snap->policy = cfgapi_obj_policy;
+    snap->policy_index = cfgapi_obj_policy_index;
+    snap->profile_detection = cfgapi_obj_profile_detection;
+    snap->profile_content = cfgapi_obj_profile_content;
+    snap->profile_tls = cfgapi_obj_profile_tls;
+    snap->profile_auth = cfgapi_obj_profile_auth;
+    snap->profile_alg_dns = cfgapi_obj_profile_alg_dns;
+    
+    for(auto const& a: snap->address) {
+        FqdnAddress* fa = dynamic_cast<FqdnAddress*>(a.second);
+        if(fa) {
+            snap->fqdns.push_back(fa->fqdn());
+        }
     }
     
-    if(index < (signed int)cfgapi_obj_policy.size()) {
-        return cfgapi_obj_policy.at(index)->profile_auth;
-    } else {
-        DIA_("cfgapi_obj_policy_profile_auth[#%d]: out of bounds, nullptr",index);
-        return nullptr;
-    }
+    // cfgapi_obj_* tables are from now only view of the snapshot, cleanup must not free objects
+    cfgapi_obj_published = true;
+    
+    std::atomic_store(&cfgapi_snapshot_current,snap);
+    DIA_("cfgapi_snapshot_publish: %d policies published",snap->policy.size());
+}
+
+void cfgapi_snapshot_release() {
+    std::atomic_store(&cfgapi_snapshot_current,std::make_shared<CfgSnapshot>());
+}
+
+
+int cfgapi_obj_policy_match(ConnectionKey const& key) {
+    return cfgapi_snapshot()->policy_match(key);
+}
+
+int cfgapi_obj_policy_match(baseProxy* proxy) {
+    return cfgapi_snapshot()->policy_match(proxy);
+}
+
+int cfgapi_obj_policy_match(std::vector<baseHostCX*>& left, std::vector<baseHostCX*>& right) {
+    return cfgapi_snapshot()->policy_match(left,right);
+}
+
+int cfgapi_obj_policy_action(int index) {
+    return cfgapi_snapshot()->policy_action(index);
+}
+
+ProfileContent* cfgapi_obj_policy_profile_content(int index) {
+    return cfgapi_snapshot()->policy_profile_content(index);
+}
+
+ProfileDetection* cfgapi_obj_policy_profile_detection(int index) {
+    return cfgapi_snapshot()->policy_profile_detection(index);
+}
+
+ProfileTls* cfgapi_obj_policy_profile_tls(int index) {
+    return cfgapi_snapshot()->policy_profile_tls(index);
+}
+
+ProfileAlgDns* cfgapi_obj_policy_profile_alg_dns(int index) {
+    return cfgapi_snapshot()->policy_profile_alg_dns(index);
+}
+
+ProfileAuth* cfgapi_obj_policy_profile_auth(int index) {
+    return cfgapi_snapshot()->policy_profile_auth(index);
 }
 
 
@@ -749,6 +937,7 @@ int cfgapi_load_obj_profile_detection() {
             
             if( cur_object.lookupValue("mode",a->mode) ) {
                 
+                cur_object.lookupValue("flow_max_bytes",a->flow_max_bytes);
                 a->prof_name = name;
                 cfgapi_obj_profile_detection[name] = a;
                 
@@ -829,6 +1018,11 @@ int cfgapi_load_obj_profile_content() {
                             ERR_("    [%d] unfinished replace policy",j);
                         }
                     }
+
+                    if(a->content_rules.size() > 0) {
+                        a->compiled_rules = std::make_shared<ContentRuleSet>();
+                        a->compiled_rules->compile(a->content_rules);
+                    }
                 }
                 
                 
@@ -898,6 +1092,24 @@ int cfgapi_load_obj_profile_tls() {
                                 }
                         }
                 }
+                cur_object.lookupValue("sni_filter_use_dns_cache",a->sni_filter_use_dns_cache);
+                cur_object.lookupValue("sni_filter_use_dns_domain_tree",a->sni_filter_use_dns_domain_tree);
+                
+                if(a->sni_filter_bypass.valid()) {
+                    for(std::string const& elem: *a->sni_filter_bypass.ptr()) {
+                        bool subdomains_only = false;
+                        std::string domain = DomainTrie::from_filter(elem,subdomains_only);
+                        
+                        bool added = false;
+                        if(domain.size() > 0) {
+                            added = subdomains_only ? a->sni_filter_bypass_domains.add("*." + domain,false) 
+                                                    : a->sni_filter_bypass_domains.add(domain,a->sni_filter_use_dns_domain_tree);
+                        }
+                        if(! added) {
+                            DIA_("cfgapi_load_obj_profile_tls: '%s': sni filter entry '%s' can't be checked against DNS cache",name.c_str(),elem.c_str());
+                        }
+                    }
+                }
                 
 
                 if(cur_object.exists("redirect_warning_ports")) {
@@ -914,6 +1126,7 @@ int cfgapi_load_obj_profile_tls() {
                         }
                 }
                 cur_object.lookupValue("sslkeylog",a->sslkeylog);
+                cur_object.lookupValue("ktls",a->ktls);
                 
                 cfgapi_obj_profile_tls[name] = a;
                 
@@ -1005,6 +1218,7 @@ int cfgapi_load_obj_profile_auth() {
                     
                     ProfileSubAuth* n_subpol = new ProfileSubAuth();
                     n_subpol->name = cur_subpol.getName();
+                    n_subpol->group_id = cfgapi_auth_group_id(n_subpol->name);
                     
                     std::string name_content;
                     std::string name_detection;
@@ -1055,6 +1269,7 @@ int cfgapi_load_obj_profile_auth() {
 
                     
                     a->sub_policies.push_back(n_subpol);
+                    a->groups.add(n_subpol->group_id);
                     DIA_("cfgapi_load_obj_profile_auth: profiles: %d:%s",j,n_subpol->name.c_str());
                 }
             }
@@ -1079,12 +1294,13 @@ int cfgapi_cleanup_obj_address() {
     {
         std::pair<std::string,AddressObject*> a = (*i);
         AddressObject* c = a.second;
-        if (c != nullptr) delete c;
+        if (c != nullptr && !cfgapi_obj_published) delete c;
 
         a.second = nullptr;
     }
     
     cfgapi_obj_address.clear();
+    cfgapi_obj_address_trie.clear();
     
     DEB_("cfgapi_cleanup_obj_address: %d objects freed",r);
     return r;
@@ -1096,11 +1312,12 @@ int cfgapi_cleanup_obj_policy() {
     int r = cfgapi_obj_policy.size();
     for(std::vector<PolicyRule*>::iterator i = cfgapi_obj_policy.begin(); i < cfgapi_obj_policy.end(); ++i) {
         PolicyRule* ptr = (*i);
-        if (ptr != nullptr) delete ptr;
+        if (ptr != nullptr && !cfgapi_obj_published) delete ptr;
         (*i) = nullptr;
     }
     
     cfgapi_obj_policy.clear();
+    cfgapi_obj_policy_index.clear();
     
     DEB_("cfgapi_cleanup_obj_policy: %d objects freed",r);
     return r;
@@ -1132,7 +1349,7 @@ int cfgapi_cleanup_obj_profile_content() {
     for(std::map<std::string, ProfileContent*>::iterator i = cfgapi_obj_profile_content.begin(); i != cfgapi_obj_profile_content.end(); ++i) {
         std::pair<std::string,ProfileContent*> t = (*i);
         ProfileContent* c = t.second;
-        if (c != nullptr) delete c;
+        if (c != nullptr && !cfgapi_obj_published) delete c;
     }
     cfgapi_obj_profile_content.clear();
     
@@ -1145,7 +1362,7 @@ int cfgapi_cleanup_obj_profile_detection() {
     for(std::map<std::string, ProfileDetection*>::iterator i = cfgapi_obj_profile_detection.begin(); i != cfgapi_obj_profile_detection.end(); ++i) {
         std::pair<std::string,ProfileDetection*> t = (*i);
         ProfileDetection* c = t.second;
-        if (c != nullptr) delete c;
+        if (c != nullptr && !cfgapi_obj_published) delete c;
     }
     cfgapi_obj_profile_detection.clear();
     
@@ -1158,7 +1375,7 @@ int cfgapi_cleanup_obj_profile_tls() {
     for(std::map<std::string, ProfileTls*>::iterator i = cfgapi_obj_profile_tls.begin(); i != cfgapi_obj_profile_tls.end(); ++i) {
         std::pair<std::string,ProfileTls*> t = (*i);
         ProfileTls* c = t.second;
-        if (c != nullptr) delete c;
+        if (c != nullptr && !cfgapi_obj_published) delete c;
     }
     cfgapi_obj_profile_tls.clear();
     
@@ -1172,7 +1389,7 @@ int cfgapi_cleanup_obj_profile_alg_dns() {
     for(std::map<std::string, ProfileAlgDns*>::iterator i = cfgapi_obj_profile_alg_dns.begin(); i != cfgapi_obj_profile_alg_dns.end(); ++i) {
         std::pair<std::string,ProfileAlgDns*> t = (*i);
         ProfileAlgDns* c = t.second;
-        if (c != nullptr) delete c;
+        if (c != nullptr && !cfgapi_obj_published) delete c;
     }
     cfgapi_obj_profile_alg_dns.clear();
     
@@ -1189,11 +1406,12 @@ int cfgapi_cleanup_obj_profile_auth() {
         std::pair<std::string,ProfileAuth*> t = (*i);
         ProfileAuth* c = t.second;
         
-        for(auto j: c->sub_policies) {
-            delete j;
+        if (c != nullptr && !cfgapi_obj_published) {
+            for(auto j: c->sub_policies) {
+                delete j;
+            }
+            delete c;
         }
-        
-        if (c != nullptr) delete c;
     }
     cfgapi_obj_profile_auth.clear();
     
@@ -1221,10 +1439,9 @@ bool cfgapi_obj_profile_content_apply(baseHostCX* originator, baseProxy* new_pro
             DIA_("cfgapi_obj_policy_apply: policy content profile[%s]: write payload: %d", pc_name, pc->write_payload);
             mitm_proxy->write_payload(pc->write_payload);
     
-            if(pc->content_rules.size() > 0) {
+            if(pc->compiled_rules) {
                 DIA_("cfgapi_obj_policy_apply: policy content profile[%s]: applying content rules, size %d", pc_name, pc->content_rules.size());
-                mitm_proxy->init_content_replace();
-                mitm_proxy->content_replace(pc->content_rules);
+                mitm_proxy->content_replace(pc->compiled_rules);
             }
         }
         else if(cfgapi.getRoot()["settings"].lookupValue("default_write_payload",cfg_wrt)) {
@@ -1266,6 +1483,16 @@ bool cfgapi_obj_profile_detect_apply(baseHostCX* originator, baseProxy* new_prox
             DIA_("cfgapi_obj_policy_apply[%s]: policy detection profile: mode: %d", pd_name, pd->mode);
             mitm_originator->mode(pd->mode);
         }
+        
+        MitmHostCX* mh = dynamic_cast<MitmHostCX*>(mitm_originator);
+        if(mh != nullptr && pd != nullptr) {
+            mh->flow_max_bytes = pd->flow_max_bytes < 0 ? 0 : pd->flow_max_bytes;
+        }
+        
+        // sensors are allocated only now, for the inspected side
+        if(mh != nullptr) {
+            mh->load_signatures();
+        }
     } else {
         WARS_("cfgapi_obj_policy_apply: cannot apply detection profile: cast to AppHostCX failed.");
         ret = false;
@@ -1274,7 +1501,12 @@ bool cfgapi_obj_profile_detect_apply(baseHostCX* originator, baseProxy* new_prox
     return ret;
 }
 
-bool cfgapi_obj_profile_tls_apply(baseHostCX* originator, baseProxy* new_proxy, ProfileTls* ps) {
+// TLS profile has SNI bypass list to be checked against DNS cache
+static bool cfgapi_profile_tls_sni_bypass_dns(ProfileTls* ps) {
+    return ps->sni_filter_bypass_domains.size() > 0 && ps->sni_filter_use_dns_cache;
+}
+
+bool cfgapi_obj_profile_tls_apply(baseHostCX* originator, baseProxy* new_proxy, ProfileTls* ps, PolicyProfileBundle const* bundle) {
     
     MitmProxy* mitm_proxy = static_cast<MitmProxy*>(new_proxy); 
     AppHostCX* mitm_originator = static_cast<AppHostCX*>(originator);
@@ -1296,59 +1528,35 @@ bool cfgapi_obj_profile_tls_apply(baseHostCX* originator, baseProxy* new_proxy,
                     
                     //applying bypass based on DNS cache
                     
-                    SSLCom* sslcom = dynamic_cast<SSLCom*>(xcom);
-                    if(sslcom && ps->sni_filter_bypass.valid()) {
-                        if(ps->sni_filter_bypass.ptr()->size() > 0 && ps->sni_filter_use_dns_cache) {
+                    bool sni_bypass_dns = bundle ? bundle->tls_sni_bypass_dns : cfgapi_profile_tls_sni_bypass_dns(ps);
+                    
+                    SSLCom* sslcom = sni_bypass_dns ? dynamic_cast<SSLCom*>(xcom) : nullptr;
+                    if(sslcom) {
+                    
+                        AddressKey c;
+                        c.load(xcom->owner_cx()->host().c_str());
                         
-                            bool interrupt = false;
-                            for(std::string& filter_element: *ps->sni_filter_bypass) {
-                                FqdnAddress f(filter_element);
-                                CIDR* c = cidr_from_str(xcom->owner_cx()->host().c_str());
-                                
-                                if(f.match(c)) {
-                                    if(sslcom->bypass_me_and_peer()) {
-                                        INF_("Connection %s bypassed: IP in DNS cache matching TLS bypass list (%s).",originator->full_name('L').c_str(),filter_element.c_str());
-                                        interrupt = true;
-                                    } else {
-                                        WAR_("Connection %s: cannot be bypassed.",originator->full_name('L').c_str());
-                                    }
-                                } else if (ps->sni_filter_use_dns_domain_tree) {
-                                    domain_cache.lock();
-                                    //INF_("FQDN doesn't match SNI element, looking for sub-domains of %s", filter_element.c_str());
-                                    //FIXME: we assume flter is 2nd level domain... 
-                                    
-                                    auto subdomain_cache = domain_cache.get(filter_element);
-                                    if(subdomain_cache != nullptr) {
-                                        for(auto subdomain: subdomain_cache->cache()) {
-                                            
-                                            std::vector<std::string> prefix_n_domainname = string_split(subdomain.first,':');
-                                            if(prefix_n_domainname.size() < 2) continue; // don't continue if we can't strip A: or AAAA:
-                                            
-                                            FqdnAddress f(prefix_n_domainname.at(1)+"."+filter_element);
-                                            DEB_("Connection %s: subdomain check: test if %s matches %s",originator->full_name('L').c_str(),f.to_string().c_str(),xcom->owner_cx()->host().c_str());
-                                            
-                                            if(f.match(c)) {
-                                                if(sslcom->bypass_me_and_peer()) {
-                                                    INF_("Connection %s bypassed: IP in DNS subdomain cache matching TLS bypass list (%s).",originator->full_name('L').c_str(),filter_element.c_str());
-                                                } else {
-                                                    WAR_("Connection %s: cannot be bypassed.",originator->full_name('L').c_str());                                                    
-                                                }
-                                                interrupt = true; //exit also from main loop
-                                                break;
-                                            }
-                                        }
-                                    }
-                                    
-                                    domain_cache.unlock();
-                                }
-                                
-                                delete c;
-                                
-                                if(interrupt) 
-                                    break;
-                            }                        
-                            
+                        // names target IP was resolved from, checked against SNI filter domains
+                        DomainTrie const& domains = ps->sni_filter_bypass_domains;
+                        std::string matched_name;
+                        int matched = -1;
+                        inspect_dns_cache.find_name_of(c,[&domains,&matched,&matched_name](std::string const& n) {
+                            matched = domains.match(n);
+                            if(matched >= 0) {
+                                matched_name = n;
+                                return true;
+                            }
+                            return false;
+                        });
+                        
+                        if(matched >= 0) {
+                            if(sslcom->bypass_me_and_peer()) {
+                                INF_("Connection %s bypassed: IP in DNS cache as %s matching TLS bypass list (%s).",originator->full_name('L').c_str(),matched_name.c_str(),domains.domain(matched).c_str());
+                            } else {
+                                WAR_("Connection %s: cannot be bypassed.",originator->full_name('L').c_str());
+                            }
                         }
+                        
                     }
                 }
             }
@@ -1358,6 +1566,27 @@ bool cfgapi_obj_profile_tls_apply(baseHostCX* originator, baseProxy* new_proxy,
     return tls_applied;
 }
 
+// create DNS inspector set up from ALG profile, nullptr if connection is not DNS
+static Inspector* cfgapi_create_alg_dns_inspector(ProfileAlgDns* p_alg_dns, AppHostCX* cx) {
+    
+    // don't allocate inspector for connections it's not interested in
+    static InspectorInterest const* dns_interest = InspectorRegistry::find("DNS_Inspector");
+    if(dns_interest != nullptr && ! dns_interest->match(cx)) {
+        return nullptr;
+    }
+    
+    DNS_Inspector* n = new DNS_Inspector();
+    if(n->l4_prefilter(cx)) {
+        n->opt_match_id = p_alg_dns->match_request_id;
+        n->opt_randomize_id = p_alg_dns->randomize_id;
+        n->opt_cached_responses = p_alg_dns->cached_responses;
+        return n;
+    }
+    
+    delete n;
+    return nullptr;
+}
+
 bool cfgapi_obj_alg_dns_apply(baseHostCX* originator, baseProxy* new_proxy, ProfileAlgDns* p_alg_dns) {
     
     AppHostCX* mitm_originator = static_cast<AppHostCX*>(originator);    
@@ -1368,17 +1597,11 @@ bool cfgapi_obj_alg_dns_apply(baseHostCX* originator, baseProxy* new_proxy, Prof
     if(mh != nullptr) {
 
         if(p_alg_dns != nullptr) {
-            DNS_Inspector* n = new DNS_Inspector();
-            if(n->l4_prefilter(mh)) {
-                n->opt_match_id = p_alg_dns->match_request_id;
-                n->opt_randomize_id = p_alg_dns->randomize_id;
-                n->opt_cached_responses = p_alg_dns->cached_responses;
-                mh->inspectors_.push_back(n);
+            Inspector* n = cfgapi_create_alg_dns_inspector(p_alg_dns,mh);
+            if(n != nullptr) {
+                mh->inspector_add(n);
                 ret = true;
             }
-            else {
-                delete n;
-            }
         }
         
     } else {
@@ -1388,18 +1611,28 @@ bool cfgapi_obj_alg_dns_apply(baseHostCX* originator, baseProxy* new_proxy, Prof
     return ret;
 }
 
-int cfgapi_obj_policy_apply(baseHostCX* originator, baseProxy* new_proxy) {
-    std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
+int cfgapi_obj_policy_apply(baseHostCX* originator, baseProxy* new_proxy, ConnectionKey const* key) {
     
-    int policy_num = cfgapi_obj_policy_match(new_proxy);
-    int verdict = cfgapi_obj_policy_action(policy_num);
-    if(verdict == POLICY_ACTION_PASS) {
-
-        ProfileContent* pc  = cfgapi_obj_policy_profile_content(policy_num);
-        ProfileDetection* pd = cfgapi_obj_policy_profile_detection(policy_num);
-        ProfileTls* pt = cfgapi_obj_policy_profile_tls(policy_num);
-        ProfileAuth* pa = cfgapi_obj_policy_profile_auth(policy_num);
-        ProfileAlgDns* p_alg_dns  = cfgapi_obj_policy_profile_alg_dns(policy_num);
+    MitmProxy* mitm_proxy = static_cast<MitmProxy*>(new_proxy); 
+    
+    // no lock needed: session is matched against its own snapshot, which doesn't change
+    cfgapi_snapshot_ptr cfg = mitm_proxy->config();
+    if(!cfg) {
+        cfg = cfgapi_snapshot();
+        mitm_proxy->config(cfg);
+    }
+    
+    int policy_num = (key != nullptr && key->valid) ? cfg->policy_match(*key) : cfg->policy_match(new_proxy);
+    PolicyRule* rule = cfg->policy_at(policy_num);
+    int verdict = cfg->policy_action(policy_num);
+    if(verdict == POLICY_ACTION_PASS && rule != nullptr) {
+
+        // everything is resolved in the rule and its bundle, see cfgapi_compile_obj_policy()
+        PolicyProfileBundle const& bundle = rule->bundle;
+        ProfileContent* pc  = rule->profile_content;
+        ProfileDetection* pd = rule->profile_detection;
+        ProfileTls* pt = rule->profile_tls;
+        ProfileAuth* pa = rule->profile_auth;
         
         
         const char* pc_name = "none";
@@ -1424,22 +1657,38 @@ int cfgapi_obj_policy_apply(baseHostCX* originator, baseProxy* new_proxy) {
             pd_name = pd->prof_name.c_str();
         }        
         
+        // no detection profile: context keeps its default mode. Sensors are created only for originator.
+        if(! pd) {
+            MitmHostCX* mh = dynamic_cast<MitmHostCX*>(originator);
+            if(mh != nullptr) {
+                mh->load_signatures();
+            }
+        }
+        
         /* Processing TLS profile*/
         if(pt)
-        if(cfgapi_obj_profile_tls_apply(originator,new_proxy,pt)) {
+        if(cfgapi_obj_profile_tls_apply(originator,new_proxy,pt,&bundle)) {
             pt_name = pt->prof_name.c_str();
         }        
         
-        /* Processing ALG : DNS*/
-        if(p_alg_dns)
-        if(cfgapi_obj_alg_dns_apply(originator,new_proxy,p_alg_dns)) {
-            algs_name += p_alg_dns->prof_name.c_str();
-        }        
+        /* Processing ALGs */
+        if(! bundle.inspectors.empty()) {
+            // ALGS can operate only on MitmHostCX classes
+            MitmHostCX* mh = dynamic_cast<MitmHostCX*>(originator);
+            if(mh != nullptr) {
+                for(auto const& i: bundle.inspectors) {
+                    Inspector* n = i.create(mh);
+                    if(n != nullptr) {
+                        mh->inspector_add(n);
+                        algs_name += i.name;
+                    }
+                }
+            } else {
+                NOT_("Connection %s cannot be inspected by ALGs",originator->full_name('L').c_str());
+            }
+        }
 
         
-        MitmProxy* mitm_proxy = static_cast<MitmProxy*>(new_proxy); 
-        AppHostCX* mitm_originator = static_cast<AppHostCX*>(originator);
-        
         /* Processing Auth profile */
         if(pa) {
             // auth is applied on proxy
@@ -1449,8 +1698,6 @@ int cfgapi_obj_policy_apply(baseHostCX* originator, baseProxy* new_proxy) {
             pa_name = pa->prof_name.c_str();
         } 
         
-        // ALGS can operate only on MitmHostCX classes
-
         
         INF_("Connection %s accepted: policy=%d cont=%s det=%s tls=%s auth=%s algs=%s",originator->full_name('L').c_str(),policy_num,pc_name,pd_name,pt_name,pa_name,algs_name.c_str());
         
@@ -1548,6 +1795,11 @@ bool cfgapi_obj_policy_apply_tls(ProfileTls* pt, baseCom* xcom) {
             
             sslcom->sslkeylog = pt->sslkeylog;
             
+            MySSLMitmCom* mcom = dynamic_cast<MySSLMitmCom*>(xcom);
+            if(mcom != nullptr) {
+                mcom->opt_ktls = pt->ktls && pt->inspect;
+            }
+            
             tls_applied = true;
         }        
     }
@@ -1556,8 +1808,12 @@ bool cfgapi_obj_policy_apply_tls(ProfileTls* pt, baseCom* xcom) {
 }
 
 
+// clear cfgapi_obj_* tables. Objects are freed only if they were not published - published ones
+// are owned by the snapshot.
 void cfgapi_cleanup()
 {
+  std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
+  
   cfgapi_cleanup_obj_policy();
   cfgapi_cleanup_obj_address();
   cfgapi_cleanup_obj_port();
@@ -1567,6 +1823,8 @@ void cfgapi_cleanup()
   cfgapi_cleanup_obj_profile_tls();
   cfgapi_cleanup_obj_profile_auth();
   cfgapi_cleanup_obj_profile_alg_dns();
+  
+  cfgapi_obj_published = false;
 }
 
 
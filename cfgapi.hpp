@@ -23,12 +23,15 @@
 #include <vector>
 #include <map>
 #include <mutex>
+#include <memory>
 #include <ctime>
  
 #include <libconfig.h++>
 #include <cidr.hpp>
 #include <ranges.hpp>
 #include <policy.hpp>
+#include <policyidx.hpp>
+#include <addrtrie.hpp>
 
 #include <cfgapi_auth.hpp>
 
@@ -48,9 +51,11 @@ using namespace libconfig;
 extern time_t system_started;
 extern Config cfgapi;
 extern std::map<std::string,AddressObject*> cfgapi_obj_address;
+extern AddressTrie<std::vector<std::string>> cfgapi_obj_address_trie;
 extern std::map<std::string,range> cfgapi_obj_port;
 extern std::map<std::string,int> cfgapi_obj_proto;
 extern std::vector<PolicyRule*> cfgapi_obj_policy;
+extern PolicyIndex cfgapi_obj_policy_index;
 extern std::map<std::string,ProfileDetection*> cfgapi_obj_profile_detection;
 extern std::map<std::string,ProfileContent*> cfgapi_obj_profile_content;
 extern std::map<std::string,ProfileTls*> cfgapi_obj_profile_tls;
@@ -68,6 +73,51 @@ extern std::string cfgapi_tenant_magic_ip;
 
 extern std::vector<std::string> cfgapi_obj_nameservers;
 
+
+//
+// Immutable snapshot of policy, profiles and address objects. It's built at the end of each (re)load
+// from the cfgapi_obj_* tables and published atomically. Workers read it without cfgapi_write_lock,
+// and sessions keep the snapshot they matched against, so reload doesn't pull objects from under them.
+// Snapshot owns its objects: they are freed when the last reference is dropped.
+//
+struct CfgSnapshot {
+    std::map<std::string,AddressObject*> address;
+    std::vector<PolicyRule*> policy;
+    PolicyIndex policy_index;
+    std::map<std::string,ProfileDetection*> profile_detection;
+    std::map<std::string,ProfileContent*> profile_content;
+    std::map<std::string,ProfileTls*> profile_tls;
+    std::map<std::string,ProfileAuth*> profile_auth;
+    std::map<std::string,ProfileAlgDns*> profile_alg_dns;
+    // names of FQDN address objects, for DNS updater
+    std::vector<std::string> fqdns;
+
+    int policy_match(ConnectionKey const& key);
+    int policy_match(baseProxy* proxy);
+    int policy_match(std::vector<baseHostCX*>& left, std::vector<baseHostCX*>& right);
+
+    // nullptr if index is out of policy table
+    PolicyRule* policy_at(int index);
+    int policy_action(int index);
+    ProfileContent* policy_profile_content(int index);
+    ProfileDetection* policy_profile_detection(int index);
+    ProfileTls* policy_profile_tls(int index);
+    ProfileAuth* policy_profile_auth(int index);
+    ProfileAlgDns* policy_profile_alg_dns(int index);
+
+    CfgSnapshot() {};
+    CfgSnapshot(CfgSnapshot const&) = delete;
+    CfgSnapshot& operator=(CfgSnapshot const&) = delete;
+    virtual ~CfgSnapshot();
+};
+
+// currently published snapshot - never nullptr, lock-free
+cfgapi_snapshot_ptr cfgapi_snapshot();
+// build snapshot from loaded objects and publish it. Objects are then owned by the snapshot.
+void cfgapi_snapshot_publish();
+// drop published snapshot (at exit), sessions still holding it keep it alive
+void cfgapi_snapshot_release();
+
 struct logging_{
     loglevel level = INF;
     loglevel cli_init_level = NON;
@@ -85,6 +135,8 @@ bool  cfgapi_init(const char* fnm);
 void  cfgapi_cleanup();
 
 AddressObject* cfgapi_lookup_address(const char* name);
+// names of CIDR address objects containing the key, shortest prefix first. Returns number of matched prefixes.
+int   cfgapi_lookup_address(AddressKey const& key, std::vector<std::string>& names);
 range cfgapi_lookup_port(const char* name);
 int   cfgapi_lookup_proto(const char* name);
 ProfileDetection* cfgapi_lookup_profile_detection(const char* name);
@@ -103,6 +155,11 @@ int  cfgapi_load_obj_profile_tls();
 int  cfgapi_load_obj_profile_auth();
 int  cfgapi_load_obj_profile_alg_dns();
 
+// build policy index - must be called after policy is loaded
+int  cfgapi_compile_obj_policy();
+// fill rule's profile bundle; done by cfgapi_compile_obj_policy() for loaded policy
+void cfgapi_compile_policy_bundle(PolicyRule* rule);
+
 int  cfgapi_cleanup_obj_address();
 int  cfgapi_cleanup_obj_port();
 int  cfgapi_cleanup_obj_proto();
@@ -113,17 +170,21 @@ int  cfgapi_cleanup_obj_profile_tls();
 int  cfgapi_cleanup_obj_profile_auth();
 int  cfgapi_cleanup_obj_profile_alg_dns();
 
+// functions below use current snapshot; sessions should use their own one (MitmProxy::config())
+int cfgapi_obj_policy_match(ConnectionKey const& key);
 int cfgapi_obj_policy_match(baseProxy* proxy);
 int cfgapi_obj_policy_match(std::vector<baseHostCX*>& left, std::vector<baseHostCX*>& right);
 int cfgapi_obj_policy_action(int index);
-int cfgapi_obj_policy_apply(baseHostCX* originator, baseProxy* proxy);
+// key is optional: if not set, connection tuple is parsed from proxy contexts.
+// Proxy is matched against its snapshot if it has one, otherwise current snapshot is assigned to it.
+int cfgapi_obj_policy_apply(baseHostCX* originator, baseProxy* proxy, ConnectionKey const* key=nullptr);
 
 bool cfgapi_obj_policy_apply_tls(int policy_num, baseCom* xcom);
 bool cfgapi_obj_policy_apply_tls(ProfileTls* pt, baseCom* xcom);
 
 bool cfgapi_obj_profile_content_apply(baseHostCX* originator, baseProxy* new_proxy, ProfileContent* pc);
 bool cfgapi_obj_profile_detect_apply(baseHostCX* originator, baseProxy* new_proxy, ProfileDetection* pd);
-bool cfgapi_obj_profile_tls_apply(baseHostCX* originator, baseProxy* new_proxy, ProfileTls* ps);
+bool cfgapi_obj_profile_tls_apply(baseHostCX* originator, baseProxy* new_proxy, ProfileTls* ps, PolicyProfileBundle const* bundle=nullptr);
 bool cfgapi_obj_alg_dns_apply(baseHostCX* originator, baseProxy* new_proxy, ProfileAlgDns* p_alg_dns);
 
 void cfgapi_log_version(bool warn_delay=true);
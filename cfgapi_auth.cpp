@@ -25,6 +25,37 @@
 unsigned int IdentityInfoBase::global_idle_timeout = 600;
 
 
+// group name intern table - append only
+static std::mutex cfgapi_auth_group_lock;
+static std::unordered_map<std::string,unsigned int> cfgapi_auth_group_ids;
+static std::vector<std::string> cfgapi_auth_group_names;
+
+unsigned int cfgapi_auth_group_id(std::string const& name) {
+    std::lock_guard<std::mutex> l(cfgapi_auth_group_lock);
+    
+    auto it = cfgapi_auth_group_ids.find(name);
+    if(it != cfgapi_auth_group_ids.end()) {
+        return it->second;
+    }
+    
+    unsigned int id = cfgapi_auth_group_names.size();
+    cfgapi_auth_group_names.push_back(name);
+    cfgapi_auth_group_ids[name] = id;
+    
+    DIA_("cfgapi_auth_group_id: new group '%s' id %d",name.c_str(),id);
+    return id;
+}
+
+std::string cfgapi_auth_group_name(unsigned int id) {
+    std::lock_guard<std::mutex> l(cfgapi_auth_group_lock);
+    
+    if(id < cfgapi_auth_group_names.size()) {
+        return cfgapi_auth_group_names[id];
+    }
+    return "";
+}
+
+
 // IPv4 logon shm table and its map
 shared_ip_map auth_shm_ip_map;
 std::unordered_map<std::string,IdentityInfo> auth_ip_map;
@@ -32,6 +32,7 @@
 
 #include <buffer.hpp>
 #include <shmtable.hpp>
+#include <authgroup.hpp>
 
 
 #define AUTH_IP_MEM_NAME "/smithproxy_auth_ok_%s"
@@ -194,6 +195,8 @@ struct IdentityInfoBase {
     std::string  groups;
     
     std::vector<std::string> groups_vec;
+    GroupSet groups_set;            // interned groups_vec, see authgroup.hpp
+    bool groups_parsed = false;
     
     unsigned int rx_bytes = 0;
     unsigned int tx_bytes = 0;
@@ -221,8 +224,17 @@ struct IdentityInfoType : public IdentityInfoBase {
     IdentityInfoType() : IdentityInfoBase() {}
 
     virtual void update() {
-        groups = last_logon_info.groups();
+        std::string new_groups = last_logon_info.groups();
+        
+        // identity is refreshed periodically, but groups change rarely
+        if(groups_parsed && new_groups == groups) {
+            return;
+        }
+        
+        groups = new_groups;
         groups_vec.clear();
+        groups_set.clear();
+        groups_parsed = true;
         
         int pos = 0;
         int old_pos = 0;
@@ -231,6 +243,7 @@ struct IdentityInfoType : public IdentityInfoBase {
             if(pos > old_pos && pos != static_cast<int>(std::string::npos)) {
                 std::string x  = groups.substr(old_pos,pos-old_pos);
                 groups_vec.push_back(x);
+                groups_set.add(cfgapi_auth_group_id(x));
                 
                 old_pos = pos + 1;
                 pos++;
@@ -238,6 +251,7 @@ struct IdentityInfoType : public IdentityInfoBase {
             } else {
                 std::string x  = groups.substr(old_pos,groups.size()-old_pos);
                 groups_vec.push_back(x);
+                groups_set.add(cfgapi_auth_group_id(x));
                 break;
             }
         }
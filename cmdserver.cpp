@@ -20,6 +20,10 @@
 #include <string>
 #include <thread>
 #include <set>
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <regex>
 
 #include <cstring>
 #include <cstdlib>
@@ -46,12 +50,17 @@
 #include <socle.hpp>
 #include <sslcom.hpp>
 #include <sslcertstore.hpp>
+#include <tcpcom.hpp>
 
 #include <smithproxy.hpp>
 #include <mitmproxy.hpp>
+#include <mitmhost.hpp>
+#include <ktls.hpp>
+#include <sigprefilter.hpp>
 #include <sobject.hpp>
 #include <dns.hpp>
 #include <inspectors.hpp>
+#include <dnsresolver.hpp>
 
 int cli_port = 50000;
 std::string cli_enable_password = "";
@@ -298,6 +307,814 @@ int cli_test_dns_refreshallfqdns(struct cli_def *cli, const char *command, char
 }
 
 
+// worker of DNS cache benchmark: lookups mixed with one insert in 'insert_every' operations
+template <class Lookup, class Insert>
+static void cli_test_dns_cache_worker(unsigned int seed, int ops, int insert_every, std::vector<std::string> const& names,
+                                      Lookup lookup, Insert insert, int& hits) {
+    unsigned int x = seed;
+    for(int i = 0; i < ops; i++) {
+        // xorshift, so threads don't share any random generator state
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        
+        std::string const& name = names[x % names.size()];
+        uint16_t type = (x & 0x100) ? AAAA : A;
+        
+        if(i % insert_every == 0) {
+            insert(type,name);
+        } else if(lookup(type,name)) {
+            hits++;
+        }
+    }
+}
+
+int cli_test_dns_cache(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    int ops = 200000;
+    int insert_every = 10;
+    
+    if(argc > 0) {
+        std::string argv0(argv[0]);
+        if( argv0 == "?" || argv0 == "\t") {
+            cli_print(cli,"specify number of cache operations per thread, default is %d",ops);
+            return CLI_OK;
+        }
+        ops = safe_val(argv[0],ops);
+        if(ops <= 0) ops = 1;
+    }
+    
+    cli_print(cli,"comparing single-lock DNS cache with sharded cache, %d operations per thread, 1/%d inserts",ops,insert_every);
+    
+    std::vector<std::string> names;
+    for(int i = 0; i < 1500; i++) {
+        names.push_back(string_format("host%d.domain%d.example.com",i,i%37));
+    }
+    
+    for(int n: { 1, 2, 4, 8, 16 }) {
+        
+        std::vector<int> hits(n,0);
+        
+        // previous design: one cache and one lock, keys built as "A:"+fqdn
+        ptr_cache<std::string,DNS_Response> single("DNS cache benchmark",2000,true);
+        auto single_lookup = [&single](uint16_t type, std::string const& name) {
+            single.lock();
+            bool ret = single.get((type == A ? "A:" : "AAAA:") + name) != nullptr;
+            single.unlock();
+            return ret;
+        };
+        auto single_insert = [&single](uint16_t type, std::string const& name) {
+            single.lock();
+            single.set((type == A ? "A:" : "AAAA:") + name,new DNS_Response());
+            single.unlock();
+        };
+        
+        DnsCache sharded("DNS cache benchmark",2000);
+        auto sharded_lookup = [&sharded](uint16_t type, std::string const& name) {
+            return (bool)sharded.get(type,name);
+        };
+        auto sharded_insert = [&sharded](uint16_t type, std::string const& name) {
+            sharded.set(type,name,new DNS_Response());
+        };
+        
+        auto t_start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::thread> threads;
+            for(int t = 0; t < n; t++) {
+                threads.push_back(std::thread(cli_test_dns_cache_worker<decltype(single_lookup),decltype(single_insert)>,
+                                              2463534242u + t,ops,insert_every,std::cref(names),single_lookup,single_insert,std::ref(hits[t])));
+            }
+            for(auto& th: threads) th.join();
+        }
+        auto t_single = std::chrono::steady_clock::now();
+        {
+            std::vector<std::thread> threads;
+            for(int t = 0; t < n; t++) {
+                threads.push_back(std::thread(cli_test_dns_cache_worker<decltype(sharded_lookup),decltype(sharded_insert)>,
+                                              2463534242u + t,ops,insert_every,std::cref(names),sharded_lookup,sharded_insert,std::ref(hits[t])));
+            }
+            for(auto& th: threads) th.join();
+        }
+        auto t_sharded = std::chrono::steady_clock::now();
+        
+        double total = (double)ops*n;
+        double mops_single = total/std::chrono::duration_cast<std::chrono::microseconds>(t_single - t_start).count();
+        double mops_sharded = total/std::chrono::duration_cast<std::chrono::microseconds>(t_sharded - t_single).count();
+        
+        cli_print(cli,"%3d threads: single lock %8.3f Mops/s, sharded %8.3f Mops/s",n,mops_single,mops_sharded);
+    }
+    
+    return CLI_OK;
+}
+
+
+// DNS message builder for parser tests
+struct cli_test_dns_msg {
+    std::string m;
+    
+    cli_test_dns_msg(uint16_t id, uint16_t flags, uint16_t qd, uint16_t an, uint16_t ns, uint16_t ar) {
+        u16(id); u16(flags); u16(qd); u16(an); u16(ns); u16(ar);
+    }
+    void u16(uint16_t v) { m += (char)(v >> 8); m += (char)(v & 0xff); }
+    void u32(uint32_t v) { u16(v >> 16); u16(v & 0xffff); }
+    // dotted name, optionally ending with compression pointer
+    void name(const char* dotted, int ptr=-1) {
+        std::string n(dotted);
+        unsigned int b = 0;
+        while(b < n.size()) {
+            std::string::size_type e = n.find('.',b);
+            if(e == std::string::npos) e = n.size();
+            m += (char)(e - b);
+            m += n.substr(b,e-b);
+            b = e + 1;
+        }
+        if(ptr >= 0) u16(0xC000 | ptr); else m += (char)0;
+    }
+    void question(uint16_t type) { u16(type); u16(1); }
+    void rr(uint16_t type, uint32_t ttl, std::string const& rdata) { u16(type); u16(1); u32(ttl); u16(rdata.size()); m += rdata; }
+};
+
+// valid and malformed DNS messages; first 'valid' of them parse OK
+static std::vector<std::string> cli_test_dns_corpus(unsigned int& valid) {
+    std::vector<std::string> ret;
+    
+    // A response, answers compressed to question name
+    cli_test_dns_msg a(0x1234,0x8180,1,2,0,0);
+    a.name("www.example.com"); a.question(A);
+    a.name("",12); a.rr(A,300,std::string("\x5d\xb8\xd8\x22",4));
+    a.name("",12); a.rr(A,300,std::string("\x5d\xb8\xd8\x23",4));
+    ret.push_back(a.m);
+    
+    // CNAME chain with suffix compression, EDNS0 in additionals
+    cli_test_dns_msg c(0x2345,0x8180,1,2,0,1);
+    c.name("img.static.example.org"); c.question(AAAA);
+    c.name("",12); 
+    int cname_target = c.m.size() + 10;
+    {
+        cli_test_dns_msg t(0,0,0,0,0,0); t.m.clear(); t.name("cdn",23);       // -> example.org of question
+        c.rr(CNAME,60,t.m);
+    }
+    c.name("",cname_target); c.rr(AAAA,60,std::string("\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\x01",16));
+    c.name(""); c.u16(OPT); c.u16(4096); c.u32(0); c.u16(0);
+    ret.push_back(c.m);
+    
+    // NXDOMAIN with SOA in authorities
+    cli_test_dns_msg n(0x3456,0x8183,1,0,1,0);
+    n.name("nonexistent.example.com"); n.question(A);
+    {
+        cli_test_dns_msg t(0,0,0,0,0,0); t.m.clear(); 
+        t.name("ns1",24); t.name("hostmaster",24); t.u32(2024010101); t.u32(7200); t.u32(3600); t.u32(1209600); t.u32(300);
+        n.name("",24); n.rr(SOA,900,t.m);
+    }
+    ret.push_back(n.m);
+    
+    // query
+    cli_test_dns_msg q(0x4567,0x0100,1,0,0,0);
+    q.name("smithproxy.org"); q.question(A);
+    ret.push_back(q.m);
+    
+    valid = ret.size();
+    
+    // pointer to itself
+    cli_test_dns_msg l1(0x5678,0x8180,1,1,0,0);
+    l1.name("loop.example.com"); l1.question(A);
+    l1.u16(0xC000 | l1.m.size()); l1.rr(A,1,std::string("\1\2\3\4",4));
+    ret.push_back(l1.m);
+    
+    // pointer forward, to the next name which points back
+    cli_test_dns_msg l2(0x6789,0x8180,2,0,0,0);
+    l2.name("a",20); l2.question(A);
+    l2.name("b",12); l2.question(A);
+    ret.push_back(l2.m);
+    
+    // name longer than 255 bytes
+    cli_test_dns_msg lng(0x789a,0x8180,1,0,0,0);
+    std::string long_name;
+    for(int i = 0; i < 30; i++) long_name += "abcdefghi.";
+    long_name += "com";
+    lng.name(long_name.c_str()); lng.question(A);
+    ret.push_back(lng.m);
+    
+    // truncated in the middle of answer data
+    ret.push_back(a.m.substr(0,a.m.size() - 2));
+    // header only, counts don't match
+    ret.push_back(a.m.substr(0,12));
+    
+    return ret;
+}
+
+int cli_test_dns_parser(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    int count = 100000;
+    
+    if(argc > 0) {
+        std::string argv0(argv[0]);
+        if( argv0 == "?" || argv0 == "\t") {
+            cli_print(cli,"specify number of parsed messages, default is %d",count);
+            return CLI_OK;
+        }
+        count = safe_val(argv[0],count);
+        if(count <= 0) count = 1;
+    }
+    
+    unsigned int valid = 0;
+    std::vector<std::string> corpus = cli_test_dns_corpus(valid);
+    
+    // corpus: valid messages must parse, malformed ones must be rejected
+    int failed = 0;
+    for(unsigned int i = 0; i < corpus.size(); i++) {
+        DnsWireParser wire;
+        int r = wire.parse((const unsigned char*)corpus[i].data(),corpus[i].size());
+        bool ok = (i < valid) ? (r == DnsWireParser::DNS_PARSE_OK && wire.length() == corpus[i].size()) 
+                              : (r == DnsWireParser::DNS_PARSE_ERROR);
+        if(! ok) failed++;
+        
+        std::string names;
+        if(r == DnsWireParser::DNS_PARSE_OK) {
+            for(unsigned int j = 0; j < wire.records(); j++) {
+                names += " " + wire.name(wire.at(j).name);
+            }
+        }
+        cli_print(cli,"corpus[%d]: %s %s:%s",i,ok ? "ok  " : "FAIL",r == DnsWireParser::DNS_PARSE_OK ? "parsed" : "rejected",names.c_str());
+    }
+    
+    // mutated messages: parser must terminate without reading out of bounds (run with sanitizers to be sure)
+    unsigned int x = 2463534242u;
+    int mutated_ok = 0;
+    for(int i = 0; i < count; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        std::string m = corpus[x % corpus.size()];
+        
+        for(int k = 0; k < 1 + (int)(x >> 28) && m.size() > 0; k++) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            m[x % m.size()] = (char)(x >> 8);
+        }
+        if(x & 0x10) {
+            m.resize(x % (m.size() + 1));
+        }
+        
+        DnsWireParser wire;
+        if(wire.parse((const unsigned char*)m.data(),m.size()) == DnsWireParser::DNS_PARSE_OK) {
+            mutated_ok++;
+            DNS_Response r;
+            r.load(wire,(const unsigned char*)m.data());
+        }
+    }
+    cli_print(cli,"fuzz: %d mutated messages, %d still parseable",count,mutated_ok);
+    
+    // benchmark on valid messages: in place parsing, and building owned structures
+    unsigned int parsed = 0;
+    auto t_start = std::chrono::steady_clock::now();
+    for(int i = 0; i < count; i++) {
+        std::string const& m = corpus[i % valid];
+        DnsWireParser wire;
+        if(wire.parse((const unsigned char*)m.data(),m.size()) == DnsWireParser::DNS_PARSE_OK) {
+            parsed += wire.addresses();
+        }
+    }
+    auto t_wire = std::chrono::steady_clock::now();
+    for(int i = 0; i < count; i++) {
+        std::string const& m = corpus[i % valid];
+        buffer b(m.data(),m.size());
+        DNS_Response r;
+        if(r.load(&b) >= 0) {
+            parsed += r.answers().size();
+        }
+    }
+    auto t_owned = std::chrono::steady_clock::now();
+    
+    double s_wire = std::chrono::duration_cast<std::chrono::microseconds>(t_wire - t_start).count()/1000000.0;
+    double s_owned = std::chrono::duration_cast<std::chrono::microseconds>(t_owned - t_wire).count()/1000000.0;
+    
+    cli_print(cli,"in place parsing: %12.0f messages/s",s_wire > 0 ? count/s_wire : 0.0);
+    cli_print(cli,"DNS_Packet::load: %12.0f messages/s",s_owned > 0 ? count/s_owned : 0.0);
+    cli_print(cli,"corpus: %d failed (%d records)",failed,parsed);
+    
+    return CLI_OK;
+}
+
+
+int cli_test_dns_answer(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    int count = 1000000;
+    
+    if(argc > 0) {
+        std::string argv0(argv[0]);
+        if( argv0 == "?" || argv0 == "\t") {
+            cli_print(cli,"specify number of answers written, default is %d",count);
+            return CLI_OK;
+        }
+        count = safe_val(argv[0],count);
+        if(count <= 0) count = 1;
+    }
+    
+    unsigned int valid = 0;
+    std::vector<std::string> corpus = cli_test_dns_corpus(valid);
+    // CNAME chain with EDNS0: TTLs in answers are patched, OPT is left alone
+    std::string const& m = corpus[1];
+    
+    DnsWireParser wire;
+    if(wire.parse((const unsigned char*)m.data(),m.size()) != DnsWireParser::DNS_PARSE_OK) {
+        cli_print(cli,"corpus message doesn't parse");
+        return CLI_OK;
+    }
+    DNS_Response resp;
+    resp.load(wire,(const unsigned char*)m.data());
+    DNS_CachedAnswer answer(wire,(const unsigned char*)m.data());
+    time_t now = answer.loaded_at() + 7;
+    
+    // previous way: copy packet, patch it, and copy again for TCP framing
+    auto copy_patch = [&](uint16_t id, bool tcp, buffer& out) {
+        buffer b;
+        b.append(m.data(),m.size());
+        *((uint16_t*)b.data()) = htons(id);
+        for(auto i: resp.answer_ttl_idx) {
+            uint32_t ttl = ntohl(b.get_at<uint32_t>(i)) - (now - answer.loaded_at());
+            *((uint32_t*)&b.data()[i]) = htonl(ttl);
+        }
+        if(tcp) {
+            uint16_t len = htons(b.size());
+            buffer f;
+            f.append(&len,sizeof(uint16_t));
+            f.append(b.data(),b.size());
+            out.append(f.data(),f.size());
+        } else {
+            out.append(b.data(),b.size());
+        }
+    };
+    auto gather = [&](uint16_t id, bool tcp, buffer& out) {
+        answer.write(id,now,tcp,[&out](const unsigned char* data, unsigned int len) { out.append(data,len); });
+    };
+    
+    // both must produce the same bytes
+    for(int tcp = 0; tcp < 2; tcp++) {
+        buffer a; copy_patch(0xbeef,tcp,a);
+        buffer g; gather(0xbeef,tcp,g);
+        bool same = (a.size() == g.size() && memcmp(a.data(),g.data(),a.size()) == 0);
+        cli_print(cli,"%s: answer %d bytes, %d TTLs patched: %s",tcp ? "tcp" : "udp",g.size(),answer.patches(),same ? "ok" : "DIFFERENT");
+    }
+    
+    for(int tcp = 0; tcp < 2; tcp++) {
+        buffer out;
+        auto t_start = std::chrono::steady_clock::now();
+        for(int i = 0; i < count; i++) {
+            out.clear();
+            copy_patch(i & 0xffff,tcp,out);
+        }
+        auto t_copy = std::chrono::steady_clock::now();
+        for(int i = 0; i < count; i++) {
+            out.clear();
+            gather(i & 0xffff,tcp,out);
+        }
+        auto t_gather = std::chrono::steady_clock::now();
+        
+        double s_copy = std::chrono::duration_cast<std::chrono::microseconds>(t_copy - t_start).count()/1000000.0;
+        double s_gather = std::chrono::duration_cast<std::chrono::microseconds>(t_gather - t_copy).count()/1000000.0;
+        
+        cli_print(cli,"%s: copy and patch %12.0f answers/s, gather %12.0f answers/s",tcp ? "tcp" : "udp",
+                  s_copy > 0 ? count/s_copy : 0.0, s_gather > 0 ? count/s_gather : 0.0);
+    }
+    
+    return CLI_OK;
+}
+
+
+// answers A queries with 10.x.y.z; drops every 10th query, and precedes every 7th answer with one of wrong ID
+static void cli_test_dns_responder(int s, std::atomic<bool>* stop) {
+    unsigned int n = 0;
+    unsigned char m[512];
+    
+    while(! *stop) {
+        sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        int l = ::recvfrom(s,m,sizeof(m) - 16,0,(sockaddr*)&from,&from_len);
+        if(l <= 0) continue;
+        
+        DnsWireParser wire;
+        if(wire.parse(m,l) != DnsWireParser::DNS_PARSE_OK || wire.response() || wire.count(DnsWireParser::SECTION_QUESTION) != 1) {
+            continue;
+        }
+        n++;
+        if(n % 10 == 0) continue;
+        
+        // answer: question as is, one A record pointing to question name
+        l = wire.length();
+        m[2] = 0x81; m[3] = 0x80;
+        m[6] = 0; m[7] = 1;
+        unsigned char rr[16] = { 0xC0, 0x0C, 0, A, 0, 1, 0, 0, 0x0e, 0x10, 0, 4, 10, (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+        memcpy(m + l,rr,16);
+        
+        if(n % 7 == 0) {
+            m[0] ^= 0x5a;
+            ::sendto(s,m,l + 16,0,(sockaddr*)&from,from_len);
+            m[0] ^= 0x5a;
+        }
+        ::sendto(s,m,l + 16,0,(sockaddr*)&from,from_len);
+    }
+}
+
+int cli_test_dns_resolver(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    int count = 10000;
+    
+    if(argc > 0) {
+        std::string argv0(argv[0]);
+        if( argv0 == "?" || argv0 == "\t") {
+            cli_print(cli,"specify number of queries, default is %d",count);
+            return CLI_OK;
+        }
+        count = safe_val(argv[0],count);
+        if(count <= 0) count = 1;
+    }
+    
+    // local responder, and nameserver which never answers (its queries have to be retried elsewhere)
+    int live = ::socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+    int dead = ::socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+    std::vector<std::string> ns;
+    for(int s: { live, dead }) {
+        sockaddr_in a;
+        memset(&a,0,sizeof(a));
+        a.sin_family = AF_INET;
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(a);
+        
+        if(s < 0 || ::bind(s,(sockaddr*)&a,sizeof(a)) < 0 || ::getsockname(s,(sockaddr*)&a,&len) < 0) {
+            cli_print(cli,"cannot set up local responder: %s",strerror(errno));
+            if(live >= 0) ::close(live);
+            if(dead >= 0) ::close(dead);
+            return CLI_OK;
+        }
+        ns.push_back(string_format("127.0.0.1:%d",ntohs(a.sin_port)));
+    }
+    timeval tv = { 0, 100000 };
+    setsockopt(live,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    int rcvbuf = 4*1024*1024;
+    setsockopt(live,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
+    
+    std::atomic<bool> stop(false);
+    std::thread responder(cli_test_dns_responder,live,&stop);
+    
+    std::atomic<int> answered(0);
+    std::atomic<int> failed(0);
+    std::atomic<int> wrong(0);
+    
+    auto t_start = std::chrono::steady_clock::now();
+    {
+        DnsResolver r("DNS resolver - test");
+        r.timeout = 200;
+        r.attempts = 4;
+        r.nameservers(ns);
+        
+        for(int i = 0; i < count; i++) {
+            bool q = r.query(string_format("q%d.smithproxy.test",i),A,[&answered,&failed,&wrong](DNS_Response* resp) {
+                if(resp == nullptr) {
+                    failed++;
+                    return;
+                }
+                if(resp->answers().size() == 1 && resp->answers().at(0).ip(false).find("10.") == 0) {
+                    answered++;
+                } else {
+                    wrong++;
+                }
+                delete resp;
+            });
+            if(! q) failed++;
+        }
+        
+        while(answered + failed + wrong < count) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        auto t_end = std::chrono::steady_clock::now();
+        double secs = std::chrono::duration_cast<std::chrono::microseconds>(t_end - t_start).count()/1000000.0;
+        
+        cli_print(cli,"nameservers: %s (answering), %s (silent)",ns[0].c_str(),ns[1].c_str());
+        cli_print(cli,"queries: %d, answered: %d, failed: %d, wrong answer: %d",count,(int)answered,(int)failed,(int)wrong);
+        cli_print(cli,"datagrams sent: %lu, mismatched responses ignored: %lu",(unsigned long)r.stat_sent,(unsigned long)r.stat_mismatched);
+        cli_print(cli,"time: %.3fs, %.0f queries/s",secs,secs > 0 ? count/secs : 0.0);
+    }
+    
+    stop = true;
+    responder.join();
+    ::close(live);
+    ::close(dead);
+    
+    return CLI_OK;
+}
+
+
+int cli_test_policy_benchmark(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    int iterations = 10000;
+    
+    if(argc > 0) {
+        std::string argv0(argv[0]);
+        if( argv0 == "?" || argv0 == "\t") {
+            cli_print(cli,"specify number of lookups for each rule set, default is %d",iterations);
+            return CLI_OK;
+        }
+        iterations = safe_val(argv[0],iterations);
+        if(iterations <= 0) iterations = 1;
+    }
+    
+    cli_print(cli,"comparing linear policy scan with compiled policy index, %d lookups per rule set",iterations);
+    
+    for(int n: { 10, 100, 1000 }) {
+        
+        // each rule matches its own source /24 and destination port
+        std::vector<PolicyRule*> rules;
+        for(int i = 0; i < n; i++) {
+            PolicyRule* rule = new PolicyRule();
+            rule->src.push_back(new CidrAddress(cidr_from_str(string_format("10.%d.%d.0/24",i/256,i%256).c_str())));
+            rule->src_default = false;
+            rule->dst_ports.push_back(range(1000+i,1000+i));
+            rule->dst_ports_default = false;
+            rules.push_back(rule);
+        }
+        
+        // connection hitting the last rule - worst case for linear scan
+        std::vector<baseHostCX*> left;
+        std::vector<baseHostCX*> right;
+        left.push_back(new baseHostCX(new TCPCom(),string_format("10.%d.%d.1",(n-1)/256,(n-1)%256).c_str(),"40000"));
+        right.push_back(new baseHostCX(new TCPCom(),"192.168.1.1",std::to_string(1000+n-1).c_str()));
+        
+        for(auto rule: rules) {
+            rule->compile();
+        }
+        
+        PolicyIndex index;
+        index.compile(rules);
+        
+        ConnectionKey key;
+        key.load(left.at(0),right.at(0),PROTO_TCP);
+        
+        int linear_result = -1;
+        auto t_start = std::chrono::steady_clock::now();
+        for(int it = 0; it < iterations; it++) {
+            linear_result = -1;
+            for(unsigned int x = 0; x < rules.size(); x++) {
+                if(rules[x]->match(left,right)) {
+                    linear_result = x;
+                    break;
+                }
+            }
+        }
+        auto t_linear = std::chrono::steady_clock::now();
+        
+        int index_result = -1;
+        for(int it = 0; it < iterations; it++) {
+            index_result = index.match(rules,key);
+        }
+        auto t_index = std::chrono::steady_clock::now();
+        
+        double us_linear = std::chrono::duration_cast<std::chrono::nanoseconds>(t_linear - t_start).count()/1000.0/iterations;
+        double us_index = std::chrono::duration_cast<std::chrono::nanoseconds>(t_index - t_linear).count()/1000.0/iterations;
+        
+        cli_print(cli,"%5d rules: linear %10.3f us/lookup (#%d), indexed %10.3f us/lookup (#%d)",
+                            n,us_linear,linear_result,us_index,index_result);
+        if(linear_result != index_result) {
+            cli_print(cli,"      ERROR: index and linear scan disagree");
+        }
+        
+        for(auto cx: left) delete cx;
+        for(auto cx: right) delete cx;
+        for(auto rule: rules) {
+            for(auto a: rule->src) delete a;
+            delete rule;
+        }
+    }
+    
+    return CLI_OK;
+}
+
+
+int cli_test_content_rules(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    // rules are applied in order, each to the output of previous ones: compare with sequential std::regex_replace
+    struct content_case {
+        const char* name;
+        std::vector<std::pair<const char*,const char*>> rules;
+        const char* data;
+        const char* expected;
+        unsigned int split;         // data are received in two reads, split at this offset (0 = one read)
+    };
+    std::vector<content_case> cases = {
+        { "overlap, longer rule first",     { {"abcd","X"}, {"bc","Y"} },                   "abcd.",        "X.", 0 },
+        { "overlap, shorter rule first",    { {"bc","Y"}, {"abcd","X"} },                   "abcd.",        "aYd.", 0 },
+        { "overlap, later rule leftmost",   { {"cd","1"}, {"abc","2"} },                    "abcd.",        "ab1.", 0 },
+        { "overlap within rule",            { {"aa","b"} },                                 "aaaaa.",       "bba.", 0 },
+        { "chained literals",               { {"foo","bar"}, {"bar","baz"} },               "foo bar.",     "baz baz.", 0 },
+        { "chained by removal",             { {"x",""}, {"ab","Z"} },                       "axb ab.",      "Z Z.", 0 },
+        { "literal, regex, literal",        { {"cat","dog"}, {"d[o]g","wolf"}, {"wolf","fox"} }, "cat dog.", "fox fox.", 0 },
+        { "independent literals",           { {"a","1"}, {"b","2"} },                       "abab.",        "1212.", 0 },
+        { "regex split in anchor",          { {"foo[0-9]+","X"} },                          "foo12.",       "X.", 2 },
+        { "greedy regex across reads",      { {"foo[0-9]+","X"} },                          "foo1234.",     "X.", 5 },
+        { "unanchored regex across reads",  { {"[0-9]+","N"} },                             "a1234b.",      "aNb.", 3 },
+    };
+
+    int failed = 0;
+    for(auto const& c: cases) {
+
+        std::vector<ProfileContentRule> rules;
+        std::string reference = c.data;
+        for(auto const& r: c.rules) {
+            ProfileContentRule pr;
+            pr.match = r.first;
+            pr.replace = r.second;
+            rules.push_back(pr);
+
+            reference = std::regex_replace(reference,std::regex(r.first),r.second);
+        }
+
+        content_ruleset_ptr rs = std::make_shared<ContentRuleSet>();
+        rs->compile(rules);
+
+        ContentReplacer cr(rs);
+        buffer out;
+        unsigned int len = strlen(c.data);
+        unsigned int split = (c.split < len) ? c.split : 0;
+        if(split > 0) {
+            cr.process('L',(const unsigned char*)c.data,split,out);
+        }
+        cr.process('L',(const unsigned char*)c.data + split,len - split,out);
+        cr.flush('L',out,true);
+        std::string result((const char*)out.data(),out.size());
+
+        bool ok = (result == c.expected && reference == c.expected);
+        if(! ok) {
+            ++failed;
+        }
+        cli_print(cli,"%-30s %s: '%s' -> '%s' (expected '%s', sequential regex '%s'), %s",c.name,ok ? "OK  " : "FAIL",
+                  c.data,result.c_str(),c.expected,reference.c_str(),rs->to_string().c_str());
+    }
+
+    cli_print(cli,"%d of %d cases failed",failed,(int)cases.size());
+    return CLI_OK;
+}
+
+
+
+// inspector offered data only by direction and budget, as in MitmHostCX::inspect()
+class TestDirectionInspector : public Inspector {
+public:
+    explicit TestDirectionInspector(unsigned char direction) { interest_.direction = direction; }
+    virtual void update(AppHostCX* cx) {}
+    
+    DECLARE_C_NAME("TestDirectionInspector");
+};
+
+int cli_test_inspectors_direction(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    // flow sides 'r' (client data) and 'w' (server data), and cx sides 'l'/'L', 'R'
+    struct direction_case {
+        unsigned char direction;
+        char side;
+        bool expected;
+    };
+    std::vector<direction_case> cases = {
+        { InspectorInterest::DIR_LEFT,  'r', true  },
+        { InspectorInterest::DIR_LEFT,  'w', false },
+        { InspectorInterest::DIR_LEFT,  'l', true  },
+        { InspectorInterest::DIR_LEFT,  'L', true  },
+        { InspectorInterest::DIR_LEFT,  'R', false },
+        { InspectorInterest::DIR_RIGHT, 'r', false },
+        { InspectorInterest::DIR_RIGHT, 'w', true  },
+        { InspectorInterest::DIR_RIGHT, 'L', false },
+        { InspectorInterest::DIR_RIGHT, 'R', true  },
+        { InspectorInterest::DIR_BOTH,  'r', true  },
+        { InspectorInterest::DIR_BOTH,  'w', true  },
+    };
+    const char* names[] = { "", "left", "right", "both" };
+
+    int failed = 0;
+    for(auto const& c: cases) {
+        TestDirectionInspector i(c.direction);
+        bool offered = i.interested(c.side);
+        bool ok = (offered == c.expected);
+        if(! ok) {
+            ++failed;
+        }
+        cli_print(cli,"interest %-5s side '%c': %s (expected %s), %s",names[c.direction],c.side,
+                  offered ? "offered" : "not offered",c.expected ? "offered" : "not offered",ok ? "OK" : "FAIL");
+    }
+
+    cli_print(cli,"%d of %d cases failed",failed,(int)cases.size());
+    return CLI_OK;
+}
+
+int cli_test_policy_apply(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    int iterations = 10000;
+    
+    if(argc > 0) {
+        std::string argv0(argv[0]);
+        if( argv0 == "?" || argv0 == "\t") {
+            cli_print(cli,"specify number of policy applications, default is %d",iterations);
+            return CLI_OK;
+        }
+        iterations = safe_val(argv[0],iterations);
+        if(iterations <= 0) iterations = 1;
+    }
+    
+    // synthetic configuration: 100 rules with all profiles set, snapshot frees everything at the end
+    cfgapi_snapshot_ptr cfg = std::make_shared<CfgSnapshot>();
+    
+    ProfileContent* pc = new ProfileContent();
+    pc->prof_name = "bench";
+    cfg->profile_content["bench"] = pc;
+    ProfileDetection* pd = new ProfileDetection();
+    pd->prof_name = "bench";
+    cfg->profile_detection["bench"] = pd;
+    ProfileTls* pt = new ProfileTls();
+    pt->prof_name = "bench";
+    cfg->profile_tls["bench"] = pt;
+    ProfileAlgDns* pdns = new ProfileAlgDns();
+    pdns->prof_name = "bench";
+    cfg->profile_alg_dns["bench"] = pdns;
+    
+    int n = 100;
+    for(int i = 0; i < n; i++) {
+        std::string name = string_format("bench-%d",i);
+        AddressObject* a = new CidrAddress(cidr_from_str(string_format("10.%d.%d.0/24",i/256,i%256).c_str()));
+        cfg->address[name] = a;
+        
+        PolicyRule* rule = new PolicyRule();
+        rule->src.push_back(a);
+        rule->src_default = false;
+        rule->profile_content = pc;
+        rule->profile_detection = pd;
+        rule->profile_tls = pt;
+        rule->profile_alg_dns = pdns;
+        
+        rule->compile();
+        cfgapi_compile_policy_bundle(rule);
+        cfg->policy.push_back(rule);
+    }
+    cfg->policy_index.compile(cfg->policy);
+    
+    MitmHostCX* left = new MitmHostCX(new TCPCom(),string_format("10.%d.%d.1",(n-1)/256,(n-1)%256).c_str(),"40000");
+    MitmHostCX* right = new MitmHostCX(new TCPCom(),"192.168.1.1","80");
+    MitmProxy* proxy = new MitmProxy(new TCPCom());
+    proxy->config(cfg);
+    
+    ConnectionKey key;
+    key.load(left,right,PROTO_TCP);
+    int policy_num = cfg->policy_match(key);
+    
+    // connection log lines would flood the log
+    loglevel orig_level = get_logger()->level();
+    get_logger()->level(WAR);
+    
+    // Reference variant, not the code replaced by bundles: today's snapshot accessors, each called under
+    // cfgapi_write_lock as the old accessors were. It shows locking and call overhead only, the old
+    // lookup in global tables isn't measured.
+    auto t_start = std::chrono::steady_clock::now();
+    for(int it = 0; it < iterations; it++) {
+        void* volatile p;
+        { std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock); p = (void*)(long)cfg->policy_action(policy_num); }
+        { std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock); p = cfg->policy_profile_content(policy_num); }
+        { std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock); p = cfg->policy_profile_detection(policy_num); }
+        { std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock); p = cfg->policy_profile_tls(policy_num); }
+        { std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock); p = cfg->policy_profile_auth(policy_num); }
+        { std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock); p = cfg->policy_profile_alg_dns(policy_num); }
+        (void)p;
+    }
+    auto t_accessors = std::chrono::steady_clock::now();
+    
+    // profile resolution from the rule bundle
+    for(int it = 0; it < iterations; it++) {
+        void* volatile p;
+        PolicyRule* rule = cfg->policy_at(policy_num);
+        p = rule->profile_content;
+        p = rule->profile_detection;
+        p = rule->profile_tls;
+        p = rule->profile_auth;
+        p = &rule->bundle;
+        (void)p;
+    }
+    auto t_bundle = std::chrono::steady_clock::now();
+    
+    // complete policy application, including match
+    for(int it = 0; it < iterations; it++) {
+        cfgapi_obj_policy_apply(left,proxy,&key);
+    }
+    auto t_apply = std::chrono::steady_clock::now();
+    
+    get_logger()->level(orig_level);
+    
+    double us_accessors = std::chrono::duration_cast<std::chrono::nanoseconds>(t_accessors - t_start).count()/1000.0/iterations;
+    double us_bundle = std::chrono::duration_cast<std::chrono::nanoseconds>(t_bundle - t_accessors).count()/1000.0/iterations;
+    double us_apply = std::chrono::duration_cast<std::chrono::nanoseconds>(t_apply - t_bundle).count()/1000.0/iterations;
+    
+    cli_print(cli,"policy #%d of %d rules, %d iterations",policy_num,n,iterations);
+    cli_print(cli,"  profiles via locked accessors (reference variant, not old code): %10.3f us",us_accessors);
+    cli_print(cli,"  profiles via bundle:                                            %10.3f us",us_bundle);
+    cli_print(cli,"  cfgapi_obj_policy_apply:                                        %10.3f us",us_apply);
+    
+    delete proxy;
+    delete left;
+    delete right;
+    
+    return CLI_OK;
+}
+
 int cli_diag_ssl_cache_stats(struct cli_def *cli, const char *command, char *argv[], int argc) {
     
     SSLCertStore* store = SSLCom::certstore();
@@ -638,22 +1455,22 @@ int cli_diag_ssl_memcheck_disable(struct cli_def *cli, const char *command, char
 
 
 int cli_diag_dns_cache_list(struct cli_def *cli, const char *command, char *argv[], int argc) {
-    inspect_dns_cache.lock();
     
     cli_print(cli,"\nDNS cache populated from traffic: ");
     std::string out; 
     
-    for(auto it = inspect_dns_cache.cache().begin(); it != inspect_dns_cache.cache().end() ; ++it ) {
-        std::string s = it->first;
-        DNS_Response* r = it->second;
-
-        if (r != nullptr && r->answers().size() > 0) {
+    inspect_dns_cache.for_each([&out](uint16_t type, std::string const& name, DnsCache::entry_ptr const& r) {
+        if(r && r->negative) {
+            int ttl = (r->loaded_at + r->negative_ttl) - time(nullptr);
+            std::string t = string_format("    %s:%s  -> [ttl:%d] negative, rcode %d",dns_record_type_str(type),name.c_str(),ttl,r->rcode());
+            out += t + "\n";
+        }
+        else if (r && r->answers().size() > 0) {
             int ttl = (r->loaded_at + r->answers().at(0).ttl_) - time(nullptr);
-            std::string t = string_format("    %s  -> [ttl:%d]%s",s.c_str(),ttl,r->answer_str().c_str());
+            std::string t = string_format("    %s:%s  -> [ttl:%d]%s",dns_record_type_str(type),name.c_str(),ttl,r->answer_str().c_str());
             out += t + "\n";
         }
-    }
-    inspect_dns_cache.unlock();
+    });
     
     cli_print(cli, "%s", out.c_str());
     
@@ -663,26 +1480,23 @@ int cli_diag_dns_cache_list(struct cli_def *cli, const char *command, char *argv
 int cli_diag_dns_cache_stats(struct cli_def *cli, const char *command, char *argv[], int argc) {
 
     cli_print(cli,"\nDNS cache statistics: ");
-    inspect_dns_cache.lock();
-    int cache_size = inspect_dns_cache.cache().size();
+    int cache_size = inspect_dns_cache.size();
     int max_size = inspect_dns_cache.max_size();
-    bool del = inspect_dns_cache.auto_delete();
-    inspect_dns_cache.unlock();
 
     cli_print(cli,"  Current size: %5d",cache_size);
     cli_print(cli,"  Maximum size: %5d",max_size);
-    cli_print(cli,"\n    Autodelete: %5d",del);
+    cli_print(cli,"      Negative: %5d",inspect_dns_cache.negative_size());
+    cli_print(cli,"        Shards: %5d",DnsCache::SHARDS);
+    cli_print(cli,"  Indexed addresses: %5d",inspect_dns_cache.addresses());
 
     return CLI_OK;
 }
 
 int cli_diag_dns_cache_clear(struct cli_def *cli, const char *command, char *argv[], int argc) {
-    inspect_dns_cache.lock();
     
     inspect_dns_cache.clear();
     
     cli_print(cli,"\nDNS cache cleared.");
-    inspect_dns_cache.unlock();
     
     return CLI_OK;
 }
@@ -1232,6 +2046,8 @@ int cli_diag_proxy_session_list(struct cli_def *cli, const char *command, char *
                         
                         ss << "     " << sm << "_os_recv-q: " <<  in_pending << " " << sm << "_os_send-q: " <<  out_pending << "\n";
                         ss << "     " << sm << "_sx_recv-q: " <<  in_buf     << " " << sm << "_sx_send-q: " <<  out_buf << "\n";
+                        ss << "     " << sm << "_flow: " << cx->flow().flow().size() << " entries, " << cx->flow_memory() << "B held, " 
+                                                  << cx->flow_released() << "B in " << cx->flow_released_entries() << " entries released (max " << cx->flow_max_bytes << "B)\n";
                         
                         // fun stuff
                         if(verbosity >= EXT) {
@@ -1296,6 +2112,218 @@ int cli_diag_proxy_session_clear(struct cli_def *cli, const char *command, char
     return CLI_OK;
 }
 
+// recorded-like flows for signature prefilter benchmark: direction ('r' from client, 'w' from server) and data
+static std::vector<std::vector<std::pair<char,std::string>>> cli_test_sigs_flows() {
+    std::vector<std::vector<std::pair<char,std::string>>> flows;
+
+    flows.push_back({
+        { 'r', "GET /index.html?lang=en HTTP/1.1\r\nHost: www.example.com\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0\r\n"
+               "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\nAccept-Language: en-US,en;q=0.5\r\nAccept-Encoding: gzip, deflate\r\n"
+               "Cookie: session=8f2a6c1e55d04b1a9e7f; theme=dark\r\nConnection: keep-alive\r\n\r\n" },
+        { 'w', "HTTP/1.1 200 OK\r\nServer: nginx/1.14.0\r\nDate: Mon, 02 Jul 2018 10:11:12 GMT\r\nContent-Type: text/html; charset=utf-8\r\n"
+               "Content-Length: 612\r\nConnection: keep-alive\r\nCache-Control: max-age=600\r\n\r\n" },
+        { 'w', "<!DOCTYPE html>\n<html>\n<head>\n<title>Welcome to example.com</title>\n<style>\n body { width: 35em; margin: 0 auto; font-family: Tahoma, Verdana, Arial, sans-serif; }\n"
+               "</style>\n</head>\n<body>\n<h1>Welcome!</h1>\n<p>If you see this page, the web server is successfully installed and working.</p>\n"
+               "<p>For online documentation and support please refer to the documentation pages.</p>\n</body>\n</html>\n" }
+    });
+
+    flows.push_back({
+        { 'w', "220 mail.example.com ESMTP Postfix (Debian/GNU)\r\n" },
+        { 'r', "EHLO client.example.org\r\n" },
+        { 'w', "250-mail.example.com\r\n250-PIPELINING\r\n250-SIZE 10240000\r\n250-VRFY\r\n250-ETRN\r\n250-STARTTLS\r\n250-ENHANCEDSTATUSCODES\r\n250-8BITMIME\r\n250 DSN\r\n" },
+        { 'r', "STARTTLS\r\n" },
+        { 'w', "220 2.0.0 Ready to start TLS\r\n" }
+    });
+
+    flows.push_back({
+        { 'w', "* OK [CAPABILITY IMAP4rev1 LITERAL+ SASL-IR LOGIN-REFERRALS ID ENABLE IDLE STARTTLS AUTH=PLAIN] Dovecot ready.\r\n" },
+        { 'r', "a001 CAPABILITY\r\n" },
+        { 'w', "* CAPABILITY IMAP4rev1 LITERAL+ SASL-IR LOGIN-REFERRALS ID ENABLE IDLE STARTTLS AUTH=PLAIN\r\na001 OK Pre-login capabilities listed, post-login capabilities have more.\r\n" },
+        { 'r', "a002 STARTTLS\r\n" },
+        { 'w', "a002 OK Begin TLS negotiation now.\r\n" }
+    });
+
+    return flows;
+}
+
+// signature set for benchmark: few real ones, the rest are generated from templates
+static std::vector<std::string> cli_test_sigs_patterns(int count) {
+    std::vector<std::string> sigs = {
+        "^(GET|POST) +([^ \r\n]+)",
+        "HTTP/1.[01] +([1-5][0-9][0-9]) ",
+        "^STARTTLS",
+        "^2[0-5]0 ",
+        ". STARTTLS\r\n",
+        "^[+]OK",
+        "^CONNECT [^ ]+:443[^\r]*\r\n"
+    };
+
+    for(int i = 0; (int)sigs.size() < count; i++) {
+        switch(i % 6) {
+            case 0: sigs.push_back(string_format("^GET /app%d/[^ ]+ HTTP/1\\.[01]",i)); break;
+            case 1: sigs.push_back(string_format("X-Trace-%d: [0-9a-f]+",i)); break;
+            case 2: sigs.push_back(string_format("^250-mail%d\\.example",i)); break;
+            case 3: sigs.push_back(string_format("^a[0-9]+ LOGIN user%d ",i)); break;
+            case 4: sigs.push_back(string_format("User-Agent: Tool%d/[0-9.]+",i)); break;
+            // no usable anchor
+            default: sigs.push_back(string_format("^[A-Z]{%d}[0-9]+ ",i%7 + 2)); break;
+        }
+    }
+
+    return sigs;
+}
+
+int cli_test_signatures_prefilter(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    int count = 500;
+    int rounds = 20;
+
+    if(argc > 0) {
+        std::string argv0(argv[0]);
+        if( argv0 == "?" || argv0 == "\t") {
+            cli_print(cli,"specify number of signatures, default is %d",count);
+            return CLI_OK;
+        }
+        count = safe_val(argv[0],count);
+        if(count <= 0) count = 1;
+    }
+
+    auto flows = cli_test_sigs_flows();
+    auto patterns = cli_test_sigs_patterns(count);
+
+    std::vector<std::regex> res;
+    SignaturePrefilter pf;
+    for(unsigned int i = 0; i < patterns.size(); i++) {
+        res.push_back(std::regex(patterns[i]));
+        pf.add(SignaturePrefilter::SET_DETECTION,i,SignaturePrefilter::regex_anchor(patterns[i]));
+    }
+    pf.compile();
+
+    cli_print(cli,"%s",pf.to_string().c_str());
+
+    unsigned long bytes = 0;
+    unsigned long matched_all = 0;
+    unsigned long matched_pf = 0;
+    unsigned long evaluated_pf = 0;
+
+    // evaluate every signature on data accumulated in direction, as detection does with each new chunk
+    auto t_start = std::chrono::steady_clock::now();
+    for(int r = 0; r < rounds; r++) {
+        for(auto const& fl: flows) {
+            std::string acc[2];
+            for(auto const& chunk: fl) {
+                std::string& a = acc[chunk.first == 'r' ? 0 : 1];
+                a += chunk.second;
+                bytes += chunk.second.size();
+
+                for(auto const& re: res) {
+                    if(std::regex_search(a,re)) matched_all++;
+                }
+            }
+        }
+    }
+    auto t_all = std::chrono::steady_clock::now();
+
+    // prefilter scans new chunk once, only signatures without anchor and with anchor hit are evaluated
+    for(int r = 0; r < rounds; r++) {
+        for(auto const& fl: flows) {
+            std::string acc[2];
+            SignaturePrefilter::state st;
+            std::vector<unsigned int> active = pf.always(SignaturePrefilter::SET_DETECTION);
+
+            for(auto const& chunk: fl) {
+                int dir = chunk.first == 'r' ? 0 : 1;
+                acc[dir] += chunk.second;
+
+                pf.scan(st,dir,(const unsigned char*)chunk.second.data(),chunk.second.size(),[&active](int, unsigned int index) {
+                    active.push_back(index);
+                });
+
+                for(auto i: active) {
+                    evaluated_pf++;
+                    if(std::regex_search(acc[dir],res[i])) matched_pf++;
+                }
+            }
+        }
+    }
+    auto t_pf = std::chrono::steady_clock::now();
+
+    // prefilter automaton alone
+    unsigned long hits = 0;
+    for(int r = 0; r < rounds; r++) {
+        for(auto const& fl: flows) {
+            SignaturePrefilter::state st;
+            for(auto const& chunk: fl) {
+                pf.scan(st,chunk.first == 'r' ? 0 : 1,(const unsigned char*)chunk.second.data(),chunk.second.size(),[&hits](int, unsigned int) { hits++; });
+            }
+        }
+    }
+    auto t_scan = std::chrono::steady_clock::now();
+
+    double ns_all = std::chrono::duration_cast<std::chrono::nanoseconds>(t_all - t_start).count()/(double)bytes;
+    double ns_pf = std::chrono::duration_cast<std::chrono::nanoseconds>(t_pf - t_all).count()/(double)bytes;
+    double ns_scan = std::chrono::duration_cast<std::chrono::nanoseconds>(t_scan - t_pf).count()/(double)bytes;
+    unsigned long chunks = 0;
+    for(auto const& fl: flows) chunks += fl.size();
+    chunks *= rounds;
+
+    cli_print(cli,"%d signatures, %d flows, %ld bytes in %d rounds",(int)patterns.size(),(int)flows.size(),bytes,rounds);
+    cli_print(cli,"  all signatures:  %10.1f ns/byte, %ld matches",ns_all,matched_all);
+    cli_print(cli,"  prefiltered:     %10.1f ns/byte, %ld matches, %.1f signatures evaluated per chunk",ns_pf,matched_pf,(double)evaluated_pf/chunks);
+    cli_print(cli,"  prefilter scan:  %10.1f ns/byte, %ld anchor hits",ns_scan,hits);
+    if(matched_all != matched_pf) {
+        cli_print(cli,"  WARNING: prefiltered results differ!");
+    }
+
+    return CLI_OK;
+}
+
+int cli_test_tls_ktls(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    std::string report;
+    bool ok = ktls_loopback_test(report);
+
+    std::istringstream lines(report);
+    std::string line;
+    while(std::getline(lines,line)) {
+        cli_print(cli,"%s",line.c_str());
+    }
+    cli_print(cli,"kTLS loopback test: %s",ok ? "passed" : "not in effect");
+
+    return CLI_OK;
+}
+
+int cli_diag_address_lookup(struct cli_def *cli, const char *command, char *argv[], int argc) {
+
+    if(argc <= 0 || argv[0][0] == '?') {
+        cli_print(cli,"specify IPv4 or IPv6 address to look up in address objects");
+        return CLI_OK;
+    }
+
+    AddressKey key;
+    if(!key.load(argv[0])) {
+        cli_print(cli,"'%s' is not valid IP address",argv[0]);
+        return CLI_OK;
+    }
+
+    std::vector<std::string> names;
+    int prefixes = cfgapi_lookup_address(key,names);
+
+    if(names.empty()) {
+        cli_print(cli,"%s: no matching address object",key.to_string().c_str());
+        return CLI_OK;
+    }
+
+    // names are ordered from the shortest prefix, print the most specific first
+    cli_print(cli,"%s: %d matching prefixes",key.to_string().c_str(),prefixes);
+    for(auto it = names.rbegin(); it != names.rend(); ++it) {
+        AddressObject* ao = cfgapi_lookup_address(it->c_str());
+        cli_print(cli,"    %s: %s",it->c_str(), ao ? ao->to_string().c_str() : "?");
+    }
+
+    return CLI_OK;
+}
+
 int cli_diag_proxy_policy_list(struct cli_def *cli, const char *command, char *argv[], int argc) {
 
     std::string filter = "";
@@ -1320,6 +2348,10 @@ int cli_diag_proxy_policy_list(struct cli_def *cli, const char *command, char *a
         out += it->to_string(verbosity);
         out += "\n\n";
     }
+    if(verbosity > INF) {
+        out += cfgapi_obj_policy_index.to_string(verbosity);
+        out += "\n";
+    }
     cfgapi_write_lock.unlock();
     
     cli_print(cli, "%s", out.c_str());
@@ -1338,6 +2370,11 @@ void client_thread(int client_socket) {
         struct cli_command *show;
         struct cli_command *test;
             struct cli_command *test_dns;
+            struct cli_command *test_policy;
+            struct cli_command *test_tls;
+            struct cli_command *test_signatures;
+            struct cli_command *test_content;
+            struct cli_command *test_inspectors;
         struct cli_command *debuk;
         struct cli_command *diag;
             struct cli_command *diag_ssl;
@@ -1353,6 +2390,7 @@ void client_thread(int client_socket) {
             struct cli_command *diag_dns;
                 struct cli_command *diag_dns_cache;
                 struct cli_command *diag_dns_domains;
+            struct cli_command *diag_address;
             struct cli_command *diag_proxy;
                 struct cli_command *diag_proxy_policy;
                 struct cli_command *diag_proxy_session;
@@ -1385,7 +2423,22 @@ void client_thread(int client_socket) {
                 test_dns = cli_register_command(cli, test, "dns", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "dns related testing commands");
                     cli_register_command(cli, test_dns, "genrequest", cli_test_dns_genrequest, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "generate dns request");
                     cli_register_command(cli, test_dns, "sendrequest", cli_test_dns_sendrequest, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "generate and send dns request to configured nameserver");
+                    cli_register_command(cli, test_dns, "parser", cli_test_dns_parser, PRIVILEGE_PRIVILEGED, MODE_EXEC, "check DNS parser against message corpus and mutations, benchmark it");
+                    cli_register_command(cli, test_dns, "resolver", cli_test_dns_resolver, PRIVILEGE_PRIVILEGED, MODE_EXEC, "run asynchronous resolver against local DNS responder");
+                    cli_register_command(cli, test_dns, "answer", cli_test_dns_answer, PRIVILEGE_PRIVILEGED, MODE_EXEC, "check and benchmark answering from cached DNS responses");
+                    cli_register_command(cli, test_dns, "cache", cli_test_dns_cache, PRIVILEGE_PRIVILEGED, MODE_EXEC, "benchmark DNS cache with concurrent lookups and inserts");
                     cli_register_command(cli, test_dns, "refreshallfqdns", cli_test_dns_refreshallfqdns, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "refresh all configured FQDN address objects against configured nameserver");
+                test_policy = cli_register_command(cli, test, "policy", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "policy related testing commands");
+                    cli_register_command(cli, test_policy, "benchmark", cli_test_policy_benchmark, PRIVILEGE_PRIVILEGED, MODE_EXEC, "compare linear policy scan with compiled policy index");
+                    cli_register_command(cli, test_policy, "apply", cli_test_policy_apply, PRIVILEGE_PRIVILEGED, MODE_EXEC, "benchmark policy application on synthetic proxy, compared with locked accessor variant");
+                test_tls = cli_register_command(cli, test, "tls", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "tls related testing commands");
+                    cli_register_command(cli, test_tls, "ktls", cli_test_tls_ktls, PRIVILEGE_PRIVILEGED, MODE_EXEC, "run TLS handshake over loopback and check kernel TLS offload");
+                test_signatures = cli_register_command(cli, test, "signatures", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "signature detection testing commands");
+                    cli_register_command(cli, test_signatures, "prefilter", cli_test_signatures_prefilter, PRIVILEGE_PRIVILEGED, MODE_EXEC, "benchmark signature evaluation with and without anchor prefilter");
+                test_content = cli_register_command(cli, test, "content", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "content rewriting testing commands");
+                    cli_register_command(cli, test_content, "rules", cli_test_content_rules, PRIVILEGE_PRIVILEGED, MODE_EXEC, "check content replacement with overlapping and chained rules, and matches split between reads");
+                test_inspectors = cli_register_command(cli, test, "inspectors", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "inspector testing commands");
+                    cli_register_command(cli, test_inspectors, "direction", cli_test_inspectors_direction, PRIVILEGE_PRIVILEGED, MODE_EXEC, "check which flow sides are offered to inspector by its direction interest");
                 
         diag  = cli_register_command(cli, NULL, "diag", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "diagnose commands helping to troubleshoot");
             diag_ssl = cli_register_command(cli, diag, "ssl", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "ssl related troubleshooting commands");
@@ -1431,6 +2484,8 @@ void client_thread(int client_socket) {
                 diag_dns_domains = cli_register_command(cli, diag_dns, "domain", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "DNS domain cache troubleshooting commands");
                         cli_register_command(cli, diag_dns_domains, "list", cli_diag_dns_domain_cache_list, PRIVILEGE_PRIVILEGED, MODE_EXEC, "DNS sub-domain list");
                         cli_register_command(cli, diag_dns_domains, "clear", cli_diag_dns_domain_cache_clear, PRIVILEGE_PRIVILEGED, MODE_EXEC, "clear DNS sub-domain cache");
+            diag_address = cli_register_command(cli, diag, "address",NULL, PRIVILEGE_PRIVILEGED, MODE_EXEC, "address object troubleshooting commands");
+                        cli_register_command(cli, diag_address,"lookup",cli_diag_address_lookup, PRIVILEGE_PRIVILEGED, MODE_EXEC,"list address objects containing IP address");
             diag_proxy = cli_register_command(cli, diag, "proxy",NULL, PRIVILEGE_PRIVILEGED, MODE_EXEC, "proxy related troubleshooting commands");
                 diag_proxy_policy = cli_register_command(cli,diag_proxy,"policy",NULL,PRIVILEGE_PRIVILEGED, MODE_EXEC,"proxy policy commands");
                         cli_register_command(cli, diag_proxy_policy,"list",cli_diag_proxy_policy_list, PRIVILEGE_PRIVILEGED, MODE_EXEC,"proxy policy list");
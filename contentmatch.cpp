@@ -0,0 +1,553 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstring>
+#include <map>
+#include <algorithm>
+
+#include <contentmatch.hpp>
+#include <policy.hpp>
+#include <display.hpp>
+#include <logger.hpp>
+
+
+unsigned int ContentReplacer::hold_timeout_ms = 200;
+unsigned int ContentReplacer::hold_max = 4096;
+
+
+static inline bool contentmatch_is_meta(char c) {
+    return c != 0 && strchr("^$.|?*+()[]{}\\",c) != nullptr;
+}
+
+// escaped character which stands for itself
+static inline bool contentmatch_is_escaped_literal(char c) {
+    return c == '/' || contentmatch_is_meta(c);
+}
+
+// true if literal could match text which contains (part of) replacement, so it has to see output of the rule
+static bool contentmatch_chains(std::string const& replace, std::string const& lit) {
+
+    // removed text joins its neighbours
+    if(replace.empty()) {
+        return lit.size() > 1;
+    }
+
+    // literal placed at offset d from replacement start, overlapping it at least by one character
+    for(int d = 1 - (int)lit.size(); d < (int)replace.size(); d++) {
+        bool ok = true;
+        for(int i = std::max(0,-d); i < (int)lit.size() && d + i < (int)replace.size(); i++) {
+            if(lit[i] != replace[d+i]) {
+                ok = false;
+                break;
+            }
+        }
+        if(ok) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ContentRuleSet::literal_match(std::string const& match, std::string& lit) {
+    lit.clear();
+
+    for(unsigned int i = 0; i < match.size(); i++) {
+        char c = match[i];
+
+        if(c == '\\') {
+            if(i + 1 < match.size() && contentmatch_is_escaped_literal(match[i+1])) {
+                lit += match[++i];
+                continue;
+            }
+            return false;
+        }
+        if(contentmatch_is_meta(c)) {
+            return false;
+        }
+
+        lit += c;
+    }
+
+    return lit.size() > 0;
+}
+
+std::string ContentRuleSet::literal_anchor(std::string const& match) {
+    std::string lit;
+
+    // with alternatives no prefix is mandatory
+    if(match.find('|') != std::string::npos) {
+        return lit;
+    }
+
+    for(unsigned int i = 0; i < match.size(); ) {
+        char c = match[i];
+        unsigned int step = 1;
+
+        if(c == '\\') {
+            if(i + 1 < match.size() && contentmatch_is_escaped_literal(match[i+1])) {
+                c = match[i+1];
+                step = 2;
+            } else {
+                break;
+            }
+        }
+        else if(contentmatch_is_meta(c)) {
+            break;
+        }
+
+        // quantifier makes character optional; with '+' it's still there once
+        char q = (i + step < match.size()) ? match[i+step] : 0;
+        if(q == '*' || q == '?' || q == '{') {
+            break;
+        }
+        lit += c;
+        if(q == '+') {
+            break;
+        }
+
+        i += step;
+    }
+
+    // very short anchor would hit too often to save anything
+    if(lit.size() < 3) {
+        lit.clear();
+    }
+
+    return lit;
+}
+
+int ContentRuleSet::compile(std::vector<ProfileContentRule> const& src) {
+
+    rules_.clear();
+    ac_.clear();
+    ac_rule_.clear();
+    literals_ = 0;
+    stages_ = 0;
+
+    std::vector<std::string> lits;
+
+    for(auto const& s: src) {
+        rule r;
+        r.match = s.match;
+        r.replace = s.replace;
+        r.fill_length = s.fill_length;
+        r.replace_each_nth = s.replace_each_nth;
+
+        std::string lit;
+        bool is_literal = literal_match(s.match,lit);
+
+        // fill_length and format references ($1, $&, ...) need regex machinery even for plain text match
+        if(is_literal && ! r.fill_length && r.replace.find('$') == std::string::npos) {
+            r.literal = true;
+            ++literals_;
+        } else {
+            try {
+                r.re = std::regex(s.match);
+            }
+            catch(std::regex_error const& e) {
+                ERR_("ContentRuleSet::compile: invalid match '%s': %s",ESC_(s.match).c_str(),e.what());
+                continue;
+            }
+
+            if(! is_literal) {
+                lit = literal_anchor(s.match);
+            }
+        }
+
+        if(lit.size() > 0) {
+            r.ac_id = ac_.add(lit);
+            ac_rule_.push_back(rules_.size());
+        }
+
+        rules_.push_back(r);
+        lits.push_back(lit);
+    }
+
+    // split consecutive literal rules into stages where one could match output of another
+    for(unsigned int i = 0; i < rules_.size(); ) {
+        if(! rules_[i].literal) {
+            i++;
+            continue;
+        }
+
+        unsigned int j = i + 1;
+        for( ; j < rules_.size() && rules_[j].literal; j++) {
+            bool chained = false;
+            for(unsigned int k = i; k < j && ! chained; k++) {
+                chained = contentmatch_chains(rules_[k].replace,lits[j]);
+            }
+            if(chained) {
+                break;
+            }
+        }
+
+        for(unsigned int k = i; k < j; k++) {
+            rules_[k].stage_end = j;
+        }
+        ++stages_;
+        i = j;
+    }
+
+    ac_.compile();
+
+    DIA_("ContentRuleSet::compile: %s",to_string().c_str());
+    return rules_.size();
+}
+
+std::string ContentRuleSet::to_string() const {
+    return string_format("ContentRuleSet: rules=%d literal=%d stages=%d patterns=%d states=%d",
+                         rules_.size(),literals_,stages_,ac_.patterns(),ac_.states());
+}
+
+
+ContentReplacer::ContentReplacer(content_ruleset_ptr const& rules): rules_(rules) {
+    counters_.assign(rules_->rules().size(),0);
+}
+
+bool ContentReplacer::nth_hit(unsigned int rule) {
+    int nth = rules_->rules()[rule].replace_each_nth;
+    if(nth <= 0) {
+        return true;
+    }
+
+    if(++counters_[rule] >= nth) {
+        counters_[rule] = 0;
+        return true;
+    }
+    return false;
+}
+
+// same as regex_replace_fill(), with precompiled regex: each match is replaced by 'replace' padded with spaces
+// to the length of the match
+static std::string contentmatch_replace_fill(std::string const& data, std::regex const& re, std::string const& replace) {
+
+    std::string ret;
+    ret.reserve(data.size());
+
+    auto b = data.cbegin();
+    std::smatch m;
+    while(b != data.cend() && std::regex_search(b, data.cend(), m, re,
+                                                b == data.cbegin() ? std::regex_constants::match_default : std::regex_constants::match_prev_avail)) {
+        ret.append(m.prefix().first, m.prefix().second);
+        ret.append(replace);
+        if((unsigned int)m.length(0) > replace.size()) {
+            ret.append(m.length(0) - replace.size(), ' ');
+        }
+
+        // empty match: copy one character, so search moves on
+        if(m.length(0) == 0) {
+            ret.push_back(*m[0].second);
+            b = m[0].second + 1;
+        } else {
+            b = m[0].second;
+        }
+    }
+    ret.append(b, data.cend());
+
+    return ret;
+}
+
+int ContentReplacer::replace_regex(ContentRuleSet::rule const& r, unsigned int rule, std::string& data) {
+
+    try {
+        // std::regex_replace doesn't tell if it replaced anything: to count n-th occurence we need extra search
+        if(r.replace_each_nth != 0) {
+            if(! std::regex_search(data,r.re) || ! nth_hit(rule)) {
+                return 0;
+            }
+        }
+
+        std::string replaced;
+        if(r.fill_length) {
+            replaced = contentmatch_replace_fill(data, r.re, r.replace);
+        } else {
+            replaced = std::regex_replace(data, r.re, r.replace);
+        }
+
+        // unchanged data are still valid for hits found before
+        if(replaced == data) {
+            return 0;
+        }
+        data.swap(replaced);
+        return 1;
+    }
+    catch(std::regex_error const& e) {
+        NOT_("ContentReplacer: failed to replace string: %s",e.what());
+    }
+
+    return 0;
+}
+
+unsigned int ContentReplacer::apply(const unsigned char* p, unsigned int n, buffer& out, bool last, int& replaced) {
+
+    ContentRuleSet const& rs = *rules_;
+    std::vector<ContentRuleSet::rule> const& rules = rs.rules();
+    AhoCorasick const& ac = rs.automaton();
+
+    std::vector<hit> hits;
+    std::vector<int> anchor_first(rules.size(),-1);
+    std::vector<int> anchor_last(rules.size(),-1);
+
+    auto scan = [&](const unsigned char* data, unsigned int len) -> int {
+        hits.clear();
+        std::fill(anchor_first.begin(),anchor_first.end(),-1);
+        std::fill(anchor_last.begin(),anchor_last.end(),-1);
+
+        return ac.scan(AhoCorasick::root, data, len, [&](int id, unsigned int end) {
+            int r = rs.pattern_rule(id);
+            unsigned int start = end - ac.pattern_length(id);
+
+            if(rules[r].literal) {
+                hits.push_back({start,end,r});
+            } else {
+                if(anchor_first[r] < 0) anchor_first[r] = start;
+                anchor_last[r] = start;
+            }
+        });
+    };
+
+    unsigned int emit = n;
+
+    if(ac.patterns() > 0) {
+        int state = scan(p,n);
+
+        // possible beginning of a match at the end
+        if(! last) {
+            emit = n - ac.pending(state);
+        }
+    }
+
+    // regex with anchor near the end which doesn't match (yet) is likely waiting for the rest of data
+    for(unsigned int r = 0; r < rules.size() && ! last; r++) {
+        int a = anchor_last[r];
+        if(a < 0 || (unsigned int)a >= emit || emit - a >= hold_max) {
+            continue;
+        }
+
+        std::cmatch m;
+        if(! std::regex_search((const char*)p + a, (const char*)p + emit, m, rules[r].re, std::regex_constants::match_continuous)) {
+            emit = a;
+        }
+    }
+
+    // match reaching the end of data may go on in the next read (foo[0-9]+ on "foo12|34"): hold it whole.
+    // Only the last hold_max bytes are searched, longer match couldn't be held anyway.
+    for(unsigned int r = 0; r < rules.size() && ! last; r++) {
+        if(rules[r].literal || (rules[r].ac_id >= 0 && anchor_first[r] < 0)) {
+            continue;
+        }
+
+        unsigned int from = (rules[r].ac_id >= 0) ? anchor_first[r] : 0;
+        if(emit > hold_max && from < emit - hold_max) {
+            from = emit - hold_max;
+        }
+        if(from >= emit) {
+            continue;
+        }
+
+        auto flags = (from > 0) ? std::regex_constants::match_prev_avail : std::regex_constants::match_default;
+        std::cregex_iterator it((const char*)p + from, (const char*)p + emit, rules[r].re, flags);
+        std::cregex_iterator end;
+        const char* tail = nullptr;
+        for( ; it != end; ++it) {
+            if(it->length(0) > 0 && (*it)[0].second == (const char*)p + emit) {
+                tail = (*it)[0].first;
+            }
+        }
+        if(tail != nullptr) {
+            emit = tail - (const char*)p;
+        }
+    }
+
+    // rules are applied in their order; after data are changed, hits and anchors are found again
+    bool changed = false;
+    bool scanned = true;
+    std::string result;
+
+    for(unsigned int r = 0; r < rules.size(); ) {
+        const char* cur = changed ? result.data() : (const char*)p;
+        unsigned int len = changed ? result.size() : emit;
+
+        if(! scanned && ac.patterns() > 0) {
+            scan((const unsigned char*)cur,len);
+            scanned = true;
+        }
+
+        if(rules[r].literal) {
+            unsigned int to = rules[r].stage_end;
+
+            std::string staged;
+            if(replace_literals(cur,len,hits,r,to,staged,replaced)) {
+                result.swap(staged);
+                changed = true;
+                scanned = false;
+            }
+            r = to;
+            continue;
+        }
+
+        // anchored regex is run only if the anchor is in data
+        if(rules[r].ac_id >= 0 && (anchor_first[r] < 0 || (unsigned int)anchor_first[r] >= len)) {
+            r++;
+            continue;
+        }
+
+        if(! changed) {
+            result.assign((const char*)p, emit);
+            changed = true;
+        }
+        if(replace_regex(rules[r],r,result) > 0) {
+            ++replaced;
+            scanned = false;
+        }
+        r++;
+    }
+
+    if(changed) {
+        out.append(result.data(),result.size());
+    } else {
+        out.append(p,emit);
+    }
+
+    return emit;
+}
+
+bool ContentReplacer::replace_literals(const char* data, unsigned int len, std::vector<hit>& hits, unsigned int from, unsigned int to,
+                                       std::string& out, int& replaced) {
+
+    // hits of the stage, grouped by rule; within rule they are ordered by start already (one pattern, one length)
+    std::vector<hit> stage;
+    for(auto const& h: hits) {
+        if(h.end <= len && (unsigned int)h.rule >= from && (unsigned int)h.rule < to) {
+            stage.push_back(h);
+        }
+    }
+    if(stage.empty()) {
+        return false;
+    }
+    std::stable_sort(stage.begin(),stage.end(),[](hit const& a, hit const& b) { return a.rule < b.rule; });
+
+    // taken hits by start. Earlier rule replaces first, so later rule can't use text overlapping its hits.
+    std::map<unsigned int,hit> taken;
+    auto overlaps = [&taken](hit const& h) {
+        auto it = taken.lower_bound(h.start);
+        if(it != taken.end() && it->second.start < h.end) return true;
+        if(it != taken.begin() && (--it)->second.end > h.start) return true;
+        return false;
+    };
+
+    std::vector<hit> picked;
+    for(unsigned int i = 0; i < stage.size(); ) {
+        int rule = stage[i].rule;
+
+        picked.clear();
+        unsigned int pos = 0;
+        for( ; i < stage.size() && stage[i].rule == rule; i++) {
+            hit const& h = stage[i];
+            if(h.start < pos || overlaps(h)) {
+                continue;
+            }
+            picked.push_back(h);
+            pos = h.end;
+        }
+
+        // n-th counter is advanced once per data with a hit, as for regex rules
+        if(picked.empty() || ! nth_hit(rule)) {
+            continue;
+        }
+        for(auto const& h: picked) {
+            taken[h.start] = h;
+        }
+    }
+
+    if(taken.empty()) {
+        return false;
+    }
+
+    std::vector<ContentRuleSet::rule> const& rules = rules_->rules();
+
+    out.reserve(len + 64);
+    unsigned int pos = 0;
+    for(auto const& t: taken) {
+        hit const& h = t.second;
+        out.append(data + pos, h.start - pos);
+        out.append(rules[h.rule].replace);
+        pos = h.end;
+        ++replaced;
+    }
+    out.append(data + pos, len - pos);
+
+    return true;
+}
+
+int ContentReplacer::process(char side, const unsigned char* data, unsigned int len, buffer& out) {
+
+    side_state_t& st = side_state(side);
+
+    // held tail is scanned again, now followed by new data
+    std::string joined;
+    const unsigned char* p = data;
+    unsigned int n = len;
+    unsigned int was_held = st.held.size();
+
+    if(was_held > 0) {
+        joined.reserve(was_held + len);
+        joined = st.held;
+        joined.append((const char*)data,len);
+        p = (const unsigned char*)joined.data();
+        n = joined.size();
+    }
+
+    int replaced = 0;
+    unsigned int emit = apply(p,n,out,false,replaced);
+
+    if(emit < n) {
+        // timer runs since the oldest held byte arrived
+        if(emit >= was_held) {
+            st.held_since = std::chrono::steady_clock::now();
+        }
+        st.held.assign((const char*)p + emit, n - emit);
+    } else {
+        st.held.clear();
+    }
+
+    return replaced;
+}
+
+bool ContentReplacer::flush(char side, buffer& out, bool force) {
+    side_state_t& st = side_state(side);
+
+    if(st.held.empty()) {
+        return false;
+    }
+
+    if(! force && std::chrono::steady_clock::now() - st.held_since < std::chrono::milliseconds(hold_timeout_ms)) {
+        return false;
+    }
+
+    // nothing more is expected: held data are processed as they are
+    std::string held;
+    held.swap(st.held);
+
+    int replaced = 0;
+    apply((const unsigned char*)held.data(),held.size(),out,true,replaced);
+
+    return true;
+}
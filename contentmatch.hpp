@@ -0,0 +1,150 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CONTENTMATCH_HPP
+ #define CONTENTMATCH_HPP
+
+#include <vector>
+#include <string>
+#include <regex>
+#include <memory>
+#include <chrono>
+
+#include <buffer.hpp>
+#include <ahocorasick.hpp>
+
+class ProfileContentRule;
+
+//
+// Content profile rules compiled once, when profile is loaded. Immutable, shared by all sessions using the profile.
+//
+// Rules with literal match (no regex operators, or only escaped ones) go into single Aho-Corasick automaton
+// and are replaced in one pass over the data. Other rules keep precompiled std::regex. If such regex starts
+// with literal text ("anchor"), anchor is added to the automaton too, and regex is run only on data
+// containing the anchor.
+//
+// Result is the same as if rules were applied one after another, each to the output of the previous one.
+// Consecutive literal rules form a stage replaced in one pass: where hits overlap, the earlier rule wins,
+// and each rule takes its leftmost non-overlapping hits. Literal rule which could match text produced by
+// an earlier rule of the stage (foo->bar, bar->baz) starts a new stage, so it sees that output.
+// Output is seen only within the same processed data: text produced at the end of one read doesn't combine
+// with the next read.
+//
+class ContentRuleSet {
+public:
+    struct rule {
+        std::string match;
+        std::string replace;
+        bool fill_length = false;
+        int replace_each_nth = 0;
+
+        bool literal = false;       // replaced by automaton
+        std::regex re;              // compiled match for non-literal rules
+        int ac_id = -1;             // automaton pattern: literal itself, or regex anchor
+        unsigned int stage_end = 0; // literal rules: one past the last rule replaced in the same pass
+    };
+
+    // returns number of rules compiled; rules with invalid regex are skipped
+    int compile(std::vector<ProfileContentRule> const& rules);
+
+    std::vector<rule> const& rules() const { return rules_; }
+    AhoCorasick const& automaton() const { return ac_; }
+    // rule index of automaton pattern
+    int pattern_rule(int ac_id) const { return ac_rule_[ac_id]; }
+    bool has_literals() const { return literals_ > 0; }
+
+    std::string to_string() const;
+
+    // if match is plain text, unescape it into 'lit' and return true
+    static bool literal_match(std::string const& match, std::string& lit);
+    // longest literal text which any match of regex starts with, empty if there is none
+    static std::string literal_anchor(std::string const& match);
+
+private:
+    std::vector<rule> rules_;
+    AhoCorasick ac_;
+    std::vector<int> ac_rule_;
+    int literals_ = 0;
+    int stages_ = 0;
+};
+
+typedef std::shared_ptr<ContentRuleSet> content_ruleset_ptr;
+
+
+//
+// Per-session state of content replacement. Data of each direction are processed exactly once when received.
+// Tail of data which could be start of a match split between two reads is held back and processed with
+// the next read, or flushed unchanged after hold_timeout_ms if nothing follows. Held are:
+//  - possible start of literal rule or regex anchor,
+//  - data from the last regex anchor, if regex doesn't match there yet,
+//  - regex match ending at the end of data, which could go on (foo[0-9]+ on "foo12|34"),
+// each at most hold_max bytes long.
+// Regex without anchor (or with anchor shorter than 3 characters) can't tell the start of an incomplete
+// match: match split between two reads is found only if its part in the first read matches on its own.
+//
+class ContentReplacer {
+public:
+    explicit ContentReplacer(content_ruleset_ptr const& rules);
+
+    // process new data of 'L' or 'R' side, output ready to be sent is appended to 'out'.
+    // Returns number of replacements made.
+    int process(char side, const unsigned char* data, unsigned int len, buffer& out);
+
+    // process held data of the side as complete and append them to 'out', if they are waiting longer
+    // than hold_timeout_ms, or if forced. Returns true if something was flushed.
+    bool flush(char side, buffer& out, bool force=false);
+    bool holding(char side) { return ! side_state(side).held.empty(); }
+
+    content_ruleset_ptr const& rules() const { return rules_; }
+
+    static unsigned int hold_timeout_ms;
+    // regex rule can't hold more data than this waiting to be completed
+    static unsigned int hold_max;
+
+private:
+    struct side_state_t {
+        std::string held;
+        std::chrono::steady_clock::time_point held_since;
+    };
+
+    side_state_t& side_state(char side) { return side == 'R' ? right_ : left_; }
+
+    content_ruleset_ptr rules_;
+    side_state_t left_;
+    side_state_t right_;
+
+    // replace_each_nth counters, per rule
+    std::vector<int> counters_;
+
+    // replace data, return length of processed part; rest should be held unless this is the last data
+    unsigned int apply(const unsigned char* p, unsigned int n, buffer& out, bool last, int& replaced);
+
+    struct hit {
+        unsigned int start;
+        unsigned int end;
+        int rule;
+    };
+    // replace hits of literal rules <from,to) in data, result goes to 'out'. Returns false if nothing was replaced.
+    bool replace_literals(const char* data, unsigned int len, std::vector<hit>& hits, unsigned int from, unsigned int to,
+                          std::string& out, int& replaced);
+    bool nth_hit(unsigned int rule);
+    int replace_regex(ContentRuleSet::rule const& r, unsigned int rule, std::string& data);
+};
+
+#endif
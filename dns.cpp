@@ -18,6 +18,7 @@
 */
 
 #include <arpa/inet.h>
+#include <algorithm>
 
 
 #include <dns.hpp>
@@ -36,7 +37,7 @@ const char* str_txt= "TXT";
 const char* str_opt = "OPT";
 const char* str_soa = "SOA";
 
-dns_cache inspect_dns_cache("DNS cache - global",2000,true);
+dns_cache inspect_dns_cache("DNS cache - global",2000);
 std::unordered_map<std::string,ptr_cache<std::string,DNS_Response>*> inspect_per_ip_dns_cache;
 
 domain_cache_t domain_cache("DNS 3l domain cache",2000,true);
@@ -55,38 +56,6 @@ const char* dns_record_type_str(int a) {
 }
 
 
-int load_qname(unsigned char* ptr, unsigned int maxlen, std::string* str_storage=nullptr) {
-    int xi = 0;
-    int name_i = 0;
-    
-    DEB_("load_qname:\n%s",hex_dump(ptr,maxlen).c_str());
-    
-    
-    if(ptr[xi] == 0) {
-        xi++;
-        DEBS_("zero label");
-    } 
-    else if(ptr[xi] < 0xC0) {
-        std::string lab;
-        for(; xi < maxlen; ++xi) {
-            uint8_t c = ptr[xi];
-            if (c == 0) break;
-            lab += c;
-        }
-        ++xi;
-        
-        if(str_storage) str_storage->assign(lab);
-        
-        DEB_("plain label: %s",ESC(lab.c_str())); 
-    } else {
-        uint8_t label = ptr[++xi];
-        DEB_("ref label: %d",label);
-        ++xi;
-    }
-    
-    return xi;
-}
-
 int generate_dns_request(unsigned short id, buffer& b,const std::string h, DNS_Record_Type t) {
     
     std::string hostname = "." + h;
@@ -158,289 +127,159 @@ int generate_dns_request(unsigned short id, buffer& b,const std::string h, DNS_R
  */
 int DNS_Packet::load(buffer* src) {
 
+    DnsWireParser wire;
+    if(wire.parse(src->data(),src->size()) != DnsWireParser::DNS_PARSE_OK) {
+        DIA___("DNS_Packet::load: malformed or incomplete message (buffer length=%d)",src->size());
+        return -1;
+    }
+    
+    load(wire,src->data());
+    
+    DIA___("DNS_Packet::load: finished message_length=%d buffer_size=%d",wire.length(),src->size());
+    if(wire.length() == src->size()) {
+        return 0;
+    }
+    return wire.length();
+}
+
+void DNS_Packet::load(DnsWireParser const& wire, const unsigned char* data) {
+
     loaded_at = ::time(nullptr);
     
-    if(src->size() > DNS_HEADER_SZ) {
-        id_ = ntohs(src->get_at<unsigned short>(0));
-        flags_ = ntohs(src->get_at<unsigned short>(2));
-        questions_ = ntohs(src->get_at<unsigned short>(4));
-        answers_ = ntohs(src->get_at<unsigned short>(6));
-        authorities_ = ntohs(src->get_at<unsigned short>(8));
-        additionals_ = ntohs(src->get_at<unsigned short>(10));
-        //std::string    rq((const char*)&src->data()[DNS_HEADER_SZ]);
+    id_ = wire.id();
+    flags_ = wire.flags();
+    questions_ = wire.count(DnsWireParser::SECTION_QUESTION);
+    answers_ = wire.count(DnsWireParser::SECTION_ANSWER);
+    authorities_ = wire.count(DnsWireParser::SECTION_AUTHORITY);
+    additionals_ = wire.count(DnsWireParser::SECTION_ADDITIONAL);
+    
+    DIA___("DNS_Packet::load: processing [0x%x] Q: %d, A: %d, AU: %d, AD: %d",id_, questions_,answers_,authorities_,additionals_);
+    
+    questions_list_.clear();
+    answers_list_.clear();
+    authorities_list_.clear();
+    additionals_list_.clear();
+    answer_ttl_idx.clear();
+    
+    for(unsigned int i = 0; i < wire.records(); i++) {
+        DnsWireParser::record const& r = wire.at(i);
         
-        uint16_t questions_togo = questions_;
-        uint16_t answers_togo = answers_;
-        uint16_t authorities_togo = authorities_;
-        uint16_t additionals_togo = additionals_;
+        if(r.section == DnsWireParser::SECTION_QUESTION) {
+            DNS_Question q;
+            q.rec_str = wire.name(r.name);
+            q.rec_type = r.type;
+            q.rec_class = r.rclass;
+            
+            DIA___("DNS_Packet::load: question: %s",q.hr().c_str());
+            questions_list_.push_back(q);
+            continue;
+        }
         
-        DIA___("DNS_Packet::load: processing [0x%x] Q: %d, A: %d, AU: %d, AD: %d  (buffer length=%d)",id_, questions_,answers_,authorities_,additionals_,src->size());
-        DEB___("DNS Packet dump:\n%s",hex_dump(src->data(),src->size()).c_str());
+        // EDNS0 pseudo-record: its TTL field is not TTL
+        if(r.section == DnsWireParser::SECTION_ADDITIONAL && r.type == OPT) {
+            continue;
+        }
         
-        unsigned int mem_counter = DNS_HEADER_SZ;
-            
-        bool failure = false;
+        DNS_Answer a;
+        a.name_ = r.name;
+        a.type_ = r.type;
+        a.class_ = r.rclass;
+        a.ttl_ = r.ttl;
+        a.datalen_ = r.rdlength;
+        if(r.rdlength > 0) {
+            a.data_.append(data + r.rdata,r.rdlength);
+        }
+        DIA___("DNS_Packet::load: section %d record: %s",r.section,a.hr().c_str());
         
-        /* QUESTION */
-        if(!failure && questions_togo > 0) {
-            DIA___("DNS Inspect: Questions: start (count %d)",questions_togo);            
-            
-            for(; mem_counter < src->size() && questions_togo > 0 && questions_togo > 0;) {
-                DEB___("DNS_Packet::load: question loop start: current memory pos: %d",mem_counter);
-                DNS_Question question_temp;
-                unsigned int field_len = 0;
-                
-                for(unsigned int cur_mem = mem_counter; cur_mem < src->size() && questions_togo > 0;) {
-                    
-                    
-                    buffer tmp_b = src->view(cur_mem,src->size()-cur_mem);
-                    DUM__("current buffer: %s", hex_dump(tmp_b).c_str());
-                    
-                    // load next field length
-                    field_len = src->get_at<uint8_t>(cur_mem);
-                    
-                    // 
-                    if(cur_mem + field_len >= src->size()) {
-                        DIA___("DNS_Packet::load: incomplete question data in the preamble, position %d, field_len %d out of buffer bounds %d",cur_mem, field_len, src->size());
-                        failure = true;
-                        break;
-                    }
-                    
-                    DEB___("DNS_Packet::load: question field_len=%d i=%d buffer_size=%d",field_len,cur_mem,src->size());
-                    
-                    // last part of the fqdn?
-                    if(field_len == 0) {
-                        
-                        if(cur_mem+5 > src->size()) {
-                            DIA___("DNS_Packet::load: incomplete question data in the preamble, index+5 = %d is out of buffer bounds %d",cur_mem+5,src->size());
-                            mem_counter = src->size();
-                            failure = true;
-                            break;
-                        }
-                        question_temp.rec_type = ntohs(src->get_at<unsigned short>(cur_mem+1));           DEB___("DNS_Packet::load: read 'type' at index %d", cur_mem+1);
-                        question_temp.rec_class =  ntohs(src->get_at<unsigned short>(cur_mem+1+2));       DEB___("DNS_Packet::load: read 'class' at index %d", cur_mem+1+2);
-                        DEB___("type=%d,class=%d",question_temp.rec_type,question_temp.rec_class);
-                        mem_counter += (1 + (2*2));
-                        DEB___("DNS_Packet::load: s==0, mem counter changed to: %d (0x%x)",mem_counter,mem_counter);
-                        
-                        if(questions_togo > 0) {
-                            questions_list_.push_back(question_temp);
-                            questions_togo--;
-                        }
-                        // we don't currently process authorities and additional records
-                        break;
-                    } else {
-                        if(field_len > src->size()) {
-                            DIA___("DNS_Packet::load: incomplete question data in the preamble, field_len %d is out of buffer bounds %d",field_len,src->size());
-                            mem_counter = src->size();
-                            failure = true;
-                            break;
-                        }
-                        if(cur_mem+1 >= src->size()) {
-                            DIA___("DNS_Packet::load: incomplete question data in the preamble, cur_mem+1 = %d is out of buffer bounds %d",cur_mem+1,src->size());
-                            mem_counter = src->size();
-                            failure = true;
-                            break;
-                            
-                        }
-                        
-                        if(question_temp.rec_str.size() != 0) question_temp.rec_str += ".";
-                        
-                        std::string t((const char*)&src->data()[cur_mem+1],field_len);
-                        
-                        cur_mem += (field_len + 1);
-                        mem_counter += (field_len+1);
-                        question_temp.rec_str += t;
-                    }
-                }
-                
-                if(!failure) {
-                    DIA___("DNS_Packet::load: OK question[%d]: name: %s, type: %s, class: %d",questions_togo, question_temp.rec_str.c_str(),
-                                        dns_record_type_str(question_temp.rec_type),question_temp.rec_class);
-                } else {
-                    DIA___("DNS_Packet::load: FAILED question[%d]",questions_togo);
-                    break;
-                }
-            }
+        if(r.section == DnsWireParser::SECTION_ANSWER) {
+            answer_ttl_idx.push_back(r.ttl_offset);
+            answers_list_.push_back(a);
         }
-            
-        /* ANSWER section */
-        if(!failure && answers_togo > 0) {
-            DIA___("DNS Inspect: Answers: start (count %d)",answers_togo);
-            
-            for(unsigned int i = mem_counter; i < src->size() && answers_togo > 0; ) {
-                DNS_Answer answer_temp;
-                answer_temp.name_ = ntohs(src->get_at<unsigned short>(i));
-                answer_temp.type_ = ntohs(src->get_at<unsigned short>(i+2));
-                answer_temp.class_ = ntohs(src->get_at<unsigned short>(i+4));
-                answer_ttl_idx.push_back(i+6);
-                answer_temp.ttl_ = ntohl(src->get_at<uint32_t>(i+6));
-                answer_temp.datalen_ = ntohs(src->get_at<uint32_t>(i+10)); 
-                if(answer_temp.datalen_ > 0)
-                    answer_temp.data_.append(src->view(i+12,answer_temp.datalen_));
-                int inc = 12 + answer_temp.datalen_;
-
-                mem_counter += inc ;
-                i += inc;
-                
-                DIA___("DNS_Packet::load: answer[%d]: name: %d, type: %d, class: %d, ttl: %d, len: %d, buflen: %d",answers_togo,
-                                    answer_temp.name_,answer_temp.type_,answer_temp.class_,answer_temp.ttl_,answer_temp.datalen_,answer_temp.data_.size()  );
-                answers_list_.push_back(answer_temp);
-                answers_togo--;
-            }
+        else if(r.section == DnsWireParser::SECTION_AUTHORITY) {
+            authorities_list_.push_back(a);
+        }
+        else {
+            answer_ttl_idx.push_back(r.ttl_offset);
+            additionals_list_.push_back(a);
         }
+    }
+    
+    //fix additionals number, for case we omitted some
+    additionals_ = additionals_list_.size();
+    
+    int nttl = dns_negative_ttl(wire);
+    negative = (nttl >= 0);
+    negative_ttl = negative ? nttl : 0;
+}
+
+time_t DNS_Packet::expires_at() const {
+    
+    if(negative) {
+        return loaded_at + negative_ttl;
+    }
+    if(answers_list_.size() == 0) {
+        return loaded_at;
+    }
+    
+    uint32_t ttl = answers_list_[0].ttl_;
+    for(auto const& a: answers_list_) {
+        if(a.ttl_ < ttl) ttl = a.ttl_;
+    }
+    return loaded_at + ttl;
+}
+
+int dns_negative_ttl(DnsWireParser const& wire) {
+    
+    if(! wire.response()) {
+        return -1;
+    }
+    if(wire.rcode() == RCODE_SERVFAIL) {
+        return DNS_SERVFAIL_TTL;
+    }
+    // NXDOMAIN, or NODATA: no address, possibly CNAME chain ending nowhere
+    if(wire.rcode() != RCODE_NXDOMAIN && (wire.rcode() != RCODE_NOERROR || wire.addresses() > 0)) {
+        return -1;
+    }
+    
+    // SOA TTL, but no more than its MINIMUM (RFC 2308, section 5)
+    for(unsigned int i = 0; i < wire.records(); i++) {
+        DnsWireParser::record const& r = wire.at(i);
+        uint32_t minimum = 0;
         
-        /* AUTHORITIES sectin */
-        if(!failure && authorities_togo > 0) {
-            
-            DIA___("DNS Inspect: Authorities: start (count %d)",authorities_togo);
-            
-            for(unsigned int i = mem_counter; i < src->size() && authorities_togo > 0; ) {
-                DNS_Answer answer_temp;
-                
-                int xi = load_qname(src->data()+i,src->size()-i);
-                
-                //unsigned short pre_type = ntohs(src->get_at<unsigned short>(i+1));
-                unsigned short pre_type = ntohs(src->get_at<unsigned short>(i+xi));                
-                i += (xi + 2);
-                
-                DUM___("xi: %d, pre-type: %d",xi, pre_type);
-                
-                if(pre_type == SOA) {
-                    //answer_temp.name_ = ntohs(src->get_at<unsigned short>(i));
-                    answer_temp.type_ = pre_type;//ntohs(src->get_at<unsigned short>(i+1));
-                    answer_temp.class_ = ntohs(src->get_at<unsigned short>(i));
-                    answer_temp.ttl_ = ntohl(src->get_at<uint32_t>(i+2));
-                    answer_temp.datalen_ = ntohs(src->get_at<uint16_t>(i+6)); 
-                
-                    
-                    DUM___("DNS_Packet::load: authorities[%d]: name: %d, type: %d, class: %d, ttl: %d, len: %d",authorities_togo,
-                                        answer_temp.name_,answer_temp.type_,answer_temp.class_,answer_temp.ttl_,answer_temp.datalen_);
-                    
-                    if(answer_temp.datalen_ > 0)
-                        answer_temp.data_.append(src->view(i+8,answer_temp.datalen_));
-                    int inc = 8 + answer_temp.datalen_;
-
-                    mem_counter += inc ;
-                    i += inc;
-                    
-                    DIA___("DNS_Packet::load: authorities[%d]: name: %d, type: %d, class: %d, ttl: %d, len: %d, buflen: %d",authorities_togo,
-                                        answer_temp.name_,answer_temp.type_,answer_temp.class_,answer_temp.ttl_,answer_temp.datalen_,answer_temp.data_.size()  );
-                    authorities_list_.push_back(answer_temp);
-                    authorities_togo--;
-                } 
-                else {
-                    mem_counter = src->size();
-                    i = src->size();
-
-                    failure = true;
-                    break;
-                }
-            }
+        if(r.section == DnsWireParser::SECTION_AUTHORITY && wire.soa_minimum(r,minimum)) {
+            uint32_t ttl = (r.ttl < minimum) ? r.ttl : minimum;
+            return (ttl < DNS_NEGATIVE_TTL_MAX) ? ttl : DNS_NEGATIVE_TTL_MAX;
         }
+    }
+    
+    return DNS_NEGATIVE_TTL_NOSOA;
+}
+
+
+DNS_CachedAnswer::DNS_CachedAnswer(DnsWireParser const& wire, const unsigned char* data, uint32_t ttl_limit) {
+    
+    loaded_at_ = ::time(nullptr);
+    wire_.assign(data,data + wire.length());
+    min_ttl_ = ttl_limit;
+    
+    for(unsigned int i = 0; i < wire.records(); i++) {
+        DnsWireParser::record const& r = wire.at(i);
         
-        /* ADDITIONALS */
-        if(!failure && additionals_togo > 0) {
-            
-            DIA___("DNS Inspect: Additionals: start (count %d)",additionals_togo);
-            
-            for(unsigned int i = mem_counter; i < src->size() && additionals_togo > 0; ) {
-  
-                
-                int xi = load_qname(src->data()+i,src->size()-i);
-                
-                //unsigned short pre_type = ntohs(src->get_at<unsigned short>(i+1));
-                unsigned short pre_type = ntohs(src->get_at<unsigned short>(i+xi));                
-                i += (xi + 2);
-                
-               
-                DIA___("DNS inspect: Additionals: packet pre_type = %s(%d)",dns_record_type_str(pre_type), pre_type);
-                
-                if(pre_type == OPT) {
-                    //THIS IS DNSSEC ADDITIONALS - we need to handle it better, now remove                
-                
-                    DNS_DnssecAdditionalInfo answer_temp;
-                    //answer_temp.name_ = src->get_at<uint8_t>(i);
-                    answer_temp.opt_ = pre_type;
-                    answer_temp.udp_size_ = ntohs(src->get_at<unsigned short>(i)); i+=2;
-                    answer_temp.higher_bits_rcode_ = src->get_at<uint8_t>(i);      i+=1;
-                    answer_temp.edns0_version_ = src->get_at<uint8_t>(i);          i+=1; 
-                    answer_temp.z_ = ntohs(src->get_at<uint16_t>(i));              i+=2;
-                    answer_temp.datalen_ = ntohs(src->get_at<uint16_t>(i));        i+=2;
-                    
-                    
-                    if(i + answer_temp.datalen_ <= src->size()) {
-                        
-                        if(answer_temp.datalen_ > 0) {
-                            answer_temp.data_.append(src->view(i,answer_temp.datalen_));
-                            i += answer_temp.datalen_;
-                        }
-
-                        DIA___("DNS_Packet::load: additional DNSSEC info[%d]: name: %d, opt: %d, udp: %d, hb_rcode: %d, edns0: %d, z: %d, len %d, buflen: %d", additionals_togo,
-                                            answer_temp.name_,answer_temp.opt_,answer_temp.udp_size_,answer_temp.higher_bits_rcode_,answer_temp.edns0_version_,answer_temp.z_,answer_temp.datalen_,answer_temp.data_.size()  );
-                        
-                        mem_counter = i;
-                        
-                        
-                        additionals_togo--;
-                    } else {
-                        mem_counter = src->size();
-                        i = src->size();
-                    }
-                }
-                else if (pre_type == A || pre_type == AAAA || pre_type == TXT) {
-                    DNS_Answer answer_temp;
-                    //answer_temp.name_ = ntohs(src->get_at<unsigned short>(i));
-                    
-                    
-                    
-                    answer_temp.type_ = pre_type;
-                    answer_temp.class_ = ntohs(src->get_at<unsigned short>(i));    i+=2;
-                    answer_ttl_idx.push_back(i);
-                    answer_temp.ttl_ = ntohl(src->get_at<uint32_t>(i));            i+=4;
-                    answer_temp.datalen_ = ntohs(src->get_at<uint16_t>(i));        i+=2;
-
-                    if(answer_temp.datalen_ > 0) {
-                        answer_temp.data_.append(src->view(i,answer_temp.datalen_));
-                        i += answer_temp.datalen_;
-                    }
-
-                    mem_counter = i;
-                    
-                    DEB___("mem_counter: %d, size %d",i, src->size());
-                    
-                    DIA___("DNS_Packet::load: additional answer[%d]: name: %d, type: %d, class: %d, ttl: %d, len: %d, buflen: %d",additionals_togo,
-                                        answer_temp.name_,answer_temp.type_,answer_temp.class_,answer_temp.ttl_,answer_temp.datalen_,answer_temp.data_.size()  );
-                    additionals_list_.push_back(answer_temp);
-                    additionals_togo--;
-                }
-                else {
-                    
-                    WARS___("unsupported additional message, skipping the rest of message.");
-                    
-                    mem_counter = src->size();
-                    i = mem_counter;
-                    
-                    failure = true;
-                    break;
-                }
-            }
-            
-            //fix additionals number, for case we omitted some
-            additionals_ = additionals_list_.size();
+        // question has no TTL, EDNS0 pseudo-record's TTL field is not TTL
+        if(r.section == DnsWireParser::SECTION_QUESTION || (r.section == DnsWireParser::SECTION_ADDITIONAL && r.type == OPT)) {
+            continue;
         }
         
-        if(questions_togo == 0 && answers_togo == 0 && authorities_togo == 0 /*&& additionals_togo == 0*/) {
-            DIA___("DNS_Packet::load: finished mem_counter=%d buffer_size=%d",mem_counter,src->size());
-            if(mem_counter == src->size()) {
-                return 0;
-            }
-
-            return mem_counter;
+        patch p;
+        p.offset = r.ttl_offset;
+        p.ttl = (r.ttl < ttl_limit) ? r.ttl : ttl_limit;
+        patches_.push_back(p);
+        
+        if(p.ttl < min_ttl_) {
+            min_ttl_ = p.ttl;
         }
     }
-    return -1;
-};
+}
 
 
 std::string DNS_Packet::to_string(int verbosity) {
@@ -493,3 +332,249 @@ std::vector< CidrAddress*> DNS_Packet::get_a_anwsers() {
     return ret;
 }
 
+
+DnsCache::entry_ptr DnsCache::get(uint16_t type, std::string const& name) {
+    shard& sh = shard_of(name);
+    std::lock_guard<std::mutex> l(sh.lock);
+    
+    auto it = sh.names.find(name);
+    if(it != sh.names.end()) {
+        for(auto const& e: it->second) {
+            if(e.first == type) {
+                return e.second;
+            }
+        }
+    }
+    
+    return entry_ptr();
+}
+
+bool DnsCache::set(uint16_t type, std::string const& name, DNS_Response* r) {
+    entry_ptr entry(r);
+    
+    shard& sh = shard_of(name);
+    std::lock_guard<std::mutex> l(sh.lock);
+    
+    auto& entries = sh.names[name];
+    bool replaced = false;
+    for(auto& e: entries) {
+        if(e.first == type) {
+            // failed lookup doesn't hide addresses which are still valid
+            if(entry->negative && ! e.second->negative && e.second->expires_at() >= ::time(nullptr)) {
+                return false;
+            }
+            
+            // replaced entry is freed when last reader drops it
+            index(e.second,type,name,false);
+            if(e.second->negative) sh.negative_entries--;
+            bool requeue = (e.second->negative != entry->negative);
+            
+            e.second = entry;
+            index(e.second,type,name,true);
+            replaced = true;
+            
+            if(! requeue) {
+                return true;
+            }
+            break;
+        }
+    }
+    
+    if(! replaced) {
+        entries.push_back(std::make_pair(type,entry));
+        index(entry,type,name,true);
+        sh.entries++;
+    }
+    if(entry->negative) {
+        sh.negative_order.push_back(std::make_pair(type,name));
+        sh.negative_entries++;
+    } else {
+        sh.order.push_back(std::make_pair(type,name));
+    }
+    
+    unsigned int shard_max = (max_size_ + SHARDS - 1)/SHARDS;
+    unsigned int negative_max = (shard_max + 3)/4;
+    while(sh.negative_entries > negative_max && ! sh.negative_order.empty()) {
+        evict(sh,true);
+    }
+    while(sh.entries > shard_max && ! (sh.order.empty() && sh.negative_order.empty())) {
+        evict(sh,sh.order.empty());
+    }
+    
+    return true;
+}
+
+void DnsCache::evict(shard& sh, bool negative) {
+    auto& order = negative ? sh.negative_order : sh.order;
+    
+    while(! order.empty()) {
+        auto victim = order.front();
+        order.pop_front();
+        
+        // skip records of entries erased, or replaced by entry of the other kind
+        auto it = sh.names.find(victim.second);
+        if(it == sh.names.end()) {
+            continue;
+        }
+        for(auto const& e: it->second) {
+            if(e.first == victim.first && e.second->negative == negative) {
+                remove(sh,victim.first,victim.second);
+                return;
+            }
+        }
+    }
+}
+
+bool DnsCache::remove(shard& sh, uint16_t type, std::string const& name) {
+    auto it = sh.names.find(name);
+    if(it == sh.names.end()) {
+        return false;
+    }
+    
+    auto& entries = it->second;
+    for(unsigned int i = 0; i < entries.size(); i++) {
+        if(entries[i].first == type) {
+            index(entries[i].second,type,name,false);
+            if(entries[i].second->negative) sh.negative_entries--;
+            entries.erase(entries.begin() + i);
+            if(entries.empty()) {
+                sh.names.erase(it);
+            }
+            sh.entries--;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+bool DnsCache::erase(uint16_t type, std::string const& name) {
+    shard& sh = shard_of(name);
+    std::lock_guard<std::mutex> l(sh.lock);
+    
+    return remove(sh,type,name);
+}
+
+void DnsCache::clear() {
+    for(auto& sh: shards_) {
+        std::lock_guard<std::mutex> l(sh.lock);
+        for(auto const& n: sh.names) {
+            for(auto const& e: n.second) {
+                index(e.second,e.first,n.first,false);
+            }
+        }
+        sh.names.clear();
+        sh.order.clear();
+        sh.negative_order.clear();
+        sh.entries = 0;
+        sh.negative_entries = 0;
+    }
+}
+
+unsigned int DnsCache::size() {
+    unsigned int ret = 0;
+    for(auto& sh: shards_) {
+        std::lock_guard<std::mutex> l(sh.lock);
+        ret += sh.entries;
+    }
+    return ret;
+}
+
+unsigned int DnsCache::negative_size() {
+    unsigned int ret = 0;
+    for(auto& sh: shards_) {
+        std::lock_guard<std::mutex> l(sh.lock);
+        ret += sh.negative_entries;
+    }
+    return ret;
+}
+
+size_t DnsCache::address_hash::operator()(AddressKey const& k) const {
+    // FNV-1a; IPv4 occupies only last 4 bytes
+    size_t h = 2166136261u;
+    for(int i = (k.proto == CIDR_IPV4 ? 12 : 0); i < 16; i++) {
+        h = (h ^ k.addr[i]) * 16777619u;
+    }
+    return h;
+}
+
+void DnsCache::index(entry_ptr const& r, uint16_t type, std::string const& name, bool add) {
+    if(! r || (type != A && type != AAAA)) {
+        return;
+    }
+    
+    for(DNS_Answer const& a: r->answers()) {
+        AddressKey k;
+        if(a.type_ == A && a.data_.size() == 4) {
+            k.proto = CIDR_IPV4;
+            memcpy(&k.addr[12],a.data_.data(),4);
+        }
+        else if(a.type_ == AAAA && a.data_.size() == 16) {
+            k.proto = CIDR_IPV6;
+            memcpy(&k.addr[0],a.data_.data(),16);
+        }
+        else {
+            continue;
+        }
+        
+        address_shard& ash = address_shard_of(k);
+        std::lock_guard<std::mutex> l(ash.lock);
+        
+        if(add) {
+            auto& names = ash.names[k];
+            if(std::find(names.begin(),names.end(),name) == names.end()) {
+                names.push_back(name);
+            }
+        } else {
+            auto it = ash.names.find(k);
+            if(it == ash.names.end()) {
+                continue;
+            }
+            auto& names = it->second;
+            auto n = std::find(names.begin(),names.end(),name);
+            if(n != names.end()) {
+                names.erase(n);
+            }
+            if(names.empty()) {
+                ash.names.erase(it);
+            }
+        }
+    }
+}
+
+bool DnsCache::resolves_to(std::string const& name, AddressKey const& k) {
+    address_shard& ash = address_shard_of(k);
+    std::lock_guard<std::mutex> l(ash.lock);
+    
+    auto it = ash.names.find(k);
+    if(it == ash.names.end()) {
+        return false;
+    }
+    
+    for(auto const& n: it->second) {
+        if(n == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::string> DnsCache::names_of(AddressKey const& k) {
+    address_shard& ash = address_shard_of(k);
+    std::lock_guard<std::mutex> l(ash.lock);
+    
+    auto it = ash.names.find(k);
+    if(it == ash.names.end()) {
+        return std::vector<std::string>();
+    }
+    return it->second;
+}
+
+unsigned int DnsCache::addresses() {
+    unsigned int ret = 0;
+    for(auto& ash: address_shards_) {
+        std::lock_guard<std::mutex> l(ash.lock);
+        ret += ash.names.size();
+    }
+    return ret;
+}
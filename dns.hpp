@@ -24,7 +24,10 @@
 #include <vector>
 #include <mutex>
 #include <unordered_map>
+#include <deque>
+#include <memory>
 #include <ctime>
+#include <cstring>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -37,6 +40,7 @@
 #include <logger.hpp>
 #include <cidr.hpp>
 #include <addrobj.hpp>
+#include <dnsparser.hpp>
 
 #define DNS_HEADER_SZ 12
 
@@ -51,6 +55,23 @@ typedef enum DNS_Record_Type_ {
     OPT=41
 } DNS_Record_Type;
 
+typedef enum DNS_Rcode_ {
+    RCODE_NOERROR=0,
+    RCODE_FORMERR=1,
+    RCODE_SERVFAIL=2,
+    RCODE_NXDOMAIN=3,
+    RCODE_NOTIMP=4,
+    RCODE_REFUSED=5
+} DNS_Rcode;
+
+// negative caching (RFC 2308): TTL is taken from SOA in authorities, limited to 3 hours
+#define DNS_NEGATIVE_TTL_MAX 10800
+// negative answer without SOA has no TTL to use; keep it just long enough to absorb repeated queries
+#define DNS_NEGATIVE_TTL_NOSOA 30
+// server failure is valid for 30 seconds (RFC 2308 7.1 allows 5 minutes at most), only for the query
+// it answered: it's specific to the server and isn't put into shared cache
+#define DNS_SERVFAIL_TTL 30
+
 extern const char* _unknown;
 extern const char* str_a;
 extern const char* str_aaaa;
@@ -162,15 +183,23 @@ protected:
 public:    
     std::vector<int> answer_ttl_idx; // should be protected;
     time_t      loaded_at = 0;
+    // RFC 2308 negative answer (NXDOMAIN, NODATA or SERVFAIL), valid for negative_ttl seconds
+    bool        negative = false;
+    uint32_t    negative_ttl = 0;
     
     virtual std::string to_string(int verbosity=iINF);
     virtual bool ask_destroy() { return false; };
 
     virtual ~DNS_Packet() {}
     int load(buffer* src); // initialize from memory. if non-zero is returned, there is yet another data and new DNS_packet should be read.
+    // initialize from message already parsed in place
+    void load(DnsWireParser const& wire, const unsigned char* data);
 
     inline uint16_t id() const { return id_; }
     inline uint16_t flags() const { return flags_; } // todo: split and inspect all bits of this field
+    inline int rcode() const { return flags_ & 0x000f; }
+    // negative answer expires after negative_ttl, positive with its first record
+    time_t expires_at() const;
 
     // helper inline functions to operate on most common content
     std::string question_str_0() const { 
@@ -182,6 +211,10 @@ public:
         } 
         return std::string("? "); 
     };
+    std::string const& question_name_0() const { 
+        static const std::string empty;
+        if(questions_list_.size()) { return questions_list_.at(0).rec_str; } return empty; 
+    };
     uint16_t question_type_0() const { if(questions_list_.size()) { return questions_list_.at(0).rec_type; } return 0; };
     uint16_t question_class_0() const { if(questions_list_.size()) { return questions_list_.at(0).rec_class; } return 0; };
     
@@ -200,6 +233,8 @@ public:
 
 #define DNS_REQUEST_OVERHEAD 17
 int generate_dns_request(unsigned short id, buffer& b,const std::string hostname, DNS_Record_Type t);
+// seconds negative answer can be cached for, or -1 if response is not negative
+int dns_negative_ttl(DnsWireParser const& wire);
 
 class DNS_Request : public DNS_Packet {
 public:
@@ -210,20 +245,186 @@ public:
 };
 
 
+//
+// Response kept in wire format, for answering queries from cache. It's not modified after it's built,
+// so it can be shared by all connections: query ID and decremented TTLs are written out with the answer,
+// at offsets found when response was parsed.
+//
+class DNS_CachedAnswer {
+public:
+    // message must be parsed completely (wire.truncated() is false). TTLs over ttl_limit are sent as ttl_limit,
+    // which is also the answer's lifetime if there are no records (negative answers).
+    DNS_CachedAnswer(DnsWireParser const& wire, const unsigned char* data, uint32_t ttl_limit=0xffffffff);
+
+    unsigned int size() const { return wire_.size(); }
+    time_t loaded_at() const { return loaded_at_; }
+    // time when the first of records expires
+    time_t expires_at() const { return loaded_at_ + min_ttl_; }
+    bool expired(time_t now) const { return now > expires_at(); }
+    unsigned int patches() const { return patches_.size(); }
+
+    // call fn(data, len) for consecutive parts of answer with given ID, and TTLs decremented by time
+    // elapsed since it was loaded. Immutable parts point into the cached message, patched fields
+    // (and 2-byte length prefix for TCP) are passed from small copy. Returns written answer size.
+    template <class F>
+    unsigned int write(uint16_t id, time_t now, bool tcp, F fn) const {
+        uint32_t elapsed = (now > loaded_at_) ? now - loaded_at_ : 0;
+        const unsigned char* data = wire_.data();
+
+        unsigned char header[4];
+        unsigned int h = 0;
+        if(tcp) {
+            header[h++] = (wire_.size() >> 8) & 0xff;
+            header[h++] = wire_.size() & 0xff;
+        }
+        header[h++] = id >> 8;
+        header[h++] = id & 0xff;
+        fn(header,h);
+
+        unsigned int pos = 2;
+        for(auto const& p: patches_) {
+            fn(data + pos,p.offset - pos);
+
+            uint32_t ttl = (p.ttl > elapsed) ? p.ttl - elapsed : 0;
+            unsigned char field[4] = { (unsigned char)(ttl >> 24), (unsigned char)(ttl >> 16), (unsigned char)(ttl >> 8), (unsigned char)ttl };
+            fn(field,4);
+            pos = p.offset + 4;
+        }
+        fn(data + pos,wire_.size() - pos);
+
+        return (tcp ? 2 : 0) + wire_.size();
+    }
+
+private:
+    struct patch {
+        uint16_t offset;    // TTL field offset
+        uint32_t ttl;       // original TTL
+    };
+
+    std::vector<unsigned char> wire_;
+    std::vector<patch> patches_;    // sorted by offset
+    time_t loaded_at_ = 0;
+    uint32_t min_ttl_ = 0;
+};
+
 class DNS_Response : public DNS_Packet {
 public:
-    buffer* cached_packet = nullptr;
-    unsigned int cached_id_idx = 0;
+    // set when responses are cached for answering queries, not modified afterwards
+    DNS_CachedAnswer* cached_answer = nullptr;
     
     DNS_Response(): DNS_Packet() {};        // we won't allow parsing in constructor
-    virtual ~DNS_Response() { if(cached_packet != nullptr) delete cached_packet; };
+    virtual ~DNS_Response() { if(cached_answer != nullptr) delete cached_answer; };
     
     DECLARE_C_NAME("DNS_Response");
     DECLARE_LOGGING(to_string);
 };
 
 
-typedef ptr_cache<std::string,DNS_Response> dns_cache;
+//
+// DNS cache of responses, keyed by record type and name. Names are split into shards by their hash,
+// each shard has its own lock, so DNS inspection, FQDN policy matching, SOCKS and DNS updater threads
+// don't wait on each other unless they touch the same shard.
+//
+// Entries are shared: get() returns pointer which stays valid after shard is unlocked, even if the entry
+// is replaced or evicted meanwhile. Cached responses must not be modified.
+//
+// Addresses in A and AAAA answers are indexed back to names, so it's cheap to find out if an address
+// belongs to a name. Index follows entries as they are stored, replaced, evicted and erased.
+//
+class DnsCache {
+public:
+    typedef std::shared_ptr<DNS_Response> entry_ptr;
+    enum { SHARDS=16 };
+    
+    DnsCache(const char* name, unsigned int max_size) : name_(name), max_size_(max_size) {};
+    
+    entry_ptr get(uint16_t type, std::string const& name);
+    // cache takes ownership of the response. Shard over its size share drops its oldest entries. Negative
+    // entries may take only a quarter of it, so flood of queries for random names doesn't push out the rest.
+    // Negative response doesn't replace positive entry not expired yet: it's freed and false is returned.
+    bool set(uint16_t type, std::string const& name, DNS_Response* r);
+    bool erase(uint16_t type, std::string const& name);
+    void clear();
+    
+    unsigned int size();
+    unsigned int negative_size();
+    unsigned int max_size() const { return max_size_; }
+    
+    // true if cached answers of name contain the address; no allocation
+    bool resolves_to(std::string const& name, AddressKey const& k);
+    // names with cached answers containing the address
+    std::vector<std::string> names_of(AddressKey const& k);
+    // call fn(name) for names of the address until it returns true; returns true if it did. Address shard
+    // is locked meanwhile, keep fn short.
+    template <class F>
+    bool find_name_of(AddressKey const& k, F fn) {
+        address_shard& ash = address_shard_of(k);
+        std::lock_guard<std::mutex> l(ash.lock);
+        
+        auto it = ash.names.find(k);
+        if(it != ash.names.end()) {
+            for(auto const& n: it->second) {
+                if(fn(n)) return true;
+            }
+        }
+        return false;
+    }
+    unsigned int addresses();
+    const char* name() const { return name_.c_str(); }
+    
+    // call fn(type, name, entry) for all entries; shards are locked one after another
+    template <class F>
+    void for_each(F fn) {
+        for(auto& sh: shards_) {
+            std::lock_guard<std::mutex> l(sh.lock);
+            for(auto const& n: sh.names) {
+                for(auto const& e: n.second) {
+                    fn(e.first,n.first,e.second);
+                }
+            }
+        }
+    }
+    
+private:
+    struct shard {
+        std::mutex lock;
+        // name -> entries of record types; typically A and AAAA
+        std::unordered_map<std::string,std::vector<std::pair<uint16_t,entry_ptr>>> names;
+        // insertion order, for eviction, separate for negative entries. May refer to entries erased already.
+        std::deque<std::pair<uint16_t,std::string>> order;
+        std::deque<std::pair<uint16_t,std::string>> negative_order;
+        unsigned int entries = 0;
+        unsigned int negative_entries = 0;
+    };
+    
+    struct address_hash {
+        size_t operator()(AddressKey const& k) const;
+    };
+    struct address_equal {
+        bool operator()(AddressKey const& a, AddressKey const& b) const { 
+            return a.proto == b.proto && memcmp(a.addr,b.addr,16) == 0; 
+        }
+    };
+    struct address_shard {
+        std::mutex lock;
+        std::unordered_map<AddressKey,std::vector<std::string>,address_hash,address_equal> names;
+    };
+    
+    std::string name_;
+    unsigned int max_size_;
+    shard shards_[SHARDS];
+    address_shard address_shards_[SHARDS];
+    
+    shard& shard_of(std::string const& name) { return shards_[std::hash<std::string>()(name) % SHARDS]; }
+    address_shard& address_shard_of(AddressKey const& k) { return address_shards_[address_hash()(k) % SHARDS]; }
+    bool remove(shard& sh, uint16_t type, std::string const& name);
+    // remove oldest positive or negative entry of shard
+    void evict(shard& sh, bool negative);
+    // add or remove addresses of entry to/from reverse index. Called with entry's shard locked.
+    void index(entry_ptr const& r, uint16_t type, std::string const& name, bool add);
+};
+
+typedef DnsCache dns_cache;
 
 extern dns_cache inspect_dns_cache;
 extern std::unordered_map<std::string,ptr_cache<std::string,DNS_Response>*> inspect_per_ip_dns_cache;
@@ -0,0 +1,172 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cctype>
+
+#include <dnsparser.hpp>
+
+#define DNSPARSER_HEADER_SZ 12
+
+static inline uint16_t dnsparser_u16(const unsigned char* p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t dnsparser_u32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+int DnsWireParser::parse(const unsigned char* data, unsigned int len) {
+
+    data_ = data;
+    len_ = len;
+    length_ = 0;
+    records_ = 0;
+    truncated_ = false;
+
+    if(len < DNSPARSER_HEADER_SZ) {
+        return DNS_PARSE_ERROR;
+    }
+    // message can't be longer (TCP length prefix is 16 bit), offsets fit into 16 bits
+    if(len > 0xffff) {
+        len = 0xffff;
+        len_ = len;
+    }
+
+    id_ = dnsparser_u16(data);
+    flags_ = dnsparser_u16(data + 2);
+    for(int s = 0; s < SECTIONS; s++) {
+        counts_[s] = dnsparser_u16(data + 4 + 2*s);
+    }
+
+    unsigned int i = DNSPARSER_HEADER_SZ;
+
+    for(int s = 0; s < SECTIONS; s++) {
+        for(unsigned int n = 0; n < counts_[s]; n++) {
+
+            int end = walk_name(data,len,i,[](const unsigned char*, unsigned int) {});
+            if(end < 0) {
+                return DNS_PARSE_ERROR;
+            }
+
+            record r;
+            r.section = s;
+            r.name = i;
+            i = end;
+
+            if(i + 4 > len) {
+                return DNS_PARSE_ERROR;
+            }
+            r.type = dnsparser_u16(data + i);
+            r.rclass = dnsparser_u16(data + i + 2);
+            r.ttl = 0;
+            r.ttl_offset = 0;
+            r.rdata = 0;
+            r.rdlength = 0;
+            i += 4;
+
+            if(s != SECTION_QUESTION) {
+                if(i + 6 > len) {
+                    return DNS_PARSE_ERROR;
+                }
+                r.ttl_offset = i;
+                r.ttl = dnsparser_u32(data + i);
+                r.rdlength = dnsparser_u16(data + i + 4);
+                i += 6;
+
+                if(i + r.rdlength > len) {
+                    return DNS_PARSE_ERROR;
+                }
+                r.rdata = i;
+                i += r.rdlength;
+            }
+
+            if(records_ < max_records) {
+                record_[records_++] = r;
+            } else {
+                truncated_ = true;
+            }
+        }
+    }
+
+    length_ = i;
+    return DNS_PARSE_OK;
+}
+
+unsigned int DnsWireParser::addresses() const {
+    unsigned int ret = 0;
+    for(unsigned int i = 0; i < records_; i++) {
+        record const& r = record_[i];
+        if(r.section == SECTION_ANSWER && ((r.type == 1 && r.rdlength == 4) || (r.type == 28 && r.rdlength == 16))) {
+            ret++;
+        }
+    }
+    return ret;
+}
+
+bool DnsWireParser::soa_minimum(record const& r, uint32_t& minimum) const {
+    // SOA type
+    if(r.section == SECTION_QUESTION || r.type != 6) {
+        return false;
+    }
+
+    // MNAME and RNAME, then serial, refresh, retry, expire and minimum. Names may point back into message,
+    // but can't go past record data.
+    unsigned int end = r.rdata + r.rdlength;
+    int i = walk_name(data_,end,r.rdata,[](const unsigned char*, unsigned int) {});
+    if(i < 0) return false;
+    i = walk_name(data_,end,i,[](const unsigned char*, unsigned int) {});
+    if(i < 0 || i + 20 > (int)end) return false;
+
+    minimum = dnsparser_u32(data_ + i + 16);
+    return true;
+}
+
+std::string DnsWireParser::name(unsigned int offset) const {
+    std::string ret;
+    walk_name(data_,len_,offset,[&ret](const unsigned char* label, unsigned int l) {
+        if(ret.size() > 0) ret += '.';
+        ret.append((const char*)label,l);
+    });
+    return ret;
+}
+
+bool DnsWireParser::name_equals(unsigned int offset, const char* dotted, unsigned int len) const {
+
+    if(len > 0 && dotted[len-1] == '.') {
+        len--;
+    }
+
+    unsigned int pos = 0;
+    bool ok = true;
+    int end = walk_name(data_,len_,offset,[&](const unsigned char* label, unsigned int l) {
+        if(! ok) return;
+        if(pos > 0) {
+            if(pos >= len || dotted[pos] != '.') { ok = false; return; }
+            pos++;
+        }
+        if(pos + l > len) { ok = false; return; }
+        for(unsigned int k = 0; k < l; k++) {
+            if(tolower(label[k]) != tolower((unsigned char)dotted[pos+k])) { ok = false; return; }
+        }
+        pos += l;
+    });
+
+    return end >= 0 && ok && pos == len;
+}
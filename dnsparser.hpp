@@ -0,0 +1,131 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef DNSPARSER_HPP
+ #define DNSPARSER_HPP
+
+#include <string>
+#include <cstdint>
+
+//
+// DNS message parser working in place: header and records are read into fixed structure with offsets
+// into the message, nothing is copied nor allocated. Names are left in wire format, possibly compressed;
+// they are decompressed only when asked for.
+//
+// Every name is validated when message is parsed. Compression pointer must point before itself and
+// decompressed name can't exceed 255 bytes, so following pointers always terminates.
+//
+class DnsWireParser {
+public:
+    enum { DNS_PARSE_OK=0, DNS_PARSE_ERROR };
+    enum { SECTION_QUESTION=0, SECTION_ANSWER, SECTION_AUTHORITY, SECTION_ADDITIONAL, SECTIONS };
+
+    // records over this number are validated, but not kept
+    static const unsigned int max_records = 64;
+
+    // filled by parse(), not initialized otherwise
+    struct record {
+        uint8_t  section;
+        uint16_t name;          // offset of owner name
+        uint16_t type;
+        uint16_t rclass;
+        uint32_t ttl;
+        uint16_t ttl_offset;    // offset of TTL field, 0 in question section
+        uint16_t rdata;         // offset of record data
+        uint16_t rdlength;
+    };
+
+    // parse message at the beginning of data; length() is message size when parsed OK
+    int parse(const unsigned char* data, unsigned int len);
+    unsigned int length() const { return length_; }
+
+    uint16_t id() const { return id_; }
+    uint16_t flags() const { return flags_; }
+    int rcode() const { return flags_ & 0x000f; }
+    bool response() const { return (flags_ & 0x8000) != 0; }
+    uint16_t count(int section) const { return counts_[section]; }
+
+    unsigned int records() const { return records_; }
+    record const& at(unsigned int i) const { return record_[i]; }
+    // true if not all records fit into the parser
+    bool truncated() const { return truncated_; }
+
+    // A and AAAA records in answer section
+    unsigned int addresses() const;
+    // MINIMUM field of SOA record; false if record is not SOA or its data is malformed
+    bool soa_minimum(record const& r, uint32_t& minimum) const;
+
+    // decompressed name at offset, in dotted notation without trailing dot. Message must be parsed already.
+    std::string name(unsigned int offset) const;
+    // compare name at offset with dotted name, case-insensitively; doesn't allocate
+    bool name_equals(unsigned int offset, const char* dotted, unsigned int len) const;
+
+    // call fn(label, length) for each label of name at offset, following compression pointers.
+    // Returns offset after the name in place, or -1 if name is malformed.
+    template <class F>
+    static int walk_name(const unsigned char* data, unsigned int len, unsigned int offset, F fn) {
+        int end = -1;
+        unsigned int total = 0;
+        unsigned int i = offset;
+
+        while(true) {
+            if(i >= len) return -1;
+            uint8_t l = data[i];
+
+            if(l == 0) {
+                if(end < 0) end = i + 1;
+                return end;
+            }
+            if((l & 0xC0) == 0xC0) {
+                if(i + 1 >= len) return -1;
+                unsigned int target = ((l & 0x3F) << 8) | data[i+1];
+                // backward only; cycle through labels is stopped by name length limit
+                if(target >= i) return -1;
+                if(end < 0) end = i + 2;
+                i = target;
+                continue;
+            }
+            if(l & 0xC0) {
+                // extended label types are not used
+                return -1;
+            }
+            if(i + 1 + l > len) return -1;
+            total += l + 1;
+            if(total > 255) return -1;
+
+            fn(data + i + 1, l);
+            i += l + 1;
+        }
+    }
+
+private:
+    const unsigned char* data_ = nullptr;
+    unsigned int len_ = 0;
+    unsigned int length_ = 0;
+
+    uint16_t id_ = 0;
+    uint16_t flags_ = 0;
+    uint16_t counts_[SECTIONS] = {0,0,0,0};
+
+    record record_[max_records];
+    unsigned int records_ = 0;
+    bool truncated_ = false;
+};
+
+#endif
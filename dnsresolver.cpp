@@ -0,0 +1,474 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstring>
+#include <condition_variable>
+#include <memory>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/rand.h>
+
+#include <logger.hpp>
+#include <dnsresolver.hpp>
+
+DnsResolver dns_resolver("DNS resolver - global");
+
+
+bool DnsResolver::parse_server(std::string const& str, server& s) {
+
+    std::string host = str;
+    unsigned short port = 53;
+
+    // [v6]:port, v4:port, or just address
+    if(str.size() > 0 && str[0] == '[') {
+        std::string::size_type e = str.find(']');
+        if(e == std::string::npos) return false;
+        host = str.substr(1,e-1);
+        if(e + 1 < str.size()) {
+            if(str[e+1] != ':') return false;
+            port = (unsigned short)atoi(str.c_str() + e + 2);
+        }
+    }
+    else {
+        std::string::size_type c = str.find(':');
+        if(c != std::string::npos && str.find(':',c+1) == std::string::npos) {
+            host = str.substr(0,c);
+            port = (unsigned short)atoi(str.c_str() + c + 1);
+        }
+    }
+    if(port == 0) return false;
+
+    memset(&s.addr,0,sizeof(s.addr));
+    sockaddr_in* a4 = (sockaddr_in*)&s.addr;
+    sockaddr_in6* a6 = (sockaddr_in6*)&s.addr;
+
+    if(inet_pton(AF_INET,host.c_str(),&a4->sin_addr) == 1) {
+        a4->sin_family = AF_INET;
+        a4->sin_port = htons(port);
+        s.len = sizeof(sockaddr_in);
+    }
+    else if(inet_pton(AF_INET6,host.c_str(),&a6->sin6_addr) == 1) {
+        a6->sin6_family = AF_INET6;
+        a6->sin6_port = htons(port);
+        s.len = sizeof(sockaddr_in6);
+    }
+    else {
+        return false;
+    }
+
+    s.str = str;
+    return true;
+}
+
+bool DnsResolver::same_address(server const& s, sockaddr_storage const& from) {
+    if(s.addr.ss_family != from.ss_family) {
+        return false;
+    }
+    if(from.ss_family == AF_INET) {
+        sockaddr_in const* a = (sockaddr_in const*)&s.addr;
+        sockaddr_in const* b = (sockaddr_in const*)&from;
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+    sockaddr_in6 const* a = (sockaddr_in6 const*)&s.addr;
+    sockaddr_in6 const* b = (sockaddr_in6 const*)&from;
+    return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr,&b->sin6_addr,sizeof(in6_addr)) == 0;
+}
+
+void DnsResolver::nameservers(std::vector<std::string> const& ns) {
+    std::vector<server> parsed;
+    for(auto const& str: ns) {
+        server s;
+        if(parse_server(str,s)) {
+            parsed.push_back(s);
+        } else {
+            ERR_("DnsResolver: invalid nameserver '%s'",str.c_str());
+        }
+    }
+
+    std::lock_guard<std::mutex> l(lock_);
+    servers_ = parsed;
+}
+
+bool DnsResolver::query(std::string const& name, DNS_Record_Type t, callback_t cb, std::string const& nameserver) {
+
+    request r;
+    r.name = name;
+    r.type = t;
+    r.cb = cb;
+    if(nameserver.size() > 0) {
+        if(! parse_server(nameserver,r.ns)) {
+            ERR_("DnsResolver::query: %s:%s: invalid nameserver '%s'",dns_record_type_str(t),name.c_str(),nameserver.c_str());
+            return false;
+        }
+        r.fixed = true;
+    }
+
+    std::lock_guard<std::mutex> l(lock_);
+    if(stopping_) {
+        return false;
+    }
+
+    if(thread_ == nullptr) {
+        epoll_ = ::epoll_create1(EPOLL_CLOEXEC);
+        wake_ = ::eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+        if(epoll_ < 0 || wake_ < 0) {
+            ERR_("DnsResolver::query: cannot start resolver: %s",strerror(errno));
+            if(epoll_ >= 0) ::close(epoll_);
+            if(wake_ >= 0) ::close(wake_);
+            epoll_ = wake_ = -1;
+            return false;
+        }
+
+        struct epoll_event ev;
+        memset(&ev,0,sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = -1;
+        ::epoll_ctl(epoll_,EPOLL_CTL_ADD,wake_,&ev);
+
+        thread_ = new std::thread([this]() { run(); });
+    }
+
+    queued_.push_back(r);
+    stat_queries++;
+
+    uint64_t one = 1;
+    if(::write(wake_,&one,sizeof(one)) < 0) {
+        DIA_("DnsResolver::query: wake: %s",strerror(errno));
+    }
+
+    return true;
+}
+
+DNS_Response* DnsResolver::resolve(std::string const& name, DNS_Record_Type t, std::string const& nameserver) {
+
+    struct result {
+        std::mutex lock;
+        std::condition_variable cv;
+        bool done = false;
+        DNS_Response* resp = nullptr;
+    };
+    auto res = std::make_shared<result>();
+
+    bool queued = query(name,t,[res](DNS_Response* resp) {
+        std::lock_guard<std::mutex> l(res->lock);
+        res->resp = resp;
+        res->done = true;
+        res->cv.notify_all();
+    },nameserver);
+
+    if(! queued) {
+        return nullptr;
+    }
+
+    // callback comes always, at latest when resolver is stopped
+    std::unique_lock<std::mutex> l(res->lock);
+    res->cv.wait(l,[&res]() { return res->done; });
+
+    return res->resp;
+}
+
+void DnsResolver::stop() {
+    std::thread* t = nullptr;
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        stopping_ = true;
+        t = thread_;
+        thread_ = nullptr;
+
+        if(t != nullptr) {
+            uint64_t one = 1;
+            if(::write(wake_,&one,sizeof(one)) < 0) {
+                DIA_("DnsResolver::stop: wake: %s",strerror(errno));
+            }
+        }
+    }
+
+    if(t != nullptr) {
+        t->join();
+        delete t;
+    }
+
+    for(auto const& s: sockets_) {
+        ::close(s.fd);
+    }
+    sockets_.clear();
+    if(epoll_ >= 0) ::close(epoll_);
+    if(wake_ >= 0) ::close(wake_);
+    epoll_ = wake_ = -1;
+}
+
+unsigned int DnsResolver::pending() {
+    std::lock_guard<std::mutex> l(lock_);
+    return queued_.size() + pending_count_;
+}
+
+
+int DnsResolver::socket_for(int family, unsigned int& index) {
+
+    unsigned int n = 0;
+    for(auto const& s: sockets_) {
+        if(s.family == family) n++;
+    }
+
+    // few sockets per family, each with its own source port; queries are spread over them
+    if(n < SOCKETS) {
+        int fd = ::socket(family,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,IPPROTO_UDP);
+        if(fd >= 0) {
+            udp_socket s;
+            s.fd = fd;
+            s.family = family;
+            sockets_.push_back(s);
+            index = sockets_.size() - 1;
+
+            struct epoll_event ev;
+            memset(&ev,0,sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.fd = index;
+            ::epoll_ctl(epoll_,EPOLL_CTL_ADD,fd,&ev);
+
+            return fd;
+        }
+        ERR_("DnsResolver: cannot create socket: %s",strerror(errno));
+        if(n == 0) {
+            return -1;
+        }
+    }
+
+    for(unsigned int i = 0; i < sockets_.size(); i++) {
+        unsigned int c = (next_socket_ + i) % sockets_.size();
+        if(sockets_[c].family == family) {
+            next_socket_ = c + 1;
+            index = c;
+            return sockets_[c].fd;
+        }
+    }
+    return -1;
+}
+
+bool DnsResolver::send(request& r) {
+
+    while(r.attempt < attempts) {
+        r.attempt++;
+
+        if(! r.fixed) {
+            std::lock_guard<std::mutex> l(lock_);
+            if(servers_.size() > 0) {
+                // first attempts are spread over nameservers, retries go to the one after
+                r.server_index = (r.attempt == 1) ? next_server_++ : r.server_index + 1;
+                r.ns = servers_[r.server_index % servers_.size()];
+            } else {
+                parse_server("8.8.8.8",r.ns);
+            }
+        }
+
+        unsigned int index = 0;
+        int fd = socket_for(r.ns.addr.ss_family,index);
+        if(fd < 0) {
+            continue;
+        }
+
+        // random ID, not used by other query on this socket
+        uint32_t key = 0;
+        uint16_t id = 0;
+        for(int i = 0; i < 16; i++) {
+            unsigned char rand_pool[2];
+            RAND_pseudo_bytes(rand_pool,2);
+            id = (rand_pool[0] << 8) | rand_pool[1];
+            key = (index << 16) | id;
+            if(pending_.find(key) == pending_.end()) break;
+        }
+        if(pending_.find(key) != pending_.end()) {
+            continue;
+        }
+
+        buffer b(0);
+        if(generate_dns_request(id,b,r.name,r.type) < 0) {
+            return false;
+        }
+
+        if(::sendto(fd,b.data(),b.size(),0,(sockaddr*)&r.ns.addr,r.ns.len) < 0) {
+            DIA_("DnsResolver::send: %s:%s to %s: %s",dns_record_type_str(r.type),r.name.c_str(),r.ns.str.c_str(),strerror(errno));
+            continue;
+        }
+        stat_sent++;
+        DEB_("DnsResolver::send: %s:%s to %s, id 0x%x, attempt %d",dns_record_type_str(r.type),r.name.c_str(),r.ns.str.c_str(),id,r.attempt);
+
+        r.seq = ++seq_;
+        deadlines_.push(std::make_pair(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout),std::make_pair(key,r.seq)));
+        pending_[key] = r;
+        pending_count_ = pending_.size();
+
+        return true;
+    }
+
+    return false;
+}
+
+void DnsResolver::finish(request& r, DNS_Response* resp) {
+    if(resp == nullptr) {
+        stat_failed++;
+        DIA_("DnsResolver: %s:%s: no answer after %d attempts",dns_record_type_str(r.type),r.name.c_str(),r.attempt);
+    }
+    if(r.cb) {
+        r.cb(resp);
+    } else if(resp != nullptr) {
+        delete resp;
+    }
+}
+
+void DnsResolver::receive(unsigned int index) {
+
+    unsigned char data[1500];
+
+    // drain the socket, but don't let it starve the others
+    for(int n = 0; n < 64; n++) {
+        sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        int l = ::recvfrom(sockets_[index].fd,data,sizeof(data),0,(sockaddr*)&from,&from_len);
+        if(l <= 0) {
+            break;
+        }
+
+        DnsWireParser wire;
+        if(wire.parse(data,l) != DnsWireParser::DNS_PARSE_OK || ! wire.response()) {
+            stat_mismatched++;
+            continue;
+        }
+
+        uint32_t key = (index << 16) | wire.id();
+        auto it = pending_.find(key);
+        if(it == pending_.end()) {
+            stat_mismatched++;
+            continue;
+        }
+        request& r = it->second;
+
+        // must come from the nameserver we asked, and answer our question
+        bool match = same_address(r.ns,from) && wire.count(DnsWireParser::SECTION_QUESTION) == 1 && wire.records() > 0;
+        if(match) {
+            DnsWireParser::record const& q = wire.at(0);
+            match = (q.type == r.type && wire.name_equals(q.name,r.name.c_str(),r.name.size()));
+        }
+        if(! match) {
+            DIA_("DnsResolver: response id 0x%x doesn't match query %s:%s",wire.id(),dns_record_type_str(r.type),r.name.c_str());
+            stat_mismatched++;
+            continue;
+        }
+
+        DNS_Response* resp = new DNS_Response();
+        resp->load(wire,data);
+        stat_answered++;
+
+        request done = r;
+        pending_.erase(it);
+        pending_count_ = pending_.size();
+
+        finish(done,resp);
+    }
+}
+
+void DnsResolver::expire() {
+
+    auto now = std::chrono::steady_clock::now();
+
+    while(! deadlines_.empty() && deadlines_.top().first <= now) {
+        uint32_t key = deadlines_.top().second.first;
+        unsigned long seq = deadlines_.top().second.second;
+        deadlines_.pop();
+
+        auto it = pending_.find(key);
+        if(it == pending_.end() || it->second.seq != seq) {
+            continue;
+        }
+
+        request r = it->second;
+        pending_.erase(it);
+        pending_count_ = pending_.size();
+
+        DIA_("DnsResolver: %s:%s: timeout waiting for %s",dns_record_type_str(r.type),r.name.c_str(),r.ns.str.c_str());
+        if(! send(r)) {
+            finish(r,nullptr);
+        }
+    }
+}
+
+void DnsResolver::run() {
+
+    while(true) {
+        int wait = -1;
+        if(! deadlines_.empty()) {
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadlines_.top().first - std::chrono::steady_clock::now()).count();
+            wait = (ms > 0) ? ms + 1 : 0;
+        }
+
+        struct epoll_event events[16];
+        int n = ::epoll_wait(epoll_,events,16,wait);
+
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.fd < 0) {
+                uint64_t c;
+                if(::read(wake_,&c,sizeof(c)) < 0 && errno != EAGAIN) {
+                    DIA_("DnsResolver: wake read: %s",strerror(errno));
+                }
+                continue;
+            }
+            receive(events[i].data.fd);
+        }
+
+        std::deque<request> q;
+        bool stopping = false;
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            stopping = stopping_;
+            if(stopping) {
+                q.swap(queued_);
+            }
+            // queued requests left are taken when answers or timeouts make room
+            while(! queued_.empty() && pending_.size() + q.size() < max_outstanding) {
+                q.push_back(queued_.front());
+                queued_.pop_front();
+            }
+        }
+
+        if(stopping) {
+            for(auto& r: q) {
+                finish(r,nullptr);
+            }
+            for(auto& p: pending_) {
+                finish(p.second,nullptr);
+            }
+            pending_.clear();
+            pending_count_ = 0;
+            break;
+        }
+
+        for(auto& r: q) {
+            if(! send(r)) {
+                finish(r,nullptr);
+            }
+        }
+
+        expire();
+    }
+}
@@ -0,0 +1,142 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef DNSRESOLVER_HPP
+ #define DNSRESOLVER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+
+#include <sys/socket.h>
+
+#include <dns.hpp>
+
+//
+// Asynchronous DNS resolver. Queries from any thread are sent by resolver's own thread over a few UDP
+// sockets, and answers are matched by socket, ID, nameserver address and question. Query not answered
+// in time is sent again with new ID, to the next nameserver, until attempts are exhausted.
+//
+// Callback is called from resolver thread exactly once per query: with the response, which callback
+// then owns, or with nullptr if no usable answer came. Keep it short and don't wait for resolver in it.
+//
+class DnsResolver {
+public:
+    typedef std::function<void(DNS_Response*)> callback_t;
+    enum { SOCKETS=4 };
+
+    explicit DnsResolver(const char* name) : name_(name) {};
+    virtual ~DnsResolver() { stop(); };
+
+    // "address", "address:port", or "[address]:port" for IPv6. Queries rotate over them, 8.8.8.8 is used if none.
+    void nameservers(std::vector<std::string> const& ns);
+
+    // queue the query, resolver thread is started with the first one. Nameserver, if set, is used instead
+    // of configured ones. Returns false (and callback is not called) if query can't be queued.
+    bool query(std::string const& name, DNS_Record_Type t, callback_t cb, std::string const& nameserver="");
+    // query and wait for the answer
+    DNS_Response* resolve(std::string const& name, DNS_Record_Type t, std::string const& nameserver="");
+
+    // fail outstanding queries and stop resolver thread
+    void stop();
+
+    const char* name() const { return name_.c_str(); }
+    unsigned int pending();
+
+    // per attempt, msec
+    unsigned int timeout = 1000;
+    unsigned int attempts = 3;
+    // queries over this number wait in queue, so bursts don't overflow socket buffers
+    unsigned int max_outstanding = 512;
+
+    std::atomic<unsigned long> stat_queries {0};
+    std::atomic<unsigned long> stat_sent {0};       // including retries
+    std::atomic<unsigned long> stat_answered {0};
+    std::atomic<unsigned long> stat_failed {0};     // all attempts timed out, or couldn't be sent
+    std::atomic<unsigned long> stat_mismatched {0}; // responses not matching any query
+
+private:
+    struct server {
+        sockaddr_storage addr;
+        socklen_t len = 0;
+        std::string str;
+    };
+
+    struct request {
+        std::string name;
+        DNS_Record_Type type;
+        callback_t cb;
+        bool fixed = false;     // explicit nameserver, no rotation
+        server ns;              // nameserver of current attempt
+        unsigned int server_index = 0;
+        unsigned int attempt = 0;
+        unsigned long seq = 0;
+    };
+
+    typedef std::chrono::steady_clock::time_point time_point;
+    // (deadline, (pending key, sequence)) - entries of answered requests are skipped when they come up
+    typedef std::pair<time_point,std::pair<uint32_t,unsigned long>> deadline;
+
+    std::string name_;
+
+    // guards everything submitted from other threads
+    std::mutex lock_;
+    std::vector<server> servers_;
+    std::deque<request> queued_;
+    std::thread* thread_ = nullptr;
+    bool stopping_ = false;
+    int epoll_ = -1;
+    int wake_ = -1;
+
+    // resolver thread only
+    struct udp_socket {
+        int fd;
+        int family;
+    };
+    std::vector<udp_socket> sockets_;
+    unsigned int next_socket_ = 0;
+    unsigned int next_server_ = 0;
+    unsigned long seq_ = 0;
+    // key is socket index and query ID
+    std::unordered_map<uint32_t,request> pending_;
+    std::priority_queue<deadline,std::vector<deadline>,std::greater<deadline>> deadlines_;
+    std::atomic<unsigned int> pending_count_ {0};
+
+    static bool parse_server(std::string const& str, server& s);
+    static bool same_address(server const& s, sockaddr_storage const& from);
+
+    void run();
+    // send request as its next attempt; false when there is no attempt left or it can't be sent
+    bool send(request& r);
+    void receive(unsigned int index);
+    void expire();
+    void finish(request& r, DNS_Response* resp);
+    int socket_for(int family, unsigned int& index);
+};
+
+extern DnsResolver dns_resolver;
+
+#endif
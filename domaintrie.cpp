@@ -0,0 +1,229 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cctype>
+
+#include <domaintrie.hpp>
+
+
+static inline bool domaintrie_is_label_char(char c) {
+    return isalnum((unsigned char)c) || c == '-' || c == '_';
+}
+
+// compare label (any case) with lowercase node label
+static int domaintrie_compare(const char* label, unsigned int len, std::string const& node_label) {
+    unsigned int n = (len < node_label.size()) ? len : node_label.size();
+    for(unsigned int i = 0; i < n; i++) {
+        int a = tolower((unsigned char)label[i]);
+        int b = (unsigned char)node_label[i];
+        if(a != b) {
+            return a < b ? -1 : 1;
+        }
+    }
+    if(len == node_label.size()) return 0;
+    return len < node_label.size() ? -1 : 1;
+}
+
+
+void DomainTrie::clear() {
+    nodes_.clear();
+    domains_.clear();
+    // root
+    nodes_.push_back(node());
+}
+
+int DomainTrie::child(int n, const char* label, unsigned int len) const {
+    std::vector<int> const& ch = nodes_[n].children;
+
+    unsigned int lo = 0;
+    unsigned int hi = ch.size();
+    while(lo < hi) {
+        unsigned int mid = (lo + hi)/2;
+        int c = domaintrie_compare(label,len,nodes_[ch[mid]].label);
+        if(c == 0) {
+            return ch[mid];
+        }
+        if(c < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
+
+int DomainTrie::child_add(int n, std::string const& label) {
+    int c = child(n,label.c_str(),label.size());
+    if(c >= 0) {
+        return c;
+    }
+
+    node x;
+    x.label = label;
+    nodes_.push_back(x);
+    c = nodes_.size() - 1;
+
+    std::vector<int>& ch = nodes_[n].children;
+    unsigned int i = 0;
+    while(i < ch.size() && domaintrie_compare(label.c_str(),label.size(),nodes_[ch[i]].label) > 0) i++;
+    ch.insert(ch.begin() + i,c);
+
+    return c;
+}
+
+bool DomainTrie::add(std::string const& domain, bool subdomains) {
+
+    std::string d;
+    for(char c: domain) {
+        d += tolower((unsigned char)c);
+    }
+
+    bool wildcard = false;
+    if(d.size() >= 2 && d[0] == '*' && d[1] == '.') {
+        wildcard = true;
+        d = d.substr(2);
+    }
+    if(! d.empty() && d[d.size()-1] == '.') {
+        d.resize(d.size()-1);
+    }
+    if(d.empty()) {
+        return false;
+    }
+
+    // validate first, so bad domain leaves no nodes behind
+    unsigned int label_len = 0;
+    for(char c: d) {
+        if(c == '.') {
+            if(label_len == 0) return false;
+            label_len = 0;
+        }
+        else if(domaintrie_is_label_char(c)) {
+            label_len++;
+        }
+        else {
+            return false;
+        }
+    }
+    if(label_len == 0) {
+        return false;
+    }
+
+    int index = domains_.size();
+    domains_.push_back(domain);
+
+    int n = 0;
+    unsigned int e = d.size();
+    while(true) {
+        std::string::size_type b = d.rfind('.',e-1);
+        unsigned int from = (b == std::string::npos) ? 0 : b + 1;
+        n = child_add(n,d.substr(from,e-from));
+
+        if(b == std::string::npos) break;
+        e = b;
+    }
+
+    if(! wildcard && nodes_[n].exact < 0) {
+        nodes_[n].exact = index;
+    }
+    if((wildcard || subdomains) && nodes_[n].under < 0) {
+        nodes_[n].under = index;
+    }
+
+    return true;
+}
+
+int DomainTrie::match(const char* name, unsigned int len) const {
+
+    if(len > 0 && name[len-1] == '.') {
+        len--;
+    }
+    if(len == 0) {
+        return -1;
+    }
+
+    int n = 0;
+    unsigned int e = len;
+    while(true) {
+        unsigned int b = e;
+        while(b > 0 && name[b-1] != '.') b--;
+
+        if(b == e) {
+            // empty label
+            return -1;
+        }
+
+        n = child(n,name + b,e - b);
+        if(n < 0) {
+            return -1;
+        }
+
+        // all labels consumed
+        if(b == 0) {
+            return nodes_[n].exact;
+        }
+        if(nodes_[n].under >= 0) {
+            return nodes_[n].under;
+        }
+
+        e = b - 1;
+    }
+}
+
+std::string DomainTrie::from_filter(std::string const& entry, bool& subdomains_only) {
+
+    subdomains_only = false;
+
+    unsigned int b = 0;
+    unsigned int e = entry.size();
+    if(b < e && entry[b] == '^') b++;
+    if(e > b && entry[e-1] == '$') e--;
+
+    // literal domain at the end: labels, dots and escaped dots
+    std::string tail;
+    unsigned int i = e;
+    while(i > b) {
+        char c = entry[i-1];
+        if(c == '.') {
+            tail.insert(0,1,'.');
+            i--;
+            if(i > b && entry[i-1] == '\\') i--;
+        }
+        else if(domaintrie_is_label_char(c)) {
+            // escaped letter is character class (\d, \w, ...)
+            if(i-1 > b && entry[i-2] == '\\') break;
+            tail.insert(0,1,c);
+            i--;
+        }
+        else {
+            break;
+        }
+    }
+
+    if(i == b) {
+        return tail;
+    }
+
+    // something before "\.domain": names under domain
+    if(tail.size() > 1 && tail[0] == '.') {
+        subdomains_only = true;
+        return tail.substr(1);
+    }
+
+    return std::string();
+}
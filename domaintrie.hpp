@@ -0,0 +1,68 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef DOMAINTRIE_HPP
+ #define DOMAINTRIE_HPP
+
+#include <vector>
+#include <string>
+
+//
+// Trie of domain names by reversed labels ("www.example.com" is stored as com -> example -> www).
+// Domain matches the name itself, and optionally everything under it; "*.example.com" matches only
+// names under example.com. Lookup walks name's labels from the right, so it costs the same for any
+// number of domains stored. Labels are compared case-insensitively and lookup doesn't allocate.
+//
+class DomainTrie {
+public:
+    DomainTrie() { clear(); }
+
+    void clear();
+
+    // add domain; returns false if it's not usable domain name
+    bool add(std::string const& domain, bool subdomains);
+
+    // index of matching domain (in order they were added), or -1
+    int match(const char* name, unsigned int len) const;
+    int match(std::string const& name) const { return match(name.c_str(),name.size()); }
+
+    std::string const& domain(int index) const { return domains_.at(index); }
+    unsigned int size() const { return domains_.size(); }
+    unsigned int nodes() const { return nodes_.size(); }
+
+    // domain from SNI filter entry. Entries may be regular expressions: only literal domains and
+    // <expression>\.domain (anything under domain) are understood, empty string is returned otherwise.
+    static std::string from_filter(std::string const& entry, bool& subdomains_only);
+
+private:
+    struct node {
+        std::string label;
+        int exact = -1;         // domain ending in this node
+        int under = -1;         // domain whose subdomains are matched
+        // children sorted by label
+        std::vector<int> children;
+    };
+    std::vector<node> nodes_;
+    std::vector<std::string> domains_;
+
+    int child(int n, const char* label, unsigned int len) const;
+    int child_add(int n, std::string const& label);
+};
+
+#endif
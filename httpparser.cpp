@@ -0,0 +1,457 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
+
+#include <httpparser.hpp>
+
+
+unsigned int HttpHeadParser::max_head_bytes = 16384;
+
+static inline bool httpparser_is_space(unsigned char c) {
+    return c == ' ' || c == '\t';
+}
+
+
+bool HttpHeadParser::span::iequals(const unsigned char* data, const char* text) const {
+    return strlen(text) == size && strncasecmp((const char*)data + offset, text, size) == 0;
+}
+
+bool HttpHeadParser::span::icontains(const unsigned char* data, const char* text) const {
+    unsigned int n = strlen(text);
+    for(unsigned int i = 0; i + n <= size; i++) {
+        if(strncasecmp((const char*)data + offset + i, text, n) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void HttpHeadParser::reset() {
+    pos_ = 0;
+    status_ = HTTP_PARSE_MORE;
+    request_line_ = false;
+
+    method = span();
+    path = span();
+    query = span();
+    version = span();
+    code = span();
+    host = span();
+    referer = span();
+    content_length = span();
+    transfer_encoding = span();
+}
+
+// METHOD SP request-target SP HTTP-version
+bool HttpHeadParser::parse_request_line(const unsigned char* data, unsigned int b, unsigned int e) {
+
+    unsigned int i = b;
+    while(i < e && data[i] != ' ') i++;
+    if(i == b || i == e) {
+        return false;
+    }
+    method.offset = b;
+    method.size = i - b;
+
+    while(i < e && data[i] == ' ') i++;
+
+    unsigned int t = i;
+    while(i < e && data[i] != ' ' && data[i] != '?') i++;
+    if(i == t) {
+        return false;
+    }
+    path.offset = t;
+    path.size = i - t;
+
+    t = i;
+    while(i < e && data[i] != ' ') i++;
+    query.offset = t;
+    query.size = i - t;
+
+    while(i < e && data[i] == ' ') i++;
+    version.offset = i;
+    version.size = e - i;
+
+    return true;
+}
+
+// HTTP-version SP status-code SP reason-phrase
+bool HttpHeadParser::parse_status_line(const unsigned char* data, unsigned int b, unsigned int e) {
+
+    if(e - b < 5 || strncmp((const char*)data + b, "HTTP/", 5) != 0) {
+        return false;
+    }
+
+    unsigned int i = b;
+    while(i < e && data[i] != ' ') i++;
+    version.offset = b;
+    version.size = i - b;
+
+    while(i < e && data[i] == ' ') i++;
+
+    unsigned int c = i;
+    while(i < e && data[i] >= '0' && data[i] <= '9') i++;
+    if(i - c != 3) {
+        return false;
+    }
+    code.offset = c;
+    code.size = 3;
+
+    return true;
+}
+
+void HttpHeadParser::parse_header(const unsigned char* data, unsigned int b, unsigned int e) {
+
+    // obsolete line folding - continuation of previous header, not interesting for us
+    if(httpparser_is_space(data[b])) {
+        return;
+    }
+
+    const unsigned char* colon = (const unsigned char*)memchr(data + b, ':', e - b);
+    if(colon == nullptr) {
+        return;
+    }
+
+    span name;
+    name.offset = b;
+    name.size = colon - (data + b);
+
+    unsigned int v = colon - data + 1;
+    while(v < e && httpparser_is_space(data[v])) v++;
+    unsigned int ve = e;
+    while(ve > v && httpparser_is_space(data[ve-1])) ve--;
+
+    span* target = nullptr;
+    if(name.iequals(data,"host")) {
+        target = &host;
+    }
+    else if(name.iequals(data,"referer")) {
+        target = &referer;
+    }
+    else if(name.iequals(data,"content-length")) {
+        target = &content_length;
+    }
+    else if(name.iequals(data,"transfer-encoding")) {
+        target = &transfer_encoding;
+    }
+
+    // first occurrence wins
+    if(target != nullptr && target->empty()) {
+        target->offset = v;
+        target->size = ve - v;
+    }
+}
+
+int HttpHeadParser::parse(const unsigned char* data, unsigned int len) {
+
+    while(status_ == HTTP_PARSE_MORE) {
+
+        const unsigned char* nl = (pos_ < len) ? (const unsigned char*)memchr(data + pos_, '\n', len - pos_) : nullptr;
+        if(nl == nullptr) {
+            if(len > max_head_bytes) {
+                status_ = HTTP_PARSE_ERROR;
+            }
+            break;
+        }
+
+        unsigned int b = pos_;
+        unsigned int e = nl - data;
+        pos_ = e + 1;
+
+        if(e > b && data[e-1] == '\r') {
+            e--;
+        }
+
+        if(! request_line_) {
+            // empty lines before request line are allowed
+            if(e == b) {
+                continue;
+            }
+            if(! (response_ ? parse_status_line(data,b,e) : parse_request_line(data,b,e))) {
+                status_ = HTTP_PARSE_ERROR;
+                break;
+            }
+            request_line_ = true;
+            continue;
+        }
+
+        if(e == b) {
+            status_ = HTTP_PARSE_DONE;
+            break;
+        }
+
+        parse_header(data,b,e);
+
+        if(pos_ > max_head_bytes) {
+            status_ = HTTP_PARSE_ERROR;
+        }
+    }
+
+    return status_;
+}
+
+
+// longest chunk size or trailer line we accept
+#define HTTPTRACKER_MAX_LINE 1024
+
+unsigned int HttpTracker::pending_max = 16;
+
+void HttpTracker::stop() {
+    request_.state = STOPPED;
+    response_.state = STOPPED;
+    request_.head.clear();
+    response_.head.clear();
+    pending_.clear();
+}
+
+void HttpTracker::feed(stream& st, const unsigned char* data, unsigned int len) {
+
+    while(len > 0 && st.state != STOPPED) {
+        unsigned int used = 0;
+        bool complete = false;
+
+        switch(st.state) {
+            case HEAD:
+                used = feed_head(st,data,len);
+                break;
+
+            case BODY_LENGTH:
+            case CHUNK_DATA:
+                used = (st.remaining < len) ? st.remaining : len;
+                st.remaining -= used;
+                if(st.remaining == 0) {
+                    st.state = (st.state == BODY_LENGTH) ? HEAD : CHUNK_END;
+                }
+                break;
+
+            case CHUNK_SIZE:
+                used = feed_line(st,data,len,complete);
+                if(complete) {
+                    // chunk extensions after ';' are ignored
+                    char* end = nullptr;
+                    unsigned long long sz = strtoull(st.line.c_str(),&end,16);
+                    if(end == st.line.c_str()) {
+                        stop();
+                        break;
+                    }
+                    st.line.clear();
+                    st.remaining = sz;
+                    st.state = (sz > 0) ? CHUNK_DATA : TRAILER;
+                }
+                break;
+
+            case CHUNK_END:
+                // CRLF after chunk data
+                used = feed_line(st,data,len,complete);
+                if(complete) {
+                    st.line.clear();
+                    st.state = CHUNK_SIZE;
+                }
+                break;
+
+            case TRAILER:
+                used = feed_line(st,data,len,complete);
+                if(complete) {
+                    bool last = st.line.empty();
+                    st.line.clear();
+                    if(last) {
+                        st.state = HEAD;
+                    }
+                }
+                break;
+
+            case BODY_EOF:
+                used = len;
+                break;
+        }
+
+        st.position += used;
+        data += used;
+        len -= used;
+    }
+}
+
+// consume data up to end of line (included). Line without CRLF is kept in st.line.
+unsigned int HttpTracker::feed_line(stream& st, const unsigned char* data, unsigned int len, bool& complete) {
+
+    const unsigned char* nl = (const unsigned char*)memchr(data,'\n',len);
+    unsigned int used = (nl == nullptr) ? len : (nl - data + 1);
+
+    st.line.append((const char*)data, (nl == nullptr) ? len : (nl - data));
+    if(st.line.size() > HTTPTRACKER_MAX_LINE) {
+        stop();
+        return len;
+    }
+
+    complete = (nl != nullptr);
+    if(complete && st.line.size() > 0 && st.line[st.line.size()-1] == '\r') {
+        st.line.resize(st.line.size()-1);
+    }
+
+    return used;
+}
+
+// Head is parsed in place, if it's complete in received data. Otherwise it's collected in st.head.
+unsigned int HttpTracker::feed_head(stream& st, const unsigned char* data, unsigned int len) {
+
+    unsigned int carried = st.head.size();
+    const unsigned char* head = data;
+    unsigned int head_len = len;
+
+    if(carried > 0) {
+        st.head.append((const char*)data,len);
+        head = (const unsigned char*)st.head.data();
+        head_len = st.head.size();
+    }
+
+    int r = st.parser.parse(head,head_len);
+
+    if(r == HttpHeadParser::HTTP_PARSE_ERROR) {
+        stop();
+        return len;
+    }
+
+    if(r == HttpHeadParser::HTTP_PARSE_MORE) {
+        if(carried == 0) {
+            st.head.assign((const char*)data,len);
+        }
+        return len;
+    }
+
+    unsigned int used = st.parser.head_length() - carried;
+    on_head(st,head);
+
+    st.parser.reset();
+    st.head.clear();
+
+    return used;
+}
+
+void HttpTracker::on_head(stream& st, const unsigned char* head) {
+
+    HttpHeadParser& p = st.parser;
+
+    if(! p.response()) {
+        pending r;
+        r.seq = requests_++;
+        r.no_body = p.method.iequals(head,"HEAD");
+        r.tunnel = p.method.iequals(head,"CONNECT");
+
+        bool queued = pending_.size() < pending_max;
+        if(queued) {
+            pending_.push_back(r);
+        } else {
+            dropped_++;
+        }
+
+        if(on_request) {
+            on_request(r.seq,p,head);
+        }
+
+        // response to dropped request would be framed as if it had a body
+        if(! queued && (r.no_body || r.tunnel)) {
+            stop();
+        }
+        else if(! frame_body(st,head)) {
+            stop();
+        }
+        // bytes after CONNECT are not HTTP anymore
+        else if(r.tunnel) {
+            st.state = STOPPED;
+        }
+        return;
+    }
+
+    int code = atoi(p.code.str(head).c_str());
+
+    // interim response, final one follows
+    if(code >= 100 && code < 200) {
+        if(code == 101) {
+            // protocol switched
+            stop();
+        }
+        return;
+    }
+
+    pending r;
+    r.seq = responses_;
+    r.no_body = false;
+    r.tunnel = false;
+    // front is newer than this response if its request was dropped
+    if(! pending_.empty() && pending_.front().seq == responses_) {
+        r = pending_.front();
+        pending_.pop_front();
+    }
+    responses_++;
+
+    if(on_response) {
+        on_response(r.seq,code);
+    }
+
+    if(r.tunnel && code >= 200 && code < 300) {
+        stop();
+        return;
+    }
+
+    if(r.no_body || code == 204 || code == 304) {
+        st.state = HEAD;
+        return;
+    }
+
+    if(! frame_body(st,head)) {
+        stop();
+        return;
+    }
+
+    // no framing in response: body ends with connection
+    if(st.state == HEAD && p.content_length.empty()) {
+        st.state = BODY_EOF;
+    }
+}
+
+bool HttpTracker::frame_body(stream& st, const unsigned char* head) {
+
+    HttpHeadParser& p = st.parser;
+
+    if(! p.transfer_encoding.empty()) {
+        if(! p.transfer_encoding.icontains(head,"chunked")) {
+            return false;
+        }
+        st.state = CHUNK_SIZE;
+        return true;
+    }
+
+    if(! p.content_length.empty()) {
+        std::string cl = p.content_length.str(head);
+        char* end = nullptr;
+        unsigned long long n = strtoull(cl.c_str(),&end,10);
+        if(end == cl.c_str() || *end != 0) {
+            return false;
+        }
+        st.remaining = n;
+        st.state = (n > 0) ? BODY_LENGTH : HEAD;
+        return true;
+    }
+
+    st.state = HEAD;
+    return true;
+}
@@ -0,0 +1,160 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef HTTPPARSER_HPP
+ #define HTTPPARSER_HPP
+
+#include <string>
+#include <deque>
+#include <functional>
+
+//
+// Incremental tokenizer of HTTP/1.x message head (request or status line and headers). It doesn't copy anything:
+// parsed fields are spans (offset, size) into the data passed to parse().
+//
+// Data is the message received so far and it may only grow between calls (as flow buffer does),
+// so head split over several reads is parsed as it comes. Only complete lines are tokenized,
+// parsing resumes at the first unfinished line.
+//
+class HttpHeadParser {
+public:
+    enum { HTTP_PARSE_MORE=0, HTTP_PARSE_DONE, HTTP_PARSE_ERROR };
+
+    struct span {
+        unsigned int offset = 0;
+        unsigned int size = 0;
+
+        bool empty() const { return size == 0; }
+        std::string str(const unsigned char* data) const { return std::string((const char*)data + offset, size); }
+        bool iequals(const unsigned char* data, const char* text) const;
+        bool icontains(const unsigned char* data, const char* text) const;
+    };
+
+    // longer message head is not HTTP we want to inspect
+    static unsigned int max_head_bytes;
+
+    explicit HttpHeadParser(bool response=false) : response_(response) { reset(); }
+    void reset();
+
+    int parse(const unsigned char* data, unsigned int len);
+    int status() const { return status_; }
+    bool response() const { return response_; }
+    bool request_line() const { return request_line_; }
+    // size of message head including terminating empty line, valid when done
+    unsigned int head_length() const { return status_ == HTTP_PARSE_DONE ? pos_ : 0; }
+
+    // request line
+    span method;
+    span path;      // request target up to '?'
+    span query;     // rest of request target, including '?'
+    // request or status line
+    span version;
+    // status line
+    span code;
+
+    span host;
+    span referer;
+    span content_length;
+    span transfer_encoding;
+
+private:
+    bool response_;
+    unsigned int pos_;
+    int status_;
+    bool request_line_;
+
+    bool parse_request_line(const unsigned char* data, unsigned int b, unsigned int e);
+    bool parse_status_line(const unsigned char* data, unsigned int b, unsigned int e);
+    void parse_header(const unsigned char* data, unsigned int b, unsigned int e);
+};
+
+
+//
+// Follows request/response exchanges on persistent HTTP/1.x connection, including pipelined requests.
+// Message heads are tokenized; bodies are framed by Content-Length or chunked encoding and skipped,
+// so only head in progress is kept in memory. Requests and responses are paired in order.
+//
+// At most pending_max requests wait for their response. Requests pipelined beyond that are still
+// reported, but not queued and counted as dropped; their responses are paired by sequence number.
+// Dropped HEAD or CONNECT request stops tracking, as its response can't be framed.
+//
+// Tracking stops when connection leaves HTTP (CONNECT tunnel, protocol upgrade), when response body
+// is delimited by connection close, or when data are not parseable.
+//
+class HttpTracker {
+public:
+    // sequence number of request (from 0), parser with request head and head data
+    std::function<void(unsigned long, HttpHeadParser const&, const unsigned char*)> on_request;
+    // sequence number of request and response status code
+    std::function<void(unsigned long, int)> on_response;
+
+    HttpTracker() : request_(false), response_(true) {};
+
+    // requests waiting for response kept at most
+    static unsigned int pending_max;
+
+    // feed client and server data, in order they are seen in each direction
+    void request(const unsigned char* data, unsigned int len) { feed(request_,data,len); }
+    void response(const unsigned char* data, unsigned int len) { feed(response_,data,len); }
+
+    bool active() const { return request_.state != STOPPED || response_.state != STOPPED; }
+    unsigned long requests() const { return requests_; }
+    unsigned long responses() const { return responses_; }
+    // requests not queued because too many were waiting for response
+    unsigned long dropped() const { return dropped_; }
+    // bytes of request stream consumed so far
+    unsigned long long request_position() const { return request_.position; }
+
+private:
+    enum { HEAD=0, BODY_LENGTH, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILER, BODY_EOF, STOPPED };
+
+    struct stream {
+        explicit stream(bool response) : parser(response) {};
+
+        HttpHeadParser parser;
+        std::string head;       // unfinished head, carried over to next data
+        std::string line;       // unfinished chunk size or trailer line
+        int state = HEAD;
+        unsigned long long remaining = 0;
+        unsigned long long position = 0;
+    };
+
+    struct pending {
+        unsigned long seq;
+        bool no_body;       // HEAD request
+        bool tunnel;        // CONNECT request
+    };
+
+    stream request_;
+    stream response_;
+    std::deque<pending> pending_;
+    unsigned long requests_ = 0;
+    unsigned long responses_ = 0;
+    unsigned long dropped_ = 0;
+
+    void feed(stream& st, const unsigned char* data, unsigned int len);
+    unsigned int feed_head(stream& st, const unsigned char* data, unsigned int len);
+    unsigned int feed_line(stream& st, const unsigned char* data, unsigned int len, bool& complete);
+    void on_head(stream& st, const unsigned char* head);
+    // set body framing from head; returns false if body can't be framed
+    bool frame_body(stream& st, const unsigned char* head);
+    void stop();
+};
+
+#endif
@@ -22,6 +22,54 @@
 
 DEFINE_LOGGING(DNS_Inspector)
 
+bool InspectorInterest::match(AppHostCX* cx) const {
+    
+    if(! ports.empty()) {
+        unsigned short port = cx->com()->nonlocal_dst_port();
+        bool found = false;
+        for(auto p: ports) {
+            if(p == port) { found = true; break; }
+        }
+        if(! found) return false;
+    }
+    
+    if(proto != PROTO_ANY) {
+        unsigned char p = (dynamic_cast<TCPCom*>(cx->com()) != nullptr) ? PROTO_TCP : PROTO_UDP;
+        if(! (proto & p)) return false;
+    }
+    
+    return true;
+}
+
+std::unordered_map<std::string,InspectorInterest>& InspectorRegistry::registry() {
+    // constructed on first use: inspectors register themselves during static initialization
+    static std::unordered_map<std::string,InspectorInterest> r;
+    return r;
+}
+
+bool InspectorRegistry::add(std::string const& name, InspectorInterest const& interest) {
+    registry()[name] = interest;
+    return true;
+}
+
+InspectorInterest const* InspectorRegistry::find(std::string const& name) {
+    auto it = registry().find(name);
+    if(it == registry().end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+bool Inspector::l4_prefilter(AppHostCX* cx) {
+    InspectorInterest const* i = InspectorRegistry::find(c_name());
+    if(i == nullptr) {
+        return false;
+    }
+    
+    interest_ = *i;
+    return interest_.match(cx);
+}
+
 std::string Inspector::remove_redundant_dots(std::string orig) {
     std::string norm;  
 
@@ -103,11 +151,12 @@ std::pair<std::string,std::string> Inspector::split_fqdn_subdomain(std::string&
 
 std::regex DNS_Inspector::wildcard = std::regex("[^.]+\\.(.*)$");
 
-bool DNS_Inspector::interested(AppHostCX* cx) {
-    if(cx->com()->nonlocal_dst_port() == 53)
-        return true;
-    return false;
+static InspectorInterest dns_inspector_interest() {
+    InspectorInterest i;
+    i.ports.push_back(53);
+    return i;
 }
+static bool dns_inspector_registered = InspectorRegistry::add("DNS_Inspector",dns_inspector_interest());
 
 void DNS_Inspector::update(AppHostCX* cx) {
   
@@ -136,7 +185,7 @@ void DNS_Inspector::update(AppHostCX* cx) {
     buffer buf = xbuf->view(0,xbuf->size());
 
     // check if response is already available
-    DNS_Response* cached_entry = nullptr;
+    DnsCache::entry_ptr cached_entry;
     
     int mem_pos = 0;
     unsigned int red = 0;
@@ -203,45 +252,27 @@ void DNS_Inspector::update(AppHostCX* cx) {
 	    }
             
             if(opt_cached_responses && ( ((DNS_Request*)ptr)->question_type_0() == A || ((DNS_Request*)ptr)->question_type_0() == AAAA ) ) {
-                inspect_dns_cache.lock();
-                cached_entry = inspect_dns_cache.get(ptr->question_str_0());
+                cached_entry = inspect_dns_cache.get(ptr->question_type_0(),ptr->question_name_0());
                 if(cached_entry != nullptr) {
                     DIA___("DNS answer for %s is already in the cache",cached_entry->question_str_0().c_str());
 
                     
-                    if(cached_entry->cached_packet != nullptr) {
-                        
-                        // do TTL check
-                        DIAS___("cached entry TTL check");
+                    if(cached_entry->cached_answer != nullptr) {
                         
+                        // answer is valid until the first of its records expires
                         time_t now = time(nullptr);
-                        bool ttl_check = true;
-                        
-                        for(auto idx: cached_entry->answer_ttl_idx) {
-                            uint32_t ttl = ntohl(cached_entry->cached_packet->get_at<uint32_t>(idx));
-                            DEB___("cached response ttl byte index %d value %d",idx,ttl);
-                            if(now > ttl + cached_entry->loaded_at) {
-                                DEB___("  %ds -- expired", now - (ttl + cached_entry->loaded_at));
-                                ttl_check = false;
-                            } else {
-                                DEB___("  %ds left to expiry", (ttl + cached_entry->loaded_at) - now);
-                            }
-                        }
+                        DNS_CachedAnswer const* answer = cached_entry->cached_answer;
+                        DEB___("cached response: %d TTLs, expiry at %d, now %d",answer->patches(),answer->expires_at(),now);
                     
-                        if(ttl_check) {
+                        if(! answer->expired(now)) {
                             verdict(CACHED);
-                            // this  will copy packet to our cached response
-                            if(cached_response == nullptr) 
-                                    cached_response = new buffer();
-                            
-                            cached_response->clear();
-                            cached_response->append(cached_entry->cached_packet->data(),cached_entry->cached_packet->size());
+                            // keep the entry, answer is written from it in apply_verdict()
+                            cached_response = cached_entry;
                             cached_response_id = ptr->id();
-                            cached_response_ttl_idx = cached_entry->answer_ttl_idx;
-                            cached_response_decrement = now - cached_entry->loaded_at;
+                            cached_response_at = now;
                         
                             DIAS___("cached entry TTL check: OK");
-                            DEB___("cached response prepared: size=%d, setting overwrite id=%d",cached_response->size(),cached_response_id);
+                            DEB___("cached response prepared: size=%d, setting overwrite id=%d",answer->size(),cached_response_id);
                         } else {
                             DIAS___("cached entry TTL check: failed");
                         }
@@ -250,76 +281,67 @@ void DNS_Inspector::update(AppHostCX* cx) {
                 } else {
                     DIA___("DNS answer for %s is not in cache",ptr->question_str_0().c_str());
                 }
-                inspect_dns_cache.unlock();
             }
             
             break;
         case 'w':
             stage = 1;
             for(unsigned int it = 0; red < buf.size() && it < 10; it++) {
-                ptr = new DNS_Response();
                 
-                buffer cur_buf = buf.view(red,buf.size()-red);
-                int cur_red = ptr->load(&cur_buf);
+                // parse in place; response is built only if it's going to be stored
+                DnsWireParser wire;
+                if(wire.parse(buf.data() + red,buf.size() - red) != DnsWireParser::DNS_PARSE_OK) {
+                    DIA___("DNS_Inspector::update[%s]: malformed or incomplete response at %d",cx->c_name(),red);
+                    break;
+                }
+                const unsigned char* msg = buf.data() + red;
                 
+                mem_pos += wire.length();
+                red += wire.length();
                 
-                if(cur_red >= 0) {
-                    if(opt_cached_responses) {
-                        if(((DNS_Response*)ptr)->cached_packet != nullptr) {
-                            delete ((DNS_Response*)ptr)->cached_packet;
-                        }
-                        ((DNS_Response*)ptr)->cached_packet = new buffer();
-                        if(cur_red == 0) {
-                            ((DNS_Response*)ptr)->cached_packet->append(cur_buf.data(),cur_buf.size());
-                        } else {
-                            ((DNS_Response*)ptr)->cached_packet->append(cur_buf.data(),cur_red);
-                        }
-                        
-                        DEB___("caching response packet: size=%d",((DNS_Response*)ptr)->cached_packet->size())
-                    }
-                    
-                    mem_pos += cur_red;
-                    red = cur_red;
-                    
-                    DIA___("DNS_Inspector::update[%s]: loaded new response (at %d size %d out of %d)",cx->c_name(),red,mem_pos,mem_len);
-                    if (!validate_response((DNS_Response*)ptr)) {
-                        // invalid, delete
-
-                        cx->writebuf()->clear();
-                        cx->error(true);
-                        WAR___("DNS inspection: cannot find corresponding DNS request id 0x%x: dropping connection.",ptr->id());
-                        delete ptr;
-                    }
-                    else {
-                        // DNS response is valid
-                        responses_ ++;
+                DIA___("DNS_Inspector::update[%s]: parsed new response (size %d, at %d out of %d)",cx->c_name(),wire.length(),mem_pos,mem_len);
+                if(find_request(wire.id()) == nullptr) {
+                    // invalid, drop
 
-                        DIA___("DNS_Inspector::update[%s]: valid response",cx->c_name());
+                    cx->writebuf()->clear();
+                    cx->error(true);
+                    WAR___("DNS inspection: cannot find corresponding DNS request id 0x%x: dropping connection.",wire.id());
+                    break;
+                }
+                
+                // DNS response is valid
+                responses_ ++;
+                DIA___("DNS_Inspector::update[%s]: valid response",cx->c_name());
 
-                        if(store((DNS_Response*)ptr)) {
-                            stored_ = true;
-                            // DNS response is interesting (A record present) - we stored it , ptr is VALID
-                            DIA___("DNS_Inspector::update[%s]: contains interesting info, stored",cx->c_name());
-                            
-                        } else {
-                            delete ptr;
-                            ptr = nullptr;
-                            
-                            DIA___("DNS_Inspector::update[%s]: no interesting info there, deleted",cx->c_name());
-                        }
-                        
-                        if(is_tcp)
-                            cx->idle_delay(30);
-                        else
-                            cx->idle_delay(1);  
+                // addresses, or negative answer worth caching
+                if(wire.addresses() > 0 || dns_negative_ttl(wire) >= 0) {
+                    DNS_Response* resp = new DNS_Response();
+                    resp->load(wire,msg);
+                    
+                    // records beyond parser's limit would be sent with stale TTLs, don't answer with them
+                    if(opt_cached_responses && ! wire.truncated()) {
+                        resp->cached_answer = new DNS_CachedAnswer(wire,msg,resp->negative ? resp->negative_ttl : 0xffffffff);
+                        DEB___("caching response packet: size=%d",resp->cached_answer->size())
+                    }
+                    
+                    if(store(resp)) {
+                        stored_ = true;
+                        // DNS response is interesting (A record present) - we stored it
+                        DIA___("DNS_Inspector::update[%s]: contains interesting info, stored",cx->c_name());
+                    } else {
+                        delete resp;
                     }
                 } else {
-                    red = 0;
-                    delete ptr;
+                    DIA___("DNS_Inspector::update[%s]: no interesting info there",cx->c_name());
                 }
                 
-                // on failure or last data exit loop
-                if(red <= 0) break;
+                if(is_tcp) {
+                    cx->idle_delay(30);
+                    // length prefix of next message
+                    red += 2;
+                }
+                else
+                    cx->idle_delay(1);  
             }
             break;
     }
@@ -349,10 +371,8 @@ bool DNS_Inspector::store(DNS_Response* ptr) {
     if(is_a_record) {
         std::string question = ptr->question_str_0();
         
-        inspect_dns_cache.lock();
-        inspect_dns_cache.set(question,ptr);
-        DIA___("DNS_Inspector::update: %s added to cache (%d elements of max %d)",ptr->question_str_0().c_str(),inspect_dns_cache.cache().size(), inspect_dns_cache.max_size());
-        inspect_dns_cache.unlock();
+        inspect_dns_cache.set(ptr->question_type_0(),ptr->question_name_0(),ptr);
+        DIA___("DNS_Inspector::update: %s added to cache (%d elements of max %d)",question.c_str(),inspect_dns_cache.size(), inspect_dns_cache.max_size());
         
         std::pair<std::string,std::string> dom_pair = split_fqdn_subdomain(question);
         DEB___("topdomain = %s, subdomain = %s",dom_pair.first.c_str(), dom_pair.second.c_str());    
@@ -392,7 +412,27 @@ bool DNS_Inspector::store(DNS_Response* ptr) {
             }
             domain_cache.unlock();
         }
-    }    
+    }
+    else if(ptr->negative && (ptr->question_type_0() == A || ptr->question_type_0() == AAAA)) {
+        std::string question = ptr->question_str_0();
+        int rcode = ptr->rcode();
+        uint32_t ttl = ptr->negative_ttl;
+        
+        // server failure applies to the server which answered (RFC 2308, section 7.1), don't share it
+        if(rcode == RCODE_SERVFAIL) {
+            DIA___("DNS_Inspector::store: server failure for %s not cached",question.c_str());
+            return false;
+        }
+        
+        // remember the name doesn't resolve, so repeated queries are not sent upstream. Cache owns the
+        // response from now on, even if it's dropped in favour of valid positive entry.
+        if(inspect_dns_cache.set(ptr->question_type_0(),ptr->question_name_0(),ptr)) {
+            DIA___("DNS_Inspector::store: negative answer (rcode %d) for %s cached for %ds",rcode,question.c_str(),ttl);
+        } else {
+            DIA___("DNS_Inspector::store: negative answer (rcode %d) for %s dropped, cached addresses still valid",rcode,question.c_str());
+        }
+        return true;
+    }
     
     return is_a_record;
 }
@@ -428,39 +468,18 @@ void Inspector::apply_verdict(AppHostCX* cx) {
 void DNS_Inspector::apply_verdict(AppHostCX* cx) {
     DEBS___("DNS_Inspector::apply_verdict called");
     
-    //TODO: dirty, make more generic
-    if(cached_response != nullptr) {
+    if(cached_response != nullptr && cached_response->cached_answer != nullptr) {
         DEB___("DNS_Inspector::apply_verdict: mangling response id=%d",cached_response_id);
-        *((uint16_t*)cached_response->data()) = htons(cached_response_id);
         
-        for(auto i: cached_response_ttl_idx) {
-            uint32_t orig_ttl = ntohl(cached_response->get_at<uint32_t>(i));
-            uint32_t new_ttl = orig_ttl - cached_response_decrement;
-            DEB___("DNS_Inspector::apply_verdict: mangling original ttl %d to %d at index %d",orig_ttl,new_ttl,i);
-            
-            uint8_t* ptr = cached_response->data();
-            uint32_t* ptr_ttl  = (uint32_t*)&ptr[i];
-            *ptr_ttl = htonl(new_ttl);
-            
-        }
+        // patched header and TTLs are gathered with unchanged parts straight into write buffer
+        unsigned int size = cached_response->cached_answer->write(cached_response_id,cached_response_at,is_tcp,
+                                [cx](const unsigned char* data, unsigned int len) {
+                                    if(len > 0) cx->to_write((unsigned char*)data,len);
+                                });
+        int w = cx->write();
+        DIA___("DNS_Inspector::apply_verdict: %d bytes written of cached response size %d (%s)",w,size,is_tcp ? "tcp" : "udp");
         
-        if(! is_tcp) {
-            DEBS___("udp encapsulation"); 
-            cx->to_write(cached_response->data(), cached_response->size());
-            int w = cx->write();
-            DIA___("DNS_Inspector::apply_verdict: %d bytes written of cached response size %d",w,cached_response->size());
-        } else {
-            DEBS___("tcp encapsulation");
-            uint16_t* ptr = (uint16_t*)cached_response->data();
-            uint16_t len = htons(cached_response->size());
-            buffer b;
-            b.append(&len,sizeof(uint16_t));
-            b.append(cached_response->data(),cached_response->size());
-            cx->to_write(b);
-            int w = cx->write();
-            
-            DIA___("DNS_Inspector::apply_verdict: %d bytes written of cached response size %d",w,b.size());
-        }
+        cached_response.reset();
         
     } else {
         // what to do now?
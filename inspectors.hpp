@@ -37,6 +37,43 @@
 #include <sobject.hpp>
 #include <lockable.hpp>
 
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+//
+/// \brief L4 interest of an inspector: which connections, which direction and how much data it wants to see.
+///        It's evaluated once, when inspector is created for the connection. Per-chunk check uses only
+///        direction mask and byte budget.
+//
+struct InspectorInterest {
+    enum { PROTO_TCP=0x01, PROTO_UDP=0x02, PROTO_ANY=0x03 };
+    enum { DIR_LEFT=0x01, DIR_RIGHT=0x02, DIR_BOTH=0x03 };
+
+    unsigned char proto = PROTO_ANY;
+    std::vector<unsigned short> ports;  // destination ports, empty = any
+    unsigned char direction = DIR_BOTH;
+    unsigned long long max_bytes = 0;   // inspector is done after seeing this many bytes, 0 = unlimited
+
+    bool match(AppHostCX* cx) const;
+    // side is flow side passed to inspection: 'r' is data read from client, 'w' data written to it.
+    // 'l'/'L' stands for left side too.
+    static unsigned char side_direction(char side) { return (side == 'r' || side == 'l' || side == 'L') ? DIR_LEFT : DIR_RIGHT; }
+};
+
+//
+/// \brief Interest of inspector classes, keyed by their c_name(). New ALG registers its interest next to
+///        its implementation, so connections are prefiltered without creating the inspector.
+//
+class InspectorRegistry {
+public:
+    static bool add(std::string const& name, InspectorInterest const& interest);
+    static InspectorInterest const* find(std::string const& name);
+    
+private:
+    static std::unordered_map<std::string,InspectorInterest>& registry();
+};
+
 //
 /// \brief Abstract class intended to be parent for all inspector modules.
 ///        Serves as an interface.
@@ -47,12 +84,23 @@ public:
     virtual ~Inspector() {}
     //! called always when there are new data in the flow. \see class Flow.
     virtual void update(AppHostCX* cx) = 0;
-    //! called before inserting to inspector list. 
+    //! called before inserting to inspector list. Sets up interest from InspectorRegistry.
     //! \return false if you don't want insert inspector to the list (and save some CPU cycles).
-    virtual bool l4_prefilter(AppHostCX* cx) = 0;
+    virtual bool l4_prefilter(AppHostCX* cx);
     
-    //! called before each update to indicate if update() should be called.
-    virtual bool interested(AppHostCX*) = 0;
+    //! L4 interest, valid after l4_prefilter().
+    InspectorInterest const& interest() const { return interest_; }
+    //! called before each update to indicate if update() should be called. Only direction and byte budget
+    //! are checked, connection itself was matched in l4_prefilter().
+    inline bool interested(char side) const { 
+        return (interest_.direction & InspectorInterest::side_direction(side)) && 
+               (interest_.max_bytes == 0 || seen_bytes_ < interest_.max_bytes); 
+    }
+    //! account data offered to inspector; inspector is completed when its byte budget is exhausted
+    void seen(unsigned long long bytes) { 
+        seen_bytes_ += bytes; 
+        if(interest_.max_bytes > 0 && seen_bytes_ >= interest_.max_bytes) completed(true); 
+    }
     
     //! indicate if inspection is complete. Completed inspectors are not updated.
     inline bool completed() const   { return completed_; }
@@ -68,6 +116,9 @@ public:
     virtual void apply_verdict(AppHostCX* cx);
     
 protected:
+    InspectorInterest interest_;
+    unsigned long long seen_bytes_ = 0;
+    
     bool completed_ = false;
     void completed(bool b) { completed_ = b; }
     bool in_progress_ = false;
@@ -97,13 +148,10 @@ public:
     virtual ~DNS_Inspector() {
         // clear local request cache
         for(auto x: requests_) { if(x.second) {delete x.second; } };
-        if(cached_response != nullptr) delete cached_response;
     };  
     virtual void update(AppHostCX* cx);
 
-    virtual bool l4_prefilter(AppHostCX* cx) { return interested(cx); };
-    virtual bool interested(AppHostCX*cx);
-    
+
     bool opt_match_id = false;
     bool opt_randomize_id = false;
     bool opt_cached_responses = false;
@@ -119,10 +167,10 @@ public:
 private:
     bool is_tcp = false;
 
-    buffer* cached_response = nullptr;
+    // cache entry is held until verdict is applied, so its answer can't go away meanwhile
+    DnsCache::entry_ptr cached_response;
     uint16_t cached_response_id = 0;
-    std::vector<int> cached_response_ttl_idx;
-    uint32_t cached_response_decrement = 0;
+    time_t cached_response_at = 0;
 
     std::unordered_map<uint16_t,DNS_Request*>  requests_;
     int responses_ = 0;
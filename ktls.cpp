@@ -0,0 +1,304 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstring>
+#include <cerrno>
+#include <mutex>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/err.h>
+
+#include <ktls.hpp>
+#include <display.hpp>
+#include <logger.hpp>
+
+#ifndef TCP_ULP
+ #define TCP_ULP 31
+#endif
+
+#if defined(SSL_OP_ENABLE_KTLS) && ! defined(OPENSSL_NO_KTLS)
+ #define SMITH_KTLS 1
+#endif
+
+
+bool ktls_openssl_support() {
+#ifdef SMITH_KTLS
+    return true;
+#else
+    return false;
+#endif
+}
+
+// connected loopback TCP pair; returns false on failure
+static bool ktls_loopback_pair(int& client, int& server, std::string& reason) {
+    client = -1;
+    server = -1;
+
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    if(l < 0) {
+        reason = string_format("socket: %s",strerror(errno));
+        return false;
+    }
+
+    sockaddr_in sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+    socklen_t salen = sizeof(sa);
+
+    if(bind(l,(sockaddr*)&sa,sizeof(sa)) != 0 || listen(l,1) != 0 || getsockname(l,(sockaddr*)&sa,&salen) != 0) {
+        reason = string_format("loopback listen: %s",strerror(errno));
+        ::close(l);
+        return false;
+    }
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if(client < 0 || connect(client,(sockaddr*)&sa,sizeof(sa)) != 0) {
+        reason = string_format("loopback connect: %s",strerror(errno));
+        if(client >= 0) ::close(client);
+        ::close(l);
+        client = -1;
+        return false;
+    }
+
+    server = accept(l,nullptr,nullptr);
+    ::close(l);
+
+    if(server < 0) {
+        reason = string_format("loopback accept: %s",strerror(errno));
+        ::close(client);
+        client = -1;
+        return false;
+    }
+
+    return true;
+}
+
+static bool ktls_kernel_probe(std::string& reason) {
+    int c, s;
+    if(! ktls_loopback_pair(c,s,reason)) {
+        return false;
+    }
+
+    bool ret = true;
+    if(setsockopt(c, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+        reason = string_format("kernel tls ULP: %s (is 'tls' module loaded?)",strerror(errno));
+        ret = false;
+    }
+
+    ::close(c);
+    ::close(s);
+
+    return ret;
+}
+
+bool ktls_kernel_support(std::string* reason) {
+    static std::once_flag probed;
+    static bool supported = false;
+    static std::string why;
+
+    std::call_once(probed,[]() {
+        supported = ktls_kernel_probe(why);
+    });
+
+    if(reason != nullptr) {
+        *reason = why;
+    }
+    return supported;
+}
+
+bool ktls_prepare(SSL* ssl) {
+#ifdef SMITH_KTLS
+    if(ssl != nullptr && ktls_kernel_support()) {
+        SSL_set_options(ssl,SSL_OP_ENABLE_KTLS);
+        return true;
+    }
+#endif
+    return false;
+}
+
+int ktls_state(SSL* ssl) {
+    int ret = KTLS_NONE;
+#ifdef SMITH_KTLS
+    if(ssl != nullptr) {
+        if(SSL_get_wbio(ssl) && BIO_get_ktls_send(SSL_get_wbio(ssl))) ret |= KTLS_TX;
+        if(SSL_get_rbio(ssl) && BIO_get_ktls_recv(SSL_get_rbio(ssl))) ret |= KTLS_RX;
+    }
+#endif
+    return ret;
+}
+
+std::string ktls_state_str(int state) {
+    switch(state & KTLS_FULL) {
+        case KTLS_FULL:
+            return "tx+rx";
+        case KTLS_TX:
+            return "tx";
+        case KTLS_RX:
+            return "rx";
+    }
+    return "none";
+}
+
+
+// self-signed certificate for loopback test
+static bool ktls_test_identity(EVP_PKEY** key, X509** cert) {
+    *key = nullptr;
+    *cert = nullptr;
+
+    EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA,nullptr);
+    if(kctx == nullptr) return false;
+
+    bool ok = EVP_PKEY_keygen_init(kctx) > 0 && EVP_PKEY_CTX_set_rsa_keygen_bits(kctx,2048) > 0 && EVP_PKEY_keygen(kctx,key) > 0;
+    EVP_PKEY_CTX_free(kctx);
+    if(! ok) return false;
+
+    X509* x = X509_new();
+    X509_set_version(x,2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x),1);
+    X509_gmtime_adj(X509_get_notBefore(x),0);
+    X509_gmtime_adj(X509_get_notAfter(x),3600);
+    X509_set_pubkey(x,*key);
+
+    X509_NAME* name = X509_get_subject_name(x);
+    X509_NAME_add_entry_by_txt(name,"CN",MBSTRING_ASC,(const unsigned char*)"smithproxy ktls test",-1,-1,0);
+    X509_set_issuer_name(x,name);
+
+    if(X509_sign(x,*key,EVP_sha256()) <= 0) {
+        X509_free(x);
+        EVP_PKEY_free(*key);
+        *key = nullptr;
+        return false;
+    }
+
+    *cert = x;
+    return true;
+}
+
+bool ktls_loopback_test(std::string& report) {
+
+    report = string_format("OpenSSL: %s, kTLS %s\n",OpenSSL_version(OPENSSL_VERSION), ktls_openssl_support() ? "supported" : "not supported");
+
+    std::string reason;
+    if(ktls_kernel_support(&reason)) {
+        report += "Kernel: tls ULP available\n";
+    } else {
+        report += "Kernel: " + reason + "\n";
+    }
+
+    EVP_PKEY* key = nullptr;
+    X509* cert = nullptr;
+    if(! ktls_test_identity(&key,&cert)) {
+        report += "cannot generate test certificate\n";
+        return false;
+    }
+
+    SSL_CTX* sctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX* cctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_use_certificate(sctx,cert);
+    SSL_CTX_use_PrivateKey(sctx,key);
+
+    int c = -1;
+    int s = -1;
+    bool ret = false;
+
+    if(! ktls_loopback_pair(c,s,reason)) {
+        report += reason + "\n";
+    } else {
+        SSL* sssl = SSL_new(sctx);
+        SSL* cssl = SSL_new(cctx);
+        SSL_set_fd(sssl,s);
+        SSL_set_fd(cssl,c);
+        fcntl(s,F_SETFL,fcntl(s,F_GETFL) | O_NONBLOCK);
+        fcntl(c,F_SETFL,fcntl(c,F_GETFL) | O_NONBLOCK);
+
+        ktls_prepare(sssl);
+        ktls_prepare(cssl);
+
+        SSL_set_accept_state(sssl);
+        SSL_set_connect_state(cssl);
+
+        // both ends in one thread: step them in turns
+        bool s_done = false;
+        bool c_done = false;
+        for(int i = 0; i < 1000 && ! (s_done && c_done); i++) {
+            if(! c_done) {
+                int r = SSL_do_handshake(cssl);
+                if(r == 1) c_done = true;
+                else if(SSL_get_error(cssl,r) != SSL_ERROR_WANT_READ && SSL_get_error(cssl,r) != SSL_ERROR_WANT_WRITE) break;
+            }
+            if(! s_done) {
+                int r = SSL_do_handshake(sssl);
+                if(r == 1) s_done = true;
+                else if(SSL_get_error(sssl,r) != SSL_ERROR_WANT_READ && SSL_get_error(sssl,r) != SSL_ERROR_WANT_WRITE) break;
+            }
+            if(! (s_done && c_done)) usleep(1000);
+        }
+
+        if(! (s_done && c_done)) {
+            report += "handshake failed\n";
+        } else {
+            const char msg[] = "smithproxy ktls loopback test";
+            char rcv[sizeof(msg)];
+            memset(rcv,0,sizeof(rcv));
+
+            int w = SSL_write(cssl,msg,sizeof(msg));
+            int r = -1;
+            for(int i = 0; i < 100 && r <= 0; i++) {
+                r = SSL_read(sssl,rcv,sizeof(rcv));
+                if(r <= 0) usleep(1000);
+            }
+
+            int sst = ktls_state(sssl);
+            int cst = ktls_state(cssl);
+
+            report += string_format("Handshake: %s, cipher %s\n",SSL_get_version(cssl),SSL_get_cipher_name(cssl));
+            report += string_format("Data: %s\n",(w == sizeof(msg) && r == sizeof(msg) && memcmp(msg,rcv,sizeof(msg)) == 0) ? "ok" : "failed");
+            report += string_format("kTLS: server %s, client %s",ktls_state_str(sst).c_str(),ktls_state_str(cst).c_str());
+            if(sst != KTLS_FULL || cst != KTLS_FULL) {
+                report += " - falling back to user space TLS";
+            }
+            report += "\n";
+
+            ret = (sst == KTLS_FULL && cst == KTLS_FULL);
+        }
+
+        SSL_free(sssl);
+        SSL_free(cssl);
+        ::close(c);
+        ::close(s);
+    }
+
+    SSL_CTX_free(sctx);
+    SSL_CTX_free(cctx);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+
+    return ret;
+}
@@ -0,0 +1,54 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef KTLS_HPP
+ #define KTLS_HPP
+
+#include <string>
+
+#include <openssl/ssl.h>
+
+//
+// Kernel TLS offload. If requested before handshake, OpenSSL (3.0+, built with kTLS) hands record encryption
+// to kernel TLS ULP when handshake is finished. It's done per direction and only for ciphers kernel supports,
+// otherwise TLS quietly continues in user space - ktls_state() tells what's in effect.
+// When kTLS is active in both directions, socket carries plaintext, and can be used with splice()/sendfile().
+//
+#define KTLS_NONE 0x00
+#define KTLS_TX   0x01
+#define KTLS_RX   0x02
+#define KTLS_FULL (KTLS_TX|KTLS_RX)
+
+// OpenSSL library is built with kTLS support
+bool ktls_openssl_support();
+// kernel is able to attach TLS ULP to TCP socket; result of the first probe is cached.
+// If 'reason' is set, it's filled with explanation when not supported.
+bool ktls_kernel_support(std::string* reason=nullptr);
+
+// request kTLS on the SSL object; must be called before handshake finishes. Returns false if not available.
+bool ktls_prepare(SSL* ssl);
+// KTLS_* flags in effect on finished handshake
+int  ktls_state(SSL* ssl);
+std::string ktls_state_str(int state);
+
+// run TLS handshake over loopback between local OpenSSL server and client with kTLS requested,
+// exchange some data and report result. Returns true if kTLS was used on both ends in both directions.
+bool ktls_loopback_test(std::string& report);
+
+#endif
@@ -17,6 +17,9 @@
 
 */
 
+#include <type_traits>
+#include <algorithm>
+
 #include <mitmhost.hpp>
 #include <display.hpp>
 #include <logger.hpp>
@@ -26,6 +29,40 @@ DEFINE_LOGGING(MitmHostCX)
 
 std::vector<duplexFlowMatch*> sigs_starttls;
 std::vector<duplexFlowMatch*> sigs_detection;
+SignaturePrefilter sigs_prefilter;
+
+void sigs_prefilter_compile() {
+    
+    sigs_prefilter.clear();
+    
+    for(unsigned int i = 0; i < sigs_detection.size(); i++) {
+        MyDuplexFlowMatch* sig = dynamic_cast<MyDuplexFlowMatch*>(sigs_detection[i]);
+        std::string anchor;
+        
+        if(sig != nullptr) {
+            for(auto const& a: sig->anchors) {
+                if(a.size() > anchor.size()) anchor = a;
+            }
+        }
+        sigs_prefilter.add(SignaturePrefilter::SET_DETECTION,i,anchor);
+    }
+    
+    // starttls sensor is evaluated by socle only, so signature put into it is evaluated with next data.
+    // Anchor must not be in the last flow match, otherwise detection would come late.
+    for(unsigned int i = 0; i < sigs_starttls.size(); i++) {
+        MyDuplexFlowMatch* sig = dynamic_cast<MyDuplexFlowMatch*>(sigs_starttls[i]);
+        std::string anchor;
+        
+        if(sig != nullptr) {
+            for(unsigned int j = 0; j + 1 < sig->anchors.size(); j++) {
+                if(sig->anchors[j].size() > anchor.size()) anchor = sig->anchors[j];
+            }
+        }
+        sigs_prefilter.add(SignaturePrefilter::SET_STARTTLS,i,anchor);
+    }
+    
+    sigs_prefilter.compile();
+}
 
 bool MitmHostCX::ask_destroy() {
     error(true);
@@ -55,14 +92,65 @@ bool MySSLMitmCom::spoof_cert(X509* x, SpoofOptions& spo) {
 }
 
 
+bool MySSLMitmCom::com_status() {
+    
+    if(opt_ktls && ! ktls_requested_ && sslcom_ssl != nullptr) {
+        ktls_requested_ = true;
+        if(! ktls_prepare(sslcom_ssl)) {
+            DIAS_("MySSLMitmCom::com_status: kTLS is not available, TLS stays in user space");
+        }
+    }
+    
+    bool r = baseSSLMitmCom<SSLCom>::com_status();
+    
+    if(r && opt_ktls && ! ktls_checked && sslcom_ssl != nullptr) {
+        ktls_checked = true;
+        ktls_in_effect = ktls_state(sslcom_ssl);
+        
+        if(ktls_in_effect != KTLS_FULL) {
+            INF_("MySSLMitmCom::com_status: kTLS %s with cipher %s, falling back to user space TLS",
+                 ktls_state_str(ktls_in_effect).c_str(), SSL_get_cipher_name(sslcom_ssl));
+        } else {
+            DIA_("MySSLMitmCom::com_status: kTLS active with cipher %s",SSL_get_cipher_name(sslcom_ssl));
+        }
+    }
+    
+    return r;
+}
+
+bool MySSLMitmCom::ktls_ready() {
+    // SSL_pending() counts only decrypted bytes; records read from socket but not processed yet count
+    // in SSL_has_pending(). Either would be skipped by splice().
+    return ktls_checked && ktls_in_effect == KTLS_FULL && sslcom_ssl != nullptr
+            && SSL_pending(sslcom_ssl) == 0 && SSL_has_pending(sslcom_ssl) == 0;
+}
+
+
+unsigned int MitmHostCX::http_history_max = 16;
+unsigned int MitmHostCX::flow_match_hold_bytes = 65536;
+
+MitmHostCX::~MitmHostCX() { 
+    if(application_data) { 
+        delete application_data; 
+    }
+    for(auto i: inspectors_) { 
+        delete i; 
+    } 
+    for(auto r: http_history_) {
+        delete r;
+    }
+    if(http_tracker_ != nullptr && http_tracker_->dropped() > 0) {
+        DIA_("MitmHostCX: %ld pipelined requests not queued for response pairing",http_tracker_->dropped());
+    }
+    delete http_tracker_;
+};
+
 MitmHostCX::MitmHostCX(baseCom* c, const char* h, const char* p ) : AppHostCX::AppHostCX(c,h,p) {
     DEB_("MitmHostCX: constructor %s:%s",h,p);
-    load_signatures();
 };
 
 MitmHostCX::MitmHostCX( baseCom* c, int s ) : AppHostCX::AppHostCX(c,s) {
     DEB_("MitmHostCX: constructor %d",s);
-    load_signatures();
 };
 
 int MitmHostCX::process() {
@@ -78,150 +166,294 @@ int MitmHostCX::process() {
     return len;
 };
 
+// Sensor state is created only for contexts which are really inspected: it's called when
+// detection profile sets mode other than MODE_NONE. Signatures themselves are global and shared,
+// only match states are per-connection.
 void MitmHostCX::load_signatures() {
 
+    if(signatures_loaded_ || mode() == AppHostCX::MODE_NONE) {
+        return;
+    }
+
     DEBS_("MitmHostCX::load_signatures: start");
 
-    zip_signatures(starttls_sensor(),sigs_starttls);
-    zip_signatures(sensor(),sigs_detection);
+    if(sigs_prefilter.compiled()) {
+        // only signatures without anchor; others are added when their anchor is seen (see prefilter())
+        std::vector<duplexFlowMatch*> st;
+        std::vector<duplexFlowMatch*> det;
+        
+        for(auto i: sigs_prefilter.always(SignaturePrefilter::SET_STARTTLS)) {
+            st.push_back(sigs_starttls[i]);
+        }
+        for(auto i: sigs_prefilter.always(SignaturePrefilter::SET_DETECTION)) {
+            det.push_back(sigs_detection[i]);
+        }
+        
+        zip_signatures(starttls_sensor(),st);
+        zip_signatures(sensor(),det);
+    } else {
+        zip_signatures(starttls_sensor(),sigs_starttls);
+        zip_signatures(sensor(),sigs_detection);
+    }
+    signatures_loaded_ = true;
 
     DEBS_("MitmHostCX::load_signatures: stop");
 };
 
 void MitmHostCX::on_detect_www_get(duplexFlowMatch* x_sig, flowMatchState& s, vector_range& r) {
     if(r.size() > 0) {
-        std::pair<char,buffer*>& get = flow().flow()[0];
-        std::pair<char,buffer*>& status = flow().flow()[0];
-
-        buffer* buffer_get = get.second;
-        buffer* buffer_status = status.second;
-        std::string buffer_data_string((const char*)buffer_get->data(),0,buffer_get->size());
-
-        //INFS_(std::string((const char*)buffer_get->data(),0,buffer_get->size()));
-        std::regex re_get("(GET|POST) *([^ \r\n\?]+)([^ \r\n]*)");
-        std::smatch m_get;
-
-        std::regex re_ref("Referer: *([^ \r\n]+)");
-        std::smatch m_ref;
-
-        std::regex re_host("Host: *([^ \r\n]+)");
-        std::smatch m_host;
-
-
-        std::string str_temp;
-        std::string print_request;
-
-        bool b_get = false;
-        bool b_host = false;
-        bool b_ref = false;
+        
+        http_parsing_ = true;
+        http_request_parse();
+        http_track_start();
 
-        if(std::regex_search (buffer_data_string, m_ref, re_ref)) {
+        // this is the right way, but not here
+        // replacement(REPLACE_REDIRECT);
+        // replacement(REPLACE_BLOCK);
 
-            str_temp = m_ref[1].str();
+        // we have to specify that we are replaceable!
+        replacement_type_ = REPLACETYPE_HTTP;
+    }
+}
 
-            //don't add referer to log.
-            //print_request += str_temp;
+// Parse request head in the first flow buffer. Request may not be complete yet, in such case fields already
+// parsed are filled and we continue with next data (see inspect()).
+void MitmHostCX::http_request_parse() {
+    
+    if(flow().flow().size() == 0) {
+        return;
+    }
+    
+    buffer* buffer_get = flow().flow()[0].second;
+    const unsigned char* data = buffer_get->data();
+    
+    int st = http_parser_.parse(data,buffer_get->size());
+    if(st == HttpHeadParser::HTTP_PARSE_ERROR) {
+        DIAS_("HTTP inspection: request head is not parseable");
+        http_parsing_ = false;
+    }
+    if(! http_parser_.request_line()) {
+        return;
+    }
+    
+    if(application_data == nullptr) {
+        application_data = new app_HttpRequest;
+    }
 
-            if(application_data == nullptr) {
-                application_data = new app_HttpRequest;
+    app_HttpRequest* app_request = dynamic_cast<app_HttpRequest*>(application_data);
+    if(app_request == nullptr) {
+        http_parsing_ = false;
+        return;
+    }
+    
+    if(app_request->uri.empty()) {
+        app_request->method = http_parser_.method.str(data);
+        app_request->uri = http_parser_.path.str(data);
+        app_request->params = http_parser_.query.str(data);
+        DIA_("URI: %s",ESC(app_request->uri));
+        DIA_("params: %s",ESC(app_request->params));
+    }
+    
+    if(app_request->host.empty() && ! http_parser_.host.empty()) {
+        app_request->host = http_parser_.host.str(data);
+        DIA_("Host: %s",app_request->host.c_str());
+    }
+    
+    //don't add referer to log.
+    if(app_request->referer.empty() && ! http_parser_.referer.empty()) {
+        app_request->referer = http_parser_.referer.str(data);
+        DIA_("Referer: %s",ESC(app_request->referer));
+    }
+    
+    // detect protocol (plain vs ssl)
+    SSLCom* proto_com = dynamic_cast<SSLCom*>(com());
+    if(proto_com != nullptr) {
+        app_request->proto="https://";
+        app_request->is_ssl = true;
+    } else {
+        app_request->proto="http://" ;
+    }
+    
+    if(st == HttpHeadParser::HTTP_PARSE_MORE) {
+        return;
+    }
+    http_parsing_ = false;
+    
+    if(app_request->host.size() > 0) {
+        bool check_inspect_dns_cache = true;
+        if(check_inspect_dns_cache) {
+            DnsCache::entry_ptr dns_resp_a = inspect_dns_cache.get(A,app_request->host);
+            DnsCache::entry_ptr dns_resp_aaaa = inspect_dns_cache.get(AAAA,app_request->host);
+            // negative entries say the name doesn't resolve
+            if(dns_resp_a && dns_resp_a->negative) dns_resp_a.reset();
+            if(dns_resp_aaaa && dns_resp_aaaa->negative) dns_resp_aaaa.reset();
+            
+            if(dns_resp_a && com()->l3_proto() == AF_INET) {
+                DIA_("HTTP inspection: Host header matches DNS: %s",ESC(dns_resp_a->question_str_0()));
+            } else if(dns_resp_aaaa && com()->l3_proto() == AF_INET6) {
+                DIA_("HTTP inspection: Host header matches IPv6 DNS: %s",ESC(dns_resp_aaaa->question_str_0()));
             }
-
-            app_HttpRequest* app_request = dynamic_cast<app_HttpRequest*>(application_data);
-            if(app_request != nullptr) {
-                app_request->referer = str_temp;
-                DIA_("Referer: %s",ESC(app_request->referer));
+            else {
+                WARS_("HTTP inspection: Host header DOESN'T match DNS!");
             }
-
-
         }
+    }
+    
+    INF_("Connection www request: %s",ESC(app_request->hr()));
+}
 
-        if(std::regex_search (buffer_data_string, m_host, re_host))  {
-            if(m_host.size() > 0) {
-                str_temp = m_host[1].str();
-                print_request += str_temp;
-
-                if(application_data == nullptr) {
-                    application_data = new app_HttpRequest;
-                }
 
-                app_HttpRequest* app_request = dynamic_cast<app_HttpRequest*>(application_data);
-                if(app_request != nullptr) {
-                    app_request->host = str_temp;
-                    DIA_("Host: %s",app_request->host.c_str());
-                    
-                    bool check_inspect_dns_cache = true;
-                    if(check_inspect_dns_cache) {
-                        DNS_Response* dns_resp_a = inspect_dns_cache.get(("A:" + app_request->host).c_str());
-                        DNS_Response* dns_resp_aaaa = inspect_dns_cache.get(("AAAA:" + app_request->host).c_str());
-                        if(dns_resp_a && com()->l3_proto() == AF_INET) {
-                            DIA_("HTTP inspection: Host header matches DNS: %s",ESC(dns_resp_a->question_str_0()));
-                        } else if(dns_resp_aaaa && com()->l3_proto() == AF_INET6) {
-                            DIA_("HTTP inspection: Host header matches IPv6 DNS: %s",ESC(dns_resp_aaaa->question_str_0()));
-                        }
-                        else {
-                            WARS_("HTTP inspection: Host header DOESN'T match DNS!");
-                        }
-                    }
-                }
-            }
+void MitmHostCX::http_track_start() {
+    
+    // tracker has to see connection from its start
+    if(http_tracker_ != nullptr || flow().flow().size() == 0 || flow_released_entries_ > 0) {
+        return;
+    }
+    
+    http_tracker_ = new HttpTracker();
+    
+    http_tracker_->on_request = [this](unsigned long seq, HttpHeadParser const& p, const unsigned char* head) {
+        
+        app_HttpRequest* r = new app_HttpRequest;
+        r->seq = seq;
+        r->method = p.method.str(head);
+        r->uri = p.path.str(head);
+        r->params = p.query.str(head);
+        r->host = p.host.str(head);
+        r->referer = p.referer.str(head);
+        
+        SSLCom* proto_com = dynamic_cast<SSLCom*>(com());
+        if(proto_com != nullptr) {
+            r->proto = "https://";
+            r->is_ssl = true;
+        } else {
+            r->proto = "http://";
         }
-
-        if(std::regex_search (buffer_data_string, m_get, re_get)) {
-            if(m_get.size() > 1) {
-                str_temp = m_get[2].str();
-                print_request += str_temp;
-
-                if(application_data == nullptr) {
-                    application_data = new app_HttpRequest;
-                }
-
-                app_HttpRequest* app_request = dynamic_cast<app_HttpRequest*>(application_data);
-                if(app_request != nullptr) {
-                    app_request->uri = str_temp;
-                    DIA_("URI: %s",ESC(app_request->uri));
-                }
-
-                if(m_get.size() > 2) {
-                    str_temp = m_get[3].str();
-                    app_request->params = str_temp;
-                    DIA_("params: %s",ESC(app_request->params));
-
-                    //print_request += str_temp;
-                }
-            }
+        
+        http_history_.push_back(r);
+        while(http_history_.size() > http_history_max) {
+            delete http_history_.front();
+            http_history_.pop_front();
         }
-
-
-        app_HttpRequest* app_request = dynamic_cast<app_HttpRequest*>(application_data);
-        if(app_request != nullptr) {
-            // detect protocol (plain vs ssl)
-            SSLCom* proto_com = dynamic_cast<SSLCom*>(com());
-            if(proto_com != nullptr) {
-                app_request->proto="https://";
-                app_request->is_ssl = true;
-            } else {
-                app_request->proto="http://" ;
+        
+        // first one is logged by detection
+        if(seq > 0) {
+            INF_("Connection www request #%ld: %s",seq,ESC(r->hr()));
+        }
+    };
+    
+    http_tracker_->on_response = [this](unsigned long seq, int status) {
+        for(auto it = http_history_.rbegin(); it != http_history_.rend(); ++it) {
+            if((*it)->seq == seq) {
+                (*it)->status = status;
+                DIA_("Connection www request #%ld: %s: response %d",seq,ESC((*it)->hr()),status);
+                break;
             }
-
-
-            INF_("Connection www request: %s",ESC(app_request->hr()));
-        } else {
-            INF_("Connection www request: %s (app_request cast failed)",ESC(print_request));
         }
+    };
+    
+    // client data received so far are in the first flow entry
+    buffer* b = flow().flow()[0].second;
+    http_tracker_->request(b->data(),b->size());
+}
 
+void MitmHostCX::http_track_request(const unsigned char* data, unsigned int len) {
+    
+    if(! http_tracking()) {
+        return;
+    }
+    
+    // data read so far end at meter_read_bytes; skip what was already fed from flow when tracking started
+    unsigned long long start = meter_read_bytes - len;
+    unsigned long long pos = http_tracker_->request_position();
+    
+    if(pos >= start + len) {
+        return;
+    }
+    if(pos > start) {
+        data += pos - start;
+        len -= pos - start;
+    }
+    
+    http_tracker_->request(data,len);
+}
 
-        // this is the right way, but not here
-        // replacement(REPLACE_REDIRECT);
-        // replacement(REPLACE_BLOCK);
-
-        // we have to specify that we are replaceable!
-        replacement_type_ = REPLACETYPE_HTTP;
+void MitmHostCX::http_track_response(const unsigned char* data, unsigned int len) {
+    
+    if(! http_tracking()) {
+        return;
     }
+    
+    http_tracker_->response(data,len);
 }
 
+void MitmHostCX::prefilter(char side) {
+    
+    if(! signatures_loaded_ || ! sigs_prefilter.compiled()) {
+        return;
+    }
+    
+    auto& fl = flow().flow();
+    if(fl.size() == 0) {
+        return;
+    }
+    
+    // flow was shrunk (ie. reset after upgrade): start over
+    if(prefilter_entry_ >= fl.size() || fl[prefilter_entry_].second->size() < prefilter_bytes_) {
+        prefilter_entry_ = 0;
+        prefilter_bytes_ = 0;
+    }
+    
+    std::vector<duplexFlowMatch*> new_starttls;
+    std::vector<duplexFlowMatch*> new_detection;
+    
+    for(unsigned int i = prefilter_entry_; i < fl.size(); i++) {
+        buffer* b = fl[i].second;
+        unsigned int from = (i == prefilter_entry_) ? prefilter_bytes_ : 0;
+        if(from >= b->size()) {
+            continue;
+        }
+        
+        sigs_prefilter.scan(prefilter_state_, fl[i].first == 'r' ? 0 : 1, b->data() + from, b->size() - from,
+                            [&new_starttls,&new_detection](int set, unsigned int index) {
+                                if(set == SignaturePrefilter::SET_STARTTLS) {
+                                    new_starttls.push_back(sigs_starttls[index]);
+                                } else {
+                                    new_detection.push_back(sigs_detection[index]);
+                                }
+                            });
+    }
+    
+    prefilter_entry_ = fl.size() - 1;
+    prefilter_bytes_ = fl.back().second->size();
+    
+    if(new_starttls.size() > 0) {
+        zip_signatures(starttls_sensor(),new_starttls);
+    }
+    
+    if(new_detection.size() > 0) {
+        DIA_("MitmHostCX::prefilter: %d signatures activated",new_detection.size());
+        
+        // detection already ran on this data without them: evaluate new signatures now, then keep them for next data
+        std::remove_reference<decltype(sensor())>::type fresh;
+        zip_signatures(fresh,new_detection);
+        detect(fresh,side);
+        
+        for(auto& s: fresh) {
+            sensor().push_back(s);
+        }
+    }
+}
 
 void MitmHostCX::inspect(char side) {
     
+    prefilter(side);
+    
+    // rest of request head detected earlier
+    if(http_parsing_ && side == 'r') {
+        http_request_parse();
+    }
+    
     if(inspect_verdict == Inspector::CACHED)
         return;
     
@@ -240,10 +472,15 @@ void MitmHostCX::inspect(char side) {
             //return;
         }
         
+        // new data in the last flow entry
+        unsigned int last_size = flow().flow().back().second->size();
+        unsigned int new_bytes = (flow().flow().size() == inspect_cur_flow_size) ? last_size - inspect_flow_same_bytes : last_size;
+        
         DIAS_("MitmHostCX::inspect: inspector loop:");
-        for(Inspector* inspector: inspectors_) {
-            if(inspector->interested(this) && (! inspector->completed() )) {
+        for(Inspector* inspector: inspectors_active_) {
+            if(inspector->interested(side) && (! inspector->completed() )) {
                 inspector->update(this);
+                inspector->seen(new_bytes);
                 
                 inspect_verdict = inspector->verdict();
                 
@@ -269,9 +506,119 @@ void MitmHostCX::inspect(char side) {
         }
         DIAS_("MitmHostCX::inspect: inspector loop end.");
         
+        inspectors_active_.erase(std::remove_if(inspectors_active_.begin(),inspectors_active_.end(),
+                                                [](Inspector* i) { return i->completed(); }),
+                                 inspectors_active_.end());
+        
         inspect_cur_flow_size = flow().flow().size();
         inspect_flow_same_bytes  = flow().flow().back().second->size();
     }
+    
+    flow_trim();
+}
+
+unsigned long long MitmHostCX::flow_memory() {
+    
+    unsigned long long held = 0;
+    auto& fl = flow().flow();
+    
+    for(auto const& e: fl) {
+        held += e.second->size();
+    }
+    
+    return held;
+}
+
+bool MitmHostCX::sensor_matching() {
+    
+    for(auto* sn: { &sensor(), &starttls_sensor() }) {
+        for(auto& sig_res: *sn) {
+            flowMatchState& st = std::get<0>(sig_res);
+            if(! st.hit() && st.result().size() > 0) {
+                return true;
+            }
+        }
+    }
+    
+    return false;
+}
+
+void MitmHostCX::sensor_restart() {
+    
+    for(auto* sn: { &sensor(), &starttls_sensor() }) {
+        for(auto& sig_res: *sn) {
+            flowMatchState& st = std::get<0>(sig_res);
+            if(! st.hit()) {
+                st = flowMatchState();
+            }
+        }
+    }
+}
+
+void MitmHostCX::flow_trim() {
+    
+    auto& fl = flow().flow();
+    
+    // last entry is still growing; request head parser needs the first one
+    if(flow_max_bytes == 0 || fl.size() < 2 || http_parsing_) {
+        return;
+    }
+    
+    // entries before 'limit' were seen by inspectors and signature prefilter
+    unsigned int limit = fl.size() - 1;
+    if(inspect_cur_flow_size > 0 && inspect_cur_flow_size - 1 < limit) {
+        limit = inspect_cur_flow_size - 1;
+    }
+    if(signatures_loaded_ && sigs_prefilter.compiled() && prefilter_entry_ < limit) {
+        limit = prefilter_entry_;
+    }
+    
+    unsigned long long held = flow_memory();
+    if(held <= flow_max_bytes) {
+        return;
+    }
+    
+    // partial match refers to flow entries it matched so far; next step is evaluated against them
+    bool matching = signatures_loaded_ && sensor_matching();
+    if(matching && held <= (unsigned long long)flow_max_bytes + flow_match_hold_bytes) {
+        DIA_("MitmHostCX::flow_trim: signature partially matched, holding %lld bytes",held);
+        return;
+    }
+    
+    unsigned int n = 0;
+    for( ; n < limit && held > flow_max_bytes; n++) {
+        unsigned int sz = fl[n].second->size();
+        delete fl[n].second;
+        
+        held -= sz;
+        flow_released_bytes_ += sz;
+    }
+    
+    if(n == 0) {
+        return;
+    }
+    
+    fl.erase(fl.begin(),fl.begin() + n);
+    flow_released_entries_ += n;
+    
+    // positions kept across calls are indexes into flow: rebase them
+    if(prefilter_entry_ >= n) {
+        prefilter_entry_ -= n;
+    } else {
+        prefilter_entry_ = 0;
+        prefilter_bytes_ = 0;
+    }
+    if(inspect_cur_flow_size >= n) {
+        inspect_cur_flow_size -= n;
+    }
+    if(signatures_loaded_) {
+        if(matching) {
+            DIA_("MitmHostCX::flow_trim: partial signature match abandoned after %d bytes held",flow_max_bytes + flow_match_hold_bytes);
+        }
+        sensor_restart();
+    }
+    
+    DIA_("MitmHostCX::flow_trim: removed %d flow entries, holding %lld bytes",n,held);
 }
 
 
@@ -321,8 +668,10 @@ void MitmHostCX::on_starttls() {
     ptr = dynamic_cast<SSLCom*>(com());
     if (ptr != nullptr) ptr->upgrade_server_socket(socket());
 
-    cfgapi_obj_policy_apply_tls(matched_policy(),com());
-    cfgapi_obj_policy_apply_tls(matched_policy(),peercom());
+    // use configuration the session started with, policy table might have been reloaded since
+    ProfileTls* pt = config() ? config()->policy_profile_tls(matched_policy()) : cfgapi_obj_policy_profile_tls(matched_policy());
+    cfgapi_obj_policy_apply_tls(pt,com());
+    cfgapi_obj_policy_apply_tls(pt,peercom());
 
     log().append("\n STARTTLS: plain connection upgraded to SSL/TLS, continuing with inspection.\n\n");
 
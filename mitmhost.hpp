@@ -24,17 +24,29 @@
 #include <apphostcx.hpp>
 #include <dns.hpp>
 #include <inspectors.hpp>
+#include <policy.hpp>
+#include <ktls.hpp>
+#include <sigprefilter.hpp>
+#include <httpparser.hpp>
+
+#include <deque>
 
 extern std::vector<duplexFlowMatch*> sigs_starttls;
 extern std::vector<duplexFlowMatch*> sigs_detection;
+extern SignaturePrefilter sigs_prefilter;
 
 class MyDuplexFlowMatch : public duplexFlowMatch {
     
 public:    
     std::string sig_side;
     std::string category;
+    // mandatory literal of each flow match, in order of flow matches (empty if there is none)
+    std::vector<std::string> anchors;
 };
 
+// build sigs_prefilter from loaded signatures
+void sigs_prefilter_compile();
+
 
 class MySSLMitmCom : public baseSSLMitmCom<SSLCom> {
 public:
@@ -42,6 +54,18 @@ public:
 
     virtual baseCom* replicate();
     virtual bool spoof_cert(X509* x, SpoofOptions& spo);
+    
+    // kernel TLS: requested before handshake finishes, result is checked once it's done
+    virtual bool com_status();
+    bool opt_ktls = false;
+    bool ktls_checked = false;
+    int  ktls_in_effect = KTLS_NONE;
+    // kTLS carries both directions and OpenSSL holds no buffered data, neither decrypted nor unprocessed
+    // records: socket can be spliced
+    bool ktls_ready();
+    
+private:
+    bool ktls_requested_ = false;
 };
 
 class MyDTLSMitmCom : public baseSSLMitmCom<DTLSCom> {
@@ -65,12 +89,17 @@ struct ApplicationData: public socle::sobject {
 struct app_HttpRequest : public ApplicationData {
     virtual ~app_HttpRequest() {};
   
+    std::string method;
     std::string host;
     std::string uri;
     std::string params;
     std::string referer;
     std::string proto;
     
+    // order of request on connection, and response status code (0 until response is seen)
+    unsigned long seq = 0;
+    int status = 0;
+    
     
     // this function returns most usable link for visited site from the request.
     virtual std::string original_request() {
@@ -106,24 +135,54 @@ class MitmHostCX : public AppHostCX, public socle::sobject {
 public:
     ApplicationData* application_data = nullptr;
     
-    virtual ~MitmHostCX() { if(application_data) { delete application_data; } ; for(auto i: inspectors_) { delete i; } };
+    virtual ~MitmHostCX();
     
     MitmHostCX(baseCom* c, const char* h, const char* p );
     MitmHostCX( baseCom* c, int s );
     
     virtual int process();
+    // create sensor states, if not done yet and detection mode is set
     virtual void load_signatures();
+    bool signatures_loaded() const { return signatures_loaded_; }
 
     
+    // inspectors owned by this cx. Those not completed yet are also in compact active list, updated on new data.
     std::vector<Inspector*> inspectors_;
+    void inspector_add(Inspector* i) { inspectors_.push_back(i); inspectors_active_.push_back(i); }
+    std::vector<Inspector*> const& inspectors_active() const { return inspectors_active_; }
     virtual void inspect(char side);
+    
+    // Flow kept for inspection is bounded: when it holds more than flow_max_bytes (0 = unlimited),
+    // entries already processed by signatures and inspectors are removed from the front of the flow.
+    // While a multi-step signature is partially matched, up to flow_match_hold_bytes more are kept for it;
+    // beyond that the partial match is abandoned and flow is trimmed anyway.
+    unsigned int flow_max_bytes = 131072;
+    static unsigned int flow_match_hold_bytes;
+    // bytes currently held in flow buffers, bytes and entries removed so far
+    unsigned long long flow_memory();
+    unsigned long long flow_released() const { return flow_released_bytes_; }
+    unsigned long flow_released_entries() const { return flow_released_entries_; }
+    // scan new flow data for signature anchors, put hit signatures into sensors
+    void prefilter(char side);
     virtual void on_detect(duplexFlowMatch* x_sig, flowMatchState& s, vector_range& r);    
     virtual void on_detect_www_get(duplexFlowMatch* x_sig, flowMatchState& s, vector_range& r);
+    void http_request_parse();
+    
+    // Requests on persistent connection are tracked once HTTP is detected. Last http_history_max
+    // of them are kept, with their response status.
+    static unsigned int http_history_max;
+    std::deque<app_HttpRequest*> const& http_history() const { return http_history_; }
+    bool http_tracking() const { return http_tracker_ != nullptr && http_tracker_->active(); }
+    // data sent by client (just read by this cx), and data from server
+    void http_track_request(const unsigned char* data, unsigned int len);
+    void http_track_response(const unsigned char* data, unsigned int len);
     
     virtual void on_starttls();
 
     int matched_policy() { return matched_policy_; }
     void matched_policy(int p) { matched_policy_ = p; }
+    cfgapi_snapshot_ptr const& config() { return config_; }
+    void config(cfgapi_snapshot_ptr const& c) { config_ = c; }
 
     typedef enum { REPLACETYPE_NONE=0, REPLACETYPE_HTTP=1} replacetype_t;    
     replacetype_t replacement_type() const { return replacement_type_; }
@@ -138,13 +197,40 @@ public:
     int inspection_verdict() const { return inspect_verdict; };
 protected:    
     int matched_policy_ = -1;
+    cfgapi_snapshot_ptr config_;
     
     replacetype_t replacement_type_ = REPLACETYPE_NONE; 
     replaceflags_t replacement_flags_ = REPLACE_NONE;
     
+    bool signatures_loaded_ = false;
+    SignaturePrefilter::state prefilter_state_;
+    // flow position scanned so far: flow entry and bytes in it
+    unsigned int prefilter_entry_ = 0;
+    unsigned int prefilter_bytes_ = 0;
+    
+    std::vector<Inspector*> inspectors_active_;
+    
+    HttpHeadParser http_parser_;
+    // request head is being parsed, waiting for more data
+    bool http_parsing_ = false;
+    
+    unsigned long flow_released_entries_ = 0;
+    unsigned long long flow_released_bytes_ = 0;
+    void flow_trim();
+    // some signature matched its first step(s), but not the whole signature yet
+    bool sensor_matching();
+    // start signatures not hit yet over, their flow positions are not valid after trim
+    void sensor_restart();
+    
+    HttpTracker* http_tracker_ = nullptr;
+    std::deque<app_HttpRequest*> http_history_;
+    void http_track_start();
+    
 public:
     bool is_ssl = false;
     bool is_ssl_port = false;
+    // nothing to peek at when accepted: waiting in master proxy for first bytes to decide if it's SSL
+    bool ssl_autodetect_pending = false;
     
     bool is_http = false;
     bool is_http_port = false;
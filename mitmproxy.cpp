@@ -21,6 +21,12 @@
 #include <cstdlib>
 #include <ctime>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <cstring>
 
 #include <mitmproxy.hpp>
 #include <mitmhost.hpp>
@@ -31,6 +37,7 @@
 #include <uxcom.hpp>
 #include <staticcontent.hpp>
 #include <filterproxy.hpp>
+#include <tcpcom.hpp>
 
 #include <algorithm>
 #include <ctime>
@@ -40,6 +47,9 @@ DEFINE_LOGGING(MitmProxy);
 
 
 unsigned int MitmProxy::half_timeout = 30;
+bool MitmProxy::opt_fast_forward = true;
+unsigned int MitmProxy::fast_forward_chunk = 65536;
+unsigned int MitmProxy::fast_forward_identity_interval = 5;
 
 socle::meter MitmProxy::total_mtr_up;
 socle::meter MitmProxy::total_mtr_down;
@@ -115,9 +125,11 @@ MitmProxy::~MitmProxy() {
         if(tlog()) tlog()->left_write("Connection stop\n");
     }
     
-    if(content_rule_ != nullptr) {
-      delete content_rule_;
+    if(content_replacer_ != nullptr) {
+      delete content_replacer_;
     }
+    
+    fast_forward_close_pipes();
         
     delete tlog_;
     
@@ -144,11 +156,15 @@ std::string MitmProxy::to_string(int verbosity) {
 
             PolicyRule* p = nullptr;
             
-            if(matched_policy() >= 0) {
-                p = cfgapi_obj_policy.at(matched_policy());
+            if(config()) {
+                p = config()->policy_at(matched_policy());
             }
             
             r << string_format("\n    PolicyRule Id: 0x%x",p);
+            r << string_format("\n    Payload: copied to peers %s",number_suffixed(stats_bytes_copied).c_str());
+            if(fast_forward()) {
+                r << "\n    Fast-forward: active";
+            }
 
             if(identity_resolved()) {
                 r << string_format("\n    User:   %s",identity_->username().c_str()); 
@@ -201,31 +217,15 @@ bool MitmProxy::apply_id_policies(baseHostCX* cx) {
     
     if( id_ptr != nullptr) {
         DIA___("apply_id_policies: matched policy: %d",matched_policy());        
-        PolicyRule* policy = cfgapi_obj_policy.at(matched_policy());
+        PolicyRule* policy = config() ? config()->policy_at(matched_policy()) : nullptr;
         
-        ProfileAuth* auth_policy = policy->profile_auth;
+        ProfileAuth* auth_policy = policy ? policy->profile_auth : nullptr;
 
         
         if(auth_policy != nullptr) {
-            for(auto sub: auth_policy->sub_policies) {
-                ProfileSubAuth* sub_prof = sub;
-                std::string sub_name = sub->name;
-                
-                DIA___("apply_id_policies: checking identity policy for: %s", sub_name.c_str());
-                
-                for(auto my_id: id_ptr->groups_vec) {
-                    DIA___("apply_id_policies: identity in policy: %s, match-test real user group '%s'",sub_prof->name.c_str(), my_id.c_str());
-                    if(sub_prof->name == my_id) {
-                        DIAS___("apply_id_policies: .. matched.");
-                        final_profile = sub_prof;
-                        break;
-                    }
-                }
-                
-                if(final_profile != nullptr) {
-                    break;
-                }
-            }
+            // groups are interned, sub-profiles are checked in order against identity group set
+            final_profile = auth_policy->match_groups(id_ptr->groups_set);
+            DIA___("apply_id_policies: identity groups '%s' matched sub-profile: %s",id_ptr->groups.c_str(), final_profile ? final_profile->name.c_str() : "none");
         }
         
         if(final_profile != nullptr) {
@@ -443,10 +443,317 @@ int MitmProxy::handle_sockets_once(baseCom* xcom) {
         filter_proxy->handle_sockets_once(xcom);
     }
     
+    // data held back by content replacer are not waiting forever for the rest
+    content_replace_flush();
+    
+    if(fast_forward_candidate && ! fast_forward()) {
+        fast_forward_start();
+    }
+    
+    if(fast_forward()) {
+        // contexts are paused, let regular processing run only when fast-forward has ended
+        if(fast_forward_once()) {
+            return 0;
+        }
+    }
+    
     return baseProxy::handle_sockets_once(xcom);
 }
 
 
+bool MitmProxy::fast_forward_check() {
+    
+    fast_forward_candidate = false;
+    
+    if(! opt_fast_forward) {
+        return false;
+    }
+    
+    // identity is resolved with first data (see fast_forward_start()); session to be blocked must stay in user space
+    if(write_payload() || content_replacer() != nullptr || filters_.size() > 0 || auth_block_identity) {
+        return false;
+    }
+    
+    if(ls().size() != 1 || rs().size() != 1 || lda().size() > 0 || rda().size() > 0) {
+        return false;
+    }
+    
+    for(auto cx: { ls().at(0), rs().at(0) }) {
+        MitmHostCX* mh = dynamic_cast<MitmHostCX*>(cx);
+        if(mh == nullptr || mh->mode() != AppHostCX::MODE_NONE || mh->inspectors_.size() > 0) {
+            return false;
+        }
+        
+        if(dynamic_cast<TCPCom*>(cx->com()) == nullptr) {
+            return false;
+        }
+        
+        // TLS can be spliced only when kernel does the records
+        if(dynamic_cast<SSLCom*>(cx->com()) != nullptr) {
+            MySSLMitmCom* mcom = dynamic_cast<MySSLMitmCom*>(cx->com());
+            if(mcom == nullptr || ! mcom->opt_ktls) {
+                return false;
+            }
+            ff_ktls_ = true;
+        }
+    }
+    
+    DIAS___("MitmProxy::fast_forward_check: session will be fast-forwarded");
+    fast_forward_candidate = true;
+    return true;
+}
+
+bool MitmProxy::fast_forward_start() {
+    
+    if(ls().size() != 1 || rs().size() != 1) {
+        fast_forward_candidate = false;
+        return false;
+    }
+    
+    baseHostCX* l = ls().at(0);
+    baseHostCX* r = rs().at(0);
+    
+    // everything already read must be written first, otherwise data would be reordered
+    if(l->readbuf()->size() > 0 || r->readbuf()->size() > 0 || l->writebuf()->size() > 0 || r->writebuf()->size() > 0) {
+        return false;
+    }
+    
+    // wait until regular processing resolves identity (and redirects to authentication if needed)
+    if((opt_auth_authenticate || opt_auth_resolve) && ! identity_resolved()) {
+        return false;
+    }
+    
+    // with TLS, kTLS must be in effect on both sides after handshake
+    if(ff_ktls_) {
+        for(auto cx: { l, r }) {
+            MySSLMitmCom* mcom = dynamic_cast<MySSLMitmCom*>(cx->com());
+            if(mcom == nullptr) {
+                fast_forward_candidate = false;
+                return false;
+            }
+            if(mcom->ktls_checked && mcom->ktls_in_effect != KTLS_FULL) {
+                DIAS___("MitmProxy::fast_forward_start: kTLS not in effect, session stays in user space");
+                fast_forward_candidate = false;
+                return false;
+            }
+            if(! mcom->ktls_ready()) {
+                return false;
+            }
+        }
+    }
+    
+    // right side has to be connected
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    sockaddr_storage peer;
+    socklen_t peerlen = sizeof(peer);
+    if(r->socket() <= 0 || getsockopt(r->socket(),SOL_SOCKET,SO_ERROR,&err,&errlen) != 0 || err != 0 
+        || getpeername(r->socket(),(sockaddr*)&peer,&peerlen) != 0) {
+        return false;
+    }
+    
+    if(pipe2(ff_pipe_lr_,O_NONBLOCK|O_CLOEXEC) != 0) {
+        ERR___("MitmProxy::fast_forward_start: cannot create pipe: %s",strerror(errno));
+        fast_forward_candidate = false;
+        return false;
+    }
+    if(pipe2(ff_pipe_rl_,O_NONBLOCK|O_CLOEXEC) != 0) {
+        ERR___("MitmProxy::fast_forward_start: cannot create pipe: %s",strerror(errno));
+        fast_forward_close_pipes();
+        fast_forward_candidate = false;
+        return false;
+    }
+    
+    // sockets stay monitored with this proxy as handler, but socle doesn't touch paused contexts
+    l->paused(true);
+    r->paused(true);
+    
+    ff_pending_lr_ = 0;
+    ff_pending_rl_ = 0;
+    ff_errno_ = 0;
+    ff_mode_l_ = EPOLLIN;
+    ff_mode_r_ = EPOLLIN;
+    ff_active_ = true;
+    
+    DIAS___("MitmProxy::fast_forward_start: started");
+    return true;
+}
+
+int MitmProxy::fast_forward_move(baseHostCX* from, baseHostCX* to, int* pipefd, unsigned int& pending, bool& closed) {
+    
+    int received = 0;
+    
+    // few rounds at most, other sessions are waiting too
+    for(int round = 0; round < 4; round++) {
+        
+        if(pending == 0) {
+            ssize_t in = splice(from->socket(), nullptr, pipefd[1], nullptr, fast_forward_chunk, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            if(in == 0) {
+                closed = true;
+                break;
+            }
+            if(in < 0) {
+                if(errno != EAGAIN && errno != EINTR) {
+                    ff_errno_ = errno;
+                    closed = true;
+                }
+                break;
+            }
+            
+            pending = in;
+            received += in;
+            // meters are what identity rx/tx counters are increased by when session ends (see on_left_error())
+            from->meter_read_bytes += in;
+            from->meter_read_count++;
+        }
+        
+        ssize_t out = splice(pipefd[0], nullptr, to->socket(), nullptr, pending, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if(out < 0) {
+            if(errno != EAGAIN && errno != EINTR) {
+                closed = true;
+            }
+            break;
+        }
+        
+        pending -= out;
+        to->meter_write_bytes += out;
+        to->meter_write_count++;
+        
+        if(pending > 0) {
+            // peer is not accepting more now
+            break;
+        }
+    }
+    
+    return received;
+}
+
+bool MitmProxy::fast_forward_once() {
+    
+    baseHostCX* l = ls().at(0);
+    baseHostCX* r = rs().at(0);
+    bool closed = false;
+    
+    int up = fast_forward_move(l, r, ff_pipe_lr_, ff_pending_lr_, closed);
+    int down = fast_forward_move(r, l, ff_pipe_rl_, ff_pending_rl_, closed);
+    
+    if(up > 0) {
+        total_mtr_up.update(up);
+        mtr_up.update(up);
+    }
+    if(down > 0) {
+        total_mtr_down.update(down);
+        mtr_down.update(down);
+    }
+    
+    // keep identity alive while traffic flows, as regular processing does with each read. If it timed out,
+    // regular processing takes over and handles the session as not authenticated.
+    if((up > 0 || down > 0) && identity_resolved()) {
+        time_t now = time(nullptr);
+        if(now - ff_identity_at_ >= fast_forward_identity_interval) {
+            ff_identity_at_ = now;
+            if(! resolve_identity(l,false)) {
+                DIAS___("MitmProxy::fast_forward_once: identity no longer valid");
+                fast_forward_stop();
+                return false;
+            }
+        }
+    }
+    
+    if(closed) {
+        // kTLS socket refuses to splice TLS control record (alert, key update, ticket). OpenSSL will handle it
+        // in regular processing, and we can continue afterwards.
+        bool resume = ff_ktls_ && (ff_errno_ == EINVAL || ff_errno_ == EIO);
+        
+        // regular processing will see EOF or error and close the session usual way
+        fast_forward_stop();
+        
+        if(resume) {
+            fast_forward_candidate = true;
+        }
+        return false;
+    }
+    
+    fast_forward_watch();
+    
+    return true;
+}
+
+void MitmProxy::fast_forward_watch() {
+    
+    baseHostCX* l = ls().at(0);
+    baseHostCX* r = rs().at(0);
+    
+    // data stuck in pipe are written when destination becomes writable; until then source is not read,
+    // otherwise level-triggered read readiness would wake us up for nothing
+    int mode_l = (ff_pending_lr_ == 0 ? EPOLLIN : 0) | (ff_pending_rl_ > 0 ? EPOLLOUT : 0);
+    int mode_r = (ff_pending_rl_ == 0 ? EPOLLIN : 0) | (ff_pending_lr_ > 0 ? EPOLLOUT : 0);
+    
+    if(mode_l != ff_mode_l_) {
+        com()->change_monitor(l->socket(),mode_l);
+        ff_mode_l_ = mode_l;
+    }
+    if(mode_r != ff_mode_r_) {
+        com()->change_monitor(r->socket(),mode_r);
+        ff_mode_r_ = mode_r;
+    }
+}
+
+void MitmProxy::fast_forward_stop() {
+    
+    if(! fast_forward()) {
+        return;
+    }
+    
+    baseHostCX* l = ls().at(0);
+    baseHostCX* r = rs().at(0);
+    
+    unsigned char b[4096];
+    
+    while(ff_pending_lr_ > 0) {
+        ssize_t n = ::read(ff_pipe_lr_[0], b, std::min((unsigned int)sizeof(b),ff_pending_lr_));
+        if(n <= 0) break;
+        r->to_write(b,n);
+        ff_pending_lr_ -= n;
+    }
+    while(ff_pending_rl_ > 0) {
+        ssize_t n = ::read(ff_pipe_rl_[0], b, std::min((unsigned int)sizeof(b),ff_pending_rl_));
+        if(n <= 0) break;
+        l->to_write(b,n);
+        ff_pending_rl_ -= n;
+    }
+    
+    fast_forward_close_pipes();
+    
+    // regular processing monitors sockets for reading, and for writing when write buffer is not empty
+    if(ff_mode_l_ != EPOLLIN) {
+        com()->change_monitor(l->socket(),EPOLLIN);
+    }
+    if(ff_mode_r_ != EPOLLIN) {
+        com()->change_monitor(r->socket(),EPOLLIN);
+    }
+    
+    l->paused(false);
+    r->paused(false);
+    
+    ff_active_ = false;
+    fast_forward_candidate = false;
+    
+    DIAS___("MitmProxy::fast_forward_stop: stopped");
+}
+
+void MitmProxy::fast_forward_close_pipes() {
+    for(int* p: { ff_pipe_lr_, ff_pipe_rl_ }) {
+        for(int i = 0; i < 2; i++) {
+            if(p[i] >= 0) {
+                ::close(p[i]);
+                p[i] = -1;
+            }
+        }
+    }
+}
+
+
 std::string whitelist_make_key(MitmHostCX* cx)  {
     
     std::string key;
@@ -598,45 +905,36 @@ void MitmProxy::on_left_bytes(baseHostCX* cx) {
     }
     
     
-    // because we have left bytes, let's copy them into all right side sockets!
-    for(auto j: right_sockets) {
-        
-        if(!redirected) {
-            if(content_rule() != nullptr) {
-                buffer b = content_replace_apply(cx->to_read());
-                j->to_write(b);
-                DIA___("mitmproxy::on_left_bytes: original %d bytes replaced with %d bytes",cx->to_read().size(),b.size())
-            } else {
-                j->to_write(cx->to_read());
-                DIA___("mitmproxy::on_left_bytes: %d copied",cx->to_read().size())
-            }
-        } else {
-        
-            // rest of connections should be closed when sending replacement to a client
-            j->shutdown();
-        }
-    }    
-    for(auto j: right_delayed_accepts) {
-        
-        if(!redirected) {
-            if(content_rule() != nullptr) {
-                buffer b = content_replace_apply(cx->to_read());
-                j->to_write(b);
-                DIA___("mitmproxy::on_left_bytes: original %d bytes replaced with %d bytes into delayed",cx->to_read().size(),b.size())
-            } else {	  
-                j->to_write(cx->to_read());
-                DIA___("mitmproxy::on_left_bytes: %d copied to delayed",cx->to_read().size())
-            }
-        } else {
-        
-            // rest of connections should be closed when sending replacement to a client
-            j->shutdown();
-        }
-    }    
+    // prepare payload once, for all right side sockets
+    buffer src = cx->to_read();
+    buffer replaced;
+    const unsigned char* data = src.data();
+    unsigned int size = src.size();
+    
+    if(mh != nullptr && mh->http_tracking()) {
+        mh->http_track_request(src.data(),src.size());
+    }
+    
+    if(content_replacer() != nullptr && !redirected) {
+        int r = content_replacer()->process('L',src.data(),src.size(),replaced);
+        data = replaced.data();
+        size = replaced.size();
+        DIA___("mitmproxy::on_left_bytes: original %d bytes replaced with %d bytes (%d replacements)",src.size(),replaced.size(),r)
+    }
+    
+    if(!redirected) {
+        // because we have left bytes, let's copy them into all right side sockets!
+        queue_chunk(data,size,right_sockets);
+        queue_chunk(data,size,right_delayed_accepts);
+    } else {
+        // rest of connections should be closed when sending replacement to a client
+        for(auto j: right_sockets) j->shutdown();
+        for(auto j: right_delayed_accepts) j->shutdown();
+    }
 
     //update meters
-    total_mtr_up.update(cx->to_read().size());
-    mtr_up.update(cx->to_read().size());
+    total_mtr_up.update(src.size());
+    mtr_up.update(src.size());
 }
 
 void MitmProxy::on_right_bytes(baseHostCX* cx) {
@@ -654,32 +952,30 @@ void MitmProxy::on_right_bytes(baseHostCX* cx) {
     }
     
     
-    for(auto j: left_sockets) {
-        
-        if(content_rule() != nullptr) {
-            buffer b = content_replace_apply(cx->to_read());
-            j->to_write(b);
-            DIA___("mitmproxy::on_right_bytes: original %d bytes replaced with %d bytes",cx->to_read().size(),b.size())
-        } else {      
-            j->to_write(cx->to_read());
-            DIA___("mitmproxy::on_right_bytes: %d copied",cx->to_read().size())
-        }
+    // prepare payload once, for all left side sockets
+    buffer src = cx->to_read();
+    buffer replaced;
+    const unsigned char* data = src.data();
+    unsigned int size = src.size();
+    
+    MitmHostCX* mh = first_left();
+    if(mh != nullptr && mh->http_tracking()) {
+        mh->http_track_response(src.data(),src.size());
     }
-    for(auto j: left_delayed_accepts) {
-        
-        if(content_rule() != nullptr) {
-            buffer b = content_replace_apply(cx->to_read());
-            j->to_write(b);
-            DIA___("mitmproxy::on_right_bytes: original %d bytes replaced with %d bytes into delayed",cx->to_read().size(),b.size())
-        } else {      
-            j->to_write(cx->to_read()); 
-            DIA___("mitmproxy::on_right_bytes: %d copied to delayed",cx->to_read().size())
-        }
+    
+    if(content_replacer() != nullptr) {
+        int r = content_replacer()->process('R',src.data(),src.size(),replaced);
+        data = replaced.data();
+        size = replaced.size();
+        DIA___("mitmproxy::on_right_bytes: original %d bytes replaced with %d bytes (%d replacements)",src.size(),replaced.size(),r)
     }
+    
+    queue_chunk(data,size,left_sockets);
+    queue_chunk(data,size,left_delayed_accepts);
 
     // update meters
-    total_mtr_down.update(cx->to_read().size());
-    mtr_down.update(cx->to_read().size());
+    total_mtr_down.update(src.size());
+    mtr_down.update(src.size());
 }
 
 
@@ -755,6 +1051,8 @@ void MitmProxy::on_left_error(baseHostCX* cx) {
     
     if(this->dead()) return;  // don't process errors twice
 
+    // peer should get everything we received
+    content_replace_flush(true);
     
     DEB___("on_left_error[%s]: proxy marked dead",(this->error_on_read ? "read" : "write"));
     DUMS___(to_string().c_str());
@@ -822,6 +1120,8 @@ void MitmProxy::on_right_error(baseHostCX* cx)
 {
     if(this->dead()) return;  // don't process errors twice
     
+    content_replace_flush(true);
+    
     DEB___("on_right_error[%s]: proxy marked dead",(this->error_on_read ? "read" : "write"));
     
     if(write_payload()) {
@@ -958,7 +1258,7 @@ void MitmProxy::handle_replacement_auth(MitmHostCX* cx) {
             
             std::string token_text = cx->application_data->original_request();
           
-            for(auto i: cfgapi_obj_policy_profile_auth( cx->matched_policy())->sub_policies) {
+            for(auto i: config()->policy_profile_auth( cx->matched_policy())->sub_policies) {
                 DIA___("MitmProxy::handle_replacement_auth: token: requesting identity %s",i->name.c_str());
                 token_text  += " |" + i->name;
             }
@@ -1189,77 +1489,51 @@ void MitmProxy::handle_replacement_ssl(MitmHostCX* cx) {
     
 }
 
-void MitmProxy::init_content_replace() {
+void MitmProxy::content_replace(content_ruleset_ptr const& rules) {
     
-    if(content_rule_ != nullptr) {
-        DIAS___("MitmProxy::init_content_replace: deleting old replace rules");
-        delete content_rule_;
+    if(content_replacer_ != nullptr) {
+        DIAS___("MitmProxy::content_replace: deleting old replace rules");
+        delete content_replacer_;
     }
     
-    content_rule_ = new std::vector<ProfileContentRule>;
+    content_replacer_ = new ContentReplacer(rules);
 }
 
-buffer MitmProxy::content_replace_apply(buffer b) {
-    std::string data = b.to_string();
-    std::string result = data;
+void MitmProxy::queue_chunk(const unsigned char* data, unsigned int size, std::vector<baseHostCX*>& peers) {
     
-    int stage = 0;
-    for(auto i = content_rule()->begin(); i != content_rule()->end(); ++i) {
-        ProfileContentRule& profile = (*i);
+    for(auto j: peers) {
+        // pointer variant appends directly into write buffer, no temporary buffer object
+        j->to_write((unsigned char*)data,size);
+        stats_bytes_copied += size;
         
-        try {
-            std::regex re_match(profile.match.c_str());
-            std::string repl = profile.replace;
-            
-            if(profile.replace_each_nth != 0) {
-
-                // unfortunately std::regex_replace doesn't return if it really replaced something
-                // ... which is no problem if we don't care. But in case we want to replace only 
-                // .... nth occurence, we have to do extra search to check (requiring one extra regex match).
-                std::smatch sm;
-                bool is_there = std::regex_search(result,sm,re_match);
-
-                if(is_there) {
-                    profile.replace_each_counter_++;
-                    if(profile.replace_each_counter_ >= profile.replace_each_nth) {
-                        
-                        if(profile.fill_length) {
-                            result = regex_replace_fill(result, profile.match, repl);
-                        } else {
-                            result = std::regex_replace(result, re_match, repl);              
-                        }
-                        profile.replace_each_counter_ = 0;
-                        DIA___("Replacing bytes[stage %d]: n-th counter hit",stage);
-                    }
-                }
-                
-            } else {
-                if(profile.fill_length) {
-                    result = regex_replace_fill(result, profile.match, repl);
-                } else {
-                    result = std::regex_replace(result, re_match, repl);              
-                }
-            }
+        DIA___("MitmProxy::queue_chunk: %d bytes queued",size)
+    }
+}
 
-            DIA___("Replacing bytes[stage %d]:",stage);
+void MitmProxy::content_replace_flush(bool force) {
+    
+    if(content_replacer() == nullptr) {
+        return;
+    }
+    
+    // called every cycle: allocate only if there is something held
+    if(content_replacer()->holding('L')) {
+        buffer l;
+        if(content_replacer()->flush('L',l,force)) {
+            queue_chunk(l.data(),l.size(),right_sockets);
+            queue_chunk(l.data(),l.size(),right_delayed_accepts);
+            DIA___("MitmProxy::content_replace_flush: %d held bytes written right",l.size())
         }
-        catch(std::regex_error e) {
-        NOT___("MitmProxy::content_replace_apply: failed to replace string: %s",e.what());
+    }
+
+    if(content_replacer()->holding('R')) {
+        buffer r;
+        if(content_replacer()->flush('R',r,force)) {
+            queue_chunk(r.data(),r.size(),left_sockets);
+            queue_chunk(r.data(),r.size(),left_delayed_accepts);
+            DIA___("MitmProxy::content_replace_flush: %d held bytes written left",r.size())
         }
-        
-        ++stage;
     }
-    
-    
-    
-    
-    
-    buffer ret_b;
-    ret_b.append(result.c_str(),result.size());
-    
-    DIA___("content rewritten: original %d bytes with new %d bytes.",b.size(),ret_b.size());
-    DUM___("Replacing bytes (%d):\n%s\n# with bytes(%d):\n%s",data.size(),hex_dump(b).c_str(),ret_b.size(),hex_dump(ret_b).c_str());
-    return ret_b;
 }
 
 void MitmProxy::tap() {
@@ -1322,50 +1596,53 @@ MitmHostCX* MitmProxy::first_right() {
 
 bool MitmMasterProxy::ssl_autodetect = false;
 bool MitmMasterProxy::ssl_autodetect_harder = true;
+unsigned int MitmMasterProxy::ssl_autodetect_timeout = 12;
 
 #define NEW_CX_PEEK_BUFFER_SZ  10
-bool MitmMasterProxy::detect_ssl_on_plain_socket(int s) {
+int MitmMasterProxy::detect_ssl_on_plain_socket(int s) {
     
-    int ret = false;
+    int ret = SSL_DETECT_PLAIN;
 
-    int time_increment = 2500; // 2.5ms
-    int time_max = time_increment*5;
-    int time_taken = 0;
-    
     if (s > 0) {
-        again:
-        
         char peek_buffer[NEW_CX_PEEK_BUFFER_SZ];
         int b = ::recv(s,peek_buffer,NEW_CX_PEEK_BUFFER_SZ,MSG_PEEK|MSG_DONTWAIT);
         
         if(b > 6) {
             if (peek_buffer[0] == 0x16 && peek_buffer[1] == 0x03 && ( peek_buffer[5] == 0x00 || peek_buffer[5] == 0x01 || peek_buffer[5] == 0x02 )) {
                 INF___("detect_ssl_on_plain_socket: SSL detected on socket %d",s);
-                ret = true;
-            }
-        } else {
-            if(ssl_autodetect_harder && time_taken < time_max) {
-                struct timespec t;
-                t.tv_sec = 0;
-                t.tv_nsec = time_increment;
-                
-                ::nanosleep(&t,nullptr);
-                time_taken += time_increment;
-                DIA___("detect_ssl_on_plain_socket: SSL strict detection on socket %d: dalayed by %dnsec",s,time_increment);
-                goto again;
+                ret = SSL_DETECT_SSL;
             }
+        } 
+        else if(b > 0 || (b < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+            // not enough data (yet). EOF and errors are passed as plaintext.
+            ret = SSL_DETECT_UNKNOWN;
         }
     }
     
     return ret;
 }
 
+MitmMasterProxy::~MitmMasterProxy() {
+    for(auto& it: classifying_) {
+        delete it.second.cx;
+    }
+    classifying_.clear();
+    
+    if(classify_timer_ >= 0) {
+        ::close(classify_timer_);
+    }
+    if(classify_epoll_ >= 0) {
+        ::close(classify_epoll_);
+    }
+}
+
 baseHostCX* MitmMasterProxy::new_cx(int s) {
     
     DEBS___("MitmMasterProxy::new_cx: new_cx start");
     
     bool is_ssl = false;
     bool is_ssl_port = false;
+    bool pending = false;
     
     SSLCom* my_sslcom = dynamic_cast<SSLCom*>(com());
     baseCom* c = nullptr;
@@ -1377,7 +1654,12 @@ baseHostCX* MitmMasterProxy::new_cx(int s) {
     if(ssl_autodetect) {
         // my com is NOT ssl-based, trigger auto-detect
 
-        is_ssl = detect_ssl_on_plain_socket(s);
+        int d = detect_ssl_on_plain_socket(s);
+        is_ssl = (d == SSL_DETECT_SSL);
+        
+        // client didn't send anything yet: it will be decided when data arrive (see classify_park)
+        pending = (d == SSL_DETECT_UNKNOWN && ssl_autodetect_harder);
+        
         if(! is_ssl) {
             c = com()->slave();
         } else {
@@ -1399,15 +1681,189 @@ baseHostCX* MitmMasterProxy::new_cx(int s) {
     if(is_ssl_port) {
         r->is_ssl = true;
     }
+    r->ssl_autodetect_pending = pending;
     
     DEB___("Pausing new connection %s",r->c_name());
     r->paused(true);
     return r; 
 }
+
+void MitmMasterProxy::classify_park(MitmHostCX* cx) {
+    
+    int s = cx->socket();
+    
+    if(classify_epoll_ < 0) {
+        classify_epoll_ = ::epoll_create1(EPOLL_CLOEXEC);
+        
+        if(classify_epoll_ >= 0) {
+            // timer wakes us at the nearest deadline, even if parked clients stay silent
+            classify_timer_ = ::timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+            if(classify_timer_ >= 0) {
+                struct epoll_event tev;
+                memset(&tev,0,sizeof(tev));
+                tev.events = EPOLLIN;
+                tev.data.fd = classify_timer_;
+                ::epoll_ctl(classify_epoll_,EPOLL_CTL_ADD,classify_timer_,&tev);
+            }
+            
+            com()->set_monitor(classify_epoll_);
+            com()->set_poll_handler(classify_epoll_,this);
+        }
+    }
+    
+    // edge-triggered: socket with too few bytes to classify stays readable, but it's reported again only when
+    // more data (or hangup) arrive. Level-triggered, it would keep waking the worker until the deadline.
+    struct epoll_event ev;
+    memset(&ev,0,sizeof(ev));
+    ev.events = EPOLLIN|EPOLLRDHUP|EPOLLET;
+    ev.data.fd = s;
+    
+    if(classify_epoll_ < 0 || ::epoll_ctl(classify_epoll_,EPOLL_CTL_ADD,s,&ev) < 0) {
+        ERR___("Connection %s: cannot wait for SSL autodetection, passed as plaintext: %s",cx->c_name(),strerror(errno));
+        cx->ssl_autodetect_pending = false;
+        on_left_new(cx);
+        return;
+    }
+    
+    classify_entry e;
+    e.cx = cx;
+    e.seq = ++classify_seq_;
+    classifying_[s] = e;
+    
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ssl_autodetect_timeout);
+    classify_deadlines_.push_back(std::make_pair(deadline,std::make_pair(s,e.seq)));
+    
+    if(classify_deadlines_.size() == 1) {
+        classify_arm();
+    }
+    
+    DIA___("Connection %s: waiting for data to detect SSL, %d connections waiting",cx->c_name(),classifying_.size());
+}
+
+void MitmMasterProxy::classify_arm() {
+    
+    if(classify_timer_ < 0) {
+        return;
+    }
+    
+    struct itimerspec t;
+    memset(&t,0,sizeof(t));
+    
+    if(! classify_deadlines_.empty()) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(classify_deadlines_.front().first - std::chrono::steady_clock::now()).count();
+        // zero would disarm the timer
+        if(ns < 1000) ns = 1000;
+        
+        t.it_value.tv_sec = ns / 1000000000;
+        t.it_value.tv_nsec = ns % 1000000000;
+    }
+    
+    ::timerfd_settime(classify_timer_,0,&t,nullptr);
+}
+
+void MitmMasterProxy::classify_finish(int s, bool is_ssl) {
+    
+    auto it = classifying_.find(s);
+    if(it == classifying_.end()) {
+        return;
+    }
+    
+    MitmHostCX* cx = it->second.cx;
+    classifying_.erase(it);
+    ::epoll_ctl(classify_epoll_,EPOLL_CTL_DEL,s,nullptr);
+    
+    if(is_ssl) {
+        // context was created as plaintext, replace it with SSL one on the same socket
+        baseCom* c = new baseSSLMitmCom<SSLCom>();
+        c->master(com());
+        
+        MitmHostCX* n_cx = new MitmHostCX(c,s);
+        n_cx->paused(true);
+        n_cx->is_ssl = true;
+        n_cx->com()->name();
+        n_cx->name();
+        n_cx->com()->nonlocal_dst(true);
+        n_cx->com()->nonlocal_dst_host() = cx->com()->nonlocal_dst_host();
+        n_cx->com()->nonlocal_dst_port() = cx->com()->nonlocal_dst_port();
+        n_cx->com()->nonlocal_dst_resolved(cx->com()->nonlocal_dst_resolved());
+        
+        // we are using the socket, so we don't want it to be closed in cx destructor.
+        cx->remove_socket();
+        delete cx;
+        
+        n_cx->on_delay_socket(s);
+        cx = n_cx;
+        
+        INF___("Connection %s: SSL detected on unusual port.",cx->c_name());
+    }
+    
+    cx->ssl_autodetect_pending = false;
+    on_left_new(cx);
+}
+
+void MitmMasterProxy::classify_run() {
+    
+    if(classifying_.empty() && classify_deadlines_.empty()) {
+        return;
+    }
+    
+    // sockets which became readable (or hung up)
+    struct epoll_event events[64];
+    int n = ::epoll_wait(classify_epoll_,events,64,0);
+    
+    for(int i = 0; i < n; i++) {
+        int s = events[i].data.fd;
+        
+        if(s == classify_timer_) {
+            // consume expiration, so the timer doesn't keep epoll readable
+            uint64_t expirations;
+            if(::read(classify_timer_,&expirations,sizeof(expirations)) < 0 && errno != EAGAIN) {
+                DIA___("MitmMasterProxy::classify_run: timer read: %s",strerror(errno));
+            }
+            continue;
+        }
+        
+        int d = detect_ssl_on_plain_socket(s);
+        
+        // less than few bytes: wait for more unless peer is gone (next data trigger new edge)
+        if(d == SSL_DETECT_UNKNOWN && !(events[i].events & (EPOLLRDHUP|EPOLLHUP|EPOLLERR))) {
+            continue;
+        }
+        
+        classify_finish(s, d == SSL_DETECT_SSL);
+    }
+    
+    // deadlines are ordered, so only expired ones at front are visited. Entries already
+    // classified (or with socket number reused since) are just dropped.
+    auto now = std::chrono::steady_clock::now();
+    while(! classify_deadlines_.empty() && classify_deadlines_.front().first <= now) {
+        int s = classify_deadlines_.front().second.first;
+        unsigned long seq = classify_deadlines_.front().second.second;
+        classify_deadlines_.pop_front();
+        
+        auto it = classifying_.find(s);
+        if(it != classifying_.end() && it->second.seq == seq) {
+            DIA___("Connection %s: SSL detection timed out, passed as plaintext",it->second.cx->c_name());
+            classify_finish(s, detect_ssl_on_plain_socket(s) == SSL_DETECT_SSL);
+        }
+    }
+    
+    if(classifying_.empty()) {
+        classify_deadlines_.clear();
+    }
+    classify_arm();
+}
+
 void MitmMasterProxy::on_left_new(baseHostCX* just_accepted_cx) {
     // ok, we just accepted socket, created context for it (using new_cx) and we probably need ... 
     // to create child proxy and attach this cx to it.
 
+    MitmHostCX* mh = dynamic_cast<MitmHostCX*>(just_accepted_cx);
+    if(mh != nullptr && mh->ssl_autodetect_pending) {
+        classify_park(mh);
+        return;
+    }
+
     if(! just_accepted_cx->com()->nonlocal_dst_resolved()) {
         ERRS___("Was not possible to resolve original destination!");
         just_accepted_cx->shutdown();
@@ -1477,8 +1933,12 @@ void MitmMasterProxy::on_left_new(baseHostCX* just_accepted_cx) {
         new_proxy->radd(target_cx);
         bool delete_proxy = false;
         
+        // parse connection tuple once, all policy lookups will use it
+        ConnectionKey key;
+        key.load(just_accepted_cx,target_cx,PROTO_TCP);
+        
         // apply policy and get result
-        int policy_num = cfgapi_obj_policy_apply(just_accepted_cx,new_proxy);
+        int policy_num = cfgapi_obj_policy_apply(just_accepted_cx,new_proxy,&key);
 
         // bypass ssl com to VIP
         if(matched_vip) {
@@ -1508,6 +1968,8 @@ void MitmMasterProxy::on_left_new(baseHostCX* just_accepted_cx) {
                 src_cx->matched_policy(policy_num);
                 target_cx->matched_policy(policy_num);
                 new_proxy->matched_policy(policy_num);
+                src_cx->config(new_proxy->config());
+                target_cx->config(new_proxy->config());
 
                 // resolve source information - is there an identity info for that IP?
                 if(new_proxy->opt_auth_authenticate && new_proxy->opt_auth_resolve) {
@@ -1564,15 +2026,10 @@ void MitmMasterProxy::on_left_new(baseHostCX* just_accepted_cx) {
                         if(id_ptr != nullptr) {
                             //std::string groups = id_ptr->last_logon_info.groups();
                             
-                            if(cfgapi_obj_policy_profile_auth(policy_num) != nullptr)
-                            for ( auto i: cfgapi_obj_policy_profile_auth(policy_num)->sub_policies) {
-                                for(auto x: id_ptr->groups_vec) {
-                                    DEB___("Connection identities: ip identity '%s' against policy '%s'",x.c_str(),i->name.c_str());
-                                    if(x == i->name) {
-                                        DIA___("Connection identities: ip identity '%s' matches policy '%s'",x.c_str(),i->name.c_str());
-                                        bad_auth = false;
-                                    }
-                                }
+                            ProfileAuth* pa = new_proxy->config()->policy_at(policy_num)->profile_auth;
+                            if(pa != nullptr && pa->groups.intersects(id_ptr->groups_set)) {
+                                DIA___("Connection identities: ip identity groups '%s' match policy %d",id_ptr->groups.c_str(),policy_num);
+                                bad_auth = false;
                             }
                             if(bad_auth) {
                                 if(target_port != 80 && target_port != 443) {
@@ -1597,12 +2054,17 @@ void MitmMasterProxy::on_left_new(baseHostCX* just_accepted_cx) {
                 }
                 
                 // setup NAT
-                if(cfgapi_obj_policy.at(policy_num)->nat == POLICY_NAT_NONE && ! matched_vip) {
+                if(new_proxy->config()->policy_at(policy_num)->nat == POLICY_NAT_NONE && ! matched_vip) {
                     target_cx->com()->nonlocal_src(true);
                     target_cx->com()->nonlocal_src_host() = h;
                     target_cx->com()->nonlocal_src_port() = std::stoi(p);               
                 }
                 
+                // sessions not needing payload in user space are spliced in kernel
+                if(! matched_vip) {
+                    new_proxy->fast_forward_check();
+                }
+                
                 // finalize connection acceptance by adding new proxy to proxies and connect
                 this->proxies().push_back(new_proxy);
                 
@@ -1638,6 +2100,7 @@ void MitmMasterProxy::on_left_new(baseHostCX* just_accepted_cx) {
 
 int MitmMasterProxy::handle_sockets_once(baseCom* c) {
     //T_DIAS___("slist",5,this->hr()+"\n===============\n");
+    classify_run();
     return ThreadedAcceptorProxy<MitmProxy>::handle_sockets_once(c);
 }
 
@@ -1677,16 +2140,21 @@ void MitmUdpProxy::on_left_new(baseHostCX* just_accepted_cx)
     
     new_proxy->radd(target_cx);
 
+    ConnectionKey key;
+    key.load(just_accepted_cx,target_cx,PROTO_UDP);
+    
     // apply policy and get result
-    int policy_num = cfgapi_obj_policy_apply(just_accepted_cx,new_proxy);
+    int policy_num = cfgapi_obj_policy_apply(just_accepted_cx,new_proxy,&key);
     if(policy_num >= 0) {
         this->proxies().push_back(new_proxy);
         
         ((MitmHostCX*)just_accepted_cx)->matched_policy(policy_num);
         target_cx->matched_policy(policy_num);
         new_proxy->matched_policy(policy_num);
+        ((MitmHostCX*)just_accepted_cx)->config(new_proxy->config());
+        target_cx->config(new_proxy->config());
         
-        if(cfgapi_obj_policy.at(policy_num)->nat == POLICY_NAT_NONE) {
+        if(new_proxy->config()->policy_at(policy_num)->nat == POLICY_NAT_NONE) {
             target_cx->com()->nonlocal_src(true);
             target_cx->com()->nonlocal_src_host() = h;
             target_cx->com()->nonlocal_src_port() = std::stoi(p);               
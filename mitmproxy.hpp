@@ -31,6 +31,11 @@
 #include <policy.hpp>
 #include <cfgapi_auth.hpp>
 #include <filterproxy.hpp>
+#include <contentmatch.hpp>
+
+#include <deque>
+#include <chrono>
+#include <unordered_map>
 
 struct whitelist_verify_entry {
 };
@@ -50,9 +55,21 @@ protected:
     bool identity_resolved_time = 0;
     shm_logon_info_base* identity_ = nullptr;
     
-    std::vector<ProfileContentRule>* content_rule_ = nullptr; //save some space and store it as a pointer. Init it only when needed and delete in dtor.
+    ContentReplacer* content_replacer_ = nullptr; //save some space and store it as a pointer. Init it only when needed and delete in dtor.
     
     int matched_policy_ = -1;
+    cfgapi_snapshot_ptr config_;    // configuration this session was matched against
+    
+    bool ff_active_ = false;
+    int ff_pipe_lr_[2] = {-1,-1};
+    int ff_pipe_rl_[2] = {-1,-1};
+    unsigned int ff_pending_lr_ = 0;    // bytes spliced into pipe, not yet written out
+    unsigned int ff_pending_rl_ = 0;
+    bool ff_ktls_ = false;              // sides are TLS with kernel doing records
+    int ff_errno_ = 0;                  // error which stopped splicing
+    int ff_mode_l_ = 0;                 // epoll events currently monitored on left and right socket
+    int ff_mode_r_ = 0;
+    time_t ff_identity_at_ = 0;         // last identity refresh
     
 public: 
     time_t half_holdtimer = 0;
@@ -79,6 +96,8 @@ public:
     
     int matched_policy() { return matched_policy_; }
     void matched_policy(int p) { matched_policy_ = p; }    
+    cfgapi_snapshot_ptr const& config() { return config_; }
+    void config(cfgapi_snapshot_ptr const& c) { config_ = c; }
     
     inline bool identity_resolved();
     inline void identity_resolved(bool b);
@@ -125,15 +144,38 @@ public:
     
     virtual int handle_sockets_once(baseCom*);
     
-    void init_content_replace();
-    std::vector<ProfileContentRule>* content_rule() { return content_rule_; }    
-    void content_replace(std::vector<ProfileContentRule>& x) { 
-	for(auto i: x) {
-	    content_rule_->push_back(i);
-	}
-    }
-    
-    buffer content_replace_apply(buffer);
+    // received data are replaced once, then written to all peers
+    void content_replace(content_ruleset_ptr const& rules);
+    ContentReplacer* content_replacer() { return content_replacer_; }
+    // write data held back by replacer, if they wait too long (or always if forced)
+    void content_replace_flush(bool force=false);
+    
+    // write payload into all peers; each peer gets its own copy in its write buffer
+    void queue_chunk(const unsigned char* data, unsigned int size, std::vector<baseHostCX*>& peers);
+    unsigned long long stats_bytes_copied = 0;
+    
+    // Fast-forward: session doesn't need payload in user space (plaintext TCP or TLS with kTLS on both sides, 
+    // no content profile, no detection, no ALG, no payload writing). Once both sides are connected, write
+    // buffers are empty and identity is resolved (if policy requires it),
+    // contexts are paused and data are moved between sockets with splice() through pipe pair.
+    // Identity is refreshed every fast_forward_identity_interval seconds while data are moving.
+    static bool opt_fast_forward;
+    static unsigned int fast_forward_chunk;
+    static unsigned int fast_forward_identity_interval;
+    bool fast_forward_candidate = false;
+    bool fast_forward() const { return ff_active_; }
+    // decide if session can be fast-forwarded; call after policy is applied
+    bool fast_forward_check();
+    bool fast_forward_start();
+    // give sockets back to regular processing; data left in pipes are queued into write buffers
+    void fast_forward_stop();
+    // returns false if fast-forward was stopped
+    bool fast_forward_once();
+    // returns bytes read from 'from'; 'closed' is set on EOF or error
+    int  fast_forward_move(baseHostCX* from, baseHostCX* to, int* pipefd, unsigned int& pending, bool& closed);
+    // monitor source for reading only while its pipe is empty, destination for writing while pipe is not
+    void fast_forward_watch();
+    void fast_forward_close_pipes();
     
     void __debug_zero_connections(baseHostCX* cx);
     
@@ -160,6 +202,7 @@ class MitmMasterProxy : public ThreadedAcceptorProxy<MitmProxy> {
 public:
     
     MitmMasterProxy(baseCom* c, int worker_id) : ThreadedAcceptorProxy< MitmProxy >(c,worker_id) {};
+    virtual ~MitmMasterProxy();
     
     virtual baseHostCX* new_cx(int s);
     virtual void on_left_new(baseHostCX* just_accepted_cx);
@@ -167,9 +210,35 @@ public:
     
     static bool ssl_autodetect;
     static bool ssl_autodetect_harder;
-    bool detect_ssl_on_plain_socket(int s);
+    // how long we wait for the first bytes of connections which didn't send anything yet (msec)
+    static unsigned int ssl_autodetect_timeout;
+
+    // result of single non-blocking peek
+    enum { SSL_DETECT_PLAIN=0, SSL_DETECT_SSL, SSL_DETECT_UNKNOWN };
+    int detect_ssl_on_plain_socket(int s);
     
     time_t auth_table_refreshed = 0;
+
+protected:
+    // Connections with nothing to peek at yet are parked here, instead of sleeping in the acceptor.
+    // Parked sockets are registered (edge-triggered) in private epoll instance, which is itself monitored by the worker,
+    // so it wakes us up when any of them becomes readable, or when timerfd fires at the nearest deadline.
+    // Deadlines are in order of parking (fixed timeout).
+    struct classify_entry {
+        MitmHostCX* cx;
+        unsigned long seq;
+    };
+    std::unordered_map<int,classify_entry> classifying_;
+    std::deque<std::pair<std::chrono::steady_clock::time_point,std::pair<int,unsigned long>>> classify_deadlines_;
+    unsigned long classify_seq_ = 0;
+    int classify_epoll_ = -1;
+    int classify_timer_ = -1;
+
+    void classify_park(MitmHostCX* cx);
+    // set timer to the nearest deadline
+    void classify_arm();
+    void classify_run();
+    void classify_finish(int s, bool is_ssl);
 };
 
 
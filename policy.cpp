@@ -17,10 +17,57 @@
     
 */  
 
+#include <cstdlib>
+
 #include <policy.hpp>
 
 DEFINE_LOGGING(PolicyRule);
 
+
+// port string to number; returns -1 if it's not a valid port
+static int policy_parse_port(std::string const& s) {
+    if(s.empty()) return -1;
+    
+    char* end = nullptr;
+    long p = ::strtol(s.c_str(),&end,10);
+    if(*end != 0 || p < 0 || p > 65535) {
+        return -1;
+    }
+    
+    return (int)p;
+}
+
+bool ConnectionKey::load(baseHostCX* left, baseHostCX* right, int l4proto) {
+    
+    valid = false;
+    proto = l4proto;
+    
+    if(left == nullptr || right == nullptr) {
+        return false;
+    }
+    
+    int sp = policy_parse_port(left->port());
+    int dp = policy_parse_port(right->port());
+    
+    if(sp < 0 || dp < 0) {
+        return false;
+    }
+    
+    src_port = (uint16_t)sp;
+    dst_port = (uint16_t)dp;
+    
+    valid = src.load(left->host().c_str()) && dst.load(right->host().c_str());
+    return valid;
+}
+
+std::string ConnectionKey::to_string() const {
+    if(!valid) {
+        return "ConnectionKey: invalid";
+    }
+    
+    return string_format("ConnectionKey: [%d] %s:%d -> %s:%d",proto,src.to_string().c_str(),src_port,dst.to_string().c_str(),dst_port);
+}
+
 std::string PolicyRule::to_string(int verbosity) {
 
     std::string from = "PolicyRule:";
@@ -90,7 +137,7 @@ std::string PolicyRule::to_string(int verbosity) {
             break;
     }
     
-    out += " [" + std::to_string(cnt_matches) + "]";
+    out += " [" + std::to_string(cnt_matches.load()) + "]";
     
     if(verbosity > INF) {
         out+=": ";
@@ -105,55 +152,104 @@ std::string PolicyRule::to_string(int verbosity) {
 }
 
 
-bool PolicyRule::match_addrgrp_cx(std::vector< AddressObject* >& sources, baseHostCX* cx) {
+void AddressGroupMatcher::compile(std::vector<AddressObject*>& grp) {
+    clear();
+
+    for(auto ao: grp) {
+        CidrAddress* ca = dynamic_cast<CidrAddress*>(ao);
+        if(ca != nullptr && ca->cidr() != nullptr) {
+            cidrs.insert(ca->cidr()) = ao;
+        } else {
+            others.push_back(ao);
+        }
+    }
+
+    compiled = true;
+}
+
+bool AddressGroupMatcher::match(AddressKey const& key) {
+
+    if(cidrs.lookup(key,[](AddressObject*&){}) > 0) {
+        return true;
+    }
+
+    for(auto ao: others) {
+        if(ao->match(key)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void PolicyRule::compile() {
+    src_matcher_.compile(src);
+    dst_matcher_.compile(dst);
+}
+
+AddressGroupMatcher* PolicyRule::matcher(std::vector<AddressObject*>& grp) {
+    if(&grp == &src && src_matcher_.compiled) return &src_matcher_;
+    if(&grp == &dst && dst_matcher_.compiled) return &dst_matcher_;
+
+    return nullptr;
+}
+
+bool PolicyRule::match_addrgrp_key(std::vector< AddressObject* >& sources, AddressKey const& key) {
     bool match = false;
     
     if(sources.size() == 0) {
         match = true;
-//                 DIAS_("PolicyRule: matched ");
     } else {
-        CIDR* l = cidr_from_str(cx->host().c_str());
+        AddressGroupMatcher* m = matcher(sources);
+        if(m != nullptr) {
+            match = m->match(key);
+            DIA_("PolicyRule::match_addrgrp_key: %s in compiled group: %d",key.to_string().c_str(),match);
+            return match;
+        }
+
         for(std::vector<AddressObject*>::iterator j = sources.begin(); j != sources.end(); ++j ) {
             AddressObject* comp = (*j);
             
-            if(comp->match(l)) {
-                if(LEV_(DIA)) {
-                    char* a = cidr_to_str(l);
-                    DIA_("PolicyRule::match_addrgrp_cx: comparing %s with rule %s: matched",a,comp->to_string().c_str());
-                    delete a;
-                }
+            if(comp->match(key)) {
+                DIA_("PolicyRule::match_addrgrp_key: comparing %s with rule %s: matched",key.to_string().c_str(),comp->to_string().c_str());
                 match = true;
                 break;
             } else {
-                if(LEV_(DIA)) {
-                    char* a = cidr_to_str(l);
-                    DIA_("PolicyRule::match_addrgrp_cx: comparing %s with rule %s: not matched",a,comp->to_string().c_str());
-                    delete[] a;
-                }
+                DIA_("PolicyRule::match_addrgrp_key: comparing %s with rule %s: not matched",key.to_string().c_str(),comp->to_string().c_str());
             }
         }
-        cidr_free(l);
     }
 
     return match;
 }
 
-bool PolicyRule::match_rangegrp_cx(std::vector< range >& ranges, baseHostCX* cx) {
+bool PolicyRule::match_addrgrp_cx(std::vector< AddressObject* >& sources, baseHostCX* cx) {
+    
+    if(sources.size() == 0) {
+        return true;
+    }
+    
+    AddressKey key;
+    key.load(cx->host().c_str());
+    
+    return match_addrgrp_key(sources,key);
+}
+
+bool PolicyRule::match_rangegrp_key(std::vector< range >& ranges, int p) {
     bool match = false;
     
     if(ranges.size() == 0) {
         match = true;
-//                 DIAS_("PolicyRule: matched ");
     } else {
-        int p = std::stoi(cx->port());
         for(std::vector<range>::iterator j = ranges.begin(); j != ranges.end(); ++j ) {
             range& comp = (*j);
             if((p >= comp.first) && (p <= comp.second)) {
-                DIA_("PolicyRule::match_rangergrp_cx: comparing %d with %s: matched",p,rangetos(comp).c_str());
+                DIA_("PolicyRule::match_rangergrp_key: comparing %d with %s: matched",p,rangetos(comp).c_str());
                 match = true;
                 break;
             } else {
-                DIA_("PolicyRule::match_rangergrp_cx: comapring %d with %s: not matched",p,rangetos(comp).c_str());
+                DIA_("PolicyRule::match_rangergrp_key: comparing %d with %s: not matched",p,rangetos(comp).c_str());
             }
         }
     }
@@ -161,6 +257,21 @@ bool PolicyRule::match_rangegrp_cx(std::vector< range >& ranges, baseHostCX* cx)
     return match;
 }
 
+bool PolicyRule::match_rangegrp_cx(std::vector< range >& ranges, baseHostCX* cx) {
+    
+    if(ranges.size() == 0) {
+        return true;
+    }
+    
+    int p = policy_parse_port(cx->port());
+    if(p < 0) {
+        DIA_("PolicyRule::match_rangergrp_cx: invalid port '%s'",cx->port().c_str());
+        return false;
+    }
+    
+    return match_rangegrp_key(ranges,p);
+}
+
 bool PolicyRule::match_rangegrp_vecx(std::vector< range >& ranges, std::vector< baseHostCX* >& vecx) {
     bool match = false;
     
@@ -231,7 +342,7 @@ bool PolicyRule::match(baseProxy* p) {
     
     end:
     
-    if (lmatch && lmatch && rmatch && rpmatch) {
+    if (lmatch && lpmatch && rmatch && rpmatch) {
         DIAS_("PolicyRule::match ok");
         cnt_matches++;
         
@@ -286,6 +397,45 @@ bool PolicyRule::match(std::vector<baseHostCX*>& l, std::vector<baseHostCX*>& r)
     return false;
 }
 
+bool PolicyRule::match(ConnectionKey const& key) {
+    bool lmatch = false;
+    bool lpmatch = false;
+    bool rmatch = false;
+    bool rpmatch = false;
+    
+    DIAS_("PolicyRule::match_key");
+    
+    if(!key.valid) {
+        DIAS_("PolicyRule::match_key: key is not valid");
+        goto end;
+    }
+    
+    lmatch = match_addrgrp_key(src,key.src);
+    if(!lmatch) goto end;
+
+    lpmatch = match_rangegrp_key(src_ports,key.src_port);
+    if(!lpmatch) goto end;
+
+    rmatch = match_addrgrp_key(dst,key.dst);
+    if(!rmatch) goto end;
+
+    rpmatch = match_rangegrp_key(dst_ports,key.dst_port);
+    if(!rpmatch) goto end;
+    
+    end:
+    
+    if (lmatch && lpmatch && rmatch && rpmatch) {
+        DIAS_("PolicyRule::match_key ok");
+        cnt_matches++;
+        
+        return true;
+    } else {
+        DIA_("PolicyRule::match_key failed: %d:%d->%d:%d",lmatch,lpmatch,rmatch,rpmatch);
+    }
+
+    return false;
+}
+
 PolicyRule::~PolicyRule() {
 }
 
@@ -22,12 +22,18 @@
  
  
 #include <vector> 
+#include <memory>
+#include <functional>
+#include <atomic>
 
 #include <hostcx.hpp>
 #include <baseproxy.hpp>
 #include <cidr.hpp>
 #include <ranges.hpp>
 #include <addrobj.hpp>
+#include <addrtrie.hpp>
+#include <domaintrie.hpp>
+#include <authgroup.hpp>
 
 #include <sobject.hpp>
 
@@ -40,10 +46,61 @@
 
 struct ProfileDetection;
 struct ProfileContent;
+class ContentRuleSet;
 struct ProfileTls;
 struct ProfileAuth;
 struct ProfileAlgDns;
 
+// immutable configuration snapshot (see cfgapi.hpp), sessions keep reference to the one they started with
+struct CfgSnapshot;
+typedef std::shared_ptr<CfgSnapshot> cfgapi_snapshot_ptr;
+
+
+// Connection tuple parsed once per session. It's small and meant to be kept on stack;
+// policy matching against it doesn't allocate nor parse strings.
+struct ConnectionKey {
+    AddressKey src;
+    AddressKey dst;
+    uint16_t src_port = 0;
+    uint16_t dst_port = 0;
+    int proto = 0;
+    bool valid = false;
+    
+    bool load(baseHostCX* left, baseHostCX* right, int l4proto);
+    std::string to_string() const;
+};
+
+// Address group prepared for matching: CIDR objects are merged into prefix trie, so lookup cost
+// doesn't depend on group size. Objects which cannot be expressed as prefix (FQDN) are checked one by one.
+struct AddressGroupMatcher {
+    bool compiled = false;
+    AddressTrie<AddressObject*> cidrs;   // one of objects with the same prefix is kept
+    std::vector<AddressObject*> others;
+
+    void compile(std::vector<AddressObject*>& grp);
+    void clear() { compiled = false; cidrs.clear(); others.clear(); }
+    // group must be non-empty - empty group matches anything and it's handled by caller
+    bool match(AddressKey const& key);
+};
+
+class Inspector;
+class AppHostCX;
+
+// creates inspector set up from policy profile, or returns nullptr if connection is not interesting for it
+typedef std::function<Inspector*(AppHostCX*)> inspector_factory;
+
+// Per-policy data resolved when policy is compiled, so applying policy on accepted connection
+// doesn't have to look anything up.
+struct PolicyProfileBundle {
+    struct inspector_entry {
+        std::string name;           // abbreviation for connection log line
+        inspector_factory create;
+    };
+    std::vector<inspector_entry> inspectors;
+
+    // TLS profile has SNI bypass list which should be checked against DNS cache
+    bool tls_sni_bypass_dns = false;
+};
 
 struct ProfileList {
        ProfileContent* profile_content = nullptr;
@@ -56,7 +113,7 @@ struct ProfileList {
 class PolicyRule : public ProfileList , public socle::sobject {
 
 public:
-       unsigned int cnt_matches = 0;
+       std::atomic<unsigned int> cnt_matches{0};  // policy is matched from all worker threads without lock
     
        int proto = 6;
        bool proto_default = true;
@@ -73,21 +130,36 @@ public:
 
        int action = POLICY_ACTION_PASS;
        int nat    = POLICY_NAT_NONE;
+
+       // filled by cfgapi_compile_obj_policy()
+       PolicyProfileBundle bundle;
       
        PolicyRule() : ProfileList(), socle::sobject() {};
        virtual ~PolicyRule();
+
+       // prepare address groups for matching; must be called again if src or dst is modified
+       void compile();
        
        bool match(baseProxy*);
        bool match(std::vector<baseHostCX*>& l, std::vector<baseHostCX*>& r);
+       bool match(ConnectionKey const& key);
        
        bool match_addrgrp_cx(std::vector<AddressObject*>& cidrs,baseHostCX* cx);
        bool match_addrgrp_vecx(std::vector<AddressObject*>& cidrs,std::vector<baseHostCX*>& vecx);
+       bool match_addrgrp_key(std::vector<AddressObject*>& cidrs,AddressKey const& key);
        bool match_rangegrp_cx(std::vector<range>& ranges,baseHostCX* cx);
        bool match_rangegrp_vecx(std::vector<range>& ranges,std::vector<baseHostCX*>& vecx);
+       bool match_rangegrp_key(std::vector<range>& ranges,int port);
        
        virtual bool ask_destroy() { return false; }
        virtual std::string to_string(int verbosity = 6);
-       
+
+private:
+       AddressGroupMatcher src_matcher_;
+       AddressGroupMatcher dst_matcher_;
+       AddressGroupMatcher* matcher(std::vector<AddressObject*>& grp);
+
+public:
        DECLARE_C_NAME("PolicyRule");
        DECLARE_LOGGING(to_string);       
 };
@@ -102,6 +174,8 @@ public:
      *  2   MODE_PRE  -- should be default, but not safe when cannot peek()
      */
     int mode = 0;
+    // inspected flow is compacted above this size (bytes); 0 means unlimited
+    int flow_max_bytes = 131072;
     std::string prof_name;
     
     virtual bool ask_destroy() { return false; };
@@ -119,7 +193,6 @@ public:
     std::string replace;
     bool fill_length = false;
     int replace_each_nth = 0;
-    int replace_each_counter_ = 0;
     
     virtual bool ask_destroy() { return false; };
     virtual std::string to_string(int verbosity = 6) {
@@ -139,6 +212,8 @@ public:
     std::string prof_name;
     
     std::vector<ProfileContentRule> content_rules;
+    // content_rules compiled at load, shared by sessions
+    std::shared_ptr<ContentRuleSet> compiled_rules;
 
 
     virtual bool ask_destroy() { return false; };
@@ -182,22 +257,24 @@ public:
     
     bool sni_filter_use_dns_cache = true;       // if sni_filter_bypass is set, check during policy match if target IP isn't in DNS cache matching SNI filter entries.
                                                 // For example: 
-                                                // Connection to 1.1.1.1 policy check will look in all SNI filter entries ["abc.com","mybank.com"] and will try to find them in DNS cache. 
-                                                // Sni filter entry mybank.com is found in DNS cache pointing to 1.1.1.1. Connection is bypassed.
-                                                // Load increases with SNI filter length lineary, but DNS cache lookup is fast.
+                                                // Connection to 1.1.1.1 policy check will look up names 1.1.1.1 was resolved from in DNS cache, and will try to find them in SNI filter entries ["abc.com","mybank.com"]. 
+                                                // mybank.com is found in DNS cache pointing to 1.1.1.1 and it's in SNI filter. Connection is bypassed.
+                                                // Cost doesn't depend on SNI filter length, see sni_filter_bypass_domains.
                                                 // DNS cache has to be active this to be working.
     bool sni_filter_use_dns_domain_tree = true;
-                                                // check IP address in full domain tree for each SNI filter entry.
-                                                // if SNI filter entry can't be found in DNS cache, try to look in all DNS subdomains of SNI filter entries.
+                                                // SNI filter entries match also names in their domain tree, at any depth.
                                                 // Example:
                                                 // Consider SNI filter from previous example. You are now connecting to ip 2.2.2.2. 
-                                                // Based on previous DNS traffic, there is subdomain cache for "mybank.com" filled with entries "www" and "ecom".
-                                                // Both "www" and "ecom" are searched in DNS cache. www points to 1.1.1.1, but ecom points to 2.2.2.2. 
-                                                // Connection is bypassed.
+                                                // Based on previous DNS traffic, DNS cache has "www.mybank.com" pointing to 1.1.1.1 and "ecom.mybank.com" to 2.2.2.2.
+                                                // ecom.mybank.com is under mybank.com. Connection is bypassed.
                                                 // DNS cache has to active and sni_filter_use_dns_cache enabled before this feature can be activated.
-                                                // Load increases with SNI filter size and subdomain cache, both lineary, so it's intensive feature.
+    
+    // SNI filter entries as domain trie, checked against DNS cache names of target IP. Entries like "*.example.com"
+    // or regular expression "[^.]\.example.com" match only names under example.com. Built when profile is loaded.
+    DomainTrie sni_filter_bypass_domains;
     
     bool sslkeylog = false;                     // disable or enable ssl keylogging on this profile
+    bool ktls = false;                          // hand record encryption to kernel TLS after handshake (if cipher is supported)
 
 
     virtual bool ask_destroy() { return false; };
@@ -238,6 +315,7 @@ public:
 
 struct ProfileSubAuth : public ProfileList {
     std::string name;
+    unsigned int group_id = 0;  // interned name
 };
 
 struct ProfileAuth {
@@ -245,6 +323,17 @@ struct ProfileAuth {
     bool resolve = false;  // resolve traffic by ip in auth table
     std::string prof_name;
     std::vector<ProfileSubAuth*> sub_policies;
+    GroupSet groups;            // group IDs of all sub_policies
+    
+    // first sub-profile matching one of groups, nullptr if none
+    ProfileSubAuth* match_groups(GroupSet const& g) {
+        if(! groups.intersects(g)) return nullptr;
+        
+        for(auto sub: sub_policies) {
+            if(g.contains(sub->group_id)) return sub;
+        }
+        return nullptr;
+    }
 };
 
 struct ProfileAlgDns {
@@ -0,0 +1,328 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+
+#include <policyidx.hpp>
+#include <logger.hpp>
+
+
+void PolicyIndexDimension::add(unsigned int index, uint32_t first, uint32_t last) {
+    item i;
+    i.index = index;
+    i.first = first;
+    i.last = last;
+    i.any = false;
+
+    items_.push_back(i);
+}
+
+void PolicyIndexDimension::add_any(unsigned int index) {
+    item i;
+    i.index = index;
+    i.first = 0;
+    i.last = UINT32_MAX;
+    i.any = true;
+
+    items_.push_back(i);
+}
+
+void PolicyIndexDimension::clear() {
+    items_.clear();
+    bounds_.clear();
+    sets_.clear();
+}
+
+void PolicyIndexDimension::compile(unsigned int rules) {
+
+    bounds_.clear();
+    sets_.clear();
+
+    bounds_.push_back(0);
+    for(auto const& i: items_) {
+        if(i.any) continue;
+
+        bounds_.push_back(i.first);
+        if(i.last < UINT32_MAX) {
+            bounds_.push_back(i.last + 1);
+        }
+    }
+    std::sort(bounds_.begin(),bounds_.end());
+    bounds_.erase(std::unique(bounds_.begin(),bounds_.end()),bounds_.end());
+
+    unsigned int words = (rules + 63)/64;
+    sets_.assign(bounds_.size(),policy_bitset(words,0));
+
+    for(auto const& i: items_) {
+
+        uint64_t bit = ((uint64_t)1) << (i.index % 64);
+        unsigned int word = i.index / 64;
+
+        // interval boundaries are cut at each range, so range always covers whole intervals
+        unsigned int x = 0;
+        if(!i.any) {
+            x = std::lower_bound(bounds_.begin(),bounds_.end(),i.first) - bounds_.begin();
+        }
+
+        for( ; x < bounds_.size() && bounds_[x] <= i.last; ++x) {
+            sets_[x][word] |= bit;
+        }
+    }
+
+    // items are not needed after compilation
+    items_.clear();
+}
+
+const policy_bitset& PolicyIndexDimension::lookup(uint32_t key) const {
+    auto it = std::upper_bound(bounds_.begin(),bounds_.end(),key);
+    return sets_[it - bounds_.begin() - 1];
+}
+
+
+void PolicyIndexAddrDimension::add(unsigned int index, CIDR* c) {
+    item i;
+    i.index = index;
+    i.cidr = c;
+
+    items_.push_back(i);
+}
+
+void PolicyIndexAddrDimension::add_any(unsigned int index) {
+    item i;
+    i.index = index;
+    i.cidr = nullptr;
+
+    items_.push_back(i);
+}
+
+void PolicyIndexAddrDimension::clear() {
+    items_.clear();
+    trie_.clear();
+    any_.clear();
+}
+
+void PolicyIndexAddrDimension::compile(unsigned int rules) {
+
+    trie_.clear();
+
+    unsigned int words = (rules + 63)/64;
+    any_.assign(words,0);
+
+    for(auto const& i: items_) {
+
+        uint64_t bit = ((uint64_t)1) << (i.index % 64);
+        unsigned int word = i.index / 64;
+
+        if(i.cidr == nullptr) {
+            any_[word] |= bit;
+            continue;
+        }
+
+        policy_bitset& set = trie_.insert(i.cidr);
+        if(set.size() != words) {
+            set.assign(words,0);
+        }
+        set[word] |= bit;
+    }
+
+    items_.clear();
+}
+
+void PolicyIndexAddrDimension::and_lookup(AddressKey const& key, uint64_t* out, unsigned int words) {
+
+    // rules of all prefixes on the path are ORed together with 'any' rules, then ANDed into out.
+    // Path is collected on stack, so no temporary set is needed.
+    const uint64_t* path[POLICYIDX_MAX_PATH];
+    unsigned int n = 0;
+
+    trie_.lookup(key,[&path,&n](policy_bitset& set) {
+        if(n < POLICYIDX_MAX_PATH) {
+            path[n++] = set.data();
+        }
+    });
+
+    for(unsigned int w = 0; w < words; w++) {
+        uint64_t m = any_[w];
+        for(unsigned int p = 0; p < n; p++) {
+            m |= path[p][w];
+        }
+        out[w] &= m;
+    }
+}
+
+
+void PolicyIndex::clear() {
+    compiled_ = false;
+    rules_ = 0;
+    words_ = 0;
+
+    src_addr_.clear();
+    dst_addr_.clear();
+    src_port_.clear();
+    dst_port_.clear();
+}
+
+
+// add group of address objects into dimension. CIDRs (IPv4 and IPv6) are indexed, anything else (FQDN objects)
+// makes rule candidate for all addresses.
+static void policyidx_add_addrgrp(PolicyIndexAddrDimension& dim, unsigned int index, std::vector<AddressObject*>& grp) {
+
+    if(grp.size() == 0) {
+        dim.add_any(index);
+        return;
+    }
+
+    for(auto ao: grp) {
+        CidrAddress* ca = dynamic_cast<CidrAddress*>(ao);
+        if(ca == nullptr || ca->cidr() == nullptr) {
+            dim.add_any(index);
+            return;
+        }
+    }
+
+    for(auto ao: grp) {
+        dim.add(index,dynamic_cast<CidrAddress*>(ao)->cidr());
+    }
+}
+
+static void policyidx_add_rangegrp(PolicyIndexDimension& dim, unsigned int index, std::vector<range>& grp) {
+
+    if(grp.size() == 0) {
+        dim.add_any(index);
+        return;
+    }
+
+    for(auto const& r: grp) {
+        if(r.second < r.first || r.second < 0) {
+            continue;
+        }
+        dim.add(index, r.first < 0 ? 0 : r.first, r.second);
+    }
+}
+
+void PolicyIndex::compile(std::vector<PolicyRule*>& rules) {
+
+    clear();
+
+    rules_ = rules.size();
+    words_ = (rules_ + 63)/64;
+
+    for(unsigned int i = 0; i < rules_; i++) {
+        PolicyRule* rule = rules[i];
+
+        policyidx_add_addrgrp(src_addr_,i,rule->src);
+        policyidx_add_addrgrp(dst_addr_,i,rule->dst);
+        policyidx_add_rangegrp(src_port_,i,rule->src_ports);
+        policyidx_add_rangegrp(dst_port_,i,rule->dst_ports);
+    }
+
+    src_addr_.compile(rules_);
+    dst_addr_.compile(rules_);
+    src_port_.compile(rules_);
+    dst_port_.compile(rules_);
+
+    compiled_ = true;
+
+    DIA_("PolicyIndex::compile: %d rules compiled: %s",rules_,to_string().c_str());
+}
+
+
+void PolicyIndex::candidates(ConnectionKey const& key, uint64_t* out) {
+
+    policy_bitset const& sport = src_port_.lookup(key.src_port);
+    policy_bitset const& dport = dst_port_.lookup(key.dst_port);
+
+    for(unsigned int w = 0; w < words_; w++) {
+        out[w] = sport[w] & dport[w];
+    }
+
+    src_addr_.and_lookup(key.src,out,words_);
+    dst_addr_.and_lookup(key.dst,out,words_);
+}
+
+
+int PolicyIndex::match(std::vector<PolicyRule*>& rules, ConnectionKey const& key) {
+
+    if(!compiled_ || rules.size() != rules_ || !key.valid) {
+        return POLICYIDX_NOINDEX;
+    }
+
+    // per-thread scratch set: it grows only when policy gets more rules, otherwise matching doesn't allocate
+    static thread_local policy_bitset cand;
+    if(cand.size() < words_) {
+        cand.resize(words_);
+    }
+    candidates(key,cand.data());
+
+    for(unsigned int w = 0; w < words_; w++) {
+        uint64_t bits = cand[w];
+        while(bits) {
+            unsigned int x = w*64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            if(rules[x]->match(key)) {
+                DIA_("PolicyIndex::match: matched #%d",x);
+                return x;
+            }
+        }
+    }
+
+    return -1;
+}
+
+int PolicyIndex::match(std::vector<PolicyRule*>& rules, baseProxy* proxy) {
+
+    if(proxy == nullptr) {
+        return POLICYIDX_NOINDEX;
+    }
+
+    // index handles only the usual case of single left and right context
+    if(proxy->ls().size() + proxy->lda().size() != 1 || proxy->rs().size() + proxy->rda().size() != 1) {
+        return POLICYIDX_NOINDEX;
+    }
+
+    baseHostCX* left = proxy->ls().size() ? proxy->ls().at(0) : proxy->lda().at(0);
+    baseHostCX* right = proxy->rs().size() ? proxy->rs().at(0) : proxy->rda().at(0);
+
+    ConnectionKey key;
+    key.load(left,right,0);
+
+    return match(rules,key);
+}
+
+int PolicyIndex::match(std::vector<PolicyRule*>& rules, std::vector<baseHostCX*>& left, std::vector<baseHostCX*>& right) {
+
+    if(left.size() != 1 || right.size() != 1) {
+        return POLICYIDX_NOINDEX;
+    }
+
+    ConnectionKey key;
+    key.load(left.at(0),right.at(0),0);
+
+    return match(rules,key);
+}
+
+std::string PolicyIndex::to_string(int verbosity) {
+    if(!compiled_) {
+        return "PolicyIndex: not compiled";
+    }
+
+    return string_format("PolicyIndex: rules=%d prefixes: src=%d dst=%d, intervals: sport=%d dport=%d",
+                         rules_,src_addr_.prefixes(),dst_addr_.prefixes(),src_port_.intervals(),dst_port_.intervals());
+}
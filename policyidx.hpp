@@ -0,0 +1,134 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef POLICYIDX_HPP
+ #define POLICYIDX_HPP
+
+#include <vector>
+#include <cstdint>
+
+#include <hostcx.hpp>
+#include <baseproxy.hpp>
+#include <policy.hpp>
+#include <addrtrie.hpp>
+
+// set of policy candidates: bit N set means policy rule N could match. Sets are allocated when policy
+// is compiled; lookups only AND them into caller's buffer.
+typedef std::vector<uint64_t> policy_bitset;
+
+// longest prefix path in the address trie: /0 to /128
+#define POLICYIDX_MAX_PATH 129
+
+//
+// One dimension of compiled policy. Key space (ports) is cut into
+// intervals at every rule boundary. Each interval carries set of rules which could match
+// any key inside of it, so lookup is single binary search.
+//
+class PolicyIndexDimension {
+public:
+    // rule 'index' matches keys between first and last (inclusive)
+    void add(unsigned int index, uint32_t first, uint32_t last);
+    // rule 'index' matches any key in this dimension
+    void add_any(unsigned int index);
+
+    void compile(unsigned int rules);
+    void clear();
+
+    const policy_bitset& lookup(uint32_t key) const;
+    unsigned int intervals() const { return bounds_.size(); }
+
+private:
+    struct item {
+        unsigned int index;
+        uint32_t first;
+        uint32_t last;
+        bool any;
+    };
+    std::vector<item> items_;
+
+    std::vector<uint32_t> bounds_;      // sorted starts of intervals, bounds_[0] is always 0
+    std::vector<policy_bitset> sets_;   // sets_[i] is valid for keys in <bounds_[i], bounds_[i+1])
+};
+
+
+//
+// Address dimension of compiled policy. Each CIDR prefix carries set of rules referencing it;
+// lookup ORs sets found along the trie path (all prefixes containing the address) with rules
+// matching any address. Works for both IPv4 and IPv6.
+//
+class PolicyIndexAddrDimension {
+public:
+    void add(unsigned int index, CIDR* c);
+    void add_any(unsigned int index);
+
+    void compile(unsigned int rules);
+    void clear();
+
+    // AND set of rules which could match the key into out[0..words)
+    void and_lookup(AddressKey const& key, uint64_t* out, unsigned int words);
+    unsigned int prefixes() const { return trie_.size(); }
+
+private:
+    struct item {
+        unsigned int index;
+        CIDR* cidr;
+    };
+    std::vector<item> items_;
+
+    AddressTrie<policy_bitset> trie_;
+    policy_bitset any_;
+};
+
+
+//
+// Compiled policy - built from policy rule list after it's loaded. It doesn't replace rule matching,
+// it only narrows list of rules which are worth full check. Candidates are checked in ascending
+// order, so first-match semantics (and PolicyRule::cnt_matches) are kept.
+//
+class PolicyIndex {
+public:
+    void compile(std::vector<PolicyRule*>& rules);
+    void clear();
+    bool compiled() const { return compiled_; }
+
+    // return index of the first matching rule, -1 if no rule matches, or
+    // POLICYIDX_NOINDEX if connection cannot be looked up in index (caller should use linear scan)
+    int match(std::vector<PolicyRule*>& rules, ConnectionKey const& key);
+    int match(std::vector<PolicyRule*>& rules, baseProxy* proxy);
+    int match(std::vector<PolicyRule*>& rules, std::vector<baseHostCX*>& left, std::vector<baseHostCX*>& right);
+
+    std::string to_string(int verbosity=iINF);
+
+    static const int POLICYIDX_NOINDEX = -2;
+
+private:
+    // fill out[0..words_) with candidate rules; doesn't allocate
+    void candidates(ConnectionKey const& key, uint64_t* out);
+
+    bool compiled_ = false;
+    unsigned int rules_ = 0;
+    unsigned int words_ = 0;
+
+    PolicyIndexAddrDimension src_addr_;
+    PolicyIndexAddrDimension dst_addr_;
+    PolicyIndexDimension src_port_;
+    PolicyIndexDimension dst_port_;
+};
+
+#endif
@@ -0,0 +1,208 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstring>
+
+#include <sigprefilter.hpp>
+#include <display.hpp>
+#include <logger.hpp>
+
+// anchors shorter than this would hit on nearly every flow
+#define SIGPREFILTER_MIN_ANCHOR 3
+
+
+static inline bool sigprefilter_is_meta(char c) {
+    return c != 0 && strchr("^$.|?*+()[]{}\\",c) != nullptr;
+}
+
+// escaped character which stands for itself
+static inline bool sigprefilter_is_escaped_literal(char c) {
+    return c == '/' || c == '-' || c == '<' || c == '>' || sigprefilter_is_meta(c);
+}
+
+// index one past the end of bracket expression starting at 'i', or 0 if it's not terminated
+static unsigned int sigprefilter_skip_class(std::string const& re, unsigned int i) {
+    unsigned int j = i + 1;
+    if(j < re.size() && re[j] == '^') j++;
+    // ']' right after opening bracket is literal
+    if(j < re.size() && re[j] == ']') j++;
+
+    for( ; j < re.size(); j++) {
+        if(re[j] == '\\') { j++; continue; }
+        if(re[j] == ']') return j + 1;
+    }
+    return 0;
+}
+
+// index one past the end of group starting at 'i', or 0 if it's not terminated
+static unsigned int sigprefilter_skip_group(std::string const& re, unsigned int i) {
+    int depth = 0;
+    for(unsigned int j = i; j < re.size(); j++) {
+        char c = re[j];
+        if(c == '\\') { j++; continue; }
+        if(c == '[') {
+            unsigned int e = sigprefilter_skip_class(re,j);
+            if(e == 0) return 0;
+            j = e - 1;
+            continue;
+        }
+        if(c == '(') depth++;
+        else if(c == ')') {
+            if(--depth == 0) return j + 1;
+        }
+    }
+    return 0;
+}
+
+
+void SignaturePrefilter::clear() {
+    compiled_ = false;
+    signatures_ = 0;
+    ac_.clear();
+    ac_sig_.clear();
+    for(int i = 0; i < SETS; i++) {
+        always_[i].clear();
+    }
+}
+
+void SignaturePrefilter::add(int set, unsigned int index, std::string const& anchor) {
+    signatures_++;
+
+    if(anchor.size() < SIGPREFILTER_MIN_ANCHOR) {
+        always_[set].push_back(index);
+        return;
+    }
+
+    ac_.add(anchor);
+    ac_sig_.push_back(std::make_pair(set,index));
+}
+
+void SignaturePrefilter::compile() {
+    ac_.compile();
+    compiled_ = true;
+
+    DIA_("SignaturePrefilter::compile: %s",to_string().c_str());
+}
+
+std::string SignaturePrefilter::regex_anchor(std::string const& re) {
+
+    // top level alternative makes nothing mandatory. Don't guess on unbalanced expression either.
+    for(unsigned int i = 0; i < re.size(); i++) {
+        char c = re[i];
+        unsigned int e = 0;
+
+        if(c == '\\') {
+            i++;
+        }
+        else if(c == '[') {
+            if((e = sigprefilter_skip_class(re,i)) == 0) return std::string();
+            i = e - 1;
+        }
+        else if(c == '(') {
+            if((e = sigprefilter_skip_group(re,i)) == 0) return std::string();
+            i = e - 1;
+        }
+        else if(c == ')' || c == '|') {
+            return std::string();
+        }
+    }
+
+    std::string best;
+    std::string cur;
+    auto cut = [&best,&cur]() {
+        if(cur.size() > best.size()) best = cur;
+        cur.clear();
+    };
+
+    for(unsigned int i = 0; i < re.size(); ) {
+        char c = re[i];
+        unsigned int step = 1;
+
+        if(c == '\\') {
+            if(i + 1 < re.size() && sigprefilter_is_escaped_literal(re[i+1])) {
+                c = re[i+1];
+                step = 2;
+            } else {
+                // character class escape (\d, \s, ...) or assertion
+                cut();
+                i += 2;
+                continue;
+            }
+        }
+        else if(c == '[') {
+            cut();
+            i = sigprefilter_skip_class(re,i);
+            continue;
+        }
+        else if(c == '(') {
+            cut();
+            i = sigprefilter_skip_group(re,i);
+            continue;
+        }
+        else if(c == '{') {
+            // repetition bounds
+            cut();
+            unsigned int e = re.find('}',i);
+            i = (e == std::string::npos) ? re.size() : e + 1;
+            continue;
+        }
+        else if(sigprefilter_is_meta(c)) {
+            cut();
+            i++;
+            continue;
+        }
+
+        // quantifier makes character optional; with '+' it's there at least once, but run ends
+        char q = (i + step < re.size()) ? re[i+step] : 0;
+        if(q == '*' || q == '?' || q == '{') {
+            cut();
+            i += step;
+            continue;
+        }
+
+        cur += c;
+        if(q == '+') {
+            cut();
+        }
+        i += step;
+    }
+    cut();
+
+    if(best.size() < SIGPREFILTER_MIN_ANCHOR) {
+        best.clear();
+    }
+    return best;
+}
+
+std::string SignaturePrefilter::simple_anchor(std::string const& text) {
+    if(text.size() < SIGPREFILTER_MIN_ANCHOR) {
+        return std::string();
+    }
+    return text;
+}
+
+std::string SignaturePrefilter::to_string() const {
+    unsigned int always = 0;
+    for(int i = 0; i < SETS; i++) {
+        always += always_[i].size();
+    }
+
+    return string_format("SignaturePrefilter: signatures=%d anchored=%d always=%d automaton states=%d",
+                         signatures_,anchored(),always,ac_.states());
+}
@@ -0,0 +1,97 @@
+/*
+    Smithproxy- transparent proxy with SSL inspection capabilities.
+    Copyright (c) 2014, Ales Stibal <astib@mag0.net>, All rights reserved.
+
+    Smithproxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Smithproxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Smithproxy.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SIGPREFILTER_HPP
+ #define SIGPREFILTER_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include <ahocorasick.hpp>
+
+//
+// Prefilter for flow signatures. Each signature contributes one literal text (anchor) which must be present
+// in the flow for the signature to match. Anchors of all signatures are compiled into one Aho-Corasick automaton,
+// so new flow data are scanned once, and only signatures whose anchor was seen are put into connection's sensor.
+// Signatures without usable anchor are evaluated always.
+//
+// Prefilter is built once, when signatures are loaded, and is shared read-only. Scan state is per connection.
+//
+class SignaturePrefilter {
+public:
+    // signature sets
+    enum { SET_DETECTION=0, SET_STARTTLS, SETS };
+
+    SignaturePrefilter() { clear(); }
+
+    void clear();
+
+    // register signature 'index' of the set with its anchor; empty anchor means signature is always evaluated
+    void add(int set, unsigned int index, std::string const& anchor);
+    void compile();
+    bool compiled() const { return compiled_; }
+
+    unsigned int signatures() const { return signatures_; }
+    unsigned int anchored() const { return ac_sig_.size(); }
+
+    // indexes of signatures without anchor
+    std::vector<unsigned int> const& always(int set) const { return always_[set]; }
+
+    // per-connection scan state. Anchors are matched in both directions, each direction is separate stream.
+    struct state {
+        int ac[2] = { AhoCorasick::root, AhoCorasick::root };
+        std::vector<uint64_t> seen;
+    };
+
+    // scan next data of direction (0 or 1); call fn(set,index) for each signature whose anchor hits for the first time
+    template <class F>
+    void scan(state& st, int dir, const unsigned char* data, unsigned int len, F fn) const {
+        if(st.seen.size() < (ac_sig_.size() + 63)/64) {
+            st.seen.resize((ac_sig_.size() + 63)/64,0);
+        }
+
+        st.ac[dir] = ac_.scan(st.ac[dir],data,len,[this,&st,&fn](int id, unsigned int) {
+            uint64_t bit = ((uint64_t)1) << (id % 64);
+            if(st.seen[id/64] & bit) {
+                return;
+            }
+            st.seen[id/64] |= bit;
+            fn(ac_sig_[id].first,ac_sig_[id].second);
+        });
+    }
+
+    // longest literal text which every match of regex contains; empty if there is none (or it's too short to be useful)
+    static std::string regex_anchor(std::string const& re);
+    // simple signatures match literally
+    static std::string simple_anchor(std::string const& text);
+
+    std::string to_string() const;
+
+private:
+    bool compiled_;
+    unsigned int signatures_;
+
+    AhoCorasick ac_;
+    // automaton pattern id -> set, signature index
+    std::vector<std::pair<int,unsigned int>> ac_sig_;
+    std::vector<unsigned int> always_[SETS];
+};
+
+#endif
@@ -17,11 +17,16 @@
     
 */
 #include <sys/socket.h>
-#include <openssl/rand.h>
+#include <unistd.h>
 
 #include <thread>
 #include <vector>
 #include <set>
+#include <map>
+#include <queue>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 #include <time.h>
 
 #include <addrobj.hpp>
@@ -29,179 +34,226 @@
 #include <inspectors.hpp>
 #include <cfgapi.hpp>
 #include <smithdnsupd.hpp>
+#include <dnsresolver.hpp>
 
 DNS_Response* send_dns_request(std::string hostname, DNS_Record_Type t, std::string nameserver) {
     
-    if(nameserver.size() == 0) {
-        ERR_("send_dns_request: query %s for type %s: missing nameserver",hostname.c_str(),dns_record_type_str(t));
+    // blocking; empty nameserver means configured ones in rotation, otherwise retries go to the same one
+    DNS_Response* resp = dns_resolver.resolve(hostname,t,nameserver);
+    if(resp) {
+        DIA_("DNS response: \n %s",resp->to_string().c_str());
+    } else {
+        DIA_("send_dns_request: no answer for %s:%s from %s",dns_record_type_str(t),hostname.c_str(),nameserver.c_str());
     }
     
-    buffer b(0);
-    int parsed = -1;
-    DNS_Response* ret = nullptr;
+    return resp;
+}
+
+
+// refresh this many seconds before TTL runs out (less for short TTLs), but not more often than min_refresh
+static const int dns_updater_ahead = 5;
+static const int dns_updater_min_refresh = 5;
+// next attempt for names nobody answered for
+static const int dns_updater_retry = 30;
+// queries sent at once, updater waits for all of them before sending next batch
+static const unsigned int dns_updater_batch = 64;
+
+typedef std::pair<DNS_Record_Type,std::string> dns_updater_key;
+
+// time when cached entry should be refreshed; 0 if there is nothing usable in the cache
+static time_t dns_updater_due(DnsCache::entry_ptr const& r) {
+    if(! r) {
+        return 0;
+    }
     
-    unsigned char rand_pool[2];
-    RAND_pseudo_bytes(rand_pool,2);
-    unsigned short id = *(unsigned short*)rand_pool;
+    // name doesn't resolve: ask again only when negative answer expires
+    if(r->negative) {
+        return r->loaded_at + r->negative_ttl;
+    }
     
-    int s = generate_dns_request(id,b,hostname,t);
-    DUM_("DNS generated request: size %db\n%s",s,hex_dump(b).c_str());
+    if(r->answers().size() == 0) {
+        return 0;
+    }
     
-    // create UDP socket
-    int send_socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);         
-    struct sockaddr_storage addr;
-    memset(&addr, 0, sizeof(struct sockaddr_storage));        
-    addr.ss_family                = AF_INET;
-    ((sockaddr_in*)&addr)->sin_addr.s_addr = inet_addr(nameserver.c_str());
-    ((sockaddr_in*)&addr)->sin_port = htons(53);
+    uint32_t ttl = r->answers().at(0).ttl_;
+    for(auto const& a: r->answers()) {
+        if(a.ttl_ < ttl) ttl = a.ttl_;
+    }
     
-    ::connect(send_socket,(sockaddr*)&addr,sizeof(sockaddr_storage));
+    uint32_t ahead = ttl / 4;
+    if(ahead > dns_updater_ahead) ahead = dns_updater_ahead;
     
-    if(::send(send_socket,b.data(),b.size(),0) < 0) {
-        std::string r = string_format("send_dns_request: cannot write remote socket: %d",send_socket);
-        DIA_("%s",r.c_str());
-        return nullptr;
-    }
-
-    int rv;
-    fd_set confds;
-    struct timeval tv;
-    tv.tv_usec = 0;
-    tv.tv_sec = 2;  
-    FD_ZERO(&confds);
-    FD_SET(send_socket, &confds);
-    rv = select(send_socket + 1, &confds, NULL, NULL, &tv);
-    if(rv == 1) {
-        buffer r(1500);
-        int l = ::recv(send_socket,r.data(),r.capacity(),0);
-        if(l > 0) { 
-            r.size(l);
-            
-            DEB_("received %d bytes",l);
-            DUM_("\n%s\n",hex_dump(r).c_str());
-
+    return r->loaded_at + ttl - ahead;
+}
 
-            DNS_Response* resp = new DNS_Response();
-            parsed = resp->load(&r);
-            DIA_("parsed %d bytes (0 means all)",parsed);
-            DIA_("DNS response: \n %s",resp->to_string().c_str());
-            
-            // save only fully parsed messages
-            if(parsed == 0) {
-                ret = resp;
-                
-            } else {
-                ret = resp;
-                ERR_("Something went wrong with parsing %s (keeping response)",hostname.c_str());
-                //delete resp;
-            }
-            
-        } else {
-            DIA_("recv() returned %d",l);
+// query all names in parallel, wait for the answers and store them into the cache
+static void dns_updater_refresh(std::vector<dns_updater_key> const& batch) {
+    
+    struct result {
+        std::mutex lock;
+        std::condition_variable cv;
+        unsigned int left = 0;
+        std::vector<DNS_Response*> resp;
+    };
+    auto res = std::make_shared<result>();
+    res->resp.resize(batch.size(),nullptr);
+    
+    for(unsigned int i = 0; i < batch.size(); i++) {
+        DNS_Record_Type t = batch[i].first;
+        std::string const& a = batch[i].second;
+        
+        DIA_("refreshing fqdn: %s:%s",dns_record_type_str(t),a.c_str());
+        
+        {
+            std::lock_guard<std::mutex> l(res->lock);
+            res->left++;
         }
+        bool queued = dns_resolver.query(a,t,[res,i](DNS_Response* resp) {
+            std::lock_guard<std::mutex> l(res->lock);
+            res->resp[i] = resp;
+            res->left--;
+            res->cv.notify_all();
+        });
         
-    } else {
-        DIAS_("timeout, or an error occured.");
+        if(! queued) {
+            std::lock_guard<std::mutex> l(res->lock);
+            res->left--;
+        }
     }
     
+    // every queued query is called back, at latest when resolver is stopped
+    std::vector<DNS_Response*> resp;
+    {
+        std::unique_lock<std::mutex> l(res->lock);
+        res->cv.wait(l,[&res]() { return res->left == 0; });
+        resp.swap(res->resp);
+    }
     
-    ::close(send_socket);    
-    
-    return ret;
+    DNS_Inspector di;
+    for(unsigned int i = 0; i < resp.size(); i++) {
+        if(resp[i] == nullptr) {
+            DIA_("dns_updater: no answer for %s:%s",dns_record_type_str(batch[i].first),batch[i].second.c_str());
+            continue;
+        }
+        DIA_("DNS response: \n %s",resp[i]->to_string().c_str());
+        
+        // negative answers are cached too, so the name is not asked for until they expire
+        if(di.store(resp[i])) {
+            DIAS_("Entry successfully stored in cache.");
+        } else {
+            WAR_("entry for %s:%s was not stored",dns_record_type_str(batch[i].first),batch[i].second.c_str());
+            delete resp[i];
+        }
+    }
 }
 
-
 std::thread* create_dns_updater() {
     std::thread * dns_thread = new std::thread([]() { 
     
     int sleep_time = 3;
-    int requery_ttl = 60;
-    std::set<std::string> record_blacklist;
+    
+    // refresh schedule: min-heap of (due time, name). Entries are valid only if they match 'scheduled',
+    // the rest (rescheduled or removed from config meanwhile) is dropped when it comes up.
+    typedef std::pair<time_t,dns_updater_key> due_entry;
+    std::priority_queue<due_entry,std::vector<due_entry>,std::greater<due_entry>> schedule;
+    std::map<dns_updater_key,time_t> scheduled;
+    
+    // FQDN names change only with config (re)load, which publishes new snapshot with their list.
+    // Config lock is not taken at all.
+    cfgapi_snapshot_ptr cfg;
     
     for(unsigned int i = 1; ; i++) {
         
-        DIA_("dns_updater: refresh round %d",i);
+        time_t now = ::time(nullptr);
         
-        std::vector<std::string> fqdns;
-        cfgapi_write_lock.lock();
-        for (auto a: cfgapi_obj_address) {
-            FqdnAddress* fa = dynamic_cast<FqdnAddress*>(a.second);
-            if(fa) {
-                std::vector<std::string> recs;
-                recs.push_back("A:" + fa->fqdn());
-                recs.push_back("AAAA:" + fa->fqdn());
-                
-                inspect_dns_cache.lock();
-                for(auto rec: recs) {
-                    DNS_Response* r = inspect_dns_cache.get(rec);
-                    if(r) {
-                        int ttl = (r->loaded_at + r->answers().at(0).ttl_) - ::time(nullptr);
-                        
-                        DIA_("fqdn %s ttl %d",rec.c_str(),ttl);
-                        
-                        //re-query only about-to-expire existing DNS entries for FQDN addresses
-                        if(ttl < requery_ttl) {
-                            fqdns.push_back(rec);
-                        }
-                    }
-                    else {
-                        // query FQDNs without DNS cache entry
-                        if(record_blacklist.find(rec) == record_blacklist.end()) {
-                            fqdns.push_back(rec);
-                        } else {
-                            DIA_("fqdn %s is blacklisted",rec.c_str());
-                        }
-                    }
+        cfgapi_snapshot_ptr cur = cfgapi_snapshot();
+        if(cur != cfg) {
+            cfg = cur;
+            
+            std::set<dns_updater_key> fqdns;
+            for(auto const& n: cfg->fqdns) {
+                for(DNS_Record_Type t: { A, AAAA }) {
+                    fqdns.insert(std::make_pair(t,n));
+                }
+            }
+            DIA_("dns_updater: config loaded, %d fqdns",(int)cfg->fqdns.size());
+            
+            for(auto it = scheduled.begin(); it != scheduled.end(); ) {
+                if(fqdns.find(it->first) == fqdns.end()) {
+                    it = scheduled.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for(auto const& k: fqdns) {
+                if(scheduled.find(k) == scheduled.end()) {
+                    scheduled[k] = now;
+                    schedule.push(std::make_pair(now,k));
                 }
-                inspect_dns_cache.unlock();
-                
             }
-        }
-        cfgapi_write_lock.unlock();
-        
-
-        std::string nameserver = "8.8.8.8";
-        if(cfgapi_obj_nameservers.size()) {
-            nameserver = cfgapi_obj_nameservers.at(i % cfgapi_obj_nameservers.size());
         }
         
-        DNS_Inspector di;
-        for(auto t_a: fqdns) {
-            DIA_("refreshing fqdn: %s",t_a.c_str());
-
-            std::string a;
-            DNS_Record_Type t;
+        std::vector<dns_updater_key> batch;
+        while(! schedule.empty() && schedule.top().first <= now) {
+            due_entry e = schedule.top();
+            schedule.pop();
             
-            if(t_a.size() < 5) continue;
-                                               
-            if(t_a.find("A:") == 0) { t = A; a = t_a.substr(2,-1); }
-            else
-            if(t_a.find("AAAA:") == 0) { t = AAAA; a = t_a.substr(5,-1); }
-            else
-            continue;
+            auto it = scheduled.find(e.second);
+            if(it == scheduled.end() || it->second != e.first) {
+                continue;
+            }
             
-
-            DNS_Response* resp =  send_dns_request(a,t,nameserver);
-            if(resp) {
-                if(di.store(resp)) {
-                    DIAS_("Entry successfully stored in cache.");
-                } else {
-                    WAR_("entry for %s was not stored, blacklisted!",t_a.c_str());
-                    record_blacklist.insert(t_a);
-                    delete resp;
-                }
+            // entry could have been refreshed by DNS traffic passing the proxy
+            time_t due = dns_updater_due(inspect_dns_cache.get(e.second.first,e.second.second));
+            if(due > now) {
+                DIA_("fqdn %s:%s refresh in %d",dns_record_type_str(e.second.first),e.second.second.c_str(),(int)(due - now));
+                it->second = due;
+                schedule.push(std::make_pair(due,e.second));
+                continue;
             }
-        } 
+            
+            batch.push_back(e.second);
+        }
         
-        // do some rescans of blacklisted entries
-        if(i % (20*sleep_time) == 0) {
-            record_blacklist.clear();
+        if(batch.size() > 0) {
+            DIA_("dns_updater: round %d, refreshing %d of %d fqdns",i,(int)batch.size(),(int)scheduled.size());
+        }
+        
+        for(unsigned int b = 0; b < batch.size(); b += dns_updater_batch) {
+            std::vector<dns_updater_key> part(batch.begin() + b,batch.begin() + std::min<size_t>(b + dns_updater_batch,batch.size()));
+            dns_updater_refresh(part);
+        }
+        
+        now = ::time(nullptr);
+        for(auto const& k: batch) {
+            auto it = scheduled.find(k);
+            if(it == scheduled.end()) {
+                continue;
+            }
+            
+            time_t due = dns_updater_due(inspect_dns_cache.get(k.first,k.second));
+            if(due == 0) {
+                due = now + dns_updater_retry;
+            }
+            else if(due < now + dns_updater_min_refresh) {
+                due = now + dns_updater_min_refresh;
+            }
+            
+            it->second = due;
+            schedule.push(std::make_pair(due,k));
         }
-
         
-        ::sleep(sleep_time);
+        // wake up for the nearest refresh, or to pick up reloaded config
+        int wait = sleep_time;
+        if(! schedule.empty()) {
+            int to_due = schedule.top().first - ::time(nullptr);
+            if(to_due < wait) wait = to_due;
+        }
+        if(wait > 0) {
+            ::sleep(wait);
+        }
     } } );
       
     
     return dns_thread;
-}
\ No newline at end of file
+}
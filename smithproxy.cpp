@@ -69,6 +69,7 @@
 #include <staticcontent.hpp>
 #include <smithlog.hpp>
 #include <smithdnsupd.hpp>
+#include <dnsresolver.hpp>
 
 
 extern "C" void __libc_freeres(void);
@@ -249,10 +250,12 @@ int load_signatures(libconfig::Config& cfg, const char* name, std::vector<duplex
             if( type == "regex") {
                 DEB_(" [%d]: new regex flow match",j);
                 newsig->add(side[0],new regexMatch(sigtext,bytes_start,bytes_max));
+                newsig->anchors.push_back(SignaturePrefilter::regex_anchor(sigtext));
             } else
             if ( type == "simple") {
                 DEB_(" [%d]: new simple flow match",j);
                 newsig->add(side[0],new simpleMatch(sigtext,bytes_start,bytes_max));
+                newsig->anchors.push_back(SignaturePrefilter::simple_anchor(sigtext));
             }
         }
         
@@ -327,7 +330,8 @@ bool load_config(std::string& config_f, bool reload) {
     
     
     // Add another level of lock. File is already loaded. We need to apply its content.
-    // lock is needed here to not try to match against potentially empty/partial policy list
+    // Lock serializes writers of cfgapi_obj_* tables; workers match against published snapshot
+    // and don't see empty/partial policy list while it's rebuilt.
     std::lock_guard<std::recursive_mutex> l(cfgapi_write_lock);
     try {
         
@@ -345,21 +349,30 @@ bool load_config(std::string& config_f, bool reload) {
         cfgapi_load_obj_profile_auth();
         
         cfgapi_load_obj_policy();
+        cfgapi_compile_obj_policy();
+        
+        // make new configuration visible to workers - existing sessions keep the previous one
+        cfgapi_snapshot_publish();
         
         
         if(!reload)  {
             load_signatures(cfgapi,"detection_signatures",sigs_detection);
             load_signatures(cfgapi,"starttls_signatures",sigs_starttls);
+            sigs_prefilter_compile();
         }
 
         
         if(cfgapi.getRoot()["settings"].exists("nameservers")) {
+            cfgapi_obj_nameservers.clear();
             int num = cfgapi.getRoot()["settings"]["nameservers"].getLength();
             for(int i = 0; i < num; ++i) {
                 std::string ns = cfgapi.getRoot()["settings"]["nameservers"][i];
                 cfgapi_obj_nameservers.push_back(ns);
             }
         }
+        dns_resolver.nameservers(cfgapi_obj_nameservers);
+        cfgapi.getRoot()["settings"].lookupValue("dns_timeout",dns_resolver.timeout);
+        cfgapi.getRoot()["settings"].lookupValue("dns_attempts",dns_resolver.attempts);
         
         cfgapi.getRoot()["settings"].lookupValue("certs_path",SSLCertStore::certs_path);
         cfgapi.getRoot()["settings"].lookupValue("certs_ca_key_password",SSLCertStore::password);
@@ -371,6 +384,8 @@ bool load_config(std::string& config_f, bool reload) {
         cfgapi.getRoot()["settings"].lookupValue("ssl_workers",cfg_ssl_workers);
         cfgapi.getRoot()["settings"].lookupValue("ssl_autodetect",MitmMasterProxy::ssl_autodetect);
         cfgapi.getRoot()["settings"].lookupValue("ssl_autodetect_harder",MitmMasterProxy::ssl_autodetect_harder);
+        cfgapi.getRoot()["settings"].lookupValue("ssl_autodetect_timeout",MitmMasterProxy::ssl_autodetect_timeout);
+        cfgapi.getRoot()["settings"].lookupValue("fast_forward",MitmProxy::opt_fast_forward);
         cfgapi.getRoot()["settings"].lookupValue("ssl_ocsp_status_ttl",SSLCertStore::ssl_ocsp_status_ttl);
         cfgapi.getRoot()["settings"].lookupValue("ssl_crl_status_ttl",SSLCertStore::ssl_crl_status_ttl);
         
@@ -883,6 +898,7 @@ int main(int argc, char *argv[]) {
     DIA_("SSL_connect: %d",SSLCom::counter_ssl_connect);
 
     cfgapi_cleanup();
+    cfgapi_snapshot_release();
 
     SSLCom::certstore()->destroy();
     
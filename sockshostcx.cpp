@@ -18,12 +18,14 @@
 */    
 
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <cfgapi.hpp>
 #include <sockshostcx.hpp>
 #include <logger.hpp>
 #include <dns.hpp>
-#include <smithdnsupd.hpp>
+#include <dnsresolver.hpp>
 
 std::string socksTCPCom::sockstcpcom_name_ = "sock5";
 std::string socksSSLMitmCom::sockssslmitmcom_name_ = "s5+ssl+insp";
@@ -32,8 +34,14 @@ socksServerCX::socksServerCX(baseCom* c, unsigned int s) : baseHostCX(c,s) {
     state_ = INIT;
 }
 
+socksServerCX::dns_wait::~dns_wait() {
+    if(resp != nullptr) delete resp;
+    if(fd >= 0) ::close(fd);
+}
+
 socksServerCX::~socksServerCX() {
 
+    dns_wait_unmonitor();
     if(left)  { delete left; }
     if(right) { delete right; }
 }
@@ -148,6 +156,7 @@ int socksServerCX::process_socks_request() {
                 DIA_("socks5 protocol: port requested: %d",req_port);
                 
                 std::vector<std::string> target_ips;
+                bool negative_cached = false;
                 
                 // Some implementations use atype FQDN eventhough the target is already IP
                 CIDR* adr_as_fqdn = cidr_from_str(fqdn.c_str());
@@ -159,10 +168,16 @@ int socksServerCX::process_socks_request() {
                 } else {
                     // really FQDN.
                     
-                    inspect_dns_cache.lock();
-                    DNS_Response* dns_resp = inspect_dns_cache.get("A:"+fqdn);
+                    DnsCache::entry_ptr dns_resp = inspect_dns_cache.get(A,fqdn);
                     if(dns_resp) {
-                        if (dns_resp->answers().size() > 0) {
+                        if(dns_resp->negative) {
+                            int ttl = (dns_resp->loaded_at + dns_resp->negative_ttl) - time(nullptr);
+                            if(ttl > 0) {
+                                DIA_("socks5 protocol: %s doesn't resolve (negative cache, rcode %d)",fqdn.c_str(),dns_resp->rcode());
+                                negative_cached = true;
+                            }
+                        }
+                        else if (dns_resp->answers().size() > 0) {
                             int ttl = (dns_resp->loaded_at + dns_resp->answers().at(0).ttl_) - time(nullptr);                
                             if(ttl > 0) {
                                 for( DNS_Answer& a: dns_resp->answers() ) {
@@ -175,39 +190,14 @@ int socksServerCX::process_socks_request() {
                             }
                         }
                     }
-                    inspect_dns_cache.unlock();
                 }
                 
-                if(target_ips.size() <= 0) {
-                    // no targets, send DNS query
-                    
-                    std::string nameserver = "8.8.8.8";
-                    if(cfgapi_obj_nameservers.size()) {
-                        nameserver = cfgapi_obj_nameservers.at(0);
-                    }
-                    DNS_Response* resp = send_dns_request(fqdn,A,nameserver);
-                    bool del_resp = true;
-                    
-                    if(resp) {
-                        for( DNS_Answer& a: resp->answers() ) {
-                            std::string a_ip = a.ip(false);
-                            if(a_ip.size()) {
-                                DIA_("fresh candidate: %s",a_ip.c_str());
-                                target_ips.push_back(a_ip);
-                            }
-                        }
-                        
-                        if(target_ips.size()) {
-                            inspect_dns_cache.lock();
-                            DNS_Inspector di;
-                            del_resp = ! di.store(resp);
-                            inspect_dns_cache.unlock();
-                        }
-                        
-                        if(del_resp) {
-                            delete resp;
-                        }
+                if(target_ips.size() <= 0 && ! negative_cached) {
+                    // no targets: ask resolver, request continues in process_dns_response()
+                    if(dns_request(fqdn)) {
+                        return readbuf()->size();
                     }
+                    goto error;
                 }
                 
                 if(target_ips.size()) {
@@ -260,22 +250,130 @@ int socksServerCX::process_socks_request() {
             goto error;
         }
         
+        process_socks_target();
+        return readbuf()->size();
+
+    error:
+        DIA_("socksServerCX::process_socks_request: error %d",e);
+        error(true);
+        return readbuf()->size();
+}
+
+void socksServerCX::process_socks_target() {
         com()->nonlocal_dst_port() = req_port;
         com()->nonlocal_dst_resolved(true);
         com()->nonlocal_src(true);
         DIA_("socksServerCX::process_socks_request: request for %s -> %s:%d",c_name(),com()->nonlocal_dst_host().c_str(),com()->nonlocal_dst_port());
 
-
-        
         setup_target();
         DIAS_("socksServerCX::process_socks_request: waiting for policy check");
-        // now 
-        return readbuf()->size();
+}
 
-    error:
-        DIA_("socksServerCX::process_socks_request: error %d",e);
+bool socksServerCX::dns_request(std::string const& fqdn) {
+    
+    auto w = std::make_shared<dns_wait>();
+    w->fd = ::eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if(w->fd < 0) {
+        ERR_("socksServerCX::dns_request: cannot create eventfd: %s",strerror(errno));
+        return false;
+    }
+    
+    bool queued = dns_resolver.query(fqdn,A,[w](DNS_Response* resp) {
+        std::lock_guard<std::mutex> l(w->lock);
+        w->resp = resp;
+        w->done = true;
+        
+        uint64_t one = 1;
+        if(::write(w->fd,&one,sizeof(one)) < 0) {
+            ERR_("socksServerCX: cannot signal DNS answer: %s",strerror(errno));
+        }
+    });
+    
+    if(! queued) {
+        return false;
+    }
+    
+    dns_wait_ = w;
+    dns_wait_monitored = false;
+    state_ = WAIT_DNS;
+    paused_read(true);
+    DIA_("socksServerCX::dns_request: waiting for resolver: %s",fqdn.c_str());
+    
+    return true;
+}
+
+void socksServerCX::dns_wait_unmonitor() {
+    
+    if(! dns_wait_ || ! dns_wait_monitored) {
+        return;
+    }
+    
+    int fd = dns_wait_->fd;
+    
+    // consume wakeup, so it doesn't stay pending in poller
+    uint64_t n;
+    if(::read(fd,&n,sizeof(n)) < 0 && errno != EAGAIN) {
+        DIA_("socksServerCX::dns_wait_unmonitor: reading eventfd: %s",strerror(errno));
+    }
+    
+    // fd is closed with last reference to the wait; its number must not lead to proxy once reused
+    com()->unset_monitor(fd);
+    com()->set_poll_handler(fd,nullptr);
+    dns_wait_monitored = false;
+}
+
+bool socksServerCX::process_dns_response() {
+    
+    if(! dns_wait_) {
+        return false;
+    }
+    
+    DNS_Response* resp = nullptr;
+    {
+        std::lock_guard<std::mutex> l(dns_wait_->lock);
+        if(! dns_wait_->done) {
+            return false;
+        }
+        resp = dns_wait_->resp;
+        dns_wait_->resp = nullptr;
+    }
+    
+    dns_wait_unmonitor();
+    dns_wait_.reset();
+    
+    std::vector<std::string> target_ips;
+    if(resp) {
+        for( DNS_Answer& a: resp->answers() ) {
+            std::string a_ip = a.ip(false);
+            if(a_ip.size()) {
+                DIA_("fresh candidate: %s",a_ip.c_str());
+                target_ips.push_back(a_ip);
+            }
+        }
+        
+        // negative answers are stored too
+        bool del_resp = true;
+        if(target_ips.size() || resp->negative) {
+            DNS_Inspector di;
+            del_resp = ! di.store(resp);
+        }
+        if(del_resp) {
+            delete resp;
+        }
+    }
+    
+    if(target_ips.empty()) {
+        DIA_("socksServerCX::process_dns_response: %s not resolved",req_str_addr.c_str());
         error(true);
-        return readbuf()->size();
+        return false;
+    }
+    
+    // for now use just first one (cleaned up from empty ones)
+    DIA_("chosen target: %s",target_ips.at(0).c_str());
+    com()->nonlocal_dst_host() = target_ips.at(0);
+    
+    process_socks_target();
+    return true;
 }
 
 bool socksServerCX::setup_target() {
@@ -343,6 +441,10 @@ bool socksServerCX::setup_target() {
 }
 
 bool socksServerCX::new_message() {
+    // proxy has to start monitoring resolver wakeups
+    if(state_ == WAIT_DNS && ! dns_wait_monitored) {
+        return true;
+    }
     if(state_ == WAIT_POLICY && verdict_ == PENDING) {
         return true;
     }
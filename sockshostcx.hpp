@@ -20,14 +20,18 @@
 #ifndef _SOCKS5HOST_HPP_
   #define _SOCKS5HOST_HPP_
 
+#include <mutex>
+#include <memory>
+
 #include <threadedacceptor.hpp>
 #include <mitmhost.hpp>
 #include <mitmproxy.hpp>
 #include <hostcx.hpp>
 #include <tcpcom.hpp>
 #include <sslmitmcom.hpp>
+#include <dns.hpp>
 
-typedef enum socks5_state_ { INIT, HELLO_SENT, WAIT_REQUEST, REQ_RECEIVED, WAIT_POLICY, POLICY_RECEIVED, REQRES_SENT, HANDOFF , ZOMBIE } socks5_state;
+typedef enum socks5_state_ { INIT, HELLO_SENT, WAIT_REQUEST, REQ_RECEIVED, WAIT_DNS, WAIT_POLICY, POLICY_RECEIVED, REQRES_SENT, HANDOFF , ZOMBIE } socks5_state;
 typedef enum socks5_request_error_ { NONE=0, UNSUPPORTED_VERSION, UNSUPPORTED_ATYPE } socks5_request_error;
 typedef enum socks5_atype_ { IPV4=1, FQDN=3, IPV6=4 } socks5_atype;
 typedef enum socks5_policy_ { PENDING, ACCEPT, REJECT } socks5_policy;
@@ -59,12 +63,20 @@ public:
     virtual int process();
     virtual int process_socks_hello();
     virtual int process_socks_request();
+    // destination address is known: prepare target and wait for policy
+    virtual void process_socks_target();
     virtual bool setup_target();
     virtual int process_socks_reply();
     virtual void pre_write();
     
     virtual bool new_message();
     void verdict(socks5_policy);
+    
+    // FQDN is being resolved: proxy monitors dns_wait_fd(), readable when the answer (or failure) is in.
+    // Returns true if request continued to policy check.
+    int dns_wait_fd() const { return dns_wait_ ? dns_wait_->fd : -1; }
+    bool dns_wait_monitored = false;
+    bool process_dns_response();
     void state(socks5_state s) { state_ = s; };
     
     socks5_policy verdict_ = PENDING;
@@ -76,6 +88,19 @@ public:
     bool handoff_as_ssl = false;
     
 private:
+    // shared with resolver callback, which may come after this CX is gone
+    struct dns_wait {
+        std::mutex lock;
+        bool done = false;
+        DNS_Response* resp = nullptr;
+        int fd = -1;
+        ~dns_wait();
+    };
+    std::shared_ptr<dns_wait> dns_wait_;
+    // stop proxy monitoring of dns_wait_ fd and remove its poll handler
+    void dns_wait_unmonitor();
+    bool dns_request(std::string const& fqdn);
+
     unsigned char version;
     socks5_atype req_atype;
     in_addr req_addr;
@@ -14,7 +14,14 @@ void SocksProxy::on_left_message(baseHostCX* basecx) {
 
     socksServerCX* cx = static_cast<socksServerCX*>(basecx);
     if(cx != nullptr) {
-        if(cx->state_ == WAIT_POLICY) {
+        if(cx->state_ == WAIT_DNS) {
+            // resolver signals the answer on eventfd, which wakes us up like any other socket
+            DIAS_("SocksProxy::on_left_message: waiting for DNS resolver");
+            com()->set_monitor(cx->dns_wait_fd());
+            com()->set_poll_handler(cx->dns_wait_fd(),this);
+            cx->dns_wait_monitored = true;
+        }
+        else if(cx->state_ == WAIT_POLICY) {
             DIAS_("SocksProxy::on_left_message: policy check: accepted");
             std::vector<baseHostCX*> l;
             std::vector<baseHostCX*> r;
@@ -22,19 +29,15 @@ void SocksProxy::on_left_message(baseHostCX* basecx) {
             r.push_back(cx->right);
             
             
-            cfgapi_write_lock.lock();
-            matched_policy(cfgapi_obj_policy_match(l,r));
-            bool verdict = cfgapi_obj_policy_action(matched_policy());
+            // session sticks to this configuration snapshot, also for handoff
+            config(cfgapi_snapshot());
+            matched_policy(config()->policy_match(l,r));
+            bool verdict = config()->policy_action(matched_policy());
             
-            PolicyRule* p = nullptr;
-            if(matched_policy() >= 0) {
-                p = cfgapi_obj_policy.at(matched_policy());
-            }
+            PolicyRule* p = config()->policy_at(matched_policy());
             
             DIA_("socksProxy::on_left_message: policy check result: policy# %d policyid 0x%x verdict %s", matched_policy(), p, verdict ? "accept" : "reject" );
             
-            cfgapi_write_lock.unlock();
-            
             socks5_policy s5_verdict = verdict ? ACCEPT : REJECT;
             cx->verdict(s5_verdict);
         }
@@ -50,6 +53,25 @@ void SocksProxy::on_left_message(baseHostCX* basecx) {
     }
 }
 
+int SocksProxy::handle_sockets_once(baseCom* xcom) {
+    
+    // policy check may change socket lists, don't run it while iterating
+    std::vector<socksServerCX*> resolved;
+    for(auto basecx: left_sockets) {
+        socksServerCX* cx = dynamic_cast<socksServerCX*>(basecx);
+        
+        if(cx != nullptr && cx->state_ == WAIT_DNS && cx->process_dns_response()) {
+            resolved.push_back(cx);
+        }
+    }
+    // target is set up, policy check follows
+    for(auto cx: resolved) {
+        on_left_message(cx);
+    }
+    
+    return MitmProxy::handle_sockets_once(xcom);
+}
+
 void SocksProxy::socks5_handoff(socksServerCX* cx) {
 
     DEBS_("SocksProxy::socks5_handoff: start");
@@ -59,8 +81,8 @@ void SocksProxy::socks5_handoff(socksServerCX* cx) {
         dead(true);
         return;
     } 
-    else if(matched_policy() >= (signed int)cfgapi_obj_policy.size()) {
-        DIA_("SocksProxy::sock5_handoff: matching policy out of policy index table: %d/%d: dropping.",matched_policy(),cfgapi_obj_policy.size());
+    else if(!config() || config()->policy_at(matched_policy()) == nullptr) {
+        DIA_("SocksProxy::sock5_handoff: matching policy out of policy index table: %d/%d: dropping.",matched_policy(),config() ? config()->policy.size() : 0);
         dead(true);
         return;
     }
@@ -123,16 +145,16 @@ void SocksProxy::socks5_handoff(socksServerCX* cx) {
     n_cx->peer(target_cx);
     target_cx->peer(n_cx);
 
-    cfgapi_write_lock.lock();
-    if(cfgapi_obj_policy.at(matched_policy())->nat == POLICY_NAT_NONE) {
+    if(config()->policy_at(matched_policy())->nat == POLICY_NAT_NONE) {
         target_cx->com()->nonlocal_src(true);
         target_cx->com()->nonlocal_src_host() = h;
         target_cx->com()->nonlocal_src_port() = std::stoi(p);
     }
-    cfgapi_write_lock.unlock();
     
     n_cx->matched_policy(matched_policy());
     target_cx->matched_policy(matched_policy());
+    n_cx->config(config());
+    target_cx->config(config());
         
     int real_socket = target_cx->connect(false);
     com()->set_monitor(real_socket);
@@ -31,6 +31,8 @@ public:
     explicit SocksProxy(baseCom*);
     virtual ~SocksProxy();
     virtual void on_left_message(baseHostCX* cx);
+    // continue requests woken up by DNS resolver
+    virtual int handle_sockets_once(baseCom*);
     
     virtual void socks5_handoff(socksServerCX* cx);
 };